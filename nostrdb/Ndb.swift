@@ -126,7 +126,11 @@ class Ndb {
         let ok = path.withCString { testdir in
             var ok = false
             while !ok && mapsize > 1024 * 1024 * 700 {
-                var cfg = ndb_config(flags: 0, ingester_threads: ingest_threads, writer_scratch_buffer_size: DEFAULT_WRITER_SCRATCH_SIZE, mapsize: mapsize, filter_context: nil, ingest_filter: nil, sub_cb_ctx: nil, sub_cb: nil)
+                // start from the defaults so new config fields get sensible values
+                var cfg = ndb_config()
+                ndb_default_config(&cfg)
+                ndb_config_set_ingest_threads(&cfg, ingest_threads)
+                ndb_config_set_mapsize(&cfg, mapsize)
                 
                 // Here we hook up the global callback function for subscription callbacks.
                 // We do an "unretained" pass here because the lifetime of the callback handler is larger than the lifetime of the nostrdb monitor in the C code.
@@ -1267,6 +1271,12 @@ enum NdbDatabase: Int, Hashable, CaseIterable, Identifiable {
     case notePubkeyKind = 13   // NDB_DB_NOTE_PUBKEY_KIND
     case noteRelayKind = 14    // NDB_DB_NOTE_RELAY_KIND
     case noteRelays = 15       // NDB_DB_NOTE_RELAYS
+    case noteThread = 16       // NDB_DB_NOTE_THREAD
+    case noteAddr = 17         // NDB_DB_NOTE_ADDR
+    case noteMention = 18      // NDB_DB_NOTE_MENTION
+    case hashtagCounts = 19    // NDB_DB_HASHTAG_COUNTS
+    case notePostings = 20     // NDB_DB_NOTE_POSTINGS
+    case noteTermStats = 21    // NDB_DB_NOTE_TERM_STATS
     case other                 // For unaccounted data
     
     var id: String {
@@ -44,6 +44,18 @@ extension NdbDatabase {
             return NSLocalizedString("Note Relay+Kind Index", comment: "Database name for note relay+kind index")
         case .noteRelays:
             return NSLocalizedString("Note Relays", comment: "Database name for note relays")
+        case .noteThread:
+            return NSLocalizedString("Note Thread Index", comment: "Database name for note thread index")
+        case .noteAddr:
+            return NSLocalizedString("Note Address Index", comment: "Database name for addressable note index")
+        case .noteMention:
+            return NSLocalizedString("Note Mention Index", comment: "Database name for note mention index")
+        case .hashtagCounts:
+            return NSLocalizedString("Hashtag Counts", comment: "Database name for hashtag counts")
+        case .notePostings:
+            return NSLocalizedString("Fulltext Postings", comment: "Database name for fulltext search postings")
+        case .noteTermStats:
+            return NSLocalizedString("Fulltext Term Stats", comment: "Database name for fulltext search term stats")
         case .other:
             return NSLocalizedString("Other Data", comment: "Database name for other/unaccounted data")
         }
@@ -60,8 +72,10 @@ extension NdbDatabase {
             return "info.circle.fill"
         case .noteBlocks:
             return "square.stack.3d.up.fill"
-        case .noteId, .profileKey, .profileSearch, .noteKind, .noteText, .noteTags, .notePubkey, .notePubkeyKind, .noteRelayKind:
+        case .noteId, .profileKey, .profileSearch, .noteKind, .noteText, .noteTags, .notePubkey, .notePubkeyKind, .noteRelayKind, .noteThread, .noteAddr, .noteMention, .notePostings, .noteTermStats:
             return "list.bullet.indent"
+        case .hashtagCounts:
+            return "number"
         case .noteRelays:
             return "antenna.radiowaves.left.and.right"
         case .profileLastFetch, .other:
@@ -80,8 +94,10 @@ extension NdbDatabase {
             return .purple
         case .meta, .ndbMeta:
             return .orange
-        case .noteId, .profileKey, .profileSearch, .noteKind, .noteText, .noteTags, .notePubkey, .notePubkeyKind, .noteRelayKind:
+        case .noteId, .profileKey, .profileSearch, .noteKind, .noteText, .noteTags, .notePubkey, .notePubkeyKind, .noteRelayKind, .noteThread, .noteAddr, .noteMention, .notePostings, .noteTermStats:
             return .gray
+        case .hashtagCounts:
+            return .pink
         case .noteRelays:
             return .cyan
         case .profileLastFetch, .other:
@@ -0,0 +1,154 @@
+
+#include "nostrdb.h"
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define BENCH_RUNS 200
+#define MAX_PUBKEYS 16
+#define MAX_RESULTS 4096
+
+static int num_pubkeys;
+static unsigned char pubkeys[MAX_PUBKEYS][32];
+static struct ndb_query_result results[MAX_RESULTS];
+
+static struct ndb *open_ndb(int query_threads)
+{
+	struct ndb *ndb;
+	struct ndb_config config;
+
+	ndb_default_config(&config);
+	ndb_config_set_mapsize(&config, 1024ULL * 1024ULL * 400ULL * 10ULL);
+	ndb_config_set_ingest_threads(&config, 1);
+	ndb_config_set_query_threads(&config, query_threads);
+	ndb_config_set_flags(&config, NDB_FLAG_NOMIGRATE);
+
+	assert(ndb_init(&ndb, "testdata/db", &config));
+	return ndb;
+}
+
+// grab some authors from recent notes so the filters hit real data
+static void load_pubkeys(struct ndb *ndb)
+{
+	struct ndb_filter filter;
+	struct ndb_txn txn;
+	int i, j, count;
+
+	ndb_filter_init(&filter);
+	ndb_filter_start_field(&filter, NDB_FILTER_KINDS);
+	ndb_filter_add_int_element(&filter, 1);
+	ndb_filter_end_field(&filter);
+	ndb_filter_end(&filter);
+
+	ndb_begin_query(ndb, &txn);
+	ndb_query(&txn, &filter, 1, results, MAX_RESULTS, &count);
+
+	for (i = 0; i < count && num_pubkeys < MAX_PUBKEYS; i++) {
+		for (j = 0; j < num_pubkeys; j++) {
+			if (!memcmp(pubkeys[j], ndb_note_pubkey(results[i].note), 32))
+				break;
+		}
+		if (j == num_pubkeys)
+			memcpy(pubkeys[num_pubkeys++], ndb_note_pubkey(results[i].note), 32);
+	}
+
+	ndb_end_query(&txn);
+	ndb_filter_destroy(&filter);
+}
+
+// a profile page: notes, reposts, reactions and zaps for a few pubkeys
+static void make_filters(struct ndb_filter *filters, int num_filters)
+{
+	static const uint64_t kinds[] = { 1, 6, 7, 9735 };
+	struct ndb_filter *f;
+	unsigned char *pk;
+	int i;
+
+	for (i = 0; i < num_filters; i++) {
+		f = &filters[i];
+		pk = pubkeys[(i / 4) % num_pubkeys];
+
+		ndb_filter_init(f);
+		ndb_filter_start_field(f, NDB_FILTER_KINDS);
+		ndb_filter_add_int_element(f, kinds[i % 4]);
+		ndb_filter_end_field(f);
+
+		if (i % 4 == 0) {
+			ndb_filter_start_field(f, NDB_FILTER_AUTHORS);
+			ndb_filter_add_id_element(f, pk);
+			ndb_filter_end_field(f);
+		} else {
+			ndb_filter_start_tag_field(f, 'p');
+			ndb_filter_add_id_element(f, pk);
+			ndb_filter_end_field(f);
+		}
+
+		ndb_filter_start_field(f, NDB_FILTER_LIMIT);
+		ndb_filter_add_int_element(f, 500);
+		ndb_filter_end_field(f);
+		ndb_filter_end(f);
+	}
+}
+
+static long bench_filters(struct ndb *ndb, struct ndb_filter *filters,
+			  int num_filters, int *count)
+{
+	struct timespec t1, t2;
+	struct ndb_txn txn;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	for (i = 0; i < BENCH_RUNS; i++) {
+		ndb_begin_query(ndb, &txn);
+		ndb_query(&txn, filters, num_filters, results, MAX_RESULTS, count);
+		ndb_end_query(&txn);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+
+	return ((t2.tv_sec - t1.tv_sec) * (long)1e9 +
+		(t2.tv_nsec - t1.tv_nsec)) / BENCH_RUNS;
+}
+
+int main(int argc, char *argv[])
+{
+	static const int sizes[] = { 4, 8, 12, 16 };
+	struct ndb_filter filters[16];
+	long serial[4], parallel[4];
+	struct ndb *ndb;
+	int i, j, count, threads;
+
+	threads = argc > 1 ? atoi(argv[1]) : 4;
+
+	ndb = open_ndb(0);
+	load_pubkeys(ndb);
+	if (num_pubkeys == 0) {
+		printf("no notes in testdata/db, run `make run-bench` first\n");
+		return 2;
+	}
+
+	make_filters(filters, 16);
+
+	for (i = 0; i < 4; i++)
+		serial[i] = bench_filters(ndb, filters, sizes[i], &count);
+	ndb_destroy(ndb);
+
+	ndb = open_ndb(threads);
+	for (i = 0; i < 4; i++)
+		parallel[i] = bench_filters(ndb, filters, sizes[i], &count);
+	ndb_destroy(ndb);
+
+	printf("filters\tserial_us\tparallel_us\tspeedup (%d threads)\n", threads);
+	for (i = 0; i < 4; i++) {
+		printf("%d\t%ld\t%ld\t%.2fx\n", sizes[i], serial[i] / 1000,
+		       parallel[i] / 1000, (double)serial[i] / parallel[i]);
+	}
+
+	for (j = 0; j < 16; j++)
+		ndb_filter_destroy(&filters[j]);
+
+	return 0;
+}
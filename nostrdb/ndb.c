@@ -4,6 +4,8 @@
 #include "print_util.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <unistd.h>
@@ -14,7 +16,8 @@ static int usage()
 	printf("usage: ndb [--skip-verification] [-d db_dir] <command>\n\n");
 	printf("commands\n\n");
 	printf("	stat\n");
-	printf("	search [--oldest-first] [--limit 42] <fulltext query>\n");
+	printf("	search [--oldest-first | --ranked] [--limit 42] <fulltext query>\n");
+	printf("	query [--explain] <filter json>\n");
 	printf("	import <line-delimited json file>\n\n");
 	printf("settings\n\n");
 	printf("	--skip-verification  skip signature validation\n");
@@ -90,6 +93,80 @@ static void print_stats(struct ndb_stat *stat)
 
 int ndb_print_search_keys(struct ndb_txn *txn);
 
+static void print_query_profile(struct ndb_query_profile *profile, int explain)
+{
+	struct ndb_query_filter_profile *fp;
+	int i, j;
+
+	for (i = 0; i < profile->num_filters; i++) {
+		fp = &profile->filters[i];
+		printf("filter %d: plan %s (%s) indices", i, fp->plan,
+		       fp->streamed ? "streamed" : "materialized");
+		for (j = 0; j < fp->num_indices; j++)
+			printf(" %s", fp->indices[j]);
+		printf("\n");
+
+		if (explain)
+			continue;
+
+		printf("  seeks %" PRIu64 " scanned %" PRIu64
+		       " fetched %" PRIu64 " rejected %" PRIu64
+		       " results %" PRIu64 "\n",
+		       fp->seeks, fp->rows_scanned, fp->notes_fetched,
+		       fp->rows_rejected, fp->results);
+	}
+
+	if (!explain)
+		printf("elapsed %.3f ms\n", profile->elapsed_ns / 1000000.0);
+}
+
+static int query(struct ndb *ndb, const char *json, int explain)
+{
+	static unsigned char buf[0x10000];
+	static struct ndb_query_result results[1000];
+	struct ndb_query_profile profile;
+	struct ndb_filter filter;
+	struct ndb_txn txn;
+	struct ndb_note *note;
+	int i, count;
+
+	if (!ndb_filter_init(&filter))
+		return 0;
+
+	if (!ndb_filter_from_json(json, strlen(json), &filter, buf, sizeof(buf))) {
+		fprintf(stderr, "invalid filter '%s'\n", json);
+		ndb_filter_destroy(&filter);
+		return 0;
+	}
+
+	if (!ndb_begin_query(ndb, &txn)) {
+		fprintf(stderr, "query: couldn't begin a transaction\n");
+		ndb_filter_destroy(&filter);
+		return 0;
+	}
+
+	if (explain) {
+		ndb_query_explain(&txn, &filter, 1, &profile);
+	} else {
+		ndb_query_with_profile(&txn, &filter, 1, results,
+				       sizeof(results) / sizeof(results[0]),
+				       &count, &profile);
+
+		for (i = 0; i < count; i++) {
+			note = results[i].note;
+			print_hex(ndb_note_id(note), 32);
+			printf("\t%u\t%u\n", ndb_note_created_at(note),
+			       ndb_note_kind(note));
+		}
+	}
+
+	print_query_profile(&profile, explain);
+
+	ndb_end_query(&txn);
+	ndb_filter_destroy(&filter);
+	return 1;
+}
+
 int main(int argc, char *argv[])
 {
 	struct ndb *ndb;
@@ -136,7 +213,11 @@ int main(int argc, char *argv[])
 
 	if (argc >= 3 && !strcmp(argv[1], "search")) {
 		for (i = 0; i < 2; i++) {
-			if (!strcmp(argv[2], "--oldest-first")) {
+			if (!strcmp(argv[2], "--ranked")) {
+				ndb_default_ranked_search_config(&search_config);
+				argv++;
+				argc--;
+			} else if (!strcmp(argv[2], "--oldest-first")) {
 				ndb_text_search_config_set_order(&search_config, NDB_ORDER_ASCENDING);
 				argv++;
 				argc--;
@@ -159,6 +240,16 @@ int main(int argc, char *argv[])
 		}
 
 		ndb_end_query(&txn);
+	} else if (argc >= 3 && !strcmp(argv[1], "query")) {
+		if (argc == 4 && !strcmp(argv[2], "--explain")) {
+			if (!query(ndb, argv[3], 1))
+				return 4;
+		} else if (argc == 3) {
+			if (!query(ndb, argv[2], 0))
+				return 4;
+		} else {
+			return usage();
+		}
 	} else if (argc == 2 && !strcmp(argv[1], "stat")) {
 		if (!ndb_stat(ndb, &stat)) {
 			return 3;
@@ -16,10 +16,19 @@
 #include "protected_queue.h"
 #include "memchr.h"
 #include "print_util.h"
+#include "unicode.h"
 #include <stdlib.h>
 #include <limits.h>
 #include <assert.h>
 #include <time.h>
+#include <math.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 #if defined(DEBUG) && (defined(__APPLE__) || defined(__linux__))
 #include <execinfo.h>
 #define NDB_DEBUG_HAS_STACKTRACE 1
@@ -42,14 +51,44 @@
 // the maximum number of things threads pop and push in bulk
 #define THREAD_QUEUE_BATCH 4096
 
-// maximum number of active subscriptions
-#define MAX_SUBSCRIPTIONS 256
 #define MAX_SCAN_CURSORS 12
+#define MAX_INTERSECT_STREAMS NDB_QUERY_MAX_INDICES
+// materialized plans start out with room for this many results, and grow
+// from there up to the query limit
+#define MAX_MATERIALIZED_RESULTS 8192
 #define MAX_FILTERS    16
 
+// an internal ndb_query_iter flag: NIP-45 counts ignore the filter limit
+#define NDB_QUERY_IGNORE_LIMIT (1 << 16)
+
+// fulltext posting lists. Words are cut off at NDB_TERM_MAX bytes, and only
+// the first NDB_POSTING_MAX_POSITIONS places a word appears in a note are
+// kept for phrase matching.
+#define NDB_TERM_MAX 64
+#define NDB_POSTING_BLOCK_MAX 128
+#define NDB_POSTING_MAX_POSITIONS 32
+#define NDB_SEARCH_MAX_TERMS 32
+#define NDB_SEARCH_MAX_EXPANSIONS 16
+
+// the background indexer takes the write lock for this many notes at a
+// time, so it doesn't hold up the writer for long
+#define NDB_INDEXER_BATCH 256
+// same for index rebuilds after a migration, which run on the writer
+#define NDB_REBUILD_BATCH 1024
+#define NDB_INDEXER_QUEUE_SIZE 64
+
 // the maximum size of inbox queues
 static const int DEFAULT_QUEUE_SIZE = 32768;
 
+// size of the shared subscription notification log. The word ring holds
+// the match bitmaps, so it is sized for a couple of words per entry.
+#ifndef NDB_NOTIFY_RING_ENTRIES
+#define NDB_NOTIFY_RING_ENTRIES (1 << 16)
+#endif
+#define NDB_NOTIFY_RING_WORDS (NDB_NOTIFY_RING_ENTRIES * 2)
+static const int DEFAULT_QUERY_QUEUE_SIZE = 256;
+static const int DEFAULT_QUERY_CACHE_SIZE = 128;
+
 // 2mb scratch size for the writer thread
 static const int DEFAULT_WRITER_SCRATCH_SIZE = 2097152;
 
@@ -58,6 +97,10 @@ static const int DEFAULT_WRITER_SCRATCH_SIZE = 2097152;
 
 #define ndb_flag_set(flags, f) ((flags & f) == f)
 
+// bump a query profile counter, if we're profiling
+#define ndb_profile_inc(profile, counter) \
+	do { if (profile) (profile)->counter++; } while (0)
+
 #define NDB_PARSED_ID           (1 << 0)
 #define NDB_PARSED_PUBKEY       (1 << 1)
 #define NDB_PARSED_SIG          (1 << 2)
@@ -68,8 +111,8 @@ static const int DEFAULT_WRITER_SCRATCH_SIZE = 2097152;
 #define NDB_PARSED_ALL          (NDB_PARSED_ID|NDB_PARSED_PUBKEY|NDB_PARSED_SIG|NDB_PARSED_CREATED_AT|NDB_PARSED_KIND|NDB_PARSED_CONTENT|NDB_PARSED_TAGS)
 
 typedef int (*ndb_migrate_fn)(struct ndb_txn *);
-typedef int (*ndb_word_parser_fn)(void *, const char *word, int word_len,
-				  int word_index);
+struct ndb_word;
+typedef int (*ndb_word_parser_fn)(void *, struct ndb_word *word);
 
 #ifdef DEBUG
 #define NDB_DEBUG_QUERY_TIMEOUT_SECONDS 3
@@ -265,8 +308,16 @@ struct ndb_note {
 #pragma pack(pop)
 
 
+#define NDB_REBUILD(db) (1ULL << (db))
+
 struct ndb_migration {
 	ndb_migrate_fn fn;
+
+	// note indices this version needs rebuilt, as NDB_REBUILD bits. They
+	// are emptied after all of the pending migrations have run and then
+	// refilled a batch at a time, so an old db only scans its notes once
+	// and never in one giant transaction.
+	uint64_t rebuild;
 };
 
 struct ndb_profile_record_builder {
@@ -300,9 +351,50 @@ enum ndb_writer_msgtype {
 	NDB_WRITER_NOTE_RELAY, // we already have the note, but we have more relays to write
 };
 
+enum ndb_notifier_msgtype {
+	NDB_NOTIFIER_QUIT, // kill thread immediately
+	NDB_NOTIFIER_NOTE, // a note that was just committed
+};
+
+struct ndb_notifier_msg {
+	enum ndb_notifier_msgtype type;
+	uint64_t txnid; // the write transaction that committed the note
+	uint64_t note_key;
+	struct ndb_note *note; // the notifier frees this when it's done
+};
+
 // keys used for storing data in the NDB metadata database (NDB_DB_NDB_META)
 enum ndb_meta_key {
-	NDB_META_KEY_VERSION = 1
+	NDB_META_KEY_VERSION = 1,
+	NDB_META_KEY_FULLTEXT = 2, // struct ndb_fulltext_state
+	NDB_META_KEY_REBUILD = 3, // struct ndb_rebuild_state
+};
+
+// Note indices a migration emptied, and how far the writer got filling
+// them back up. Notes after `last_key` were indexed as they came in.
+struct ndb_rebuild_state {
+	uint64_t indices; // NDB_REBUILD bits
+	uint64_t next_key;
+	uint64_t last_key;
+};
+
+// How far along the fulltext index is. Every note key up to `high_water`
+// has been indexed if its kind is one of `kinds`. The indexer thread
+// catches up from here, and the writer only indexes notes itself when
+// there is nothing to catch up on.
+struct ndb_fulltext_state {
+	uint64_t high_water;
+	uint64_t num_kinds;
+	uint64_t kinds[NDB_MAX_FULLTEXT_KINDS]; // sorted
+};
+
+enum ndb_indexer_msgtype {
+	NDB_INDEXER_QUIT, // kill thread immediately
+	NDB_INDEXER_WAKE, // new notes were committed
+};
+
+struct ndb_indexer_msg {
+	enum ndb_indexer_msgtype type;
 };
 
 struct ndb_json_parser {
@@ -319,6 +411,13 @@ struct ndb_json_parser {
 struct ndb_lmdb {
 	MDB_env *env;
 	MDB_dbi dbs[NDB_DBS];
+	// NULL when multi-filter queries run on the caller's thread
+	struct ndb_query_pool *query_pool;
+	// NULL when query results aren't cached
+	struct ndb_query_cache *query_cache;
+	// what the fulltext index should cover, from the config
+	int num_fulltext_kinds;
+	uint64_t fulltext_kinds[NDB_MAX_FULLTEXT_KINDS];
 };
 
 /**
@@ -347,9 +446,32 @@ static int ndb_lmdb_reader_check(MDB_env *env)
 	return 1;
 }
 
+// Matches committed notes against subscriptions and runs the subscription
+// callbacks, so none of that happens on the writer thread
+struct ndb_notifier {
+	struct ndb_monitor *monitor;
+	void *queue_buf;
+	pthread_t thread_id;
+
+	struct prot_queue inbox;
+};
+
+// Fulltext indexes notes the writer left for later, see
+// struct ndb_fulltext_state. NULL in the writer when fulltext is off.
+struct ndb_indexer {
+	struct ndb_lmdb *lmdb;
+	unsigned char *scratch;
+	int scratch_size;
+	void *queue_buf;
+	pthread_t thread_id;
+
+	struct prot_queue inbox;
+};
+
 struct ndb_writer {
 	struct ndb_lmdb *lmdb;
-	struct ndb_monitor *monitor;
+	struct ndb_notifier *notifier;
+	struct ndb_indexer *indexer;
 
 	int scratch_size;
 	uint32_t ndb_flags;
@@ -371,6 +493,64 @@ struct ndb_ingester {
 	int scratch_size;
 };
 
+// Where a query plan puts its results. Plans that don't visit notes
+// newest-first collect into a heap that keeps the newest `limit` results,
+// see push_query_result. Only results strictly older than
+// (before_created_at, before_key) are collected, which is how a resumed
+// query skips what it already returned.
+struct ndb_query_collector {
+	struct cursor cur;
+	int limit;
+	int heap;
+	// cur is malloc'd and grows up to `limit` results
+	int grow;
+	uint64_t before_created_at;
+	uint64_t before_key;
+};
+
+// runs the filters of a multi-filter query in parallel, see
+// `ndb_query_parallel`
+struct ndb_query_pool {
+	struct ndb_lmdb *lmdb;
+	struct threadpool tp;
+};
+
+struct written_note {
+	uint64_t note_id;
+	struct ndb_writer_note *note;
+};
+
+struct ndb_query_cache_entry {
+	unsigned char hash[32];
+	int used;
+	uint64_t last_used;
+
+	// the snapshot the results came from
+	size_t txn_id;
+
+	// written notes are matched against these to invalidate the entry
+	struct ndb_filter *filters;
+	int num_filters;
+
+	uint64_t *note_keys;
+	int count;
+};
+
+// ndb_query results by filter hash. The writer drops entries that match
+// anything it writes before it commits, see `ndb_query_cache_invalidate`
+struct ndb_query_cache {
+	pthread_mutex_t lock;
+	struct ndb_query_cache_entry *entries;
+	int num_entries;
+	uint64_t clock;
+	size_t hits, misses;
+
+	// the last write txn that could have changed any query results.
+	// queries on snapshots before it can't be cached, since they could
+	// have missed an invalidation.
+	size_t writer_txnid;
+};
+
 struct ndb_filter_group {
 	struct ndb_filter filters[MAX_FILTERS];
 	int num_filters;
@@ -378,27 +558,106 @@ struct ndb_filter_group {
 
 struct ndb_subscription {
 	uint64_t subid;
+	int slot; // where we are in monitor->subscriptions
+	uint32_t bit; // our bit in the notification log match bitmaps
 	struct ndb_filter_group group;
-	struct prot_queue inbox;
+
+	// guards cursor and overflowed against concurrent pollers
+	pthread_mutex_t lock;
+	uint64_t cursor; // next notification log entry to look at
+	uint64_t min_txnid; // skip notes committed before this transaction
+	int overflowed;
+
+	// created by ndb_subscription_fd. The same eventfd on linux, the
+	// two ends of a pipe elsewhere, -1 when nobody asked for one
+	int fd_read;
+	int fd_write;
+
+	// wakeup coalescing, only touched by the notify pass
+	struct ndb_delivery_policy policy;
+	uint64_t pending; // matches since the last wakeup
+	uint64_t pending_since;
+	uint64_t last_wakeup;
+	uint64_t coalesced; // read with ATOMIC_LOAD_U64
+};
+
+// subid -> subscription, open addressing with linear probing
+struct ndb_sub_map {
+	struct ndb_subscription **slots;
+	uint32_t capacity; // power of two
+	uint32_t count;
+};
+
+// One notification log entry per committed note that matched at least one
+// subscription. The match bitmap lives in the word ring and has a bit set
+// for every subscription (by sub->bit) that matched.
+struct ndb_notify_entry {
+	uint64_t txnid;
+	uint64_t note_key;
+	uint64_t words; // absolute index of the first bitmap word
+	uint32_t num_words;
+};
+
+// The notification log is written only by the notifying thread and read
+// without locks by any number of pollers, each with its own cursor. Entries
+// in [tail, head) are readable. The writer moves tail forward before it
+// overwrites anything, so a reader that still sees its entry at or past
+// tail after copying it knows the copy wasn't torn. A reader left behind
+// tail has overflowed and skips ahead.
+struct ndb_notify_ring {
+	struct ndb_notify_entry *entries;
+	uint64_t *words;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t word_head; // only touched by the writer
+
+	// only for waking up ndb_wait_for_notes
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
 };
 
 struct ndb_monitor {
-	struct ndb_subscription subscriptions[MAX_SUBSCRIPTIONS];
+	// dense and unordered, so the notify pass is a plain walk and
+	// unsubscribing is a swap with the last one
+	struct ndb_subscription **subscriptions;
+	int num_subscriptions;
+	int capacity;
+	struct ndb_sub_map map;
+
+	// subscription bit allocation, plus the notify pass's scratch
+	// bitmaps. All three are bit_words long and share one allocation.
+	uint64_t *bits_used;
+	uint64_t *bits_match;
+	uint64_t *bits_notified;
+	uint32_t bit_words;
+
+	struct ndb_notify_ring ring;
+
 	ndb_sub_fn sub_cb;
 	void *sub_cb_ctx;
-	int num_subscriptions;
+
+	// subids the notify pass woke up, so it can call sub_cb after it lets
+	// go of the lock. Only touched by the notify pass.
+	uint64_t *woken;
+	int woken_capacity;
 
 	// monitor isn't a full inbox. We want pollers to be able to poll
-	// subscriptions efficiently without going through a message queue, so
-	// we use a simple mutex here.
-	pthread_mutex_t mutex;
+	// subscriptions efficiently without going through a message queue.
+	// Only subscribing and unsubscribing change the registry, polling and
+	// the notify pass just read it (the ring is lock-free), so they never
+	// wait on each other.
+	pthread_rwlock_t lock;
 };
 
 struct ndb {
 	struct ndb_lmdb lmdb;
 	struct ndb_ingester ingester;
 	struct ndb_monitor monitor;
+	struct ndb_notifier notifier;
+	struct ndb_indexer indexer;
 	struct ndb_writer writer;
+	struct ndb_query_pool query_pool;
+	struct ndb_query_cache query_cache;
 	int version;
 	uint32_t flags; // setting flags
 	// lmdb environ handles, etc
@@ -424,6 +683,8 @@ enum ndb_query_plan {
 	NDB_PLAN_SEARCH,
 	NDB_PLAN_RELAY_KINDS,
 	NDB_PLAN_PROFILE_SEARCH,
+	NDB_PLAN_INTERSECT,
+	NDB_PLAN_MENTIONS,
 };
 
 // A id + u64 + timestamp
@@ -445,18 +706,6 @@ struct ndb_u64_ts {
 	uint64_t timestamp;
 };
 
-struct ndb_word
-{
-	const char *word;
-	int word_len;
-};
-
-struct ndb_search_words
-{
-	struct ndb_word words[MAX_TEXT_SEARCH_WORDS];
-	int num_words;
-};
-
 
 static inline int is_replaceable_kind(uint64_t kind)
 {
@@ -466,90 +715,6 @@ static inline int is_replaceable_kind(uint64_t kind)
 }
 
 
-// ndb_text_search_key
-//
-// This is compressed when in lmdb:
-//
-//   note_id:    varint
-//   strlen:     varint
-//   str:        cstr
-//   timestamp:  varint
-//   word_index: varint
-//
-static int ndb_make_text_search_key(unsigned char *buf, int bufsize,
-				    int word_index, int word_len, const char *str,
-				    uint64_t timestamp, uint64_t note_id,
-				    int *keysize)
-{
-	struct cursor cur;
-	make_cursor(buf, buf + bufsize, &cur);
-
-	// TODO: need update this to uint64_t
-	// we push this first because our query function can pull this off
-	// quickly to check matches
-	if (!cursor_push_varint(&cur, (int32_t)note_id))
-		return 0;
-
-	// string length
-	if (!cursor_push_varint(&cur, word_len))
-		return 0;
-
-	// non-null terminated, lowercase string
-	if (!cursor_push_lowercase(&cur, str, word_len))
-		return 0;
-
-	// TODO: need update this to uint64_t
-	if (!cursor_push_varint(&cur, (int)timestamp))
-		return 0;
-
-	// the index of the word in the content so that we can do more accurate
-	// phrase searches
-	if (!cursor_push_varint(&cur, word_index))
-		return 0;
-
-	// pad to 8-byte alignment
-	if (!cursor_align(&cur, 8))
-		return 0;
-
-	*keysize = cur.p - cur.start;
-	assert((*keysize % 8) == 0);
-
-	return 1;
-}
-
-static int ndb_make_noted_text_search_key(unsigned char *buf, int bufsize,
-					  int wordlen, const char *word,
-					  uint64_t timestamp, uint64_t note_id,
-					  int *keysize)
-{
-	return ndb_make_text_search_key(buf, bufsize, 0, wordlen, word,
-					timestamp, note_id, keysize);
-}
-
-static int ndb_make_text_search_key_low(unsigned char *buf, int bufsize,
-					int wordlen, const char *word,
-					uint64_t since,
-					int *keysize)
-{
-	uint64_t note_id;
-	note_id = 0;
-	return ndb_make_text_search_key(buf, bufsize, 0, wordlen, word,
-					since, note_id, keysize);
-}
-
-static int ndb_make_text_search_key_high(unsigned char *buf, int bufsize,
-					 int wordlen, const char *word,
-					 uint64_t until,
-					 int *keysize)
-{
-	uint64_t note_id;
-	note_id = INT32_MAX;
-	return ndb_make_text_search_key(buf, bufsize, 0, wordlen, word,
-					until, note_id, keysize);
-}
-
-typedef int (*ndb_text_search_key_order_fn)(unsigned char *buf, int bufsize, int wordlen, const char *word, uint64_t timestamp, int *keysize);
-
 /** From LMDB: Compare two items lexically */
 static int mdb_cmp_memn(const MDB_val *a, const MDB_val *b) {
 	int diff;
@@ -644,84 +809,45 @@ static int ndb_text_search_key_compare(const MDB_val *a, const MDB_val *b)
 	return 0;
 }
 
-static inline int ndb_unpack_text_search_key_noteid(
-		struct cursor *cur, uint64_t *note_id)
-{
-	if (!cursor_pull_varint(cur, note_id))
-		return 0;
-
-	return 1;
-}
-
-// faster peek of just the string instead of unpacking everything
-// this is used to quickly discard range query matches if there is no
-// common prefix
-static inline int ndb_unpack_text_search_key_string(struct cursor *cur,
-						    const char **str,
-						    int *str_len)
-{
-	uint64_t len;
-
-	if (!cursor_pull_varint(cur, &len))
-		return 0;
-
-	*str_len = len;
-
-	*str = (const char *)cur->p;
-
-	if (!cursor_skip(cur, *str_len))
-		return 0;
-
-	return 1;
-}
-
-// should be called after ndb_unpack_text_search_key_string. It continues
-// the unpacking of a text search key if we've already started it.
-static inline int
-ndb_unpack_remaining_text_search_key(struct cursor *cur,
-				     struct ndb_text_search_key *key)
-{
-	if (!cursor_pull_varint(cur, &key->timestamp))
-		return 0;
-
-	if (!cursor_pull_varint(cur, &key->word_index))
-		return 0;
-
-	return 1;
-}
-
-// unpack a fulltext search key
-//
-// full version of string + unpack remaining. This is split up because text
-// searching only requires to pull the string for prefix searching, and the
-// remaining is optional
-static inline int ndb_unpack_text_search_key(unsigned char *p, int len,
-				      struct ndb_text_search_key *key)
-{
-	struct cursor c;
-	make_cursor(p, p + len, &c);
+// Copies the string with case and accents folded away, like fulltext
+// search words, and fills the rest with null bytes. Spaces and punctuation
+// are kept as they are. `n` is the maximum number of bytes to copy, and a
+// character that doesn't fit is left out.
+static void fold_strncpy(char *dst, const char *src, int n) {
+	const unsigned char *p, *end;
+	unsigned char buf[4];
+	int j = 0, len, step;
+	uint32_t cp;
 
-	if (!ndb_unpack_text_search_key_noteid(&c, &key->note_id))
-		return 0;
+	if (!dst || !src || n == 0) {
+		return;
+	}
 
-	if (!ndb_unpack_text_search_key_string(&c, &key->str, &key->str_len))
-		return 0;
+	p = (const unsigned char *)src;
+	end = p + strlen(src);
 
-	return ndb_unpack_remaining_text_search_key(&c, key);
-}
+	while (p < end) {
+		len = step = ndb_utf8_decode(p, end, &cp);
 
-// Copies only lowercase characters to the destination string and fills the rest with null bytes.
-// `dst` and `src` are pointers to the destination and source strings, respectively.
-// `n` is the maximum number of characters to copy.
-static void lowercase_strncpy(char *dst, const char *src, int n) {
-	int j = 0, i = 0;
+		switch (ndb_fold_char(&cp)) {
+		case NDB_CHAR_IGNORE:
+			p += step;
+			continue;
+		case NDB_CHAR_SEP:
+			memcpy(buf, p, len);
+			break;
+		case NDB_CHAR_WORD:
+		case NDB_CHAR_CJK:
+			len = ndb_utf8_encode(cp, buf);
+			break;
+		}
 
-	if (!dst || !src || n == 0) {
-		return;
-	}
+		if (j + len > n)
+			break;
 
-	while (src[i] != '\0' && j < n) {
-		dst[j++] = tolower(src[i++]);
+		memcpy(dst + j, buf, len);
+		j += len;
+		p += step;
 	}
 
 	// Null-terminate and fill the destination string
@@ -735,11 +861,16 @@ static inline int ndb_filter_elem_is_ptr(struct ndb_filter_field *field) {
 }
 
 // Copy the filter
+static void ndb_filter_compile(struct ndb_filter *filter);
+static void ndb_filter_lowercase_hashtags(struct ndb_filter *filter);
+static void ndb_filter_matcher_free(struct ndb_filter_matcher *matcher);
+
 int ndb_filter_clone(struct ndb_filter *dst, struct ndb_filter *src)
 {
 	size_t src_size, elem_size, data_size;
 
 	memcpy(dst, src, sizeof(*src));
+	dst->matcher = NULL;
 
 	elem_size = src->elem_buf.end - src->elem_buf.start;
 	data_size = src->data_buf.end - src->data_buf.start;
@@ -762,6 +893,9 @@ int ndb_filter_clone(struct ndb_filter *dst, struct ndb_filter *src)
 
 	memcpy(dst->elem_buf.start, src->elem_buf.start, src_size);
 
+	// the matcher points into the filter's buffers
+	ndb_filter_compile(dst);
+
 	return 1;
 }
 
@@ -821,6 +955,9 @@ int ndb_filter_end(struct ndb_filter *filter)
 
 	ndb_debug("ndb_filter_end: %ld -> %ld\n", orig_size, elem_len + data_len);
 
+	ndb_filter_lowercase_hashtags(filter);
+	ndb_filter_compile(filter);
+
 	return 1;
 }
 
@@ -934,6 +1071,7 @@ int ndb_filter_init_with(struct ndb_filter *filter, int pages)
 	filter->elements[0] = 0;
 	filter->current = -1;
 	filter->finalized = 0;
+	filter->matcher = NULL;
 
 	return 1;
 }
@@ -947,6 +1085,9 @@ void ndb_filter_destroy(struct ndb_filter *filter)
 	if (filter->elem_buf.start)
 		free(filter->elem_buf.start);
 
+	if (filter->matcher)
+		ndb_filter_matcher_free(filter->matcher);
+
 	memset(filter, 0, sizeof(*filter));
 }
 
@@ -1003,6 +1144,8 @@ static int ndb_filter_start_field_impl(struct ndb_filter *filter, enum ndb_filte
 
 	els->field.type = field;
 	els->field.tag = tag;
+	els->field.tag_len = 0;
+	els->field.tag_name = 0;
 	els->field.elem_type = 0;
 	els->count = 0;
 
@@ -1019,6 +1162,71 @@ int ndb_filter_start_tag_field(struct ndb_filter *filter, char tag)
 	return ndb_filter_start_field_impl(filter, NDB_FILTER_TAGS, tag);
 }
 
+static int ndb_filter_start_tag_field_len(struct ndb_filter *filter,
+					  const char *tag, int len)
+{
+	struct ndb_filter_elements *els;
+	uint32_t offset;
+
+	if (len == 1)
+		return ndb_filter_start_tag_field(filter, tag[0]);
+
+	if (len < 1 || len > 255 || memchr(tag, 0, len))
+		return 0;
+
+	if (!ndb_filter_start_field_impl(filter, NDB_FILTER_TAGS, 0))
+		return 0;
+
+	// the name lives in the data buffer like string elements do
+	offset = filter->data_buf.p - filter->data_buf.start;
+	if (!cursor_push(&filter->data_buf, (unsigned char *)tag, len) ||
+	    !cursor_push_byte(&filter->data_buf, 0))
+		return 0;
+
+	els = ndb_filter_current_element(filter);
+	els->field.tag_len = len;
+	els->field.tag_name = offset;
+
+	return 1;
+}
+
+// Start a tag field with a name of any length, like #emoji
+int ndb_filter_start_tag_field_str(struct ndb_filter *filter, const char *tag)
+{
+	return ndb_filter_start_tag_field_len(filter, tag, strlen(tag));
+}
+
+static const char *ndb_filter_tag_name(const struct ndb_filter *filter,
+				       struct ndb_filter_elements *els,
+				       int *len)
+{
+	if (els->field.tag_len > 1) {
+		*len = els->field.tag_len;
+		return (const char *)filter->data_buf.start + els->field.tag_name;
+	}
+
+	*len = 1;
+	return &els->field.tag;
+}
+
+// does a note's tag key (the "p" in ["p", ...]) match a tag field
+static int ndb_filter_tag_key_matches(struct ndb_filter *filter,
+				      struct ndb_filter_elements *els,
+				      struct ndb_str *key)
+{
+	const char *name;
+	int len;
+
+	if (key->flag == NDB_PACKED_ID)
+		return 0;
+
+	name = ndb_filter_tag_name(filter, els, &len);
+	if (len == 1)
+		return key->str[0] == name[0] && key->str[1] == 0;
+
+	return !strcmp(key->str, name);
+}
+
 static int ndb_filter_add_element(struct ndb_filter *filter, union ndb_filter_element el)
 {
 	struct ndb_filter_elements *current;
@@ -1283,12 +1491,8 @@ static int ndb_tag_filter_matches(struct ndb_filter *filter,
 
 		str = ndb_tag_str(note, it->tag, 0);
 
-		// we only care about packed strings (single char, etc)
-		if (str.flag != NDB_PACKED_STR)
-			continue;
-
-		// do we have #e matching e (or p, etc)
-		if (str.str[0] != els->field.tag || str.str[1] != 0)
+		// do we have #e matching e (or p, emoji, etc)
+		if (!ndb_filter_tag_key_matches(filter, els, &str))
 			continue;
 
 		str = ndb_tag_str(note, it->tag, 1);
@@ -1411,3748 +1615,9189 @@ static int compare_kinds(const void *pa, const void *pb)
 }
 
 //
-// returns 1 if a filter matches a note
-static int ndb_filter_matches_with(struct ndb_filter *filter,
-				   struct ndb_note *note, int already_matched,
-				   struct ndb_note_relay_iterator *relay_iter)
+// Compiled filter matchers
+//
+// Built once when a filter is finalized, so that matching a note against
+// a filter doesn't have to scan or bsearch the filter elements. Kinds
+// below NDB_MATCHER_KINDS get a bitmap, everything else (ids, authors,
+// tag values and larger kinds) goes into open-addressed hash sets that
+// point into the filter's data.
+//
+
+#define NDB_MATCHER_KINDS 1024
+
+struct ndb_value_slot {
+	const unsigned char *data;
+	uint32_t len;
+};
+
+struct ndb_value_set {
+	struct ndb_value_slot *slots;
+	uint32_t mask;
+};
+
+struct ndb_filter_matcher {
+	uint64_t kinds[NDB_MATCHER_KINDS / 64];
+	struct ndb_value_set big_kinds;
+
+	// indexed like filter->elements, empty for fields we don't compile
+	struct ndb_value_set sets[NDB_NUM_FILTERS];
+};
+
+static inline uint64_t ndb_value_hash(const unsigned char *data, uint32_t len)
 {
-	int i, j;
-	struct ndb_filter_elements *els;
-	struct search_id_state state;
-	struct ndb_filter_custom *custom;
+	uint64_t h;
+	uint32_t i;
 
-	state.filter = filter;
+	// ids and pubkeys are already uniformly random
+	if (len == 32) {
+		memcpy(&h, data, 8);
+		return h;
+	}
 
-	for (i = 0; i < filter->num_elements; i++) {
-		els = ndb_filter_get_elements(filter, i);
-		state.els = els;
-		assert(els);
+	// fnv-1a
+	h = 14695981039346656037ULL;
+	for (i = 0; i < len; i++) {
+		h ^= data[i];
+		h *= 1099511628211ULL;
+	}
 
-		// if we know we already match from a query scan result,
-		// we can skip this check
-		if ((1 << els->field.type) & already_matched)
-			continue;
+	return h;
+}
 
-		switch (els->field.type) {
-                case NDB_FILTER_KINDS:
-                        for (j = 0; j < els->count; j++) {
-                                if ((unsigned int)els->elements[j] == note->kind)
-                                        goto cont;
-			}
+static int ndb_value_set_init(struct ndb_value_set *set, int count)
+{
+	uint32_t cap = 4;
+
+	// keep the load factor at or under 1/2
+	while (cap < (uint32_t)count * 2)
+		cap <<= 1;
+
+	if (!(set->slots = calloc(cap, sizeof(*set->slots))))
+		return 0;
+
+	set->mask = cap - 1;
+	return 1;
+}
+
+static void ndb_value_set_add(struct ndb_value_set *set,
+			      const unsigned char *data, uint32_t len)
+{
+	struct ndb_value_slot *slot;
+	uint32_t i;
+
+	i = ndb_value_hash(data, len) & set->mask;
+	for (;; i = (i + 1) & set->mask) {
+		slot = &set->slots[i];
+		if (slot->data == NULL)
 			break;
-		case NDB_FILTER_RELAYS:
-			// for each relay the note was seen on, see if any match 
-			if (!relay_iter) {
-				assert(!"expected relay iterator...");
-				break;
-			}
-			while ((state.key = (unsigned char *)ndb_note_relay_iterate_next(relay_iter))) {
-				// relays in filters are always sorted
-				if (bsearch(&state, &els->elements[0], els->count,
-					    sizeof(els->elements[0]), search_strs)) {
-					ndb_note_relay_iterate_close(relay_iter);
-					goto cont;
-				}
-			}
-			ndb_note_relay_iterate_close(relay_iter);
-			break;
-		case NDB_FILTER_IDS:
-			state.key = ndb_note_id(note);
-			if (bsearch(&state, &els->elements[0], els->count,
-				    sizeof(els->elements[0]), search_ids)) {
-				continue;
-			}
-			break;
-		case NDB_FILTER_AUTHORS:
-			state.key = ndb_note_pubkey(note);
-			if (bsearch(&state, &els->elements[0], els->count,
-				    sizeof(els->elements[0]), search_ids)) {
-				continue;
-			}
-			break;
-		case NDB_FILTER_TAGS:
-			if (ndb_tag_filter_matches(filter, els, note))
-				continue;
-			break;
-		case NDB_FILTER_SINCE:
-			assert(els->count == 1);
-			if (note->created_at >= els->elements[0])
-				continue;
-			break;
-		case NDB_FILTER_UNTIL:
-			assert(els->count == 1);
-			if (note->created_at < els->elements[0])
-				continue;
-			break;
-		case NDB_FILTER_SEARCH:
-			// TODO: matching search filters will need an accelerated
-			// data structure, like our minimal perfect hashmap
-			// idea for mutewords.
-			//
-			// We'll also want to store tokenized words in the filter
-			// itself, so that we can walk over each word and check
-			// the hashmap to see if the note contains at least
-			// one word.
-			//
-			// For now we always return true, since we assume
-			// the search index will be walked for these kinds
-			// of queries.
-			continue;
-		case NDB_FILTER_CUSTOM:
-			custom = ndb_filter_get_custom_element(filter, els);
-			if (custom->cb(custom->ctx, note))
-				continue;
-			break;
-
-		case NDB_FILTER_LIMIT:
-cont:
-			continue;
-		}
-
-		// all need to match
-		return 0;
+		if (slot->len == len && !memcmp(slot->data, data, len))
+			return;
 	}
 
-	return 1;
+	slot->data = data;
+	slot->len = len;
 }
 
-int ndb_filter_matches(struct ndb_filter *filter, struct ndb_note *note)
+static int ndb_value_set_has(struct ndb_value_set *set,
+			     const unsigned char *data, uint32_t len)
 {
-	return ndb_filter_matches_with(filter, note, 0, NULL);
+	struct ndb_value_slot *slot;
+	uint32_t i;
+
+	i = ndb_value_hash(data, len) & set->mask;
+	for (;; i = (i + 1) & set->mask) {
+		slot = &set->slots[i];
+		if (slot->data == NULL)
+			return 0;
+		if (slot->len == len && !memcmp(slot->data, data, len))
+			return 1;
+	}
 }
 
-int ndb_filter_matches_with_relay(struct ndb_filter *filter,
-				  struct ndb_note *note,
-				  struct ndb_note_relay_iterator *note_relay_iter)
+static void ndb_filter_matcher_free(struct ndb_filter_matcher *matcher)
 {
-	return ndb_filter_matches_with(filter, note, 0, note_relay_iter);
+	int i;
+
+	for (i = 0; i < NDB_NUM_FILTERS; i++)
+		free(matcher->sets[i].slots);
+
+	free(matcher->big_kinds.slots);
+	free(matcher);
 }
 
-// because elements are stored as offsets and qsort doesn't support context,
-// we do a dumb thing where we convert elements to pointers and back if we
-// are doing an id or string sort
-static void sort_filter_elements(struct ndb_filter *filter,
-				 struct ndb_filter_elements *els,
-				 int (*cmp)(const void *, const void *))
+static int ndb_filter_matcher_compile_kinds(struct ndb_filter_matcher *m,
+					    struct ndb_filter_elements *els)
 {
+	uint64_t kind;
 	int i;
 
-	assert(ndb_filter_elem_is_ptr(&els->field));
+	for (i = 0; i < els->count; i++) {
+		kind = els->elements[i];
+		if (kind < NDB_MATCHER_KINDS) {
+			m->kinds[kind / 64] |= 1ULL << (kind % 64);
+			continue;
+		}
 
-	for (i = 0; i < els->count; i++)
-		els->elements[i] += (uint64_t)filter->data_buf.start;
+		if (!m->big_kinds.slots &&
+		    !ndb_value_set_init(&m->big_kinds, els->count))
+			return 0;
 
-	qsort(&els->elements[0], els->count, sizeof(els->elements[0]), cmp);
+		ndb_value_set_add(&m->big_kinds,
+				  (unsigned char *)&els->elements[i], 8);
+	}
 
-	for (i = 0; i < els->count; i++)
-		els->elements[i] -= (uint64_t)filter->data_buf.start;
+	return 1;
 }
 
-static int ndb_filter_field_eq(struct ndb_filter *a_filt,
-			       struct ndb_filter_elements *a_field,
-			       struct ndb_filter *b_filt,
-			       struct ndb_filter_elements *b_field)
+static int ndb_filter_matcher_compile_set(struct ndb_filter *filter,
+					  struct ndb_filter_elements *els,
+					  struct ndb_value_set *set)
 {
+	const char *str;
 	int i;
-	const char *a_str, *b_str;
-	unsigned char *a_id, *b_id;
-	uint64_t a_int, b_int;
-	struct ndb_filter_custom *a_custom, *b_custom;
-
-	if (a_field->count != b_field->count)
-		return 0;
-
-	if (a_field->field.type != b_field->field.type) {
-		ndb_debug("UNUSUAL: field types do not match in ndb_filter_field_eq\n");
-		return 0;
-	}
 
-	if (a_field->field.elem_type != b_field->field.elem_type) {
-		ndb_debug("UNUSUAL: field element types do not match in ndb_filter_field_eq\n");
+	if (els->field.elem_type != NDB_ELEMENT_ID &&
+	    els->field.elem_type != NDB_ELEMENT_STRING)
 		return 0;
-	}
 
-	if (a_field->field.elem_type == NDB_ELEMENT_UNKNOWN) {
-		ndb_debug("UNUSUAL: field element types are unknown\n");
+	if (!ndb_value_set_init(set, els->count))
 		return 0;
-	}
 
-	for (i = 0; i < a_field->count; i++) {
-		switch (a_field->field.elem_type) {
-		case NDB_ELEMENT_CUSTOM:
-			a_custom = ndb_filter_get_custom_element(a_filt, a_field);
-			b_custom = ndb_filter_get_custom_element(b_filt, b_field);
-			if (memcmp(a_custom, b_custom, sizeof(*a_custom)))
-				return 0;
-			break;
-		case NDB_ELEMENT_UNKNOWN:
-			return 0;
-		case NDB_ELEMENT_STRING:
-			a_str = ndb_filter_get_string_element(a_filt, a_field, i);
-			b_str = ndb_filter_get_string_element(b_filt, b_field, i);
-			if (strcmp(a_str, b_str))
-				return 0;
-			break;
-		case NDB_ELEMENT_ID:
-			a_id = ndb_filter_get_id_element(a_filt, a_field, i);
-			b_id = ndb_filter_get_id_element(b_filt, b_field, i);
-			if (memcmp(a_id, b_id, 32))
-				return 0;
-			break;
-		case NDB_ELEMENT_INT:
-			a_int = ndb_filter_get_int_element(a_field, i);
-			b_int = ndb_filter_get_int_element(b_field, i);
-			if (a_int != b_int)
-				return 0;
-			break;
+	for (i = 0; i < els->count; i++) {
+		if (els->field.elem_type == NDB_ELEMENT_ID) {
+			ndb_value_set_add(set,
+				ndb_filter_get_id_element(filter, els, i), 32);
+		} else {
+			str = ndb_filter_get_string_element(filter, els, i);
+			ndb_value_set_add(set, (const unsigned char *)str,
+					  strlen(str));
 		}
 	}
 
 	return 1;
 }
 
-void ndb_filter_end_field(struct ndb_filter *filter)
+// Build the matcher for a finalized filter. If anything goes wrong we
+// just don't have one, and matching falls back to the filter elements.
+static void ndb_filter_compile(struct ndb_filter *filter)
 {
-	int cur_offset;
-	struct ndb_filter_elements *cur;
+	struct ndb_filter_matcher *m;
+	struct ndb_filter_elements *els;
+	int i, ok;
 
-	cur_offset = filter->current;
+	if (!filter->finalized || filter->matcher)
+		return;
 
-	if (!(cur = ndb_filter_current_element(filter)))
+	if (!(m = calloc(1, sizeof(*m))))
 		return;
 
-	filter->elements[filter->num_elements++] = cur_offset;
+	for (i = 0; i < filter->num_elements; i++) {
+		els = ndb_filter_get_elements(filter, i);
 
-	// sort elements for binary search
-	switch (cur->field.type) {
-	case NDB_FILTER_IDS:
-	case NDB_FILTER_AUTHORS:
-		sort_filter_elements(filter, cur, compare_ids);
-		break;
-	case NDB_FILTER_RELAYS:
-		sort_filter_elements(filter, cur, compare_strs);
-		break;
-	case NDB_FILTER_KINDS:
-		qsort(&cur->elements[0], cur->count,
-		      sizeof(cur->elements[0]), compare_kinds);
-		break;
-	case NDB_FILTER_TAGS:
-		// TODO: generic tag search sorting
-		break;
-	case NDB_FILTER_SINCE:
-	case NDB_FILTER_CUSTOM:
-	case NDB_FILTER_UNTIL:
-	case NDB_FILTER_LIMIT:
-	case NDB_FILTER_SEARCH:
-		// don't need to sort these
-		break;
-	}
+		switch (els->field.type) {
+		case NDB_FILTER_KINDS:
+			ok = ndb_filter_matcher_compile_kinds(m, els);
+			break;
+		case NDB_FILTER_IDS:
+		case NDB_FILTER_AUTHORS:
+		case NDB_FILTER_TAGS:
+			ok = ndb_filter_matcher_compile_set(filter, els,
+							    &m->sets[i]);
+			break;
+		default:
+			ok = 1;
+			break;
+		}
 
-	filter->current = -1;
+		if (!ok) {
+			ndb_filter_matcher_free(m);
+			return;
+		}
+	}
 
+	filter->matcher = m;
 }
 
-static void ndb_filter_group_init(struct ndb_filter_group *group)
+static inline int ndb_filter_matcher_has_kind(struct ndb_filter_matcher *m,
+					      uint64_t kind)
 {
-	group->num_filters = 0;
+	if (kind < NDB_MATCHER_KINDS)
+		return (m->kinds[kind / 64] >> (kind % 64)) & 1;
+
+	return m->big_kinds.slots &&
+		ndb_value_set_has(&m->big_kinds, (unsigned char *)&kind, 8);
 }
 
-static int ndb_filter_group_add(struct ndb_filter_group *group,
-				struct ndb_filter *filter)
-{
-	if (group->num_filters + 1 > MAX_FILTERS)
-		return 0;
+// The normalized hashtags of a note: its t tags and, for text and
+// longform notes, the #hashtags in the content. These are lowercased and
+// deduped, and are what we index under `t`.
+struct ndb_hashtags {
+	char tags[NDB_MAX_HASHTAGS][NDB_MAX_HASHTAG_LEN];
+	int count;
+};
 
-	return ndb_filter_clone(&group->filters[group->num_filters++], filter);
+static inline int ndb_kind_has_hashtag_content(uint32_t kind)
+{
+	return kind == 1 || kind == 30023;
 }
 
-static int ndb_filter_group_matches(struct ndb_filter_group *group,
-				    struct ndb_note *note)
+static void ndb_hashtags_push(struct ndb_hashtags *tags, const char *str,
+			      int len)
 {
+	char tag[NDB_MAX_HASHTAG_LEN];
 	int i;
-	struct ndb_filter *filter;
 
-	if (group->num_filters == 0)
-		return 1;
+	if (len <= 0 || len >= NDB_MAX_HASHTAG_LEN ||
+	    tags->count == NDB_MAX_HASHTAGS)
+		return;
 
-	for (i = 0; i < group->num_filters; i++) {
-		filter = &group->filters[i];
+	for (i = 0; i < len; i++)
+		tag[i] = tolower((unsigned char)str[i]);
+	tag[len] = '\0';
 
-		if (ndb_filter_matches(filter, note))
-			return 1;
+	for (i = 0; i < tags->count; i++) {
+		if (!strcmp(tags->tags[i], tag))
+			return;
 	}
 
-	return 0;
+	memcpy(tags->tags[tags->count++], tag, len + 1);
 }
 
-static void ndb_make_search_key(struct ndb_search_key *key, unsigned char *id,
-			        uint64_t timestamp, const char *search)
+// `blocks` are the parsed content blocks, if we have them
+static void ndb_note_hashtags(struct ndb_note *note, struct ndb_blocks *blocks,
+			      struct ndb_hashtags *tags)
 {
-	memcpy(key->id, id, 32);
-	key->timestamp = timestamp;
-	lowercase_strncpy(key->search, search, sizeof(key->search) - 1);
-	key->search[sizeof(key->search) - 1] = '\0';
-}
+	struct ndb_block_iterator block_iter;
+	struct ndb_iterator iter;
+	struct ndb_str_block *str_block;
+	struct ndb_block *block;
+	struct ndb_str str;
 
-static int ndb_write_profile_search_index(struct ndb_txn *txn,
-					  struct ndb_search_key *index_key,
-					  uint64_t profile_key)
-{
-	int rc;
-	MDB_val key, val;
+	tags->count = 0;
 
-	key.mv_data = index_key;
-	key.mv_size = sizeof(*index_key);
-	val.mv_data = &profile_key;
-	val.mv_size = sizeof(profile_key);
+	ndb_tags_iterate_start(note, &iter);
 
-	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_PROFILE_SEARCH],
-			  &key, &val, 0)))
-	{
-		ndb_debug("ndb_write_profile_search_index failed: %s\n",
-			  mdb_strerror(rc));
-		return 0;
-	}
+	while (ndb_tags_iterate_next(&iter)) {
+		if (iter.tag->count < 2)
+			continue;
 
-	return 1;
-}
+		str = ndb_tag_str(note, iter.tag, 0);
+		if (str.flag == NDB_PACKED_ID || strcmp(str.str, "t"))
+			continue;
 
+		str = ndb_tag_str(note, iter.tag, 1);
+		if (str.flag == NDB_PACKED_ID)
+			continue;
 
-// map usernames and display names to profile keys for user searching
-static int ndb_write_profile_search_indices(struct ndb_txn *txn,
-					    struct ndb_note *note,
-					    uint64_t profile_key,
-					    void *profile_root)
-{
-	struct ndb_search_key index;
-	NdbProfileRecord_table_t profile_record;
-	NdbProfile_table_t profile;
-
-	profile_record = NdbProfileRecord_as_root(profile_root);
-	profile = NdbProfileRecord_profile_get(profile_record);
-
-	const char *name = NdbProfile_name_get(profile);
-	const char *display_name = NdbProfile_display_name_get(profile);
-
-	// words + pubkey + created
-	if (name) {
-		ndb_make_search_key(&index, note->pubkey, note->created_at,
-				    name);
-		if (!ndb_write_profile_search_index(txn, &index, profile_key))
-			return 0;
-	}
-
-	if (display_name) {
-		// don't write the same name/display_name twice
-		if (name && !strcmp(display_name, name)) {
-			return 1;
-		}
-		ndb_make_search_key(&index, note->pubkey, note->created_at,
-				    display_name);
-		if (!ndb_write_profile_search_index(txn, &index, profile_key))
-			return 0;
+		ndb_hashtags_push(tags, str.str, strlen(str.str));
 	}
 
-	return 1;
-}
-
-static inline void ndb_tsid_init(struct ndb_tsid *key, unsigned char *id,
-				 uint64_t timestamp)
-{
-	memcpy(key->id, id, 32);
-	key->timestamp = timestamp;
-}
+	if (blocks == NULL)
+		return;
 
-static inline void ndb_tsid_low(struct ndb_tsid *key, unsigned char *id)
-{
-	memcpy(key->id, id, 32);
-	key->timestamp = 0;
-}
+	ndb_blocks_iterate_start(ndb_note_content(note), blocks, &block_iter);
 
-static inline void ndb_u64_ts_init(struct ndb_u64_ts *key, uint64_t integer,
-				     uint64_t timestamp)
-{
-	key->u64 = integer;
-	key->timestamp = timestamp;
-}
+	while ((block = ndb_blocks_iterate_next(&block_iter))) {
+		if (ndb_get_block_type(block) != BLOCK_HASHTAG)
+			continue;
 
-// useful for range-searching for the latest key with a clustered created_at timen
-static inline void ndb_tsid_high(struct ndb_tsid *key, const unsigned char *id)
-{
-	memcpy(key->id, id, 32);
-	key->timestamp = UINT64_MAX;
+		str_block = ndb_block_str(block);
+		ndb_hashtags_push(tags, ndb_str_block_ptr(str_block),
+				  ndb_str_block_len(str_block));
+	}
 }
 
-static int _ndb_begin_query(struct ndb *ndb, struct ndb_txn *txn, int flags)
+static inline int ndb_is_hashtag_field(struct ndb_filter *filter,
+				       struct ndb_filter_elements *els)
 {
-	int ok;
+	const char *tag;
+	int tag_len;
 
-	txn->lmdb = &ndb->lmdb;
-	MDB_txn **mdb_txn = (MDB_txn **)&txn->mdb_txn;
-	if (!txn->lmdb->env)
+	if (els->field.type != NDB_FILTER_TAGS ||
+	    els->field.elem_type != NDB_ELEMENT_STRING)
 		return 0;
 
-	ok = mdb_txn_begin(txn->lmdb->env, NULL, flags, mdb_txn) == 0;
-#ifdef DEBUG
-	if (ok && flags == MDB_RDONLY)
-		ndb_debug_register_query_txn(txn, flags);
-#endif
-	return ok;
+	tag = ndb_filter_tag_name(filter, els, &tag_len);
+	return tag_len == 1 && tag[0] == 't';
 }
 
-int ndb_begin_query(struct ndb *ndb, struct ndb_txn *txn)
+// #t values are lowercased when the filter is finalized
+static int ndb_hashtag_eq(const char *tag, const char *lowered)
 {
-	return _ndb_begin_query(ndb, txn, MDB_RDONLY);
-}
+	for (; *tag && *lowered; tag++, lowered++) {
+		if (tolower((unsigned char)*tag) != *lowered)
+			return 0;
+	}
 
-// this should only be used in migrations, etc
-static int ndb_begin_rw_query(struct ndb *ndb, struct ndb_txn *txn)
-{
-	return _ndb_begin_query(ndb, txn, 0);
+	return *tag == *lowered;
 }
 
-static int ndb_db_is_index(enum ndb_dbs index)
+// Does a #t value follow any '#' in the content? Cheap enough to rule out
+// most notes before we go and parse the content.
+static int ndb_content_may_have_hashtag(struct ndb_filter *filter,
+					struct ndb_filter_elements *els,
+					const char *content, int content_len)
 {
-	switch (index) {
-		case NDB_DB_NOTE:
-		case NDB_DB_META:
-		case NDB_DB_PROFILE:
-		case NDB_DB_NOTE_ID:
-		case NDB_DB_NDB_META:
-		case NDB_DB_PROFILE_SEARCH:
-		case NDB_DB_PROFILE_LAST_FETCH:
-		case NDB_DB_NOTE_RELAYS:
-		case NDB_DBS:
-			return 0;
-		case NDB_DB_PROFILE_PK:
-		case NDB_DB_NOTE_KIND:
-		case NDB_DB_NOTE_TEXT:
-		case NDB_DB_NOTE_BLOCKS:
-		case NDB_DB_NOTE_TAGS:
-		case NDB_DB_NOTE_PUBKEY:
-		case NDB_DB_NOTE_PUBKEY_KIND:
-		case NDB_DB_NOTE_RELAY_KIND:
-			return 1;
+	const char *p, *end = content + content_len, *val;
+	int i, j;
+
+	for (p = content; (p = memchr(p, '#', end - p)); p++) {
+		for (i = 0; i < els->count; i++) {
+			val = ndb_filter_get_string_element(filter, els, i);
+			for (j = 0; val[j] && p + 1 + j < end; j++) {
+				if (tolower((unsigned char)p[1 + j]) != val[j])
+					break;
+			}
+			if (val[j] == '\0')
+				return 1;
+		}
 	}
 
 	return 0;
 }
 
-static inline void ndb_id_u64_ts_init(struct ndb_id_u64_ts *key,
-				      unsigned char *id, uint64_t iu64,
-				      uint64_t timestamp)
-{
-	memcpy(key->id, id, 32);
-	key->u64 = iu64;
-	key->timestamp = timestamp;
-}
-
-// formats the relay url buffer for the NDB_DB_NOTE_RELAYS value. It's a
-// null terminated string padded to 8 bytes (we must keep the entire database
-// aligned to 8 bytes at all times)
-static int prepare_relay_buf(char *relay_buf, int bufsize, const char *relay,
-			     int relay_len)
+// Match a #t field against the hashtags in the content, the same way the
+// writer finds them for the tag index
+static int ndb_content_hashtag_matches(struct ndb_filter *filter,
+				       struct ndb_filter_elements *els,
+				       struct ndb_note *note)
 {
-	struct cursor cur;
+	struct ndb_hashtags tags;
+	struct ndb_blocks *blocks;
+	unsigned char stack_buf[4096], *buf = stack_buf;
+	const char *content;
+	int i, j, buf_size, content_len, ok = 0;
 
-	// make sure the size of the buffer is aligned
-	assert((bufsize % 8) == 0);
+	if (!ndb_kind_has_hashtag_content(note->kind))
+		return 0;
 
-	make_cursor((unsigned char *)relay_buf, (unsigned char *)relay_buf + bufsize, &cur);
+	content = ndb_note_content(note);
+	content_len = ndb_note_content_length(note);
 
-	// push the relay string
-	if (!cursor_push(&cur, (unsigned char *)relay, relay_len))
+	if (!ndb_content_may_have_hashtag(filter, els, content, content_len))
 		return 0;
 
-	// relay urls are null terminated for convenience
-	if (!cursor_push_byte(&cur, 0))
+	// parsed blocks are never much larger than the content
+	buf_size = content_len * 8 + 1024;
+	if (buf_size > (int)sizeof(stack_buf) && !(buf = malloc(buf_size)))
 		return 0;
 
-	// align the buffer
-	if (!cursor_align(&cur, 8))
-		return 0;
+	if (!ndb_parse_content(buf, buf_size, content, content_len, &blocks))
+		goto done;
 
-	return cur.p - cur.start;
+	ndb_note_hashtags(note, blocks, &tags);
+
+	for (i = 0; i < tags.count && !ok; i++) {
+		for (j = 0; j < els->count; j++) {
+			if (!strcmp(tags.tags[i],
+				    ndb_filter_get_string_element(filter, els, j))) {
+				ok = 1;
+				break;
+			}
+		}
+	}
+
+done:
+	if (buf != stack_buf)
+		free(buf);
+	return ok;
 }
 
-// Write to the note_id -> relay_url database. This records where notes
-// have been seen
-static int ndb_write_note_relay(struct ndb_txn *txn, uint64_t note_key,
-				const char *relay, uint8_t relay_len)
+// Match a #t field against the note's t tags regardless of case, and then
+// its content hashtags, so every plan agrees with the tag index
+static int ndb_hashtag_filter_matches(struct ndb_filter *filter,
+				      struct ndb_filter_elements *els,
+				      struct ndb_note *note)
 {
-	char relay_buf[256];
-	int rc, len;
-	MDB_val k, v;
+	struct ndb_iterator iter;
+	struct ndb_str str;
+	int i;
 
-	if (relay == NULL || relay_len == 0) {
-		ndb_debug("relay is NULL in ndb_write_note_relay? '%s' %d\n", relay, relay_len);
+	if (!ndb_is_hashtag_field(filter, els))
 		return 0;
-	}
-
-	ndb_debug("writing note_relay '%s' for notekey:%" PRIu64 "\n", relay, note_key);
 
-	if (!(len = prepare_relay_buf(relay_buf, sizeof(relay_buf), relay, relay_len))) {
-		fprintf(stderr, "relay url '%s' too large when writing note relay index\n", relay);
-		return 0;
-	}
+	ndb_tags_iterate_start(note, &iter);
 
-	assert((len % 8) == 0);
+	while (ndb_tags_iterate_next(&iter)) {
+		if (iter.tag->count < 2)
+			continue;
 
-	k.mv_data = &note_key;
-	k.mv_size = sizeof(note_key);
+		str = ndb_tag_str(note, iter.tag, 0);
+		if (str.flag == NDB_PACKED_ID || strcmp(str.str, "t"))
+			continue;
 
-	v.mv_data = relay_buf;
-	v.mv_size = len;
+		str = ndb_tag_str(note, iter.tag, 1);
+		if (str.flag == NDB_PACKED_ID)
+			continue;
 
-	// NODUPDATA is specified so that we don't accidently add duplicate
-	// key/value pairs
-	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_RELAYS],
-			  &k, &v, MDB_NODUPDATA)))
-	{
-		ndb_debug("ndb_write_note_relay failed: %s\n", mdb_strerror(rc));
-		return 0;
+		for (i = 0; i < els->count; i++) {
+			if (ndb_hashtag_eq(str.str,
+				ndb_filter_get_string_element(filter, els, i)))
+				return 1;
+		}
 	}
 
-	ndb_debug("wrote %d bytes to note relay: '%s'\n", len, relay_buf);
-
-	return 1;
+	return ndb_content_hashtag_matches(filter, els, note);
 }
 
-struct ndb_relay_kind_key {
-	uint64_t note_key;
-	uint64_t kind;
-	uint64_t created_at;
-	uint8_t relay_len;
-	const char *relay;
-};
-
-static int ndb_relay_kind_key_init(
-		struct ndb_relay_kind_key *key,
-		uint64_t note_key,
-		uint64_t kind,
-		uint64_t created_at,
-		const char *relay)
+// Hashtags are indexed lowercased, see ndb_note_hashtags
+static void ndb_filter_lowercase_hashtags(struct ndb_filter *filter)
 {
-	if (relay == NULL)
-		return 0;
+	struct ndb_filter_elements *els;
+	char *str;
+	int i, j;
 
-	key->relay = relay;
-	key->relay_len = strlen(relay);
-	if (key->relay_len > 248)
-		return 0;
+	for (i = 0; i < filter->num_elements; i++) {
+		els = ndb_filter_get_elements(filter, i);
+		if (!ndb_is_hashtag_field(filter, els))
+			continue;
 
-	key->note_key = note_key;
-	key->kind = kind;
-	key->created_at = created_at;
-	return 1;
+		for (j = 0; j < els->count; j++) {
+			str = (char *)ndb_filter_get_string_element(filter, els, j);
+			for (; *str; str++)
+				*str = tolower((unsigned char)*str);
+		}
+	}
 }
 
-
-// create a range key for a relay kind query
-static int ndb_relay_kind_key_init_high(
-		struct ndb_relay_kind_key *key,
-		const char *relay,
-		uint64_t kind,
-		uint64_t until)
+// like ndb_tag_filter_matches, but a single set lookup per tag
+static int ndb_tag_set_matches(struct ndb_filter *filter,
+			       struct ndb_value_set *set,
+			       struct ndb_filter_elements *els,
+			       struct ndb_note *note)
 {
-	return ndb_relay_kind_key_init(key, UINT64_MAX, kind, UINT64_MAX, relay);
-}
+	struct ndb_iterator iter, *it = &iter;
+	struct ndb_str str;
 
-static void ndb_parse_relay_kind_key(struct ndb_relay_kind_key *key, unsigned char *buf)
-{
-	// WE ARE ASSUMING WE ARE PARSING FROM AN ALIGNED BUFFER HERE
-	assert((uint64_t)buf % 8 == 0);
-	// - note_id:        00 + 8 bytes
-	// - kind:           08 + 8 bytes
-	// - created_at:     16 + 8 bytes
-	// - relay_url_size: 24 + 1 byte
-	// - relay_url:      25 + n byte null-terminated string
-	// - pad to 8 byte alignment
-	key->note_key   =  *(uint64_t*) (buf + 0);
-	key->kind       =  *(uint64_t*) (buf + 8);
-	key->created_at =  *(uint64_t*) (buf + 16);
-	key->relay_len  =   *(uint8_t*) (buf + 24);
-	key->relay      = (const char*) (buf + 25);
-}
+	ndb_tags_iterate_start(note, it);
 
-static void ndb_debug_relay_kind_key(struct ndb_relay_kind_key *key)
-{
-	ndb_debug("note_key:%" PRIu64 " kind:%" PRIu64 " created_at:%" PRIu64 " '%s'\n",
-			key->note_key, key->kind, key->created_at, key->relay);
-}
+	while (ndb_tags_iterate_next(it)) {
+		if (it->tag->count < 2)
+			continue;
+
+		str = ndb_tag_str(note, it->tag, 0);
+		if (!ndb_filter_tag_key_matches(filter, els, &str))
+			continue;
+
+		str = ndb_tag_str(note, it->tag, 1);
+
+		if (els->field.elem_type == NDB_ELEMENT_ID) {
+			if (str.flag != NDB_PACKED_ID)
+				continue;
+			if (ndb_value_set_has(set, str.id, 32))
+				return 1;
+		} else {
+			if (str.flag == NDB_PACKED_ID)
+				continue;
+			if (ndb_value_set_has(set, (const unsigned char *)str.str,
+					      strlen(str.str)))
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+//
+// returns 1 if a filter matches a note
+static int ndb_filter_matches_with(struct ndb_filter *filter,
+				   struct ndb_note *note, int already_matched,
+				   struct ndb_note_relay_iterator *relay_iter)
+{
+	int i, j;
+	struct ndb_filter_elements *els;
+	struct search_id_state state;
+	struct ndb_filter_custom *custom;
+	struct ndb_filter_matcher *m = filter->matcher;
+
+	state.filter = filter;
+
+	for (i = 0; i < filter->num_elements; i++) {
+		els = ndb_filter_get_elements(filter, i);
+		state.els = els;
+		assert(els);
+
+		// if we know we already match from a query scan result,
+		// we can skip this check
+		if ((1 << els->field.type) & already_matched)
+			continue;
+
+		switch (els->field.type) {
+                case NDB_FILTER_KINDS:
+			if (m) {
+				if (ndb_filter_matcher_has_kind(m, note->kind))
+					continue;
+				break;
+			}
+                        for (j = 0; j < els->count; j++) {
+                                if ((unsigned int)els->elements[j] == note->kind)
+                                        goto cont;
+			}
+			break;
+		case NDB_FILTER_RELAYS:
+			// for each relay the note was seen on, see if any match 
+			if (!relay_iter) {
+				assert(!"expected relay iterator...");
+				break;
+			}
+			while ((state.key = (unsigned char *)ndb_note_relay_iterate_next(relay_iter))) {
+				// relays in filters are always sorted
+				if (bsearch(&state, &els->elements[0], els->count,
+					    sizeof(els->elements[0]), search_strs)) {
+					ndb_note_relay_iterate_close(relay_iter);
+					goto cont;
+				}
+			}
+			ndb_note_relay_iterate_close(relay_iter);
+			break;
+		case NDB_FILTER_IDS:
+			state.key = ndb_note_id(note);
+			if (m) {
+				if (ndb_value_set_has(&m->sets[i], state.key, 32))
+					continue;
+				break;
+			}
+			if (bsearch(&state, &els->elements[0], els->count,
+				    sizeof(els->elements[0]), search_ids)) {
+				continue;
+			}
+			break;
+		case NDB_FILTER_AUTHORS:
+			state.key = ndb_note_pubkey(note);
+			if (m) {
+				if (ndb_value_set_has(&m->sets[i], state.key, 32))
+					continue;
+				break;
+			}
+			if (bsearch(&state, &els->elements[0], els->count,
+				    sizeof(els->elements[0]), search_ids)) {
+				continue;
+			}
+			break;
+		case NDB_FILTER_TAGS:
+			if (m && m->sets[i].slots) {
+				if (ndb_tag_set_matches(filter, &m->sets[i], els, note))
+					continue;
+			} else if (ndb_tag_filter_matches(filter, els, note)) {
+				continue;
+			}
+			if (ndb_hashtag_filter_matches(filter, els, note))
+				continue;
+			break;
+		case NDB_FILTER_SINCE:
+			assert(els->count == 1);
+			if (note->created_at >= els->elements[0])
+				continue;
+			break;
+		case NDB_FILTER_UNTIL:
+			assert(els->count == 1);
+			if (note->created_at < els->elements[0])
+				continue;
+			break;
+		case NDB_FILTER_SEARCH:
+			// TODO: matching search filters will need an accelerated
+			// data structure, like our minimal perfect hashmap
+			// idea for mutewords.
+			//
+			// We'll also want to store tokenized words in the filter
+			// itself, so that we can walk over each word and check
+			// the hashmap to see if the note contains at least
+			// one word.
+			//
+			// For now we always return true, since we assume
+			// the search index will be walked for these kinds
+			// of queries.
+			continue;
+		case NDB_FILTER_CUSTOM:
+			custom = ndb_filter_get_custom_element(filter, els);
+			if (custom->cb(custom->ctx, note))
+				continue;
+			break;
+
+		case NDB_FILTER_LIMIT:
+cont:
+			continue;
+		}
+
+		// all need to match
+		return 0;
+	}
+
+	return 1;
+}
+
+int ndb_filter_matches(struct ndb_filter *filter, struct ndb_note *note)
+{
+	return ndb_filter_matches_with(filter, note, 0, NULL);
+}
+
+int ndb_filter_matches_with_relay(struct ndb_filter *filter,
+				  struct ndb_note *note,
+				  struct ndb_note_relay_iterator *note_relay_iter)
+{
+	return ndb_filter_matches_with(filter, note, 0, note_relay_iter);
+}
+
+// because elements are stored as offsets and qsort doesn't support context,
+// we do a dumb thing where we convert elements to pointers and back if we
+// are doing an id or string sort
+static void sort_filter_elements(struct ndb_filter *filter,
+				 struct ndb_filter_elements *els,
+				 int (*cmp)(const void *, const void *))
+{
+	int i;
+
+	assert(ndb_filter_elem_is_ptr(&els->field));
+
+	for (i = 0; i < els->count; i++)
+		els->elements[i] += (uint64_t)filter->data_buf.start;
+
+	qsort(&els->elements[0], els->count, sizeof(els->elements[0]), cmp);
+
+	for (i = 0; i < els->count; i++)
+		els->elements[i] -= (uint64_t)filter->data_buf.start;
+}
+
+static int ndb_filter_field_eq(struct ndb_filter *a_filt,
+			       struct ndb_filter_elements *a_field,
+			       struct ndb_filter *b_filt,
+			       struct ndb_filter_elements *b_field)
+{
+	int i;
+	const char *a_str, *b_str;
+	unsigned char *a_id, *b_id;
+	uint64_t a_int, b_int;
+	struct ndb_filter_custom *a_custom, *b_custom;
+
+	if (a_field->count != b_field->count)
+		return 0;
+
+	if (a_field->field.type != b_field->field.type) {
+		ndb_debug("UNUSUAL: field types do not match in ndb_filter_field_eq\n");
+		return 0;
+	}
+
+	if (a_field->field.elem_type != b_field->field.elem_type) {
+		ndb_debug("UNUSUAL: field element types do not match in ndb_filter_field_eq\n");
+		return 0;
+	}
+
+	if (a_field->field.elem_type == NDB_ELEMENT_UNKNOWN) {
+		ndb_debug("UNUSUAL: field element types are unknown\n");
+		return 0;
+	}
+
+	for (i = 0; i < a_field->count; i++) {
+		switch (a_field->field.elem_type) {
+		case NDB_ELEMENT_CUSTOM:
+			a_custom = ndb_filter_get_custom_element(a_filt, a_field);
+			b_custom = ndb_filter_get_custom_element(b_filt, b_field);
+			if (memcmp(a_custom, b_custom, sizeof(*a_custom)))
+				return 0;
+			break;
+		case NDB_ELEMENT_UNKNOWN:
+			return 0;
+		case NDB_ELEMENT_STRING:
+			a_str = ndb_filter_get_string_element(a_filt, a_field, i);
+			b_str = ndb_filter_get_string_element(b_filt, b_field, i);
+			if (strcmp(a_str, b_str))
+				return 0;
+			break;
+		case NDB_ELEMENT_ID:
+			a_id = ndb_filter_get_id_element(a_filt, a_field, i);
+			b_id = ndb_filter_get_id_element(b_filt, b_field, i);
+			if (memcmp(a_id, b_id, 32))
+				return 0;
+			break;
+		case NDB_ELEMENT_INT:
+			a_int = ndb_filter_get_int_element(a_field, i);
+			b_int = ndb_filter_get_int_element(b_field, i);
+			if (a_int != b_int)
+				return 0;
+			break;
+		}
+	}
+
+	return 1;
+}
+
+void ndb_filter_end_field(struct ndb_filter *filter)
+{
+	int cur_offset;
+	struct ndb_filter_elements *cur;
+
+	cur_offset = filter->current;
+
+	if (!(cur = ndb_filter_current_element(filter)))
+		return;
+
+	filter->elements[filter->num_elements++] = cur_offset;
+
+	// sort elements for binary search
+	switch (cur->field.type) {
+	case NDB_FILTER_IDS:
+	case NDB_FILTER_AUTHORS:
+		sort_filter_elements(filter, cur, compare_ids);
+		break;
+	case NDB_FILTER_RELAYS:
+		sort_filter_elements(filter, cur, compare_strs);
+		break;
+	case NDB_FILTER_KINDS:
+		qsort(&cur->elements[0], cur->count,
+		      sizeof(cur->elements[0]), compare_kinds);
+		break;
+	case NDB_FILTER_TAGS:
+		// TODO: generic tag search sorting
+		break;
+	case NDB_FILTER_SINCE:
+	case NDB_FILTER_CUSTOM:
+	case NDB_FILTER_UNTIL:
+	case NDB_FILTER_LIMIT:
+	case NDB_FILTER_SEARCH:
+		// don't need to sort these
+		break;
+	}
+
+	filter->current = -1;
+
+}
+
+static void ndb_filter_group_init(struct ndb_filter_group *group)
+{
+	group->num_filters = 0;
+}
+
+static int ndb_filter_group_add(struct ndb_filter_group *group,
+				struct ndb_filter *filter)
+{
+	if (group->num_filters + 1 > MAX_FILTERS)
+		return 0;
+
+	return ndb_filter_clone(&group->filters[group->num_filters++], filter);
+}
+
+static int ndb_filter_group_matches(struct ndb_filter_group *group,
+				    struct ndb_note *note)
+{
+	int i;
+	struct ndb_filter *filter;
+
+	if (group->num_filters == 0)
+		return 1;
+
+	for (i = 0; i < group->num_filters; i++) {
+		filter = &group->filters[i];
+
+		if (ndb_filter_matches(filter, note))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void ndb_make_search_key(struct ndb_search_key *key, unsigned char *id,
+			        uint64_t timestamp, const char *search)
+{
+	memcpy(key->id, id, 32);
+	key->timestamp = timestamp;
+	fold_strncpy(key->search, search, sizeof(key->search) - 1);
+	key->search[sizeof(key->search) - 1] = '\0';
+}
+
+static int ndb_write_profile_search_index(struct ndb_txn *txn,
+					  struct ndb_search_key *index_key,
+					  uint64_t profile_key)
+{
+	int rc;
+	MDB_val key, val;
+
+	key.mv_data = index_key;
+	key.mv_size = sizeof(*index_key);
+	val.mv_data = &profile_key;
+	val.mv_size = sizeof(profile_key);
+
+	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_PROFILE_SEARCH],
+			  &key, &val, 0)))
+	{
+		ndb_debug("ndb_write_profile_search_index failed: %s\n",
+			  mdb_strerror(rc));
+		return 0;
+	}
+
+	return 1;
+}
+
+
+// map usernames and display names to profile keys for user searching
+static int ndb_write_profile_search_indices(struct ndb_txn *txn,
+					    struct ndb_note *note,
+					    uint64_t profile_key,
+					    void *profile_root)
+{
+	struct ndb_search_key index;
+	NdbProfileRecord_table_t profile_record;
+	NdbProfile_table_t profile;
+
+	profile_record = NdbProfileRecord_as_root(profile_root);
+	profile = NdbProfileRecord_profile_get(profile_record);
+
+	const char *name = NdbProfile_name_get(profile);
+	const char *display_name = NdbProfile_display_name_get(profile);
+
+	// words + pubkey + created
+	if (name) {
+		ndb_make_search_key(&index, note->pubkey, note->created_at,
+				    name);
+		if (!ndb_write_profile_search_index(txn, &index, profile_key))
+			return 0;
+	}
+
+	if (display_name) {
+		// don't write the same name/display_name twice
+		if (name && !strcmp(display_name, name)) {
+			return 1;
+		}
+		ndb_make_search_key(&index, note->pubkey, note->created_at,
+				    display_name);
+		if (!ndb_write_profile_search_index(txn, &index, profile_key))
+			return 0;
+	}
+
+	return 1;
+}
+
+static inline void ndb_tsid_init(struct ndb_tsid *key, unsigned char *id,
+				 uint64_t timestamp)
+{
+	memcpy(key->id, id, 32);
+	key->timestamp = timestamp;
+}
+
+static inline void ndb_tsid_low(struct ndb_tsid *key, unsigned char *id)
+{
+	memcpy(key->id, id, 32);
+	key->timestamp = 0;
+}
+
+static inline void ndb_u64_ts_init(struct ndb_u64_ts *key, uint64_t integer,
+				     uint64_t timestamp)
+{
+	key->u64 = integer;
+	key->timestamp = timestamp;
+}
+
+// useful for range-searching for the latest key with a clustered created_at timen
+static inline void ndb_tsid_high(struct ndb_tsid *key, const unsigned char *id)
+{
+	memcpy(key->id, id, 32);
+	key->timestamp = UINT64_MAX;
+}
+
+static int _ndb_begin_query(struct ndb *ndb, struct ndb_txn *txn, int flags)
+{
+	int ok;
+
+	txn->lmdb = &ndb->lmdb;
+	MDB_txn **mdb_txn = (MDB_txn **)&txn->mdb_txn;
+	if (!txn->lmdb->env)
+		return 0;
+
+	ok = mdb_txn_begin(txn->lmdb->env, NULL, flags, mdb_txn) == 0;
+#ifdef DEBUG
+	if (ok && flags == MDB_RDONLY)
+		ndb_debug_register_query_txn(txn, flags);
+#endif
+	return ok;
+}
+
+int ndb_begin_query(struct ndb *ndb, struct ndb_txn *txn)
+{
+	return _ndb_begin_query(ndb, txn, MDB_RDONLY);
+}
+
+// this should only be used in migrations, etc
+static int ndb_begin_rw_query(struct ndb *ndb, struct ndb_txn *txn)
+{
+	return _ndb_begin_query(ndb, txn, 0);
+}
+
+static int ndb_db_is_index(enum ndb_dbs index)
+{
+	switch (index) {
+		case NDB_DB_NOTE:
+		case NDB_DB_META:
+		case NDB_DB_PROFILE:
+		case NDB_DB_NOTE_ID:
+		case NDB_DB_NDB_META:
+		case NDB_DB_PROFILE_SEARCH:
+		case NDB_DB_PROFILE_LAST_FETCH:
+		case NDB_DB_NOTE_RELAYS:
+		case NDB_DBS:
+			return 0;
+		case NDB_DB_PROFILE_PK:
+		case NDB_DB_NOTE_KIND:
+		case NDB_DB_NOTE_TEXT:
+		case NDB_DB_NOTE_BLOCKS:
+		case NDB_DB_NOTE_TAGS:
+		case NDB_DB_NOTE_PUBKEY:
+		case NDB_DB_NOTE_PUBKEY_KIND:
+		case NDB_DB_NOTE_RELAY_KIND:
+		case NDB_DB_NOTE_THREAD:
+		case NDB_DB_NOTE_ADDR:
+		case NDB_DB_NOTE_MENTION:
+		case NDB_DB_HASHTAG_COUNTS:
+		case NDB_DB_NOTE_POSTINGS:
+		case NDB_DB_NOTE_TERM_STATS:
+			return 1;
+	}
+
+	return 0;
+}
+
+static inline void ndb_id_u64_ts_init(struct ndb_id_u64_ts *key,
+				      unsigned char *id, uint64_t iu64,
+				      uint64_t timestamp)
+{
+	memcpy(key->id, id, 32);
+	key->u64 = iu64;
+	key->timestamp = timestamp;
+}
+
+// formats the relay url buffer for the NDB_DB_NOTE_RELAYS value. It's a
+// null terminated string padded to 8 bytes (we must keep the entire database
+// aligned to 8 bytes at all times)
+static int prepare_relay_buf(char *relay_buf, int bufsize, const char *relay,
+			     int relay_len)
+{
+	struct cursor cur;
+
+	// make sure the size of the buffer is aligned
+	assert((bufsize % 8) == 0);
+
+	make_cursor((unsigned char *)relay_buf, (unsigned char *)relay_buf + bufsize, &cur);
+
+	// push the relay string
+	if (!cursor_push(&cur, (unsigned char *)relay, relay_len))
+		return 0;
+
+	// relay urls are null terminated for convenience
+	if (!cursor_push_byte(&cur, 0))
+		return 0;
+
+	// align the buffer
+	if (!cursor_align(&cur, 8))
+		return 0;
+
+	return cur.p - cur.start;
+}
+
+// Write to the note_id -> relay_url database. This records where notes
+// have been seen
+static int ndb_write_note_relay(struct ndb_txn *txn, uint64_t note_key,
+				const char *relay, uint8_t relay_len)
+{
+	char relay_buf[256];
+	int rc, len;
+	MDB_val k, v;
+
+	if (relay == NULL || relay_len == 0) {
+		ndb_debug("relay is NULL in ndb_write_note_relay? '%s' %d\n", relay, relay_len);
+		return 0;
+	}
+
+	ndb_debug("writing note_relay '%s' for notekey:%" PRIu64 "\n", relay, note_key);
+
+	if (!(len = prepare_relay_buf(relay_buf, sizeof(relay_buf), relay, relay_len))) {
+		fprintf(stderr, "relay url '%s' too large when writing note relay index\n", relay);
+		return 0;
+	}
+
+	assert((len % 8) == 0);
+
+	k.mv_data = &note_key;
+	k.mv_size = sizeof(note_key);
+
+	v.mv_data = relay_buf;
+	v.mv_size = len;
+
+	// NODUPDATA is specified so that we don't accidently add duplicate
+	// key/value pairs
+	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_RELAYS],
+			  &k, &v, MDB_NODUPDATA)))
+	{
+		ndb_debug("ndb_write_note_relay failed: %s\n", mdb_strerror(rc));
+		return 0;
+	}
+
+	ndb_debug("wrote %d bytes to note relay: '%s'\n", len, relay_buf);
+
+	return 1;
+}
+
+struct ndb_relay_kind_key {
+	uint64_t note_key;
+	uint64_t kind;
+	uint64_t created_at;
+	uint8_t relay_len;
+	const char *relay;
+};
+
+static int ndb_relay_kind_key_init(
+		struct ndb_relay_kind_key *key,
+		uint64_t note_key,
+		uint64_t kind,
+		uint64_t created_at,
+		const char *relay)
+{
+	if (relay == NULL)
+		return 0;
+
+	key->relay = relay;
+	key->relay_len = strlen(relay);
+	if (key->relay_len > 248)
+		return 0;
+
+	key->note_key = note_key;
+	key->kind = kind;
+	key->created_at = created_at;
+	return 1;
+}
+
+
+// create a range key for a relay kind query
+static int ndb_relay_kind_key_init_high(
+		struct ndb_relay_kind_key *key,
+		const char *relay,
+		uint64_t kind,
+		uint64_t until)
+{
+	return ndb_relay_kind_key_init(key, UINT64_MAX, kind, UINT64_MAX, relay);
+}
+
+static void ndb_parse_relay_kind_key(struct ndb_relay_kind_key *key, unsigned char *buf)
+{
+	// WE ARE ASSUMING WE ARE PARSING FROM AN ALIGNED BUFFER HERE
+	assert((uint64_t)buf % 8 == 0);
+	// - note_id:        00 + 8 bytes
+	// - kind:           08 + 8 bytes
+	// - created_at:     16 + 8 bytes
+	// - relay_url_size: 24 + 1 byte
+	// - relay_url:      25 + n byte null-terminated string
+	// - pad to 8 byte alignment
+	key->note_key   =  *(uint64_t*) (buf + 0);
+	key->kind       =  *(uint64_t*) (buf + 8);
+	key->created_at =  *(uint64_t*) (buf + 16);
+	key->relay_len  =   *(uint8_t*) (buf + 24);
+	key->relay      = (const char*) (buf + 25);
+}
+
+static void ndb_debug_relay_kind_key(struct ndb_relay_kind_key *key)
+{
+	ndb_debug("note_key:%" PRIu64 " kind:%" PRIu64 " created_at:%" PRIu64 " '%s'\n",
+			key->note_key, key->kind, key->created_at, key->relay);
+}
 
 static int ndb_build_relay_kind_key(unsigned char *buf, int bufsize, struct ndb_relay_kind_key *key)
 {
-	struct cursor cur;
-	make_cursor(buf, buf + bufsize, &cur);
+	struct cursor cur;
+	make_cursor(buf, buf + bufsize, &cur);
+
+	if (!cursor_push(&cur, (unsigned char *)&key->note_key, 8))   return 0;
+	if (!cursor_push(&cur, (unsigned char *)&key->kind, 8))       return 0;
+	if (!cursor_push(&cur, (unsigned char *)&key->created_at, 8)) return 0;
+	if (!cursor_push_byte(&cur, key->relay_len)) return 0;
+	if (!cursor_push(&cur, (unsigned char *)key->relay, key->relay_len)) return 0;
+	if (!cursor_push_byte(&cur, 0)) return 0;
+	if (!cursor_align(&cur, 8)) return 0;
+
+	assert(((cur.p-cur.start)%8) == 0);
+
+	return cur.p - cur.start;
+}
+
+static int ndb_write_note_relay_kind_index(
+		struct ndb_txn *txn,
+		struct ndb_relay_kind_key *key)
+{
+	// The relay kind key has a layout like so 
+	//
+	// - note_key:       00 + 8 bytes
+	// - kind:           08 + 8 bytes
+	// - created_at:     16 + 8 bytes
+	// - relay_url_size: 24 + 1 byte
+	// - relay_url:      25 + n byte null-terminated string
+	// - pad to 8 byte alignment
+
+	unsigned char buf[256];
+	int rc, len;
+	MDB_val k, v;
+
+	// come on bro
+	if (key->relay_len > 248 || key->relay == NULL || key->relay_len == 0)
+		return 0;
+
+	ndb_debug("writing note_relay_kind_index '%s' for notekey:%" PRIu64 "\n", key->relay, key->note_key);
+
+	if (!(len = ndb_build_relay_kind_key(buf, sizeof(buf), key)))
+		return 0;
+
+	k.mv_data = buf;
+	k.mv_size = len;
+
+	v.mv_data = NULL;
+	v.mv_size = 0;
+
+	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_RELAY_KIND], &k, &v, 0))) {
+		fprintf(stderr, "write note relay kind index failed: %s\n",
+			  mdb_strerror(rc));
+		return 0;
+	}
+
+	return 1;
+}
+
+// writes the relay note kind index and the note_id -> relay db
+static int ndb_write_note_relay_indexes(struct ndb_txn *txn, struct ndb_relay_kind_key *key)
+{
+	ndb_write_note_relay_kind_index(txn, key);
+	ndb_write_note_relay(txn, key->note_key, key->relay, key->relay_len);
+	return 1;
+}
+
+static int ndb_write_note_pubkey_index(struct ndb_txn *txn, struct ndb_note *note,
+				       uint64_t note_key)
+{
+	int rc;
+	struct ndb_tsid key;
+	MDB_val k, v;
+
+	ndb_tsid_init(&key, ndb_note_pubkey(note), ndb_note_created_at(note));
+
+	k.mv_data = &key;
+	k.mv_size = sizeof(key);
+
+	v.mv_data = &note_key;
+	v.mv_size = sizeof(note_key);
+
+	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_PUBKEY], &k, &v, 0))) {
+		fprintf(stderr, "write note pubkey index failed: %s\n",
+			  mdb_strerror(rc));
+		return 0;
+	}
+
+	return 1;
+}
+
+static int ndb_write_note_pubkey_kind_index(struct ndb_txn *txn,
+					    struct ndb_note *note,
+					    uint64_t note_key)
+{
+	int rc;
+	struct ndb_id_u64_ts key;
+	MDB_val k, v;
+
+	ndb_id_u64_ts_init(&key, ndb_note_pubkey(note), ndb_note_kind(note),
+			   ndb_note_created_at(note));
+
+	k.mv_data = &key;
+	k.mv_size = sizeof(key);
+
+	v.mv_data = &note_key;
+	v.mv_size = sizeof(note_key);
+
+	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_PUBKEY_KIND], &k, &v, 0))) {
+		fprintf(stderr, "write note pubkey_kind index failed: %s\n",
+			  mdb_strerror(rc));
+		return 0;
+	}
+
+	return 1;
+}
+
+// pubkey + kind + created_at -> note_key for every p tag, so that
+// notification queries don't have to look at note bodies
+static int ndb_write_note_mention(struct ndb_txn *txn, struct ndb_note *note,
+				  unsigned char *pubkey, uint64_t note_key)
+{
+	int rc;
+	struct ndb_id_u64_ts key;
+	MDB_val k, v;
+
+	ndb_id_u64_ts_init(&key, pubkey, ndb_note_kind(note),
+			   ndb_note_created_at(note));
+
+	k.mv_data = &key;
+	k.mv_size = sizeof(key);
+
+	v.mv_data = &note_key;
+	v.mv_size = sizeof(note_key);
+
+	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_MENTION], &k, &v, 0))) {
+		fprintf(stderr, "write note mention index failed: %s\n",
+			mdb_strerror(rc));
+		return 0;
+	}
+
+	return 1;
+}
+
+// Only used for rebuilds, new notes get their mentions written along with
+// the tag index
+static int ndb_write_note_mention_index(struct ndb_txn *txn,
+					struct ndb_note *note,
+					uint64_t note_key)
+{
+	struct ndb_iterator iter;
+	struct ndb_str str;
+
+	ndb_tags_iterate_start(note, &iter);
+
+	while (ndb_tags_iterate_next(&iter)) {
+		if (iter.tag->count < 2)
+			continue;
+
+		str = ndb_tag_str(note, iter.tag, 0);
+		if (str.flag == NDB_PACKED_ID || strcmp(str.str, "p"))
+			continue;
+
+		str = ndb_tag_str(note, iter.tag, 1);
+		if (str.flag != NDB_PACKED_ID)
+			continue;
+
+		if (!ndb_write_note_mention(txn, note, str.id, note_key))
+			return 0;
+	}
+
+	return 1;
+}
+
+// The two edges we keep in the thread index. The root edge lets us load a
+// whole thread with one range scan, the parent edge gives direct replies.
+enum ndb_thread_edge {
+	NDB_THREAD_EDGE_ROOT   = 1,
+	NDB_THREAD_EDGE_PARENT = 2,
+};
+
+// Find the root and parent of a reply using NIP-10. Marked e tags win if
+// there are any, otherwise we fall back to the deprecated positional
+// scheme: first e tag is the root, last one is what we're replying to.
+static int ndb_note_thread_refs(struct ndb_note *note,
+				const unsigned char **root,
+				const unsigned char **parent)
+{
+	struct ndb_iterator iter;
+	struct ndb_str str;
+	const unsigned char *first, *last, *id;
+
+	*root = NULL;
+	*parent = NULL;
+	first = NULL;
+	last = NULL;
+
+	ndb_tags_iterate_start(note, &iter);
+
+	while (ndb_tags_iterate_next(&iter)) {
+		if (iter.tag->count < 2)
+			continue;
+
+		str = ndb_tag_str(note, iter.tag, 0);
+		if (str.flag == NDB_PACKED_ID || str.str[0] != 'e' ||
+		    str.str[1] != 0)
+			continue;
+
+		str = ndb_tag_str(note, iter.tag, 1);
+		if (str.flag != NDB_PACKED_ID)
+			continue;
+		id = str.id;
+
+		if (iter.tag->count >= 4) {
+			str = ndb_tag_str(note, iter.tag, 3);
+			if (str.flag != NDB_PACKED_ID) {
+				if (!strcmp(str.str, "root")) {
+					*root = id;
+					continue;
+				} else if (!strcmp(str.str, "reply")) {
+					*parent = id;
+					continue;
+				} else if (!strcmp(str.str, "mention")) {
+					continue;
+				}
+			}
+		}
+
+		if (first == NULL)
+			first = id;
+		last = id;
+	}
+
+	if (*root || *parent) {
+		// a reply with only a root marker is a top level reply
+		if (*parent == NULL)
+			*parent = *root;
+		else if (*root == NULL)
+			*root = *parent;
+		return 1;
+	}
+
+	if (first == NULL)
+		return 0;
+
+	*root = first;
+	*parent = last;
+	return 1;
+}
+
+static int ndb_write_thread_edge(struct ndb_txn *txn, struct ndb_note *note,
+				 const unsigned char *id,
+				 enum ndb_thread_edge edge, uint64_t note_key)
+{
+	int rc;
+	struct ndb_id_u64_ts key;
+	MDB_val k, v;
+
+	ndb_id_u64_ts_init(&key, (unsigned char *)id, edge,
+			   ndb_note_created_at(note));
+
+	k.mv_data = &key;
+	k.mv_size = sizeof(key);
+
+	v.mv_data = &note_key;
+	v.mv_size = sizeof(note_key);
+
+	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_THREAD], &k, &v, 0))) {
+		fprintf(stderr, "write note thread index failed: %s\n",
+			mdb_strerror(rc));
+		return 0;
+	}
+
+	return 1;
+}
+
+static int ndb_write_note_thread_index(struct ndb_txn *txn,
+				       struct ndb_note *note,
+				       uint64_t note_key)
+{
+	const unsigned char *root, *parent;
+
+	if (ndb_note_kind(note) != 1)
+		return 1;
+
+	if (!ndb_note_thread_refs(note, &root, &parent))
+		return 1;
+
+	// don't let a note reply to itself
+	if (!memcmp(root, ndb_note_id(note), 32) ||
+	    !memcmp(parent, ndb_note_id(note), 32))
+		return 1;
+
+	if (!ndb_write_thread_edge(txn, note, root, NDB_THREAD_EDGE_ROOT, note_key))
+		return 0;
+
+	return ndb_write_thread_edge(txn, note, parent, NDB_THREAD_EDGE_PARENT,
+				     note_key);
+}
+
+static int ndb_write_note_tag_index(struct ndb_txn *txn, struct ndb_note *note,
+				    uint64_t note_key, int long_tags);
+static int ndb_write_note_addr_index(struct ndb_txn *txn,
+				     struct ndb_note *note, uint64_t note_key);
+static int ndb_write_note_hashtag_index(struct ndb_txn *txn,
+					struct ndb_note *note,
+					uint64_t note_key,
+					struct ndb_hashtags *tags);
+static int ndb_write_hashtag_counts(struct ndb_txn *txn, struct ndb_note *note,
+				    struct ndb_hashtags *tags);
+static struct ndb_blocks *ndb_parse_note_blocks(struct ndb_note *note,
+						unsigned char *scratch,
+						size_t scratch_size);
+static int ndb_get_fulltext_state(struct ndb_txn *txn,
+				  struct ndb_fulltext_state *state);
+static int ndb_put_fulltext_state(struct ndb_txn *txn,
+				  struct ndb_fulltext_state *state);
+static uint64_t ndb_get_last_key(MDB_txn *txn, MDB_dbi db);
+
+// Write one note into the note indices in `indices` (NDB_REBUILD bits).
+// The fulltext index is rebuilt by the indexer, see ndb_migrate_rebuild_indices
+static int ndb_rebuild_note(struct ndb_txn *txn, struct ndb_note *note,
+			    uint64_t note_key, uint64_t indices,
+			    unsigned char *scratch, size_t scratch_size,
+			    uint32_t ndb_flags)
+{
+	struct ndb_blocks *blocks;
+	struct ndb_hashtags hashtags;
+
+	// the tag index and hashtag counts need the content hashtags
+	if (indices & (NDB_REBUILD(NDB_DB_NOTE_TAGS) |
+		       NDB_REBUILD(NDB_DB_HASHTAG_COUNTS))) {
+		blocks = NULL;
+		if (ndb_kind_has_hashtag_content(note->kind))
+			blocks = ndb_parse_note_blocks(note, scratch,
+						       scratch_size);
+		ndb_note_hashtags(note, blocks, &hashtags);
+	}
+
+	if ((indices & NDB_REBUILD(NDB_DB_NOTE_PUBKEY)) &&
+	    !ndb_write_note_pubkey_index(txn, note, note_key))
+		return 0;
+
+	if ((indices & NDB_REBUILD(NDB_DB_NOTE_PUBKEY_KIND)) &&
+	    !ndb_write_note_pubkey_kind_index(txn, note, note_key))
+		return 0;
+
+	if ((indices & NDB_REBUILD(NDB_DB_NOTE_THREAD)) &&
+	    !ndb_write_note_thread_index(txn, note, note_key))
+		return 0;
+
+	if ((indices & NDB_REBUILD(NDB_DB_NOTE_TAGS)) &&
+	    (!ndb_write_note_tag_index(txn, note, note_key,
+			!ndb_flag_set(ndb_flags, NDB_FLAG_NO_LONG_TAGS)) ||
+	     !ndb_write_note_hashtag_index(txn, note, note_key, &hashtags)))
+		return 0;
+
+	if ((indices & NDB_REBUILD(NDB_DB_HASHTAG_COUNTS)) &&
+	    !ndb_write_hashtag_counts(txn, note, &hashtags))
+		return 0;
+
+	if ((indices & NDB_REBUILD(NDB_DB_NOTE_ADDR)) &&
+	    !ndb_write_note_addr_index(txn, note, note_key))
+		return 0;
+
+	if ((indices & NDB_REBUILD(NDB_DB_NOTE_MENTION)) &&
+	    !ndb_write_note_mention_index(txn, note, note_key))
+		return 0;
+
+	return 1;
+}
+
+static int ndb_get_rebuild_state(struct ndb_txn *txn,
+				 struct ndb_rebuild_state *state)
+{
+	uint64_t meta_key = NDB_META_KEY_REBUILD;
+	MDB_val k, v;
+
+	k.mv_data = &meta_key;
+	k.mv_size = sizeof(meta_key);
+
+	if (mdb_get(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NDB_META], &k, &v) ||
+	    v.mv_size != sizeof(*state))
+		return 0;
+
+	memcpy(state, v.mv_data, sizeof(*state));
+	return 1;
+}
+
+// Save how far the rebuild got, or forget about it once it's done
+static int ndb_put_rebuild_state(struct ndb_txn *txn,
+				 struct ndb_rebuild_state *state)
+{
+	uint64_t meta_key = NDB_META_KEY_REBUILD;
+	MDB_val k, v;
+	int rc;
+
+	k.mv_data = &meta_key;
+	k.mv_size = sizeof(meta_key);
+	v.mv_data = state;
+	v.mv_size = sizeof(*state);
+
+	if (state->next_key > state->last_key) {
+		rc = mdb_del(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NDB_META],
+			     &k, NULL);
+		if (rc == MDB_NOTFOUND)
+			rc = 0;
+	} else {
+		rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NDB_META],
+			     &k, &v, 0);
+	}
+
+	if (rc) {
+		ndb_debug("write rebuild state failed: %s\n", mdb_strerror(rc));
+		return 0;
+	}
+
+	return 1;
+}
+
+// Migrations
+//
+
+// Drop the old fulltext index, nothing reads it since the postings
+static int ndb_migrate_posting_index(struct ndb_txn *txn)
+{
+	if (mdb_drop(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_TEXT], 0)) {
+		fprintf(stderr, "error emptying the old fulltext index, aborting.\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+// Empty the note indices the pending migrations asked for, and leave
+// filling them back up to ndb_rebuild_batch and the indexer, a batch of
+// notes per transaction. Notes written after this are indexed as usual.
+static int ndb_migrate_rebuild_indices(struct ndb_txn *txn, uint64_t rebuild)
+{
+	struct ndb_rebuild_state state;
+	struct ndb_fulltext_state fulltext;
+	uint64_t fulltext_dbs;
+	int i;
+
+	fulltext_dbs = NDB_REBUILD(NDB_DB_NOTE_POSTINGS) |
+		       NDB_REBUILD(NDB_DB_NOTE_TERM_STATS);
+
+	// the indexer starts over, if there is one
+	if (rebuild & fulltext_dbs) {
+		rebuild |= fulltext_dbs;
+		if (ndb_get_fulltext_state(txn, &fulltext)) {
+			fulltext.high_water = 0;
+			if (!ndb_put_fulltext_state(txn, &fulltext))
+				return 0;
+		}
+	}
+
+	// a rebuild that didn't finish last time starts over along with ours
+	if (ndb_get_rebuild_state(txn, &state))
+		rebuild |= state.indices;
+
+	for (i = 0; i < NDB_DBS; i++) {
+		if (!(rebuild & NDB_REBUILD(i)))
+			continue;
+
+		if (!ndb_db_is_index((enum ndb_dbs)i) ||
+		    mdb_drop(txn->mdb_txn, txn->lmdb->dbs[i], 0)) {
+			fprintf(stderr, "error emptying %s for a rebuild, aborting.\n",
+				ndb_db_name((enum ndb_dbs)i));
+			return 0;
+		}
+	}
+
+	state.indices = rebuild & ~fulltext_dbs;
+	state.next_key = 1;
+	state.last_key = ndb_get_last_key(txn->mdb_txn,
+					  txn->lmdb->dbs[NDB_DB_NOTE]);
+	if (state.indices == 0)
+		state.next_key = state.last_key + 1;
+
+	return ndb_put_rebuild_state(txn, &state);
+}
+
+static int ndb_migrate_user_search_indices(struct ndb_txn *txn)
+{
+	int rc;
+	MDB_cursor *cur;
+	MDB_val k, v;
+	void *profile_root;
+	NdbProfileRecord_table_t record;
+	struct ndb_note *note;
+	uint64_t note_key, profile_key;
+	size_t len;
+	int count;
+
+	if ((rc = mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_PROFILE], &cur))) {
+		fprintf(stderr, "ndb_migrate_user_search_indices: mdb_cursor_open failed, error %d\n", rc);
+		return 0;
+	}
+
+	count = 0;
+
+	// loop through all profiles and write search indices
+	while (mdb_cursor_get(cur, &k, &v, MDB_NEXT) == 0) {
+		profile_root = v.mv_data;
+		profile_key = *((uint64_t*)k.mv_data);
+		record = NdbProfileRecord_as_root(profile_root);
+		note_key = NdbProfileRecord_note_key(record);
+		note = ndb_get_note_by_key(txn, note_key, &len);
+
+		if (note == NULL) {
+			continue;
+		}
+
+		if (!ndb_write_profile_search_indices(txn, note, profile_key,
+						      profile_root)) {
+			fprintf(stderr, "ndb_migrate_user_search_indices: ndb_write_profile_search_indices failed\n");
+			continue;
+		}
+
+		count++;
+	}
+
+	fprintf(stderr, "migrated %d profiles to include search indices\n", count);
+
+	mdb_cursor_close(cur);
+
+	return 1;
+}
+
+static int ndb_migrate_lower_user_search_indices(struct ndb_txn *txn)
+{
+	// just drop the search db so we can rebuild it
+	if (mdb_drop(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_PROFILE_SEARCH], 0)) {
+		fprintf(stderr, "ndb_migrate_lower_user_search_indices: mdb_drop failed\n");
+		return 0;
+	}
+
+	return ndb_migrate_user_search_indices(txn);
+}
+
+int ndb_process_profile_note(struct ndb_note *note, struct ndb_profile_record_builder *profile);
+
+
+int ndb_db_version(struct ndb_txn *txn)
+{
+	uint64_t version, version_key;
+	MDB_val k, v;
+
+	version_key = NDB_META_KEY_VERSION;
+	k.mv_data = &version_key;
+	k.mv_size = sizeof(version_key);
+
+	if (mdb_get(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NDB_META], &k, &v)) {
+		version = -1;
+	} else {
+		if (v.mv_size != 8) {
+			fprintf(stderr, "run_migrations: invalid version size?");
+			return 0;
+		}
+		version = *((uint64_t*)v.mv_data);
+	}
+
+	return version;
+}
+
+// custom pubkey+kind+timestamp comparison function. This is used by lmdb to
+// perform b+ tree searches over the pubkey+kind+timestamp index
+static int ndb_id_u64_ts_compare(const MDB_val *a, const MDB_val *b)
+{
+	struct ndb_id_u64_ts *tsa, *tsb;
+	MDB_val a2 = *a, b2 = *b;
+
+	a2.mv_size = sizeof(tsa->id);
+	b2.mv_size = sizeof(tsb->id);
+
+	int cmp = mdb_cmp_memn(&a2, &b2);
+	if (cmp) return cmp;
+
+	tsa = a->mv_data;
+	tsb = b->mv_data;
+
+	if (tsa->u64 < tsb->u64)
+		return -1;
+	else if (tsa->u64 > tsb->u64)
+		return 1;
+
+	if (tsa->timestamp < tsb->timestamp)
+		return -1;
+	else if (tsa->timestamp > tsb->timestamp)
+		return 1;
+
+	return 0;
+}
+
+// custom kind+timestamp comparison function. This is used by lmdb to perform
+// b+ tree searches over the kind+timestamp index
+static int ndb_u64_ts_compare(const MDB_val *a, const MDB_val *b)
+{
+	struct ndb_u64_ts *tsa, *tsb;
+	tsa = a->mv_data;
+	tsb = b->mv_data;
+
+	if (tsa->u64 < tsb->u64)
+		return -1;
+	else if (tsa->u64 > tsb->u64)
+		return 1;
+
+	if (tsa->timestamp < tsb->timestamp)
+		return -1;
+	else if (tsa->timestamp > tsb->timestamp)
+		return 1;
+
+	return 0;
+}
+
+static int ndb_tsid_compare(const MDB_val *a, const MDB_val *b)
+{
+	struct ndb_tsid *tsa, *tsb;
+	MDB_val a2 = *a, b2 = *b;
+
+	a2.mv_size = sizeof(tsa->id);
+	b2.mv_size = sizeof(tsb->id);
+
+	int cmp = mdb_cmp_memn(&a2, &b2);
+	if (cmp) return cmp;
+
+	tsa = a->mv_data;
+	tsb = b->mv_data;
+
+	if (tsa->timestamp < tsb->timestamp)
+		return -1;
+	else if (tsa->timestamp > tsb->timestamp)
+		return 1;
+	return 0;
+}
+
+// u64 bucket, then the hashtag bytes
+static int ndb_hashtag_count_compare(const MDB_val *a, const MDB_val *b)
+{
+	uint64_t ba, bb;
+	MDB_val a2, b2;
+
+	memcpy(&ba, a->mv_data, sizeof(ba));
+	memcpy(&bb, b->mv_data, sizeof(bb));
+
+	if (ba < bb)
+		return -1;
+	else if (ba > bb)
+		return 1;
+
+	a2.mv_data = (unsigned char *)a->mv_data + sizeof(ba);
+	a2.mv_size = a->mv_size - sizeof(ba);
+	b2.mv_data = (unsigned char *)b->mv_data + sizeof(bb);
+	b2.mv_size = b->mv_size - sizeof(bb);
+
+	return mdb_cmp_memn(&a2, &b2);
+}
+
+enum ndb_ingester_msgtype {
+	NDB_INGEST_EVENT, // write json to the ingester queue for processing
+	NDB_INGEST_QUIT,  // kill ingester thread immediately
+};
+
+struct ndb_ingester_event {
+	const char *relay;
+	char *json;
+	unsigned client : 1; // ["EVENT", {...}] messages
+	unsigned len : 31;
+};
+
+struct ndb_writer_note_relay {
+	const char *relay;
+	uint64_t note_key;
+	uint64_t kind;
+	uint64_t created_at;
+};
+
+struct ndb_writer_note {
+	struct ndb_note *note;
+	size_t note_len;
+	const char *relay;
+};
+
+static void ndb_writer_note_init(struct ndb_writer_note *writer_note, struct ndb_note *note, size_t note_len, const char *relay)
+{
+	writer_note->note = note;
+	writer_note->note_len = note_len;
+	writer_note->relay = relay;
+}
+
+struct ndb_writer_profile {
+	struct ndb_writer_note note;
+	struct ndb_profile_record_builder record;
+};
+
+struct ndb_ingester_msg {
+	enum ndb_ingester_msgtype type;
+	union {
+		struct ndb_ingester_event event;
+	};
+};
+
+struct ndb_writer_ndb_meta {
+	// these are 64 bit because I'm paranoid of db-wide alignment issues
+	uint64_t version;
+};
+
+// Used in the writer thread when writing ndb_profile_fetch_record's
+//   kv = pubkey: recor
+struct ndb_writer_last_fetch {
+	unsigned char pubkey[32];
+	uint64_t fetched_at;
+};
+
+// write note blocks
+struct ndb_writer_blocks {
+	struct ndb_blocks *blocks;
+	uint64_t note_key;
+};
+
+// The different types of messages that the writer thread can write to the
+// database
+struct ndb_writer_msg {
+	enum ndb_writer_msgtype type;
+	union {
+		struct ndb_writer_note_relay note_relay;
+		struct ndb_writer_note note;
+		struct ndb_writer_profile profile;
+		struct ndb_writer_ndb_meta ndb_meta;
+		struct ndb_writer_last_fetch last_fetch;
+		struct ndb_writer_blocks blocks;
+	};
+};
+
+static inline int ndb_writer_queue_msg(struct ndb_writer *writer,
+				       struct ndb_writer_msg *msg)
+{
+	return prot_queue_push(&writer->inbox, msg);
+}
+
+static uint64_t ndb_write_note_and_profile(struct ndb_txn *txn, struct ndb_writer_profile *profile, struct ndb_fulltext_state *fulltext, unsigned char *scratch, size_t scratch_size, uint32_t ndb_flags);
+static int ndb_migrate_utf8_profile_names(struct ndb_txn *txn)
+{
+	int rc;
+	MDB_cursor *cur;
+	MDB_val k, v;
+	void *profile_root;
+	NdbProfileRecord_table_t record;
+	struct ndb_note *note, *copied_note;
+	uint64_t note_key;
+	size_t len;
+	int count, failed, ret;
+	struct ndb_writer_profile profile;
+
+	if ((rc = mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_PROFILE], &cur))) {
+		fprintf(stderr, "ndb_migrate_utf8_profile_names: mdb_cursor_open failed, error %d\n", rc);
+		return 0;
+	}
+
+	size_t scratch_size = 8 * 1024 * 1024;
+	unsigned char *scratch = malloc(scratch_size);
+
+	ret = 1;
+	count = 0;
+	failed = 0;
+
+	// loop through all profiles and write search indices
+	while (mdb_cursor_get(cur, &k, &v, MDB_NEXT) == 0) {
+		profile_root = v.mv_data;
+		record = NdbProfileRecord_as_root(profile_root);
+		note_key = NdbProfileRecord_note_key(record);
+		note = ndb_get_note_by_key(txn, note_key, &len);
+
+		if (note == NULL) {
+			failed++;
+			continue;
+		}
+
+		struct ndb_profile_record_builder *b = &profile.record;
+
+		// reprocess profile
+		if (!ndb_process_profile_note(note, b)) {
+			failed++;
+			continue;
+		}
+
+		// the writer needs to own this note, and its expected to free it
+		copied_note = malloc(len);
+		memcpy(copied_note, note, len);
+
+		ndb_writer_note_init(&profile.note, copied_note, len, NULL);
+
+		// we don't pass in flags when migrating... a bit sketchy but
+		// whatever. noone is using this to customize nostrdb atm
+		if (ndb_write_note_and_profile(txn, &profile, NULL, scratch, scratch_size, 0)) {
+			count++;
+		}
+	}
+
+	fprintf(stderr, "migrated %d profiles to fix utf8 profile names\n", count);
+
+	if (failed != 0) {
+		fprintf(stderr, "failed to migrate %d profiles to fix utf8 profile names\n", failed);
+	}
+
+	free(scratch);
+	mdb_cursor_close(cur);
+
+	return ret;
+}
+
+static struct ndb_migration MIGRATIONS[] = {
+	{ .fn = ndb_migrate_user_search_indices },
+	{ .fn = ndb_migrate_lower_user_search_indices },
+	{ .fn = ndb_migrate_utf8_profile_names },
+	// before we had note_profile_pubkey{,_kind} indices
+	{ .rebuild = NDB_REBUILD(NDB_DB_NOTE_PUBKEY) |
+		     NDB_REBUILD(NDB_DB_NOTE_PUBKEY_KIND) },
+	// the reply graph
+	{ .rebuild = NDB_REBUILD(NDB_DB_NOTE_THREAD) },
+	// multi-char tags and overlong tag values
+	{ .rebuild = NDB_REBUILD(NDB_DB_NOTE_TAGS) },
+	{ .rebuild = NDB_REBUILD(NDB_DB_NOTE_ADDR) },
+	{ .rebuild = NDB_REBUILD(NDB_DB_NOTE_MENTION) },
+	// content hashtags, and their counts
+	{ .rebuild = NDB_REBUILD(NDB_DB_NOTE_TAGS) |
+		     NDB_REBUILD(NDB_DB_HASHTAG_COUNTS) },
+	// posting list fulltext index
+	{ .fn = ndb_migrate_posting_index,
+	  .rebuild = NDB_REBUILD(NDB_DB_NOTE_POSTINGS) },
+	// postings carry the note length, and term stats for ranking
+	{ .rebuild = NDB_REBUILD(NDB_DB_NOTE_POSTINGS) |
+		     NDB_REBUILD(NDB_DB_NOTE_TERM_STATS) },
+	// profile names and fulltext words are folded for unicode
+	{ .fn = ndb_migrate_lower_user_search_indices,
+	  .rebuild = NDB_REBUILD(NDB_DB_NOTE_POSTINGS) |
+		     NDB_REBUILD(NDB_DB_NOTE_TERM_STATS) },
+};
+
+
+int ndb_end_query(struct ndb_txn *txn)
+{
+#ifdef DEBUG
+	ndb_debug_unregister_query_txn(txn);
+#endif
+	// this works on read or write queries.
+	return mdb_txn_commit(txn->mdb_txn) == 0;
+}
+
+int ndb_note_verify(void *ctx, unsigned char *scratch, size_t scratch_size,
+		    struct ndb_note *note)
+{
+	unsigned char id[32];
+	secp256k1_xonly_pubkey xonly_pubkey;
+	int ok;
+
+	// first, we ensure the id is valid by calculating the id independently
+	// from what is given to us
+	if (!ndb_calculate_id(note, scratch, scratch_size, id)) {
+		ndb_debug("ndb_note_verify: scratch buffer size too small");
+		return 0;
+	}
+
+	if (memcmp(id, note->id, 32)) {
+		ndb_debug("ndb_note_verify: note id does not match!");
+		return 0;
+	}
+
+        // id is ok, let's check signature
+
+	ok = secp256k1_xonly_pubkey_parse((secp256k1_context*)ctx,
+					  &xonly_pubkey,
+					  ndb_note_pubkey(note)) != 0;
+	if (!ok) return 0;
+
+	ok = secp256k1_schnorrsig_verify((secp256k1_context*)ctx,
+					 ndb_note_sig(note), id, 32,
+					 &xonly_pubkey) > 0;
+	if (!ok) return 0;
+
+	return 1;
+}
+
+static void ndb_writer_last_profile_fetch(struct ndb_txn *txn,
+					  const unsigned char *pubkey,
+					  uint64_t fetched_at)
+{
+	int rc;
+	MDB_val key, val;
+
+	key.mv_data = (unsigned char*)pubkey;
+	key.mv_size = 32;
+	val.mv_data = &fetched_at;
+	val.mv_size = sizeof(fetched_at);
+
+	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_PROFILE_LAST_FETCH],
+			  &key, &val, 0)))
+	{
+		ndb_debug("write version to ndb_meta failed: %s\n",
+				mdb_strerror(rc));
+		return;
+	}
+
+	//fprintf(stderr, "writing version %" PRIu64 "\n", version);
+}
+
+
+// We just received a profile that we haven't processed yet, but it could
+// be an older one! Make sure we only write last fetched profile if it's a new
+// one
+//
+// To do this, we first check the latest profile in the database. If the
+// created_date for this profile note is newer, then we write a
+// last_profile_fetch record, otherwise we do not.
+//
+// WARNING: This function is only valid when called from the writer thread
+static int ndb_maybe_write_last_profile_fetch(struct ndb_txn *txn,
+					       struct ndb_note *note)
+{
+	size_t len;
+	uint64_t profile_key, note_key;
+	void *root;
+	struct ndb_note *last_profile;
+	NdbProfileRecord_table_t record;
+
+	if ((root = ndb_get_profile_by_pubkey(txn, note->pubkey, &len, &profile_key))) {
+		record = NdbProfileRecord_as_root(root);
+		note_key = NdbProfileRecord_note_key(record);
+		last_profile = ndb_get_note_by_key(txn, note_key, &len);
+		if (last_profile == NULL) {
+			return 0;
+		}
+
+		// found profile, let's see if it's newer than ours
+		if (note->created_at > last_profile->created_at) {
+			// this is a new profile note, record last fetched time
+			ndb_writer_last_profile_fetch(txn, note->pubkey, time(NULL));
+		}
+	} else {
+		// couldn't fetch profile. record last fetched time
+		ndb_writer_last_profile_fetch(txn, note->pubkey, time(NULL));
+	}
+
+	return 1;
+}
+
+int ndb_write_last_profile_fetch(struct ndb *ndb, const unsigned char *pubkey,
+				 uint64_t fetched_at)
+{
+	struct ndb_writer_msg msg;
+	msg.type = NDB_WRITER_PROFILE_LAST_FETCH;
+	memcpy(&msg.last_fetch.pubkey[0], pubkey, 32);
+	msg.last_fetch.fetched_at = fetched_at;
+
+	return ndb_writer_queue_msg(&ndb->writer, &msg);
+}
+
+
+// When doing cursor scans from greatest to lowest, this function positions the
+// cursor at the first element before descending. MDB_SET_RANGE puts us right
+// after the first element, so we have to go back one.
+static int ndb_cursor_start(MDB_cursor *cur, MDB_val *k, MDB_val *v)
+{
+	int rc;
+	// Position cursor at the next key greater than or equal to the
+	// specified key
+
+	if ((rc = mdb_cursor_get(cur, k, v, MDB_SET_RANGE))) {
+		ndb_debug("MDB_SET_RANGE failed: '%s'\n", mdb_strerror(rc));
+		// Failed :(. It could be the last element?
+		if ((rc = mdb_cursor_get(cur, k, v, MDB_LAST))) {
+			ndb_debug("MDB_LAST failed: '%s'\n", mdb_strerror(rc));
+			return 0;
+		}
+	} else {
+		// if set range worked and our key exists, it should be
+		// the one right before this one
+		if ((rc = mdb_cursor_get(cur, k, v, MDB_PREV))) {
+			ndb_debug("moving back failed: '%s'\n", mdb_strerror(rc));
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+
+// get some value based on a clustered id key
+int ndb_get_tsid(struct ndb_txn *txn, enum ndb_dbs db, const unsigned char *id,
+		 MDB_val *val)
+{
+	MDB_val k, v;
+	MDB_cursor *cur;
+	int success = 0, rc;
+	struct ndb_tsid tsid;
+
+	// position at the most recent
+	ndb_tsid_high(&tsid, id);
+
+	k.mv_data = &tsid;
+	k.mv_size = sizeof(tsid);
+
+	if ((rc = mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[db], &cur))) {
+		ndb_debug("ndb_get_tsid: failed to open cursor: '%s'\n", mdb_strerror(rc));
+		return 0;
+	}
+
+	if (!ndb_cursor_start(cur, &k, &v))
+		goto cleanup;
+
+	if (memcmp(k.mv_data, id, 32) == 0) {
+		*val = v;
+		success = 1;
+	}
+
+cleanup:
+	mdb_cursor_close(cur);
+	return success;
+}
+
+static void *ndb_lookup_by_key(struct ndb_txn *txn, uint64_t key,
+			       enum ndb_dbs store, size_t *len)
+{
+	MDB_val k, v;
+
+	k.mv_data = &key;
+	k.mv_size = sizeof(key);
+
+	if (mdb_get(txn->mdb_txn, txn->lmdb->dbs[store], &k, &v)) {
+		ndb_debug("ndb_lookup_by_key: mdb_get note failed\n");
+		return NULL;
+	}
+
+	if (len)
+		*len = v.mv_size;
+
+	return v.mv_data;
+}
+
+static void *ndb_lookup_tsid(struct ndb_txn *txn, enum ndb_dbs ind,
+			     enum ndb_dbs store, const unsigned char *pk,
+			     size_t *len, uint64_t *primkey)
+{
+	MDB_val k, v;
+	void *res = NULL;
+	if (len)
+		*len = 0;
+
+	if (!ndb_get_tsid(txn, ind, pk, &k)) {
+		//ndb_debug("ndb_get_profile_by_pubkey: ndb_get_tsid failed\n");
+		return 0;
+	}
+
+	if (primkey)
+		*primkey = *(uint64_t*)k.mv_data;
+
+	if (mdb_get(txn->mdb_txn, txn->lmdb->dbs[store], &k, &v)) {
+		ndb_debug("ndb_get_profile_by_pubkey: mdb_get note failed\n");
+		return 0;
+	}
+
+	res = v.mv_data;
+	assert(((uint64_t)res % 4) == 0);
+	if (len)
+		*len = v.mv_size;
+	return res;
+}
+
+void *ndb_get_profile_by_pubkey(struct ndb_txn *txn, const unsigned char *pk, size_t *len, uint64_t *key)
+{
+	return ndb_lookup_tsid(txn, NDB_DB_PROFILE_PK, NDB_DB_PROFILE, pk, len, key);
+}
+
+struct ndb_note *ndb_get_note_by_id(struct ndb_txn *txn, const unsigned char *id, size_t *len, uint64_t *key)
+{
+	return ndb_lookup_tsid(txn, NDB_DB_NOTE_ID, NDB_DB_NOTE, id, len, key);
+}
+
+struct ndb_batch_lookup {
+	const unsigned char *id;
+	uint64_t key;
+	int index;
+};
+
+static int ndb_batch_lookup_id_cmp(const void *a, const void *b)
+{
+	const struct ndb_batch_lookup *la = a, *lb = b;
+	return memcmp(la->id, lb->id, 32);
+}
+
+static int ndb_batch_lookup_key_cmp(const void *a, const void *b)
+{
+	const struct ndb_batch_lookup *la = a, *lb = b;
+
+	if (la->key < lb->key)
+		return -1;
+	else if (la->key > lb->key)
+		return 1;
+	return 0;
+}
+
+// Second half of a batch lookup: sort the hits by primary key and fetch
+// them from `store` with a single forward cursor.
+static int ndb_batch_fetch(struct ndb_txn *txn, enum ndb_dbs store,
+			   struct ndb_batch_lookup *lookups, int num_found,
+			   struct ndb_lookup_result *results)
+{
+	MDB_cursor *cur;
+	MDB_val k, v;
+	int i, found, rc;
+
+	qsort(lookups, num_found, sizeof(*lookups), ndb_batch_lookup_key_cmp);
+
+	if ((rc = mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[store], &cur))) {
+		ndb_debug("ndb_batch_fetch: cursor open failed: '%s'\n",
+			  mdb_strerror(rc));
+		return -1;
+	}
+
+	found = 0;
+	for (i = 0; i < num_found; i++) {
+		k.mv_data = &lookups[i].key;
+		k.mv_size = sizeof(lookups[i].key);
+
+		if (mdb_cursor_get(cur, &k, &v, MDB_SET_KEY)) {
+			ndb_debug("ndb_batch_fetch: missing key %" PRIu64 "\n",
+				  lookups[i].key);
+			continue;
+		}
+
+		assert(((uint64_t)v.mv_data % 4) == 0);
+		results[lookups[i].index].data = v.mv_data;
+		results[lookups[i].index].len = v.mv_size;
+		results[lookups[i].index].key = lookups[i].key;
+		found++;
+	}
+
+	mdb_cursor_close(cur);
+
+	return found;
+}
+
+// Batched version of ndb_lookup_tsid. We sort the ids so we can walk a
+// single index cursor forward, then sort the hits by primary key and walk
+// the store the same way. Results are written in the order of `ids`.
+// Returns how many were found, or -1 on errors.
+static int ndb_lookup_tsids(struct ndb_txn *txn, enum ndb_dbs ind,
+			    enum ndb_dbs store, const unsigned char *ids,
+			    int num_ids, struct ndb_lookup_result *results)
+{
+	MDB_cursor *cur;
+	MDB_val k, v;
+	struct ndb_batch_lookup *lookups;
+	struct ndb_tsid tsid;
+	int i, found, num_found, rc;
+
+	for (i = 0; i < num_ids; i++) {
+		results[i].data = NULL;
+		results[i].len = 0;
+		results[i].key = 0;
+	}
+
+	if (num_ids <= 0)
+		return 0;
+
+	if (!(lookups = malloc(sizeof(*lookups) * num_ids)))
+		return -1;
+
+	for (i = 0; i < num_ids; i++) {
+		lookups[i].id = ids + i * 32;
+		lookups[i].key = 0;
+		lookups[i].index = i;
+	}
+
+	qsort(lookups, num_ids, sizeof(*lookups), ndb_batch_lookup_id_cmp);
+
+	if ((rc = mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[ind], &cur))) {
+		ndb_debug("ndb_lookup_tsids: cursor open failed: '%s'\n",
+			  mdb_strerror(rc));
+		free(lookups);
+		return -1;
+	}
+
+	num_found = 0;
+	for (i = 0; i < num_ids; i++) {
+		// duplicate ids resolve to the same key
+		if (i > 0 && !memcmp(lookups[i].id, lookups[i-1].id, 32)) {
+			lookups[i].key = lookups[i-1].key;
+		} else {
+			ndb_tsid_high(&tsid, lookups[i].id);
+			k.mv_data = &tsid;
+			k.mv_size = sizeof(tsid);
+
+			found = ndb_cursor_start(cur, &k, &v) &&
+				!memcmp(k.mv_data, lookups[i].id, 32);
+			lookups[i].key = found ? *(uint64_t*)v.mv_data : 0;
+		}
+
+		if (lookups[i].key)
+			lookups[num_found++] = lookups[i];
+	}
+
+	mdb_cursor_close(cur);
+
+	found = ndb_batch_fetch(txn, store, lookups, num_found, results);
+	free(lookups);
+
+	return found;
+}
+
+int ndb_get_profiles_by_pubkeys(struct ndb_txn *txn,
+				const unsigned char *pubkeys, int num_pubkeys,
+				struct ndb_lookup_result *results)
+{
+	return ndb_lookup_tsids(txn, NDB_DB_PROFILE_PK, NDB_DB_PROFILE,
+				pubkeys, num_pubkeys, results);
+}
+
+int ndb_get_notes_by_ids(struct ndb_txn *txn, const unsigned char *ids,
+			 int num_ids, struct ndb_lookup_result *results)
+{
+	return ndb_lookup_tsids(txn, NDB_DB_NOTE_ID, NDB_DB_NOTE, ids, num_ids,
+				results);
+}
+
+struct ndb_thread_node {
+	struct ndb_note *note;
+	uint64_t note_key;
+	uint64_t note_size;
+	int parent; // index into the node list, -1 for the root
+	int depth;
+	int order;
+};
+
+struct ndb_thread_nodes {
+	struct ndb_thread_node *nodes;
+	int count;
+	int capacity;
+};
+
+static int ndb_thread_nodes_push(struct ndb_thread_nodes *nodes,
+				 struct ndb_thread_node *node)
+{
+	struct ndb_thread_node *grown;
+	int capacity;
+
+	if (nodes->count == nodes->capacity) {
+		capacity = nodes->capacity ? nodes->capacity * 2 : 64;
+		grown = realloc(nodes->nodes, capacity * sizeof(*grown));
+		if (grown == NULL)
+			return 0;
+		nodes->nodes = grown;
+		nodes->capacity = capacity;
+	}
+
+	nodes->nodes[nodes->count++] = *node;
+	return 1;
+}
+
+// Walk every reply along one edge of `id` in created_at order, adding
+// them as children of `parent`. Stops early once we have `max` nodes.
+// `root_key` is skipped so reply cycles can't pull the root back in.
+static int ndb_thread_scan_edge(struct ndb_txn *txn, MDB_cursor *cur,
+				const unsigned char *id,
+				enum ndb_thread_edge edge, uint64_t root_key,
+				struct ndb_thread_nodes *nodes,
+				int parent, int max)
+{
+	struct ndb_id_u64_ts key, *found;
+	struct ndb_thread_node node;
+	MDB_val k, v;
+	size_t len;
+	int rc;
+
+	ndb_id_u64_ts_init(&key, (unsigned char *)id, edge, 0);
+	k.mv_data = &key;
+	k.mv_size = sizeof(key);
+
+	rc = mdb_cursor_get(cur, &k, &v, MDB_SET_RANGE);
+	for (; rc == 0; rc = mdb_cursor_get(cur, &k, &v, MDB_NEXT)) {
+		found = k.mv_data;
+		if (memcmp(found->id, id, 32) || found->u64 != edge)
+			break;
+
+		if (nodes->count >= max)
+			break;
+
+		node.note_key = *(uint64_t*)v.mv_data;
+		if (node.note_key == root_key)
+			continue;
+
+		if (!(node.note = ndb_get_note_by_key(txn, node.note_key, &len)))
+			continue;
+
+		node.note_size = len;
+		node.parent = parent;
+		node.depth = parent == -1 ? 1 : nodes->nodes[parent].depth + 1;
+		node.order = 0;
+
+		if (!ndb_thread_nodes_push(nodes, &node))
+			return 0;
+	}
+
+	return 1;
+}
+
+static int ndb_thread_node_id_cmp(const void *a, const void *b)
+{
+	const struct ndb_thread_node *na = *(struct ndb_thread_node **)a;
+	const struct ndb_thread_node *nb = *(struct ndb_thread_node **)b;
+
+	return memcmp(ndb_note_id(na->note), ndb_note_id(nb->note), 32);
+}
+
+static int ndb_thread_find_id(struct ndb_thread_node **by_id, int count,
+			      const unsigned char *id)
+{
+	int lo = 0, hi = count - 1, mid, cmp;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		cmp = memcmp(id, ndb_note_id(by_id[mid]->note), 32);
+		if (cmp == 0)
+			return mid;
+		else if (cmp < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+
+	return -1;
+}
+
+// Everything under a thread root has a root edge, so we can load the whole
+// thread in one scan and link each reply to its NIP-10 parent afterwards.
+static int ndb_thread_link_parents(struct ndb_thread_nodes *nodes)
+{
+	struct ndb_thread_node **by_id, *node;
+	const unsigned char *root_id, *parent_id;
+	int i, j, found, steps;
+
+	if (!(by_id = malloc(nodes->count * sizeof(*by_id))))
+		return 0;
+
+	for (i = 0; i < nodes->count; i++)
+		by_id[i] = &nodes->nodes[i];
+
+	qsort(by_id, nodes->count, sizeof(*by_id), ndb_thread_node_id_cmp);
+
+	for (i = 0; i < nodes->count; i++) {
+		node = &nodes->nodes[i];
+		node->parent = -1;
+
+		if (!ndb_note_thread_refs(node->note, &root_id, &parent_id))
+			continue;
+
+		// replies to notes we don't have hang off the root
+		if ((found = ndb_thread_find_id(by_id, nodes->count, parent_id)) != -1)
+			node->parent = by_id[found] - nodes->nodes;
+
+		if (node->parent == i)
+			node->parent = -1;
+	}
+
+	free(by_id);
+
+	// depths, breaking any cycles by hanging them off the root
+	for (i = 0; i < nodes->count; i++) {
+		steps = 0;
+		for (j = nodes->nodes[i].parent; j != -1; j = nodes->nodes[j].parent) {
+			if (++steps > nodes->count) {
+				nodes->nodes[i].parent = -1;
+				steps = 0;
+				break;
+			}
+		}
+		nodes->nodes[i].depth = steps + 1;
+	}
+
+	return 1;
+}
+
+static int ndb_thread_node_order_cmp(const void *a, const void *b)
+{
+	const struct ndb_thread_node *na = *(struct ndb_thread_node **)a;
+	const struct ndb_thread_node *nb = *(struct ndb_thread_node **)b;
+	uint32_t ca = ndb_note_created_at(na->note);
+	uint32_t cb = ndb_note_created_at(nb->note);
+
+	if (na->depth != nb->depth)
+		return na->depth < nb->depth ? -1 : 1;
+	if (ca != cb)
+		return ca < cb ? -1 : 1;
+	if (na->note_key != nb->note_key)
+		return na->note_key < nb->note_key ? -1 : 1;
+	return 0;
+}
+
+static int ndb_thread_node_sibling_cmp(const void *a, const void *b)
+{
+	const struct ndb_thread_node *na = *(struct ndb_thread_node **)a;
+	const struct ndb_thread_node *nb = *(struct ndb_thread_node **)b;
+
+	if (na->parent != nb->parent)
+		return na->parent < nb->parent ? -1 : 1;
+
+	return na->order < nb->order ? -1 : na->order > nb->order;
+}
+
+// Write the first `keep` nodes (by order) out depth first with siblings
+// oldest first, which is the order a thread view renders them in.
+static int ndb_thread_emit(struct ndb_thread_nodes *nodes, int keep,
+			   struct ndb_thread_result *results)
+{
+	struct ndb_thread_node **sorted, *node;
+	int *first_child, *stack, *next;
+	int i, n, top, parent, child, written = -1;
+
+	sorted = malloc(keep * sizeof(*sorted));
+	first_child = malloc((nodes->count + 1) * sizeof(int));
+	next = malloc(keep * sizeof(int));
+	stack = malloc(keep * sizeof(int));
+
+	if (!sorted || !first_child || !next || !stack)
+		goto cleanup;
+
+	for (i = 0, n = 0; i < nodes->count; i++) {
+		if (nodes->nodes[i].order < keep)
+			sorted[n++] = &nodes->nodes[i];
+	}
+
+	// group siblings together, children of the root come first
+	qsort(sorted, keep, sizeof(*sorted), ndb_thread_node_sibling_cmp);
+
+	// first_child[p+1] is where the children of node p start in sorted
+	for (i = 0; i <= nodes->count; i++)
+		first_child[i] = -1;
+	for (i = keep - 1; i >= 0; i--) {
+		parent = sorted[i]->parent;
+		next[i] = first_child[parent + 1];
+		first_child[parent + 1] = i;
+	}
+
+	top = 0;
+	n = 0;
+	if (first_child[0] != -1)
+		stack[top++] = first_child[0];
+
+	while (top > 0) {
+		i = stack[--top];
+		node = sorted[i];
+
+		results[n].note = node->note;
+		results[n].note_key = node->note_key;
+		results[n].note_size = node->note_size;
+		results[n].depth = node->depth;
+		n++;
+
+		// push the next sibling first so our children come before it
+		if (next[i] != -1)
+			stack[top++] = next[i];
+
+		if ((child = first_child[(node - nodes->nodes) + 1]) != -1)
+			stack[top++] = child;
+	}
+
+	written = n;
+cleanup:
+	free(sorted);
+	free(first_child);
+	free(next);
+	free(stack);
+	return written;
+}
+
+int ndb_thread_query(struct ndb_txn *txn, const unsigned char *root,
+		     int depth, int limit, struct ndb_thread_result *results,
+		     int *count)
+{
+	struct ndb_thread_nodes nodes = {0};
+	struct ndb_thread_node **ranked;
+	struct ndb_note *root_note;
+	MDB_cursor *cur;
+	uint64_t root_key;
+	size_t root_size;
+	int i, keep, written, rc, ok = 0;
+	const unsigned char *id;
+
+	*count = 0;
+
+	if (limit <= 0)
+		return 1;
+
+	root_key = 0;
+	root_size = 0;
+	if ((root_note = ndb_get_note_by_id(txn, root, &root_size, &root_key))) {
+		results[0].note = root_note;
+		results[0].note_key = root_key;
+		results[0].note_size = root_size;
+		results[0].depth = 0;
+		*count = 1;
+	}
+
+	if (depth == 0 || *count == limit)
+		return 1;
+
+	if ((rc = mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_THREAD], &cur))) {
+		fprintf(stderr, "ndb_thread_query: cursor open failed: %s\n",
+			mdb_strerror(rc));
+		return 0;
+	}
+
+	if (!ndb_thread_scan_edge(txn, cur, root, NDB_THREAD_EDGE_ROOT,
+				  root_key, &nodes, -1, INT_MAX))
+		goto cleanup;
+
+	if (nodes.count > 0) {
+		if (!ndb_thread_link_parents(&nodes))
+			goto cleanup;
+	} else {
+		// not a thread root, walk direct replies breadth first. Each
+		// level is complete before the next one, so we can stop as
+		// soon as we have enough.
+		if (!ndb_thread_scan_edge(txn, cur, root, NDB_THREAD_EDGE_PARENT,
+					  root_key, &nodes, -1, limit))
+			goto cleanup;
+
+		for (i = 0; i < nodes.count && nodes.count < limit; i++) {
+			if (depth > 0 && nodes.nodes[i].depth >= depth)
+				break;
+			id = ndb_note_id(nodes.nodes[i].note);
+			if (!ndb_thread_scan_edge(txn, cur, id,
+						  NDB_THREAD_EDGE_PARENT,
+						  root_key, &nodes, i, limit))
+				goto cleanup;
+		}
+	}
+
+	// keep the shallowest, oldest replies when we're over the limit.
+	// parents always rank before their children so the tree stays
+	// connected.
+	if (nodes.count > 0) {
+		if (!(ranked = malloc(nodes.count * sizeof(*ranked))))
+			goto cleanup;
+		for (i = 0; i < nodes.count; i++)
+			ranked[i] = &nodes.nodes[i];
+		qsort(ranked, nodes.count, sizeof(*ranked),
+		      ndb_thread_node_order_cmp);
+		for (i = 0; i < nodes.count; i++)
+			ranked[i]->order = i;
+
+		keep = 0;
+		while (keep < nodes.count && keep < limit - *count &&
+		       (depth < 0 || ranked[keep]->depth <= depth))
+			keep++;
+		free(ranked);
+
+		if (keep > 0) {
+			if ((written = ndb_thread_emit(&nodes, keep, results + *count)) == -1)
+				goto cleanup;
+			*count += written;
+		}
+	}
+
+	ok = 1;
+cleanup:
+	mdb_cursor_close(cur);
+	free(nodes.nodes);
+	return ok;
+}
+
+static inline uint64_t ndb_get_indexkey_by_id(struct ndb_txn *txn,
+					      enum ndb_dbs db,
+					      const unsigned char *id)
+{
+	MDB_val k;
+
+	if (!ndb_get_tsid(txn, db, id, &k))
+		return 0;
+
+	return *(uint32_t*)k.mv_data;
+}
+
+uint64_t ndb_get_notekey_by_id(struct ndb_txn *txn, const unsigned char *id)
+{
+	return ndb_get_indexkey_by_id(txn, NDB_DB_NOTE_ID, id);
+}
+
+uint64_t ndb_get_profilekey_by_pubkey(struct ndb_txn *txn, const unsigned char *id)
+{
+	return ndb_get_indexkey_by_id(txn, NDB_DB_PROFILE_PK, id);
+}
+
+struct ndb_note *ndb_get_note_by_key(struct ndb_txn *txn, uint64_t key, size_t *len)
+{
+	return ndb_lookup_by_key(txn, key, NDB_DB_NOTE, len);
+}
+
+void *ndb_get_profile_by_key(struct ndb_txn *txn, uint64_t key, size_t *len)
+{
+	return ndb_lookup_by_key(txn, key, NDB_DB_PROFILE, len);
+}
+
+uint64_t
+ndb_read_last_profile_fetch(struct ndb_txn *txn, const unsigned char *pubkey)
+{
+	MDB_val k, v;
+
+	k.mv_data = (unsigned char*)pubkey;
+	k.mv_size = 32;
+
+	if (mdb_get(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_PROFILE_LAST_FETCH], &k, &v)) {
+		//ndb_debug("ndb_read_last_profile_fetch: mdb_get note failed\n");
+		return 0;
+	}
+
+	return *((uint64_t*)v.mv_data);
+}
+
+
+static int ndb_has_note(struct ndb_txn *txn, const unsigned char *id)
+{
+	MDB_val val;
+
+	if (!ndb_get_tsid(txn, NDB_DB_NOTE_ID, id, &val))
+		return 0;
+
+	return 1;
+}
+
+static void ndb_txn_from_mdb(struct ndb_txn *txn, struct ndb_lmdb *lmdb,
+			     MDB_txn *mdb_txn)
+{
+	txn->lmdb = lmdb;
+	txn->mdb_txn = mdb_txn;
+}
+
+static enum ndb_idres ndb_ingester_json_controller(void *data, const char *hexid)
+{
+	unsigned char id[32];
+	struct ndb_ingest_controller *c = data;
+	struct ndb_txn txn;
+
+	hex_decode(hexid, 64, id, sizeof(id));
+
+	// let's see if we already have it
+	ndb_txn_from_mdb(&txn, c->lmdb, c->read_txn);
+	c->note = ndb_get_note_by_id(&txn, id, NULL, &c->note_key);
+
+	if (c->note == NULL)
+		return NDB_IDRES_CONT;
+
+	return NDB_IDRES_STOP;
+}
+
+static int ndbprofile_parse_json(flatcc_builder_t *B,
+        const char *buf, size_t bufsiz, int flags, NdbProfile_ref_t *profile)
+{
+	flatcc_json_parser_t parser, *ctx = &parser;
+	flatcc_json_parser_init(ctx, B, buf, buf + bufsiz, flags);
+
+	if (flatcc_builder_start_buffer(B, 0, 0, 0))
+		return 0;
+
+	NdbProfile_parse_json_table(ctx, buf, buf + bufsiz, profile);
+	if (ctx->error)
+		return 0;
+
+	if (!flatcc_builder_end_buffer(B, *profile))
+		return 0;
+
+	ctx->end_loc = buf;
+
+
+	return 1;
+}
+
+void ndb_profile_record_builder_init(struct ndb_profile_record_builder *b)
+{
+	b->builder = malloc(sizeof(*b->builder));
+	b->flatbuf = NULL;
+}
+
+void ndb_profile_record_builder_free(struct ndb_profile_record_builder *b)
+{
+	if (b->flatbuf)
+		flatcc_builder_aligned_free(b->flatbuf);
+	if (b->builder) {
+		flatcc_builder_clear(b->builder);
+		free(b->builder);
+	}
+
+	b->builder = NULL;
+	b->flatbuf = NULL;
+
+}
+
+int ndb_process_profile_note(struct ndb_note *note,
+			     struct ndb_profile_record_builder *profile)
+{
+	int res;
+
+	NdbProfile_ref_t profile_table;
+	flatcc_builder_t *builder;
+
+	ndb_profile_record_builder_init(profile);
+	builder = profile->builder;
+	flatcc_builder_init(builder);
+
+	NdbProfileRecord_start_as_root(builder);
+
+	//printf("parsing profile '%.*s'\n", note->content_length, ndb_note_content(note));
+	if (!(res = ndbprofile_parse_json(builder, ndb_note_content(note),
+					  note->content_length,
+					  flatcc_json_parser_f_skip_unknown,
+					  &profile_table)))
+	{
+		ndb_debug("profile_parse_json failed %d '%.*s'\n", res,
+			  note->content_length, ndb_note_content(note));
+		ndb_profile_record_builder_free(profile);
+		return 0;
+	}
+
+	uint64_t received_at = time(NULL);
+	const char *lnurl = "fixme";
+
+	NdbProfileRecord_profile_add(builder, profile_table);
+	NdbProfileRecord_received_at_add(builder, received_at);
+
+	flatcc_builder_ref_t lnurl_off;
+	lnurl_off = flatcc_builder_create_string_str(builder, lnurl);
+
+	NdbProfileRecord_lnurl_add(builder, lnurl_off);
+
+	//*profile = flatcc_builder_finalize_aligned_buffer(builder, profile_len);
+	return 1;
+}
+
+static int ndb_ingester_queue_event(struct ndb_ingester *ingester,
+				    char *json, unsigned len,
+				    unsigned client, const char *relay)
+{
+	struct ndb_ingester_msg msg;
+	msg.type = NDB_INGEST_EVENT;
+
+	msg.event.json = json;
+	msg.event.len = len;
+	msg.event.client = client;
+	msg.event.relay = relay;
+
+	return threadpool_dispatch(&ingester->tp, &msg);
+}
+
+void ndb_ingest_meta_init(struct ndb_ingest_meta *meta, unsigned client, const char *relay)
+{
+	meta->client = client;
+	meta->relay = relay;
+}
+
+static int ndb_ingest_event(struct ndb_ingester *ingester, const char *json,
+			    int len, struct ndb_ingest_meta *meta)
+{
+	const char *relay = meta->relay;
+
+	// Without this, we get bus errors in the json parser inside when
+	// trying to ingest empty kind 6 reposts... we should probably do fuzz
+	// testing on inputs to the json parser
+	if (len == 0)
+		return 0;
+
+	// Since we need to return as soon as possible, and we're not
+	// making any assumptions about the lifetime of the string, we
+	// definitely need to copy the json here. In the future once we
+	// have our thread that manages a websocket connection, we can
+	// avoid the copy and just use the buffer we get from that
+	// thread.
+	char *json_copy = strdupn(json, len);
+	if (json_copy == NULL)
+		return 0;
+
+	if (relay != NULL) {
+		relay = strdup(meta->relay);
+		if (relay == NULL)
+			return 0;
+	}
+
+	return ndb_ingester_queue_event(ingester, json_copy, len, meta->client, relay);
+}
+
+
+static int ndb_ingester_process_note(secp256k1_context *ctx,
+				     struct ndb_note *note,
+				     size_t note_size,
+				     struct ndb_writer_msg *out,
+				     struct ndb_ingester *ingester,
+				     unsigned char *scratch,
+				     const char *relay)
+{
+	enum ndb_ingest_filter_action action;
+	struct ndb_ingest_meta meta;
+
+	action = NDB_INGEST_ACCEPT;
+
+	if (ingester->filter)
+		action = ingester->filter(ingester->filter_context, note);
+
+	if (action == NDB_INGEST_REJECT)
+		return 0;
+
+	// some special situations we might want to skip sig validation,
+	// like during large imports
+	if (action == NDB_INGEST_SKIP_VALIDATION || (ingester->flags & NDB_FLAG_SKIP_NOTE_VERIFY)) {
+		// if we're skipping validation we don't need to verify
+	} else {
+		// verify! If it's an invalid note we don't need to
+		// bother writing it to the database
+		if (!ndb_note_verify(ctx, scratch, ingester->scratch_size, note)) {
+			ndb_debug("note verification failed\n");
+			return 0;
+		}
+	}
+
+	// we didn't find anything. let's send it
+	// to the writer thread
+	note = realloc(note, note_size);
+	assert(((uint64_t)note % 4) == 0);
+
+	if (note->kind == 0) {
+		struct ndb_profile_record_builder *b =
+			&out->profile.record;
+
+		ndb_process_profile_note(note, b);
+
+		out->type = NDB_WRITER_PROFILE;
+		ndb_writer_note_init(&out->profile.note, note, note_size, relay);
+		return 1;
+	} else if (note->kind == 6) {
+		// process the repost if we have a repost event
+		ndb_debug("processing kind 6 repost\n");
+		// dup the relay string
+		ndb_ingest_meta_init(&meta, 0, relay);
+		ndb_ingest_event(ingester, ndb_note_content(note),
+					   ndb_note_content_length(note),
+					   &meta);
+	}
+
+	out->type = NDB_WRITER_NOTE;
+	ndb_writer_note_init(&out->note, note, note_size, relay);
+
+	return 1;
+}
+
+int ndb_note_seen_on_relay(struct ndb_txn *txn, uint64_t note_key, const char *relay)
+{
+	MDB_val k, v;
+	MDB_cursor *cur;
+	int rc, len;
+	char relay_buf[256];
+
+	if (relay == NULL)
+		return 0;
+
+	len = strlen(relay);
+
+	if (!(len = prepare_relay_buf(relay_buf, sizeof(relay_buf), relay, len)))
+		return 0;
+
+	assert((len % 8) == 0);
+
+	k.mv_data = &note_key;
+	k.mv_size = sizeof(note_key);
+
+	v.mv_data = relay_buf;
+	v.mv_size = len;
+
+	if ((rc = mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_RELAYS], &cur)) != MDB_SUCCESS)
+		return 0;
+
+	rc = mdb_cursor_get(cur, &k, &v, MDB_GET_BOTH);
+	ndb_debug("seen_on_relay result: %s\n", mdb_strerror(rc));
+	mdb_cursor_close(cur);
+
+	return rc == MDB_SUCCESS;
+}
+
+// process the relay for the note. this is called when we already have the
+// note in the database but still need to check if the relay needs to be
+// written to the relay indexes for corresponding note
+static int ndb_process_note_relay(struct ndb_txn *txn, struct ndb_writer_msg *out,
+				  uint64_t note_key, struct ndb_note *note,
+				  const char *relay)
+{
+	// query to see if we already have the relay on this note
+	if (ndb_note_seen_on_relay(txn, note_key, relay)) {
+		return 0;
+	}
+
+	// if not, tell the writer thread to emit a NOTE_RELAY event
+	out->type = NDB_WRITER_NOTE_RELAY;
+
+	ndb_debug("pushing NDB_WRITER_NOTE_RELAY with note_key %" PRIu64 "\n", note_key);
+	out->note_relay.relay = relay;
+	out->note_relay.note_key = note_key;
+	out->note_relay.kind = ndb_note_kind(note);
+	out->note_relay.created_at = ndb_note_created_at(note);
+
+	return 1;
+}
+
+static int ndb_ingester_process_event(secp256k1_context *ctx,
+				      struct ndb_ingester *ingester,
+				      struct ndb_ingester_event *ev,
+				      struct ndb_writer_msg *out,
+				      unsigned char *scratch,
+				      MDB_txn *read_txn)
+{
+	struct ndb_tce tce;
+	struct ndb_fce fce;
+	struct ndb_note *note;
+	struct ndb_ingest_controller controller;
+	struct ndb_id_cb cb;
+	void *buf;
+	int ok;
+	size_t bufsize, note_size;
+
+	ok = 0;
+
+	// we will use this to check if we already have it in the DB during
+	// ID parsing
+	controller.read_txn = read_txn;
+	controller.lmdb = ingester->lmdb;
+	cb.fn = ndb_ingester_json_controller;
+	cb.data = &controller;
+
+	// since we're going to be passing this allocated note to a different
+	// thread, we can't use thread-local buffers. just allocate a block
+        bufsize = max(ev->len * 8.0, 4096);
+	buf = malloc(bufsize);
+	if (!buf) {
+		ndb_debug("couldn't malloc buf\n");
+		return 0;
+	}
+
+	note_size =
+		ev->client ?
+		ndb_client_event_from_json(ev->json, ev->len, &fce, buf, bufsize, &cb) :
+		ndb_ws_event_from_json(ev->json, ev->len, &tce, buf, bufsize, &cb);
+
+	// This is a result from our special json parser. It parsed the id
+	// and found that we already have it in the database
+	if ((int)note_size == -42) {
+		assert(controller.note != NULL);
+		assert(controller.note_key != 0);
+		struct ndb_txn txn;
+		ndb_txn_from_mdb(&txn, ingester->lmdb, read_txn);
+
+		// we still need to process the relays on the note even
+		// if we already have it
+	 	if (ev->relay && ndb_process_note_relay(&txn, out,
+							controller.note_key,
+							controller.note,
+							ev->relay))
+		{
+			// free note buf here since we don't pass the note to the writer thread
+			free(buf);
+			goto success;
+		} else {
+			// we already have the note and there are no new
+			// relays to process. nothing to write.
+			goto cleanup;
+		}
+	} else if (note_size == 0) {
+		ndb_debug("failed to parse '%.*s'\n", ev->len, ev->json);
+		goto cleanup;
+	}
+
+	//ndb_debug("parsed evtype:%d '%.*s'\n", tce.evtype, ev->len, ev->json);
+
+	if (ev->client) {
+		switch (fce.evtype) {
+		case NDB_FCE_EVENT:
+			note = fce.event.note;
+			if (note != buf) {
+				ndb_debug("note buffer not equal to malloc'd buffer\n");
+				goto cleanup;
+			}
+
+			if (!ndb_ingester_process_note(ctx, note, note_size,
+						       out, ingester, scratch,
+						       ev->relay)) {
+				ndb_debug("failed to process note\n");
+				goto cleanup;
+			} else {
+				goto success;
+			}
+		}
+	} else {
+		switch (tce.evtype) {
+		case NDB_TCE_AUTH:   goto cleanup;
+		case NDB_TCE_NOTICE: goto cleanup;
+		case NDB_TCE_EOSE:   goto cleanup;
+		case NDB_TCE_OK:     goto cleanup;
+		case NDB_TCE_EVENT:
+			note = tce.event.note;
+			if (note != buf) {
+				ndb_debug("note buffer not equal to malloc'd buffer\n");
+				goto cleanup;
+			}
+
+			if (!ndb_ingester_process_note(ctx, note, note_size,
+						       out, ingester, scratch,
+						       ev->relay)) {
+				ndb_debug("failed to process note\n");
+				goto cleanup;
+			} else {
+				goto success;
+			}
+		}
+	}
+
+
+success:
+	free(ev->json);
+	// we don't free relay or buf since those are passed to the writer thread
+	return 1;
+
+cleanup:
+	free(ev->json);
+	if (ev->relay)
+		free((void*)ev->relay);
+	free(buf);
+
+	return ok;
+}
+
+static uint64_t ndb_get_last_key(MDB_txn *txn, MDB_dbi db)
+{
+	MDB_cursor *mc;
+	MDB_val key, val;
+
+	if (mdb_cursor_open(txn, db, &mc))
+		return 0;
+
+	if (mdb_cursor_get(mc, &key, &val, MDB_LAST)) {
+		mdb_cursor_close(mc);
+		return 0;
+	}
+
+	mdb_cursor_close(mc);
+
+	assert(key.mv_size == 8);
+        return *((uint64_t*)key.mv_data);
+}
+
+//
+// make a search key meant for user queries without any other note info
+static void ndb_make_search_key_low(struct ndb_search_key *key, const char *search)
+{
+	memset(key->id, 0, sizeof(key->id));
+	key->timestamp = 0;
+	fold_strncpy(key->search, search, sizeof(key->search) - 1);
+	key->search[sizeof(key->search) - 1] = '\0';
+}
+
+int ndb_search_profile(struct ndb_txn *txn, struct ndb_search *search, const char *query)
+{
+	int rc;
+	struct ndb_search_key s;
+	MDB_val k, v;
+	search->cursor = NULL;
+
+	MDB_cursor **cursor = (MDB_cursor **)&search->cursor;
+
+	ndb_make_search_key_low(&s, query);
+
+	k.mv_data = &s;
+	k.mv_size = sizeof(s);
+
+	if ((rc = mdb_cursor_open(txn->mdb_txn,
+				  txn->lmdb->dbs[NDB_DB_PROFILE_SEARCH],
+				  cursor))) {
+		printf("search_profile: cursor opened failed: %s\n",
+				mdb_strerror(rc));
+		return 0;
+	}
+
+	// Position cursor at the next key greater than or equal to the specified key
+	if (mdb_cursor_get(search->cursor, &k, &v, MDB_SET_RANGE)) {
+		printf("search_profile: cursor get failed\n");
+		goto cleanup;
+	} else {
+		search->key = k.mv_data;
+		assert(v.mv_size == 8);
+		search->profile_key = *((uint64_t*)v.mv_data);
+		return 1;
+	}
+
+cleanup:
+	mdb_cursor_close(search->cursor);
+	search->cursor = NULL;
+	return 0;
+}
+
+void ndb_search_profile_end(struct ndb_search *search)
+{
+	if (search->cursor)
+		mdb_cursor_close(search->cursor);
+}
+
+int ndb_search_profile_next(struct ndb_search *search)
+{
+	int rc;
+	MDB_val k, v;
+	unsigned char *init_id;
+
+	init_id = search->key->id;
+	k.mv_data = search->key;
+	k.mv_size = sizeof(*search->key);
+
+retry:
+	if ((rc = mdb_cursor_get(search->cursor, &k, &v, MDB_NEXT))) {
+		ndb_debug("ndb_search_profile_next: %s\n",
+				mdb_strerror(rc));
+		return 0;
+	} else {
+		search->key = k.mv_data;
+		assert(v.mv_size == 8);
+		search->profile_key = *((uint64_t*)v.mv_data);
+
+		// skip duplicate pubkeys
+		if (!memcmp(init_id, search->key->id, 32))
+			goto retry;
+	}
+
+	return 1;
+}
+
+//
+// The relay kind index has a layout like so (so we don't need dupsort)
+//
+// - note_id:        00 + 8 bytes
+// - kind:           08 + 8 bytes
+// - created_at:     16 + 8 bytes
+// - relay_url_size: 24 + 1 byte
+// - relay_url:      25 + n byte null-terminated string
+// - pad to 8 byte alignment
+//
+// The key sort order is:
+//
+// relay_url, kind, created_at
+//
+static int ndb_relay_kind_cmp(const MDB_val *a, const MDB_val *b)
+{
+	int cmp;
+	MDB_val va, vb;
+	uint64_t iva, ivb;
+	unsigned char *ad = (unsigned char *)a->mv_data;
+	unsigned char *bd = (unsigned char *)b->mv_data;
+	assert(((uint64_t)a->mv_data % 8) == 0);
+
+	va.mv_size = *(ad + 24);
+	va.mv_data =   ad + 25;
+
+	vb.mv_size = *(bd + 24);
+	vb.mv_data =   bd + 25;
+
+	cmp = mdb_cmp_memn(&va, &vb);
+	if (cmp) return cmp;
+
+	// kind
+	iva = *(uint64_t*)(ad + 8);
+	ivb = *(uint64_t*)(bd + 8);
+
+	if (iva < ivb)
+		return -1;
+	else if (iva > ivb)
+		return 1;
+
+	// created_at
+	iva = *(uint64_t*)(ad + 16);
+	ivb = *(uint64_t*)(bd + 16);
+
+	if (iva < ivb)
+		return -1;
+	else if (iva > ivb)
+		return 1;
+
+	// note_id (so we don't need dupsort logic)
+	iva = *(uint64_t*)ad;
+	ivb = *(uint64_t*)bd;
+
+	if (iva < ivb)
+		return -1;
+	else if (iva > ivb)
+		return 1;
+
+	return 0;
+}
+
+static int ndb_search_key_cmp(const MDB_val *a, const MDB_val *b)
+{
+	int cmp;
+	struct ndb_search_key *ska, *skb;
+
+	ska = a->mv_data;
+	skb = b->mv_data;
+
+	MDB_val a2 = *a;
+	MDB_val b2 = *b;
+
+	a2.mv_data = ska->search;
+	a2.mv_size = sizeof(ska->search) + sizeof(ska->id);
+
+	cmp = mdb_cmp_memn(&a2, &b2);
+	if (cmp) return cmp;
+
+	if (ska->timestamp < skb->timestamp)
+		return -1;
+	else if (ska->timestamp > skb->timestamp)
+		return 1;
+
+	return 0;
+}
+
+static int ndb_write_profile_pk_index(struct ndb_txn *txn, struct ndb_note *note, uint64_t profile_key)
+
+{
+	MDB_val key, val;
+	int rc;
+	struct ndb_tsid tsid;
+	MDB_dbi pk_db;
+
+	pk_db = txn->lmdb->dbs[NDB_DB_PROFILE_PK];
+
+	// write profile_pk + created_at index
+	ndb_tsid_init(&tsid, note->pubkey, note->created_at);
+
+	key.mv_data = &tsid;
+	key.mv_size = sizeof(tsid);
+	val.mv_data = &profile_key;
+	val.mv_size = sizeof(profile_key);
+
+	if ((rc = mdb_put(txn->mdb_txn, pk_db, &key, &val, 0))) {
+		ndb_debug("write profile_pk(%" PRIu64 ") to db failed: %s\n",
+				profile_key, mdb_strerror(rc));
+		return 0;
+	}
+
+	return 1;
+}
+
+static int ndb_write_profile(struct ndb_txn *txn,
+			     struct ndb_writer_profile *profile,
+			     uint64_t note_key)
+{
+	uint64_t profile_key;
+	struct ndb_note *note;
+	void *flatbuf;
+	size_t flatbuf_len;
+	int rc;
+
+	MDB_val key, val;
+	MDB_dbi profile_db;
+
+	note = profile->note.note;
+
+	// add note_key to profile record
+	NdbProfileRecord_note_key_add(profile->record.builder, note_key);
+	NdbProfileRecord_end_as_root(profile->record.builder);
+
+	flatbuf = profile->record.flatbuf =
+		flatcc_builder_finalize_aligned_buffer(profile->record.builder, &flatbuf_len);
+
+	assert(((uint64_t)flatbuf % 8) == 0);
+
+	// TODO: this may not be safe!?
+	flatbuf_len = (flatbuf_len + 7) & ~7;
+
+	//assert(NdbProfileRecord_verify_as_root(flatbuf, flatbuf_len) == 0);
+
+	// get dbs
+	profile_db = txn->lmdb->dbs[NDB_DB_PROFILE];
+
+	// get new key
+	profile_key = ndb_get_last_key(txn->mdb_txn, profile_db) + 1;
+
+	// write profile to profile store
+	key.mv_data = &profile_key;
+	key.mv_size = sizeof(profile_key);
+	val.mv_data = flatbuf;
+	val.mv_size = flatbuf_len;
+
+	if ((rc = mdb_put(txn->mdb_txn, profile_db, &key, &val, 0))) {
+		ndb_debug("write profile to db failed: %s\n", mdb_strerror(rc));
+		return 0;
+	}
+
+	// write last fetched record
+	if (!ndb_maybe_write_last_profile_fetch(txn, note)) {
+		ndb_debug("failed to write last profile fetched record\n");
+	}
+
+	// write profile pubkey index
+	if (!ndb_write_profile_pk_index(txn, note, profile_key)) {
+		ndb_debug("failed to write profile pubkey index\n");
+		return 0;
+	}
+
+	// write name, display_name profile search indices
+	if (!ndb_write_profile_search_indices(txn, note, profile_key,
+					      flatbuf)) {
+		ndb_debug("failed to write profile search indices\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+// find the last id tag in a note (e, p, etc)
+static unsigned char *ndb_note_last_id_tag(struct ndb_note *note, char type)
+{
+	unsigned char *last = NULL;
+	struct ndb_iterator iter;
+	struct ndb_str str;
+
+	// get the liked event id (last id)
+	ndb_tags_iterate_start(note, &iter);
+
+	while (ndb_tags_iterate_next(&iter)) {
+		if (iter.tag->count < 2)
+			continue;
+
+		str = ndb_tag_str(note, iter.tag, 0);
+
+		// assign liked to the last e tag
+		if (str.flag == NDB_PACKED_STR && str.str[0] == type) {
+			str = ndb_tag_str(note, iter.tag, 1);
+			if (str.flag == NDB_PACKED_ID)
+				last = str.id;
+		}
+	}
+
+	return last;
+}
+
+void *ndb_get_note_meta(struct ndb_txn *txn, const unsigned char *id, size_t *len)
+{
+	MDB_val k, v;
+
+	k.mv_data = (unsigned char*)id;
+	k.mv_size = 32;
+
+	if (mdb_get(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_META], &k, &v)) {
+		//ndb_debug("ndb_get_note_meta: mdb_get note failed\n");
+		return NULL;
+	}
+
+	if (len)
+		*len = v.mv_size;
+
+	return v.mv_data;
+}
+
+// When receiving a reaction note, look for the liked id and increase the
+// reaction counter in the note metadata database
+static int ndb_write_reaction_stats(struct ndb_txn *txn, struct ndb_note *note)
+{
+	size_t len;
+	void *root;
+	int reactions, rc;
+	MDB_val key, val;
+	NdbEventMeta_table_t meta;
+	unsigned char *liked = ndb_note_last_id_tag(note, 'e');
+
+	if (liked == NULL)
+		return 0;
+
+	root = ndb_get_note_meta(txn, liked, &len);
+
+	flatcc_builder_t builder;
+	flatcc_builder_init(&builder);
+	NdbEventMeta_start_as_root(&builder);
+
+	// no meta record, let's make one
+	if (root == NULL) {
+		NdbEventMeta_reactions_add(&builder, 1);
+	} else {
+		// clone existing and add to it
+		meta = NdbEventMeta_as_root(root);
+
+		reactions = NdbEventMeta_reactions_get(meta);
+		NdbEventMeta_clone(&builder, meta);
+		NdbEventMeta_reactions_add(&builder, reactions + 1);
+	}
+
+	NdbProfileRecord_end_as_root(&builder);
+	root = flatcc_builder_finalize_aligned_buffer(&builder, &len);
+	assert(((uint64_t)root % 8) == 0);
+
+	if (root == NULL) {
+		ndb_debug("failed to create note metadata record\n");
+		goto fail;
+	}
+
+	// metadata is keyed on id because we want to collect stats regardless
+	// if we have the note yet or not
+	key.mv_data = liked;
+	key.mv_size = 32;
+
+	val.mv_data = root;
+	val.mv_size = len;
+
+	// write the new meta record
+	//ndb_debug("writing stats record for ");
+	//print_hex(liked, 32);
+	//ndb_debug("\n");
+
+	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_META], &key, &val, 0))) {
+		ndb_debug("write reaction stats to db failed: %s\n", mdb_strerror(rc));
+		goto fail;
+	}
+
+	free(root);
+	flatcc_builder_clear(&builder);
+
+	return 1;
+
+fail:
+	free(root);
+	flatcc_builder_clear(&builder);
+	return 0;
+}
+
+
+static int ndb_write_note_id_index(struct ndb_txn *txn, struct ndb_note *note,
+				   uint64_t note_key)
+
+{
+	struct ndb_tsid tsid;
+	int rc;
+	MDB_val key, val;
+	MDB_dbi id_db;
+
+	ndb_tsid_init(&tsid, note->id, note->created_at);
+
+	key.mv_data = &tsid;
+	key.mv_size = sizeof(tsid);
+	val.mv_data = &note_key;
+	val.mv_size = sizeof(note_key);
+
+	id_db = txn->lmdb->dbs[NDB_DB_NOTE_ID];
+
+	if ((rc = mdb_put(txn->mdb_txn, id_db, &key, &val, 0))) {
+		ndb_debug("write note id index to db failed: %s\n",
+				mdb_strerror(rc));
+		return 0;
+	}
+
+	return 1;
+}
+
+static int ndb_filter_group_add_filters(struct ndb_filter_group *group,
+					struct ndb_filter *filters,
+					int num_filters)
+{
+	int i;
+
+	for (i = 0; i < num_filters; i++) {
+		if (!ndb_filter_group_add(group, &filters[i]))
+			return 0;
+	}
+
+	return 1;
+}
+
+
+static struct ndb_filter_elements *
+ndb_filter_find_elements(struct ndb_filter *filter, enum ndb_filter_fieldtype typ)
+{
+	int i;
+	struct ndb_filter_elements *els;
+
+	for (i = 0; i < filter->num_elements; i++) {
+		els = ndb_filter_get_elements(filter, i);
+		assert(els);
+		if (els->field.type == typ) {
+			return els;
+		}
+	}
+
+	return NULL;
+}
+
+static const char *ndb_filter_find_search(struct ndb_filter *filter)
+{
+	struct ndb_filter_elements *els;
+
+	if (!(els = ndb_filter_find_elements(filter, NDB_FILTER_SEARCH)))
+		return NULL;
+
+	return ndb_filter_get_string_element(filter, els, 0);
+}
+
+int ndb_filter_is_subset_of(const struct ndb_filter *a, const struct ndb_filter *b)
+{
+	int i;
+	struct ndb_filter_elements *b_field, *a_field;
+
+        // Everything is always a subset of {}
+	if (b->num_elements == 0)
+		return 1;
+
+        // We can't be a subset if the number of elements in the other
+        // filter is larger then the number of elements we have.
+	if (b->num_elements > a->num_elements)
+		return 0;
+
+        // If our filter count matches, we can only be a subset if we are
+        // equal
+	if (b->num_elements == a->num_elements)
+		return ndb_filter_eq(a, b);
+
+        // If our element count is larger than the other filter, then we
+        // must see if every element in the other filter exists in ours. If
+        // so, then we are a subset of the other.
+        //
+        // eg: B={k:1, a:b} <- A={t:x, k:1, a:b}
+        //
+        // A is a subset of B because `k:1` and `a:b` both exist in A
+
+	for (i = 0; i < b->num_elements; i++) {
+		b_field = ndb_filter_get_elements((struct ndb_filter*)b, i);
+		a_field = ndb_filter_find_elements((struct ndb_filter*)a,
+						   b_field->field.type);
+
+		if (a_field == NULL)
+			return 0;
+
+		if (!ndb_filter_field_eq((struct ndb_filter*)a, a_field,
+					 (struct ndb_filter*)b, b_field))
+			return 0;
+	}
+
+	return 1;
+}
+
+int ndb_filter_eq(const struct ndb_filter *a, const struct ndb_filter *b)
+{
+	int i;
+	struct ndb_filter_elements *a_els, *b_els;
+
+	if (a->num_elements != b->num_elements)
+		return 0;
+
+	for (i = 0; i < a->num_elements; i++) {
+		a_els = ndb_filter_get_elements((struct ndb_filter*)a, i);
+		b_els = ndb_filter_find_elements((struct ndb_filter *)b,
+						 a_els->field.type);
+
+		if (b_els == NULL)
+			return 0;
+
+		if (!ndb_filter_field_eq((struct ndb_filter*)a, a_els,
+					 (struct ndb_filter*)b, b_els))
+			return 0;
+	}
+
+	return 1;
+}
+
+
+static uint64_t *
+ndb_filter_get_elem(struct ndb_filter *filter, enum ndb_filter_fieldtype typ)
+{
+	struct ndb_filter_elements *els;
+	if ((els = ndb_filter_find_elements(filter, typ)))
+		return &els->elements[0];
+	return NULL;
+}
+
+static uint64_t *ndb_filter_get_int(struct ndb_filter *filter,
+				    enum ndb_filter_fieldtype typ)
+{
+	uint64_t *el;
+	if (NULL == (el = ndb_filter_get_elem(filter, typ)))
+		return NULL;
+	return el;
+}
+
+// descending (created_at, note_key) order
+static int ndb_ts_key_cmp(uint64_t ts_a, uint64_t key_a,
+			  uint64_t ts_b, uint64_t key_b)
+{
+	if (ts_a != ts_b)
+		return ts_a > ts_b ? -1 : 1;
+	if (key_a != key_b)
+		return key_a > key_b ? -1 : 1;
+	return 0;
+}
+
+static int compare_query_results(const void *pa, const void *pb)
+{
+	struct ndb_query_result *a, *b;
+
+	a = (struct ndb_query_result *)pa;
+	b = (struct ndb_query_result *)pb;
+
+	if (a->note->created_at > b->note->created_at)
+		return -1;
+	else if (a->note->created_at < b->note->created_at)
+		return 1;
+
+	// tie-break on note key so that we have the same ordering as our
+	// index cursors
+	if (a->note_id > b->note_id)
+		return -1;
+	else if (a->note_id < b->note_id)
+		return 1;
+
+	return 0;
+}
+
+static void query_heap_swap(struct ndb_query_result *heap, int a, int b)
+{
+	struct ndb_query_result tmp = heap[a];
+	heap[a] = heap[b];
+	heap[b] = tmp;
+}
+
+// the oldest result sits on top
+static void query_heap_sift_up(struct ndb_query_result *heap, int i)
+{
+	int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (compare_query_results(&heap[i], &heap[parent]) <= 0)
+			return;
+		query_heap_swap(heap, i, parent);
+		i = parent;
+	}
+}
+
+static void query_heap_sift_down(struct ndb_query_result *heap, int n, int i)
+{
+	int oldest, child;
+
+	for (;;) {
+		oldest = i;
+		child = 2 * i + 1;
+		if (child < n &&
+		    compare_query_results(&heap[child], &heap[oldest]) > 0)
+			oldest = child;
+		if (child + 1 < n &&
+		    compare_query_results(&heap[child + 1], &heap[oldest]) > 0)
+			oldest = child + 1;
+		if (oldest == i)
+			return;
+		query_heap_swap(heap, i, oldest);
+		i = oldest;
+	}
+}
+
+static int ndb_query_collector_grow(struct ndb_query_collector *results)
+{
+	size_t size = sizeof(struct ndb_query_result);
+	int count, capacity;
+	unsigned char *buf;
+
+	count = cursor_count(&results->cur, size);
+	capacity = (results->cur.end - results->cur.start) / size;
+	capacity = capacity > results->limit / 2 ? results->limit : capacity * 2;
+
+	if (!(buf = realloc(results->cur.start, capacity * size)))
+		return 0;
+
+	make_cursor(buf, buf + capacity * size, &results->cur);
+	results->cur.p = buf + count * size;
+	return 1;
+}
+
+static int query_collector_has_room(struct ndb_query_collector *results)
+{
+	return (results->cur.p < results->cur.end || results->grow) &&
+		cursor_count(&results->cur, sizeof(struct ndb_query_result)) <
+		results->limit;
+}
+
+// In heap mode a full collector swaps its oldest result for a newer one,
+// so the plan can keep scanning without holding more than `limit` results
+static int push_query_result(struct ndb_query_collector *results,
+			     struct ndb_query_result *result)
+{
+	struct ndb_query_result *heap;
+	int n;
+
+	// we already returned this one before the query was resumed
+	if (ndb_ts_key_cmp(result->note->created_at, result->note_id,
+			   results->before_created_at,
+			   results->before_key) <= 0)
+		return 1;
+
+	if (results->grow && results->cur.p >= results->cur.end &&
+	    cursor_count(&results->cur, sizeof(*result)) < results->limit &&
+	    !ndb_query_collector_grow(results))
+		return 0;
+
+	if (!results->heap)
+		return cursor_push(&results->cur, (unsigned char*)result, sizeof(*result));
+
+	heap = (struct ndb_query_result *)results->cur.start;
+	n = cursor_count(&results->cur, sizeof(*result));
+
+	if (query_collector_has_room(results)) {
+		if (!cursor_push(&results->cur, (unsigned char*)result, sizeof(*result)))
+			return 0;
+		query_heap_sift_up(heap, n);
+		return 1;
+	}
+
+	if (n > 0 && compare_query_results(result, &heap[0]) < 0) {
+		heap[0] = *result;
+		query_heap_sift_down(heap, n, 0);
+	}
+
+	return 1;
+}
+
+// Index ranges are walked newest-first, so once a full heap only has
+// newer results than this entry the rest of the range can be skipped
+static int query_heap_is_done(struct ndb_query_collector *results,
+			      uint64_t created_at)
+{
+	struct ndb_query_result *heap;
+
+	if (!results->heap || query_collector_has_room(results))
+		return 0;
+
+	heap = (struct ndb_query_result *)results->cur.start;
+	if (cursor_count(&results->cur, sizeof(*heap)) == 0)
+		return 1;
+
+	return created_at < heap[0].note->created_at;
+}
+
+static void ndb_query_result_init(struct ndb_query_result *res,
+				  struct ndb_note *note,
+				  uint64_t note_size,
+				  uint64_t note_id)
+{
+	*res = (struct ndb_query_result){
+		.note_id = note_id,
+		.note_size = note_size,
+		.note = note,
+	};
+}
+
+static int query_is_full(struct ndb_query_collector *results, int limit)
+{
+	// heaps are never done until the plan has seen everything
+	if (results->heap)
+		return 0;
+
+	if (results->cur.p >= results->cur.end && !results->grow)
+		return 1;
+
+	return cursor_count(&results->cur, sizeof(struct ndb_query_result)) >= limit;
+}
+
+static int ndb_query_plan_execute_search(struct ndb_txn *txn,
+					 struct ndb_filter *filter,
+					 struct ndb_query_collector *results,
+					 int limit,
+					 struct ndb_query_filter_profile *profile)
+{
+	const char *search;
+	struct ndb_text_search_iter *iter;
+	struct ndb_text_search_result text_result;
+	struct ndb_query_result result;
+
+	if (!(search = ndb_filter_find_search(filter)))
+		return 0;
+
+	if (!ndb_text_search_iter_begin(txn, search, NULL, filter, &iter))
+		return 0;
+
+	while (!query_is_full(results, limit) &&
+	       ndb_text_search_iter_next(iter, &text_result)) {
+		ndb_profile_inc(profile, rows_scanned);
+		ndb_profile_inc(profile, notes_fetched);
+
+		ndb_query_result_init(&result, text_result.note,
+				      text_result.note_size,
+				      text_result.key.note_id);
+
+		if (!push_query_result(results, &result))
+			break;
+	}
+
+	ndb_text_search_iter_end(iter);
+
+	return 1;
+}
+
+static int ndb_query_plan_execute_ids(struct ndb_txn *txn,
+				      struct ndb_filter *filter,
+				      struct ndb_query_collector *results,
+				      int limit,
+				      struct ndb_query_filter_profile *profile)
+{
+	MDB_cursor *cur;
+	MDB_dbi db;
+	MDB_val k, v;
+	int rc, i, need_relays = 0;
+	struct ndb_filter_elements *ids;
+	struct ndb_note *note;
+	struct ndb_query_result res;
+	struct ndb_tsid tsid, *ptsid;
+	uint64_t note_id, until, *pint;
+	size_t note_size;
+	unsigned char *id;
+	struct ndb_note_relay_iterator note_relay_iter = {0};
+	struct ndb_note_relay_iterator *relay_iter = NULL;
+
+	until = UINT64_MAX;
+
+	if (!(ids = ndb_filter_find_elements(filter, NDB_FILTER_IDS)))
+		return 0;
+
+	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
+		until = *pint;
+
+	if (ndb_filter_find_elements(filter, NDB_FILTER_RELAYS))
+		need_relays = 1;
+
+	db = txn->lmdb->dbs[NDB_DB_NOTE_ID];
+	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur)))
+		return 0;
+
+	// for each id in our ids filter, find in the db
+	for (i = 0; i < ids->count; i++) {
+		if (query_is_full(results, limit))
+			break;
+
+		id = ndb_filter_get_id_element(filter, ids, i);
+		ndb_tsid_init(&tsid, (unsigned char *)id, until);
+
+		k.mv_data = &tsid;
+		k.mv_size = sizeof(tsid);
+
+		ndb_profile_inc(profile, seeks);
+		if (!ndb_cursor_start(cur, &k, &v))
+			continue;
+
+		ptsid = (struct ndb_tsid *)k.mv_data;
+		note_id = *(uint64_t*)v.mv_data;
+
+		if (memcmp(id, ptsid->id, 32))
+			continue;
+
+		// get the note because we need it to match against the filter
+		if (!(note = ndb_get_note_by_key(txn, note_id, &note_size)))
+			continue;
+		ndb_profile_inc(profile, notes_fetched);
+
+		relay_iter = need_relays ? &note_relay_iter : NULL;
+		if (relay_iter)
+			ndb_note_relay_iterate_start(txn, relay_iter, note_id);
+
+		// Sure this particular lookup matched the index query, but
+		// does it match the entire filter? Check! We also pass in
+		// things we've already matched via the filter so we don't have
+		// to check again. This can be pretty important for filters
+		// with a large number of entries.
+		if (!ndb_filter_matches_with(filter, note, 1 << NDB_FILTER_IDS, relay_iter)) {
+			ndb_profile_inc(profile, rows_rejected);
+			ndb_note_relay_iterate_close(relay_iter);
+			continue;
+		}
+		ndb_note_relay_iterate_close(relay_iter);
+
+		ndb_query_result_init(&res, note, note_size, note_id);
+		if (!push_query_result(results, &res))
+			break;
+	}
+
+	mdb_cursor_close(cur);
+	return 1;
+}
+
+//
+#define NDB_TAG_NAME_MAX     64
+#define NDB_TAG_VALUE_MAX    246
+#define NDB_TAG_VALUE_PREFIX (NDB_TAG_VALUE_MAX - 32)
+#define NDB_TAG_KEY_MAX      (2 + NDB_TAG_NAME_MAX + NDB_TAG_VALUE_MAX + 8)
+
+// encode a tag index key prefix, which is everything but the created_at.
+//
+// single char tags:
+//
+//   u8   tag
+//   [u8] tag_val_bytes
+//
+// multi-char tags (extended tag index):
+//
+//   u8   0
+//   u8   tag_len
+//   [u8] tag_bytes
+//   [u8] tag_val_bytes
+//
+// Values longer than NDB_TAG_VALUE_MAX are stored as their first
+// NDB_TAG_VALUE_PREFIX bytes followed by the sha256 of the whole value.
+//
+static int ndb_push_tag_value(struct cursor *writer,
+			      const unsigned char *val, int val_len)
+{
+	struct sha256 hash;
+
+	if (val_len <= NDB_TAG_VALUE_MAX)
+		return cursor_push(writer, (unsigned char *)val, val_len);
+
+	sha256(&hash, val, val_len);
+	return cursor_push(writer, (unsigned char *)val, NDB_TAG_VALUE_PREFIX) &&
+	       cursor_push(writer, hash.u.u8, sizeof(hash.u.u8));
+}
+
+static int ndb_encode_tag_prefix(unsigned char *buf, int buf_size,
+				 const char *tag, int tag_len,
+				 const unsigned char *val, int val_len)
+{
+	struct cursor writer;
+	int ok;
+
+	if (tag_len < 1 || tag_len > NDB_TAG_NAME_MAX)
+		return 0;
+
+	make_cursor(buf, buf + buf_size, &writer);
+
+	if (tag_len == 1) {
+		ok = cursor_push_byte(&writer, tag[0]);
+	} else {
+		ok = cursor_push_byte(&writer, 0) &&
+		     cursor_push_byte(&writer, tag_len) &&
+		     cursor_push(&writer, (unsigned char *)tag, tag_len);
+	}
+
+	if (!ok || !ndb_push_tag_value(&writer, val, val_len))
+		return 0;
+
+	return writer.p - writer.start;
+}
+
+// encode a tag index key: the prefix above followed by a u64 created_at
+static int ndb_encode_tag_key(unsigned char *buf, int buf_size,
+			      const char *tag, int tag_len,
+			      const unsigned char *val, int val_len,
+			      uint64_t timestamp)
+{
+	int len;
+
+	if (!(len = ndb_encode_tag_prefix(buf, buf_size - sizeof(timestamp),
+					  tag, tag_len, val, val_len)))
+		return 0;
+
+	memcpy(buf + len, &timestamp, sizeof(timestamp));
+	return len + sizeof(timestamp);
+}
+
+// the tag index key prefix for the i-th value of a tag filter field
+static int ndb_tag_elements_prefix(struct ndb_filter *filter,
+				   struct ndb_filter_elements *els, int i,
+				   unsigned char *buf, int buf_size)
+{
+	unsigned char *val;
+	const char *tag;
+	int len, tag_len;
+
+	if (!(val = ndb_filter_get_id_element(filter, els, i)))
+		return 0;
+
+	len = els->field.elem_type == NDB_ELEMENT_ID
+	    ? 32 : strlen((const char *)val);
+
+	tag = ndb_filter_tag_name(filter, els, &tag_len);
+
+	return ndb_encode_tag_prefix(buf, buf_size, tag, tag_len, val, len);
+}
+
+// Are any of the values in this tag field too long to be stored whole in
+// the tag index? Those only match on their prefix and hash there.
+static int ndb_tag_elements_hashed(struct ndb_filter *filter,
+				   struct ndb_filter_elements *els)
+{
+	const char *val;
+	int i;
+
+	if (els->field.elem_type != NDB_ELEMENT_STRING)
+		return 0;
+
+	for (i = 0; i < els->count; i++) {
+		val = ndb_filter_get_string_element(filter, els, i);
+		if (val && strlen(val) > NDB_TAG_VALUE_MAX)
+			return 1;
+	}
+
+	return 0;
+}
+
+// Addressable note index
+//
+// One entry per (kind, pubkey, d tag) pointing at the latest version of a
+// replaceable or addressable note:
+//
+//   u64  kind
+//   [32] pubkey
+//   [u8] d tag value (addressable kinds only)
+//
+// The d value is stored like a tag index value, so overlong identifiers
+// are truncated and hashed.
+//
+#define NDB_ADDR_KEY_MAX (8 + 32 + NDB_TAG_VALUE_MAX)
+
+static inline int is_addressable_kind(uint64_t kind)
+{
+	return 30000 <= kind && kind < 40000;
+}
+
+static int ndb_encode_addr_key(unsigned char *buf, int buf_size,
+			       uint64_t kind, const unsigned char *pubkey,
+			       const char *d, int d_len)
+{
+	struct cursor writer;
+
+	make_cursor(buf, buf + buf_size, &writer);
+
+	if (!cursor_push(&writer, (unsigned char *)&kind, sizeof(kind)) ||
+	    !cursor_push(&writer, (unsigned char *)pubkey, 32))
+		return 0;
+
+	// the d tag only means something for addressable kinds
+	if (is_addressable_kind(kind) &&
+	    !ndb_push_tag_value(&writer, (const unsigned char *)d, d_len))
+		return 0;
+
+	return writer.p - writer.start;
+}
+
+static int ndb_naddr_key(unsigned char *buf, int buf_size,
+			 const struct bech32_naddr *naddr)
+{
+	if (!is_replaceable_kind(naddr->kind))
+		return 0;
+
+	return ndb_encode_addr_key(buf, buf_size, naddr->kind, naddr->pubkey,
+				   naddr->identifier.str,
+				   naddr->identifier.len);
+}
+
+// the value of the first d tag. d tags that look like ids are packed in
+// the note, so we give those back in their hex form.
+static const char *ndb_note_d_tag(struct ndb_note *note, char *hexbuf,
+				  int *len)
+{
+	struct ndb_iterator iter;
+	struct ndb_str str;
+
+	ndb_tags_iterate_start(note, &iter);
+
+	while (ndb_tags_iterate_next(&iter)) {
+		if (iter.tag->count < 2)
+			continue;
+
+		str = ndb_tag_str(note, iter.tag, 0);
+		if (str.flag == NDB_PACKED_ID || strcmp(str.str, "d"))
+			continue;
+
+		str = ndb_tag_str(note, iter.tag, 1);
+		if (str.flag == NDB_PACKED_ID) {
+			hex_encode(str.id, 32, hexbuf);
+			*len = 64;
+			return hexbuf;
+		}
+
+		*len = strlen(str.str);
+		return str.str;
+	}
+
+	*len = 0;
+	return "";
+}
+
+static int ndb_write_note_addr_index(struct ndb_txn *txn,
+				     struct ndb_note *note, uint64_t note_key)
+{
+	unsigned char key_buffer[NDB_ADDR_KEY_MAX];
+	char hexbuf[65];
+	struct ndb_note *current;
+	const char *d;
+	uint64_t kind;
+	int len, d_len, rc;
+	MDB_val k, v;
+
+	kind = ndb_note_kind(note);
+	if (!is_replaceable_kind(kind))
+		return 1;
+
+	d = ndb_note_d_tag(note, hexbuf, &d_len);
+
+	if (!(len = ndb_encode_addr_key(key_buffer, sizeof(key_buffer), kind,
+					ndb_note_pubkey(note), d, d_len)))
+		return 0;
+
+	k.mv_data = key_buffer;
+	k.mv_size = len;
+
+	// keep the newest version, ties go to the lowest id (NIP-01)
+	if (mdb_get(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_ADDR], &k, &v) == 0 &&
+	    (current = ndb_get_note_by_key(txn, *(uint64_t*)v.mv_data, NULL))) {
+		if (current->created_at > note->created_at)
+			return 1;
+
+		if (current->created_at == note->created_at &&
+		    memcmp(current->id, note->id, 32) < 0)
+			return 1;
+	}
+
+	v.mv_data = &note_key;
+	v.mv_size = sizeof(note_key);
+
+	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_ADDR], &k, &v, 0))) {
+		fprintf(stderr, "write note addr index failed: %s\n",
+			mdb_strerror(rc));
+		return 0;
+	}
+
+	return 1;
+}
+
+struct ndb_note *ndb_get_note_by_naddr(struct ndb_txn *txn,
+				       const struct bech32_naddr *naddr,
+				       size_t *len, uint64_t *key)
+{
+	unsigned char key_buffer[NDB_ADDR_KEY_MAX];
+	struct ndb_note *note;
+	uint64_t note_key;
+	MDB_val k, v;
+
+	if (!(k.mv_size = ndb_naddr_key(key_buffer, sizeof(key_buffer), naddr)))
+		return NULL;
+	k.mv_data = key_buffer;
+
+	if (mdb_get(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_ADDR], &k, &v))
+		return NULL;
+
+	note_key = *(uint64_t*)v.mv_data;
+	if (!(note = ndb_get_note_by_key(txn, note_key, len)))
+		return NULL;
+
+	if (key)
+		*key = note_key;
+
+	return note;
+}
+
+struct ndb_addr_lookup {
+	unsigned char key[NDB_ADDR_KEY_MAX];
+	int len;
+	int index;
+};
+
+static int ndb_addr_lookup_cmp(const void *a, const void *b)
+{
+	const struct ndb_addr_lookup *la = a, *lb = b;
+	int cmp;
+
+	if ((cmp = memcmp(la->key, lb->key, min(la->len, lb->len))))
+		return cmp;
+
+	return la->len - lb->len;
+}
+
+// Like ndb_get_notes_by_ids, but for naddrs. The encoded keys are sorted
+// so the addr index is walked with a single cursor.
+int ndb_get_notes_by_naddrs(struct ndb_txn *txn,
+			    const struct bech32_naddr *naddrs, int num_naddrs,
+			    struct ndb_lookup_result *results)
+{
+	struct ndb_addr_lookup *addrs;
+	struct ndb_batch_lookup *lookups;
+	MDB_cursor *cur;
+	MDB_val k, v;
+	uint64_t key;
+	int i, num_addrs, num_found, rc;
+
+	for (i = 0; i < num_naddrs; i++) {
+		results[i].data = NULL;
+		results[i].len = 0;
+		results[i].key = 0;
+	}
+
+	if (num_naddrs <= 0)
+		return 0;
+
+	if (!(addrs = malloc(sizeof(*addrs) * num_naddrs)))
+		return -1;
+
+	if (!(lookups = malloc(sizeof(*lookups) * num_naddrs))) {
+		free(addrs);
+		return -1;
+	}
+
+	num_addrs = 0;
+	for (i = 0; i < num_naddrs; i++) {
+		addrs[num_addrs].len = ndb_naddr_key(addrs[num_addrs].key,
+						     sizeof(addrs[num_addrs].key),
+						     &naddrs[i]);
+		if (addrs[num_addrs].len == 0)
+			continue;
+		addrs[num_addrs++].index = i;
+	}
+
+	qsort(addrs, num_addrs, sizeof(*addrs), ndb_addr_lookup_cmp);
+
+	if ((rc = mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_ADDR], &cur))) {
+		ndb_debug("ndb_get_notes_by_naddrs: cursor open failed: '%s'\n",
+			  mdb_strerror(rc));
+		free(lookups);
+		free(addrs);
+		return -1;
+	}
+
+	num_found = 0;
+	key = 0;
+	for (i = 0; i < num_addrs; i++) {
+		// duplicate naddrs resolve to the same key
+		if (i == 0 || ndb_addr_lookup_cmp(&addrs[i], &addrs[i-1])) {
+			k.mv_data = addrs[i].key;
+			k.mv_size = addrs[i].len;
+
+			if (mdb_cursor_get(cur, &k, &v, MDB_SET_KEY))
+				key = 0;
+			else
+				key = *(uint64_t*)v.mv_data;
+		}
+
+		if (!key)
+			continue;
+
+		lookups[num_found].id = NULL;
+		lookups[num_found].key = key;
+		lookups[num_found++].index = addrs[i].index;
+	}
+
+	mdb_cursor_close(cur);
+	free(addrs);
+
+	num_found = ndb_batch_fetch(txn, NDB_DB_NOTE, lookups, num_found, results);
+	free(lookups);
+
+	return num_found;
+}
+
+static int ndb_query_plan_execute_authors(struct ndb_txn *txn,
+					  struct ndb_filter *filter,
+					  struct ndb_query_collector *results,
+					  int limit,
+					  struct ndb_query_filter_profile *profile)
+{
+	MDB_val k, v;
+	MDB_cursor *cur;
+	int rc, i, need_relays = 0;
+	uint64_t *pint, until, since, note_key;
+	unsigned char *author;
+	struct ndb_note *note;
+	size_t note_size;
+	struct ndb_filter_elements *authors;
+	struct ndb_query_result res;
+	struct ndb_tsid tsid, *ptsid;
+	struct ndb_note_relay_iterator note_relay_iter;
+	enum ndb_dbs db;
+
+	db = txn->lmdb->dbs[NDB_DB_NOTE_PUBKEY];
+
+	if (!(authors = ndb_filter_find_elements(filter, NDB_FILTER_AUTHORS)))
+		return 0;
+
+	until = UINT64_MAX;
+	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
+		until = *pint;
+
+	since = 0;
+	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_SINCE)))
+		since = *pint;
+
+	if (ndb_filter_find_elements(filter, NDB_FILTER_RELAYS))
+		need_relays = 1;
+
+	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur)))
+		return 0;
+
+	for (i = 0; i < authors->count; i++) {
+		author = ndb_filter_get_id_element(filter, authors, i);
+
+		ndb_tsid_init(&tsid, author, until);
+
+		k.mv_data = &tsid;
+		k.mv_size = sizeof(tsid);
+
+		ndb_profile_inc(profile, seeks);
+		if (!ndb_cursor_start(cur, &k, &v))
+			continue;
+
+		// for each id in our ids filter, find in the db
+		while (!query_is_full(results, limit)) {
+			ndb_profile_inc(profile, rows_scanned);
+
+			ptsid = (struct ndb_tsid *)k.mv_data;
+			note_key = *(uint64_t*)v.mv_data;
+
+			// don't continue the scan if we're below `since`
+			if (ptsid->timestamp < since)
+				break;
+
+			// our author should match, if not bail
+			if (memcmp(author, ptsid->id, 32))
+				break;
+
+			// fetch the note, we need it for our query results
+			// and to match further against the filter
+			if (!(note = ndb_get_note_by_key(txn, note_key, &note_size)))
+				goto next;
+			ndb_profile_inc(profile, notes_fetched);
+
+			if (need_relays)
+				ndb_note_relay_iterate_start(txn, &note_relay_iter, note_key);
+
+			if (!ndb_filter_matches_with(filter, note,
+						     1 << NDB_FILTER_AUTHORS,
+						     need_relays ? &note_relay_iter : NULL))
+			{
+				ndb_profile_inc(profile, rows_rejected);
+				goto next;
+			}
+
+			ndb_query_result_init(&res, note, note_size, note_key);
+			if (!push_query_result(results, &res))
+				break;
+
+next:
+			if (mdb_cursor_get(cur, &k, &v, MDB_PREV))
+				break;
+		}
+	}
+
+	mdb_cursor_close(cur);
+	return 1;
+}
+
+static int ndb_query_plan_execute_created_at(struct ndb_txn *txn,
+					     struct ndb_filter *filter,
+					     struct ndb_query_collector *results,
+					     int limit,
+					     struct ndb_query_filter_profile *profile)
+{
+	MDB_dbi db;
+	MDB_val k, v;
+	MDB_cursor *cur;
+	int rc, need_relays = 0;
+	struct ndb_note *note;
+	struct ndb_tsid key, *pkey;
+	uint64_t *pint, until, since, note_id;
+	size_t note_size;
+	struct ndb_query_result res;
+	struct ndb_note_relay_iterator note_relay_iter;
+	unsigned char high_key[32];
+
+	db = txn->lmdb->dbs[NDB_DB_NOTE_ID];
+	memset(high_key, 0xFF, sizeof(high_key));
+
+	until = UINT64_MAX;
+	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
+		until = *pint;
+
+	since = 0;
+	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_SINCE)))
+		since = *pint;
+
+	if (ndb_filter_find_elements(filter, NDB_FILTER_RELAYS))
+		need_relays = 1;
+
+	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur)))
+		return 0;
+
+	// if we have until, start there, otherwise just use max
+	ndb_tsid_init(&key, high_key, until);
+	k.mv_data = &key;
+	k.mv_size = sizeof(key);
+
+	ndb_profile_inc(profile, seeks);
+	if (!ndb_cursor_start(cur, &k, &v))
+		return 1;
+
+	while (!query_is_full(results, limit)) {
+		ndb_profile_inc(profile, rows_scanned);
+
+		pkey = (struct ndb_tsid *)k.mv_data;
+		note_id = *(uint64_t*)v.mv_data;
+		assert(v.mv_size == 8);
+
+		// the id index is ordered by id first, so notes outside of
+		// the time range are spread all over it
+		if (pkey->timestamp < since || pkey->timestamp > until)
+			goto next;
+
+		if (!(note = ndb_get_note_by_key(txn, note_id, &note_size)))
+			goto next;
+		ndb_profile_inc(profile, notes_fetched);
+
+		if (need_relays)
+			ndb_note_relay_iterate_start(txn, &note_relay_iter, note_id);
+
+		// does this entry match our filter?
+		if (!ndb_filter_matches_with(filter, note, 0, need_relays ? &note_relay_iter : NULL)) {
+			ndb_profile_inc(profile, rows_rejected);
+			goto next;
+		}
+
+		ndb_query_result_init(&res, note, (uint64_t)note_size, note_id);
+		if (!push_query_result(results, &res))
+			break;
+next:
+		if (mdb_cursor_get(cur, &k, &v, MDB_PREV))
+			break;
+	}
+
+	mdb_cursor_close(cur);
+	return 1;
+}
+
+static int ndb_query_plan_execute_tags(struct ndb_txn *txn,
+				       struct ndb_filter *filter,
+				       struct ndb_query_collector *results,
+				       int limit,
+				       struct ndb_query_filter_profile *profile)
+{
+	MDB_cursor *cur;
+	MDB_dbi db;
+	MDB_val k, v;
+	int len, rc, i, matched, need_relays = 0;
+	uint64_t *pint, until, note_id, created_at;
+	size_t note_size;
+	unsigned char key_buffer[NDB_TAG_KEY_MAX];
+	struct ndb_note *note;
+	struct ndb_filter_elements *tags;
+	struct ndb_query_result res;
+	struct ndb_note_relay_iterator note_relay_iter;
+
+	db = txn->lmdb->dbs[NDB_DB_NOTE_TAGS];
+
+	if (!(tags = ndb_filter_find_elements(filter, NDB_FILTER_TAGS)))
+		return 0;
+
+	if (ndb_filter_find_elements(filter, NDB_FILTER_RELAYS))
+		need_relays = 1;
+
+	// the index already proved the tag, including #t hashtags that are
+	// only in the content. Overlong values still need an exact compare
+	// since the index only has their prefix and hash.
+	matched = 1 << NDB_FILTER_TAGS;
+	if (ndb_tag_elements_hashed(filter, tags))
+		matched = 0;
+
+	until = UINT64_MAX;
+	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
+		until = *pint;
+
+	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur)))
+		return 0;
+
+	for (i = 0; i < tags->count; i++) {
+		if (!(len = ndb_tag_elements_prefix(filter, tags, i, key_buffer,
+						    sizeof(key_buffer) - 8))) {
+			goto fail;
+		}
+
+		memcpy(key_buffer + len, &until, sizeof(until));
+		k.mv_data = key_buffer;
+		k.mv_size = len + sizeof(until);
+
+		ndb_profile_inc(profile, seeks);
+		if (!ndb_cursor_start(cur, &k, &v))
+			continue;
+
+		// for each id in our ids filter, find in the db
+		while (!query_is_full(results, limit)) {
+			ndb_profile_inc(profile, rows_scanned);
+
+			// check if tag and value match, bail if not
+			if (k.mv_size != (size_t)len + 8 ||
+			    memcmp(k.mv_data, key_buffer, len))
+				break;
+
+			memcpy(&created_at, (unsigned char *)k.mv_data + len,
+			       sizeof(created_at));
+			if (query_heap_is_done(results, created_at))
+				break;
+
+			note_id = *(uint64_t*)v.mv_data;
+
+			if (!(note = ndb_get_note_by_key(txn, note_id, &note_size)))
+				goto next;
+			ndb_profile_inc(profile, notes_fetched);
+
+			if (need_relays)
+				ndb_note_relay_iterate_start(txn, &note_relay_iter, note_id);
+
+			if (!ndb_filter_matches_with(filter, note, matched,
+						     need_relays ? &note_relay_iter : NULL)) {
+				ndb_profile_inc(profile, rows_rejected);
+				goto next;
+			}
+
+			ndb_query_result_init(&res, note, note_size, note_id);
+			if (!push_query_result(results, &res))
+				break;
+
+next:
+			if (mdb_cursor_get(cur, &k, &v, MDB_PREV))
+				break;
+		}
+	}
+
+	mdb_cursor_close(cur);
+	return 1;
+fail:
+	mdb_cursor_close(cur);
+	return 0;
+}
+
+static int ndb_query_plan_execute_author_kinds(
+		struct ndb_txn *txn,
+		struct ndb_filter *filter,
+		struct ndb_query_collector *results,
+		int limit,
+		struct ndb_query_filter_profile *profile)
+{
+	MDB_cursor *cur;
+	MDB_dbi db;
+	MDB_val k, v;
+	struct ndb_note *note;
+	struct ndb_filter_elements *kinds, *relays, *authors;
+	struct ndb_query_result res;
+	uint64_t kind, note_id, until, since, *pint;
+	size_t note_size;
+	unsigned char *author;
+	int i, j, rc;
+	struct ndb_id_u64_ts key, *pkey;
+	struct ndb_note_relay_iterator note_relay_iter;
+
+	// we should have kinds in a kinds filter!
+	if (!(kinds = ndb_filter_find_elements(filter, NDB_FILTER_KINDS)))
+		return 0;
+	//
+	// we should have kinds in a kinds filter!
+	if (!(authors = ndb_filter_find_elements(filter, NDB_FILTER_AUTHORS)))
+		return 0;
+
+	relays = ndb_filter_find_elements(filter, NDB_FILTER_RELAYS);
+
+	until = UINT64_MAX;
+	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
+		until = *pint;
+
+	since = 0;
+	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_SINCE)))
+		since = *pint;
+
+	db = txn->lmdb->dbs[NDB_DB_NOTE_PUBKEY_KIND];
+
+	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur)))
+		return 0;
+
+	for (j = 0; j < authors->count; j++) {
+		if (query_is_full(results, limit))
+			break;
+
+		if (!(author = ndb_filter_get_id_element(filter, authors, j)))
+			continue;
+
+	for (i = 0; i < kinds->count; i++) {
+		if (query_is_full(results, limit))
+			break;
+
+		kind = kinds->elements[i];
+
+		ndb_debug("finding kind %"PRIu64"\n", kind);
+
+		ndb_id_u64_ts_init(&key, author, kind, until);
+		
+		k.mv_data = &key;
+		k.mv_size = sizeof(key);
+
+		ndb_profile_inc(profile, seeks);
+		if (!ndb_cursor_start(cur, &k, &v))
+			continue;
+
+		// scan the kind subindex
+		while (!query_is_full(results, limit)) {
+			ndb_profile_inc(profile, rows_scanned);
+
+			pkey = (struct ndb_id_u64_ts*)k.mv_data;
+
+			ndb_debug("scanning subindex kind:%"PRIu64" created_at:%"PRIu64" pubkey:",
+					pkey->u64,
+					pkey->timestamp);
+
+			if (pkey->u64 != kind)
+				break;
+
+			// don't continue the scan if we're below `since`
+			if (pkey->timestamp < since)
+				break;
+
+			if (memcmp(pkey->id, author, 32))
+				break;
+
+			note_id = *(uint64_t*)v.mv_data;
+			if (!(note = ndb_get_note_by_key(txn, note_id, &note_size)))
+				goto next;
+			ndb_profile_inc(profile, notes_fetched);
+
+			if (relays)
+				ndb_note_relay_iterate_start(txn, &note_relay_iter, note_id);
+
+			if (!ndb_filter_matches_with(filter, note,
+						     (1 << NDB_FILTER_KINDS) | (1 << NDB_FILTER_AUTHORS),
+						     relays? &note_relay_iter : NULL)) {
+				ndb_profile_inc(profile, rows_rejected);
+				goto next;
+			}
+
+			ndb_query_result_init(&res, note, note_size, note_id);
+			if (!push_query_result(results, &res))
+				break;
+
+next:
+			if (mdb_cursor_get(cur, &k, &v, MDB_PREV))
+				break;
+		}
+	}
+	}
+
+	mdb_cursor_close(cur);
+	return 1;
+}
+
+static int ndb_query_plan_execute_profile_search(
+		struct ndb_txn *txn,
+		struct ndb_filter *filter,
+		struct ndb_query_collector *results,
+		int limit,
+		struct ndb_query_filter_profile *profile)
+{
+	const char *search;
+	int i;
+
+	// The filter pubkey is updated inplace for each note search
+	unsigned char *filter_pubkey;
+	unsigned char pubkey[32] = {0};
+	struct ndb_filter_elements *els;
+	struct ndb_search profile_search;
+	struct ndb_filter note_filter, *f = &note_filter;
+
+	if (!(search = ndb_filter_find_search(filter)))
+		return 0;
+
+	if (!ndb_filter_init_with(f, 1))
+		return 0;
+
+	ndb_filter_start_field(f, NDB_FILTER_KINDS);
+	ndb_filter_add_int_element(f, 0);
+	ndb_filter_end_field(f);
+
+	ndb_filter_start_field(f, NDB_FILTER_AUTHORS);
+	ndb_filter_add_id_element(f, pubkey);
+	ndb_filter_end_field(f);
+	ndb_filter_end(f);
+
+	// get the authors element after we finalize the filter, since
+	// the data could have moved
+	if (!(els = ndb_filter_find_elements(f, NDB_FILTER_AUTHORS)))
+		goto fail;
+
+	// grab pointer to pubkey in the filter so that we can
+	// update the filter as we go
+	if (!(filter_pubkey = ndb_filter_get_id_element(f, els, 0)))
+		goto fail;
+
+	for (i = 0; !query_is_full(results, limit); i++) {
+		if (i == 0) {
+			if (!ndb_search_profile(txn, &profile_search, search))
+				break;
+		} else {
+			if (!ndb_search_profile_next(&profile_search))
+				break;
+		}
 
-	if (!cursor_push(&cur, (unsigned char *)&key->note_key, 8))   return 0;
-	if (!cursor_push(&cur, (unsigned char *)&key->kind, 8))       return 0;
-	if (!cursor_push(&cur, (unsigned char *)&key->created_at, 8)) return 0;
-	if (!cursor_push_byte(&cur, key->relay_len)) return 0;
-	if (!cursor_push(&cur, (unsigned char *)key->relay, key->relay_len)) return 0;
-	if (!cursor_push_byte(&cur, 0)) return 0;
-	if (!cursor_align(&cur, 8)) return 0;
+		// Copy pubkey into filter
+		memcpy(filter_pubkey, profile_search.key->id, 32);
 
-	assert(((cur.p-cur.start)%8) == 0);
+		// Look up the corresponding note associated with that pubkey
+		if (!ndb_query_plan_execute_author_kinds(txn, f, results, limit, profile))
+			goto fail;
+	}
 
-	return cur.p - cur.start;
+	ndb_search_profile_end(&profile_search);
+	ndb_filter_destroy(f);
+	return 1;
+
+fail:
+	ndb_filter_destroy(f);
+	return 0;
 }
 
-static int ndb_write_note_relay_kind_index(
+static int ndb_query_plan_execute_relay_kinds(
 		struct ndb_txn *txn,
-		struct ndb_relay_kind_key *key)
+		struct ndb_filter *filter,
+		struct ndb_query_collector *results,
+		int limit,
+		struct ndb_query_filter_profile *profile)
 {
-	// The relay kind key has a layout like so 
-	//
-	// - note_key:       00 + 8 bytes
-	// - kind:           08 + 8 bytes
-	// - created_at:     16 + 8 bytes
-	// - relay_url_size: 24 + 1 byte
-	// - relay_url:      25 + n byte null-terminated string
-	// - pad to 8 byte alignment
-
-	unsigned char buf[256];
-	int rc, len;
+	MDB_cursor *cur;
+	MDB_dbi db;
 	MDB_val k, v;
+	struct ndb_note *note;
+	struct ndb_filter_elements *kinds, *relays;
+	struct ndb_query_result res;
+	uint64_t kind, note_id, until, since, *pint;
+	size_t note_size;
+	const char *relay;
+	int i, j, rc, len;
+	struct ndb_relay_kind_key relay_key;
+	unsigned char keybuf[256];
 
-	// come on bro
-	if (key->relay_len > 248 || key->relay == NULL || key->relay_len == 0)
+	// we should have kinds in a kinds filter!
+	if (!(kinds = ndb_filter_find_elements(filter, NDB_FILTER_KINDS)))
 		return 0;
 
-	ndb_debug("writing note_relay_kind_index '%s' for notekey:%" PRIu64 "\n", key->relay, key->note_key);
-
-	if (!(len = ndb_build_relay_kind_key(buf, sizeof(buf), key)))
+	if (!(relays = ndb_filter_find_elements(filter, NDB_FILTER_RELAYS)))
 		return 0;
 
-	k.mv_data = buf;
-	k.mv_size = len;
+	until = UINT64_MAX;
+	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
+		until = *pint;
 
-	v.mv_data = NULL;
-	v.mv_size = 0;
+	since = 0;
+	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_SINCE)))
+		since = *pint;
 
-	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_RELAY_KIND], &k, &v, 0))) {
-		fprintf(stderr, "write note relay kind index failed: %s\n",
-			  mdb_strerror(rc));
+	db = txn->lmdb->dbs[NDB_DB_NOTE_RELAY_KIND];
+
+	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur)))
 		return 0;
-	}
 
-	return 1;
-}
+	for (j = 0; j < relays->count; j++) {
+		if (query_is_full(results, limit))
+			break;
 
-// writes the relay note kind index and the note_id -> relay db
-static int ndb_write_note_relay_indexes(struct ndb_txn *txn, struct ndb_relay_kind_key *key)
-{
-	ndb_write_note_relay_kind_index(txn, key);
-	ndb_write_note_relay(txn, key->note_key, key->relay, key->relay_len);
-	return 1;
-}
+		if (!(relay = ndb_filter_get_string_element(filter, relays, j)))
+			continue;
 
-static int ndb_write_note_pubkey_index(struct ndb_txn *txn, struct ndb_note *note,
-				       uint64_t note_key)
-{
-	int rc;
-	struct ndb_tsid key;
-	MDB_val k, v;
+	for (i = 0; i < kinds->count; i++) {
+		if (query_is_full(results, limit))
+			break;
 
-	ndb_tsid_init(&key, ndb_note_pubkey(note), ndb_note_created_at(note));
+		kind = kinds->elements[i];
+		ndb_debug("kind %" PRIu64 "\n", kind);
+		
+		if (!ndb_relay_kind_key_init_high(&relay_key, relay, kind, until)) {
+			ndb_debug("ndb_relay_kind_key_init_high failed in relay query\n");
+			continue;
+		}
 
-	k.mv_data = &key;
-	k.mv_size = sizeof(key);
+		if (!(len = ndb_build_relay_kind_key(keybuf, sizeof(keybuf), &relay_key))) {
+			ndb_debug("ndb_build_relay_kind_key failed in relay query\n");
+			ndb_debug_relay_kind_key(&relay_key);
+			continue;
+		}
 
-	v.mv_data = &note_key;
-	v.mv_size = sizeof(note_key);
+		k.mv_data = keybuf;
+		k.mv_size = len;
 
-	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_PUBKEY], &k, &v, 0))) {
-		fprintf(stderr, "write note pubkey index failed: %s\n",
-			  mdb_strerror(rc));
-		return 0;
+		ndb_debug("starting with key ");
+		ndb_debug_relay_kind_key(&relay_key);
+
+		ndb_profile_inc(profile, seeks);
+		if (!ndb_cursor_start(cur, &k, &v))
+			continue;
+
+		// scan the kind subindex
+		while (!query_is_full(results, limit)) {
+			ndb_profile_inc(profile, rows_scanned);
+
+			ndb_parse_relay_kind_key(&relay_key, k.mv_data);
+
+			ndb_debug("inside kind subindex ");
+			ndb_debug_relay_kind_key(&relay_key);
+
+			if (relay_key.kind != kind)
+				break;
+
+			if (strcmp(relay_key.relay, relay))
+				break;
+
+			// don't continue the scan if we're below `since`
+			if (relay_key.created_at < since)
+				break;
+
+			if (query_heap_is_done(results, relay_key.created_at))
+				break;
+
+			note_id = relay_key.note_key;
+			if (!(note = ndb_get_note_by_key(txn, note_id, &note_size)))
+				goto next;
+			ndb_profile_inc(profile, notes_fetched);
+
+			if (!ndb_filter_matches_with(filter, note,
+						     (1 << NDB_FILTER_KINDS) | (1 << NDB_FILTER_RELAYS),
+						     NULL)) {
+				ndb_profile_inc(profile, rows_rejected);
+				goto next;
+			}
+
+			ndb_query_result_init(&res, note, note_size, note_id);
+			if (!push_query_result(results, &res))
+				break;
+
+next:
+			if (mdb_cursor_get(cur, &k, &v, MDB_PREV))
+				break;
+		}
+	}
 	}
 
+	mdb_cursor_close(cur);
 	return 1;
 }
 
-static int ndb_write_note_pubkey_kind_index(struct ndb_txn *txn,
-					    struct ndb_note *note,
-					    uint64_t note_key)
+static int ndb_query_plan_execute_kinds(struct ndb_txn *txn,
+					struct ndb_filter *filter,
+					struct ndb_query_collector *results,
+					int limit,
+					struct ndb_query_filter_profile *profile)
 {
-	int rc;
-	struct ndb_id_u64_ts key;
+	MDB_cursor *cur;
+	MDB_dbi db;
 	MDB_val k, v;
+	struct ndb_note *note;
+	struct ndb_u64_ts tsid, *ptsid;
+	struct ndb_filter_elements *kinds;
+	struct ndb_query_result res;
+	uint64_t kind, note_id, until, since, *pint;
+	size_t note_size;
+	int i, rc, need_relays = 0;
+	struct ndb_note_relay_iterator note_relay_iter;
 
-	ndb_id_u64_ts_init(&key, ndb_note_pubkey(note), ndb_note_kind(note),
-			   ndb_note_created_at(note));
+	// we should have kinds in a kinds filter!
+	if (!(kinds = ndb_filter_find_elements(filter, NDB_FILTER_KINDS)))
+		return 0;
 
-	k.mv_data = &key;
-	k.mv_size = sizeof(key);
+	if (ndb_filter_find_elements(filter, NDB_FILTER_RELAYS))
+		need_relays = 1;
 
-	v.mv_data = &note_key;
-	v.mv_size = sizeof(note_key);
+	until = UINT64_MAX;
+	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
+		until = *pint;
 
-	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_PUBKEY_KIND], &k, &v, 0))) {
-		fprintf(stderr, "write note pubkey_kind index failed: %s\n",
-			  mdb_strerror(rc));
+	since = 0;
+	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_SINCE)))
+		since = *pint;
+
+	db = txn->lmdb->dbs[NDB_DB_NOTE_KIND];
+
+	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur)))
 		return 0;
-	}
 
-	return 1;
-}
+	for (i = 0; i < kinds->count; i++) {
+		if (query_is_full(results, limit))
+			break;
 
+		kind = kinds->elements[i];
+		ndb_debug("kind %" PRIu64 "\n", kind);
+		ndb_u64_ts_init(&tsid, kind, until);
 
-static int ndb_rebuild_note_indices(struct ndb_txn *txn, enum ndb_dbs *indices, int num_indices)
-{
-	MDB_val k, v;
-	MDB_cursor *cur;
-	int i, drop_dbi, count, rc;
-	uint64_t note_key;
-	struct ndb_note *note;
-	enum ndb_dbs index;
+		k.mv_data = &tsid;
+		k.mv_size = sizeof(tsid);
+
+		ndb_profile_inc(profile, seeks);
+		if (!ndb_cursor_start(cur, &k, &v))
+			continue;
 
-	// 0 means empty, not delete the dbi
-	drop_dbi = 0;
+		// for each id in our ids filter, find in the db
+		while (!query_is_full(results, limit)) {
+			ndb_profile_inc(profile, rows_scanned);
 
-	// ensure they are all index dbs
-	for (i = 0; i < num_indices; i++) {
-		if (!ndb_db_is_index(indices[i])) {
-			fprintf(stderr, "ndb_rebuild_note_index: %s is not an index db\n", ndb_db_name(indices[i]));
-			return -1;
-		}
-	}
+			ptsid = (struct ndb_u64_ts *)k.mv_data;
+			if (ptsid->u64 != kind)
+				break;
 
-	// empty the index dbs before we rebuild
-	for (i = 0; i < num_indices; i++) {
-		index = indices[i];
-		if (mdb_drop(txn->mdb_txn, index, drop_dbi)) {
-			fprintf(stderr, "ndb_rebuild_pubkey_index: mdb_drop failed for %s\n", ndb_db_name(index));
-			return -1;
-		}
-	}
+			// don't continue the scan if we're below `since`
+			if (ptsid->timestamp < since)
+				break;
 
-	if ((rc = mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE], &cur))) {
-		fprintf(stderr, "ndb_migrate_user_search_indices: mdb_cursor_open failed, error %d\n", rc);
-		return -1;
-	}
+			note_id = *(uint64_t*)v.mv_data;
+			if (!(note = ndb_get_note_by_key(txn, note_id, &note_size)))
+				goto next;
+			ndb_profile_inc(profile, notes_fetched);
 
-	count = 0;
+			if (need_relays)
+				ndb_note_relay_iterate_start(txn, &note_relay_iter, note_id);
 
-	// loop through all notes and write search indices
-	while (mdb_cursor_get(cur, &k, &v, MDB_NEXT) == 0) {
-		note = v.mv_data;
-		note_key = *((uint64_t*)k.mv_data);
-
-		for (i = 0; i < num_indices; i++) {
-			index = indices[i];
-			switch (index) {
-			case NDB_DB_NOTE:
-			case NDB_DB_META:
-			case NDB_DB_PROFILE:
-			case NDB_DB_NOTE_ID:
-			case NDB_DB_NDB_META:
-			case NDB_DB_PROFILE_SEARCH:
-			case NDB_DB_PROFILE_LAST_FETCH:
-			case NDB_DB_NOTE_RELAYS:
-			case NDB_DBS:
-				// this should never happen since we check at
-				// the start
-				count = -1;
-				goto cleanup;
-			case NDB_DB_PROFILE_PK:
-			case NDB_DB_NOTE_KIND:
-			case NDB_DB_NOTE_TEXT:
-			case NDB_DB_NOTE_BLOCKS:
-			case NDB_DB_NOTE_TAGS:
-				fprintf(stderr, "%s index rebuild not supported yet. sorry.\n", ndb_db_name(index));
-				count = -1;
-				goto cleanup;
-			case NDB_DB_NOTE_PUBKEY:
-				if (!ndb_write_note_pubkey_index(txn, note, note_key)) {
-					count = -1;
-					goto cleanup;
-				}
+			if (!ndb_filter_matches_with(filter, note,
+						     1 << NDB_FILTER_KINDS,
+						     need_relays ? &note_relay_iter : NULL)) {
+				ndb_profile_inc(profile, rows_rejected);
+				goto next;
+			}
+
+			ndb_query_result_init(&res, note, note_size, note_id);
+			if (!push_query_result(results, &res))
 				break;
-			case NDB_DB_NOTE_RELAY_KIND:
-				fprintf(stderr, "it doesn't make sense to rebuild note relay kind index\n");
-				return 0;
-			case NDB_DB_NOTE_PUBKEY_KIND:
-				if (!ndb_write_note_pubkey_kind_index(txn, note, note_key)) {
-					count = -1;
-					goto cleanup;
-				}
+
+next:
+			if (mdb_cursor_get(cur, &k, &v, MDB_PREV))
 				break;
-			}
 		}
-
-		count++;
 	}
 
-cleanup:
 	mdb_cursor_close(cur);
-
-	return count;
+	return 1;
 }
 
-
-// Migrations
 //
+// Index cursors
+//
+// All of our clustered note indices (note_kind, note_pubkey,
+// note_pubkey_kind, note_tags) share the same shape: a key made of some
+// prefix (kind, pubkey, pubkey+kind, tag+value) followed by a u64
+// created_at, with the note key as the (duplicate) value. An index cursor
+// walks one such prefix from newest to oldest, yielding (created_at,
+// note_key) pairs in strictly descending order.
+//
+// Duplicates aren't necessarily stored in numeric order (note_tags doesn't
+// use MDB_INTEGERDUP), so we buffer the note keys for the current created_at
+// and sort them ourselves. These runs are almost always 1 element long.
+//
+struct ndb_index_cursor {
+	MDB_cursor *mc;
+	unsigned char prefix[NDB_TAG_KEY_MAX];
+	int prefix_len;
+	uint64_t since;
+	struct ndb_query_filter_profile *profile;
 
-// This was before we had note_profile_pubkey{,_kind} indices. Let's create them.
-static int ndb_migrate_profile_indices(struct ndb_txn *txn)
-{
-	int count;
-
-	enum ndb_dbs indices[] = {NDB_DB_NOTE_PUBKEY, NDB_DB_NOTE_PUBKEY_KIND};
-	if ((count = ndb_rebuild_note_indices(txn, indices, 2)) != -1) {
-		fprintf(stderr, "migrated %d notes to have pubkey and pubkey_kind indices\n", count);
-		return 1;
-	} else {
-		fprintf(stderr, "error migrating notes to have pubkey and pubkey_kind indices, aborting.\n");
-		return 0;
-	}
-}
-
-static int ndb_migrate_user_search_indices(struct ndb_txn *txn)
-{
-	int rc;
-	MDB_cursor *cur;
-	MDB_val k, v;
-	void *profile_root;
-	NdbProfileRecord_table_t record;
-	struct ndb_note *note;
-	uint64_t note_key, profile_key;
-	size_t len;
-	int count;
-
-	if ((rc = mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_PROFILE], &cur))) {
-		fprintf(stderr, "ndb_migrate_user_search_indices: mdb_cursor_open failed, error %d\n", rc);
-		return 0;
-	}
-
-	count = 0;
-
-	// loop through all profiles and write search indices
-	while (mdb_cursor_get(cur, &k, &v, MDB_NEXT) == 0) {
-		profile_root = v.mv_data;
-		profile_key = *((uint64_t*)k.mv_data);
-		record = NdbProfileRecord_as_root(profile_root);
-		note_key = NdbProfileRecord_note_key(record);
-		note = ndb_get_note_by_key(txn, note_key, &len);
+	// kind and kind+pubkey prefixes tell us the kind of every note we
+	// yield without having to look at it
+	uint32_t kind;
+	int has_kind;
 
-		if (note == NULL) {
-			continue;
-		}
+	// the current position
+	uint64_t created_at;
+	uint64_t *run;
+	int run_len, run_pos, run_cap;
+	uint64_t run_buf[8];
+	int eof;
+};
 
-		if (!ndb_write_profile_search_indices(txn, note, profile_key,
-						      profile_root)) {
-			fprintf(stderr, "ndb_migrate_user_search_indices: ndb_write_profile_search_indices failed\n");
-			continue;
-		}
+// A union of index cursors over the same index, eg: the kind index for
+// kinds:[1,6]. Yields the newest entry of all of its cursors, skipping
+// duplicate note keys.
+struct ndb_index_stream {
+	struct ndb_index_cursor cursors[MAX_SCAN_CURSORS];
+	int num_cursors;
 
-		count++;
-	}
+	// the current position
+	uint64_t created_at;
+	uint64_t note_key;
+	uint32_t kind;
+	int has_kind;
+	int eof;
+};
 
-	fprintf(stderr, "migrated %d profiles to include search indices\n", count);
+// Which index a stream walks, and the filter fields we build its cursor
+// prefixes from
+struct ndb_stream_plan {
+	enum ndb_dbs db;
+	struct ndb_filter_elements *ids;  // pubkeys or tag values
+	struct ndb_filter_elements *kinds;
+};
 
-	mdb_cursor_close(cur);
+static int compare_note_keys_desc(const void *pa, const void *pb)
+{
+	uint64_t a = *(uint64_t *)pa;
+	uint64_t b = *(uint64_t *)pb;
 
-	return 1;
+	if (a > b)
+		return -1;
+	else if (a < b)
+		return 1;
+	return 0;
 }
 
-static int ndb_migrate_lower_user_search_indices(struct ndb_txn *txn)
+static inline uint64_t ndb_index_cursor_note_key(struct ndb_index_cursor *ic)
 {
-	// just drop the search db so we can rebuild it
-	if (mdb_drop(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_PROFILE_SEARCH], 0)) {
-		fprintf(stderr, "ndb_migrate_lower_user_search_indices: mdb_drop failed\n");
-		return 0;
-	}
-
-	return ndb_migrate_user_search_indices(txn);
+	return ic->run[ic->run_pos];
 }
 
-int ndb_process_profile_note(struct ndb_note *note, struct ndb_profile_record_builder *profile);
-
-
-int ndb_db_version(struct ndb_txn *txn)
+static int ndb_index_cursor_run_push(struct ndb_index_cursor *ic,
+				     uint64_t note_key)
 {
-	uint64_t version, version_key;
-	MDB_val k, v;
-
-	version_key = NDB_META_KEY_VERSION;
-	k.mv_data = &version_key;
-	k.mv_size = sizeof(version_key);
+	uint64_t *run;
+	int cap;
 
-	if (mdb_get(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NDB_META], &k, &v)) {
-		version = -1;
-	} else {
-		if (v.mv_size != 8) {
-			fprintf(stderr, "run_migrations: invalid version size?");
+	if (ic->run_len == ic->run_cap) {
+		cap = ic->run_cap * 2;
+		if (ic->run == ic->run_buf) {
+			if (!(run = malloc(cap * sizeof(*run))))
+				return 0;
+			memcpy(run, ic->run_buf, sizeof(ic->run_buf));
+		} else if (!(run = realloc(ic->run, cap * sizeof(*run)))) {
 			return 0;
 		}
-		version = *((uint64_t*)v.mv_data);
+		ic->run = run;
+		ic->run_cap = cap;
 	}
 
-	return version;
+	ic->run[ic->run_len++] = note_key;
+	return 1;
 }
 
-// custom pubkey+kind+timestamp comparison function. This is used by lmdb to
-// perform b+ tree searches over the pubkey+kind+timestamp index
-static int ndb_id_u64_ts_compare(const MDB_val *a, const MDB_val *b)
+// Load the run of note keys at the cursor's current index key. Sets eof if
+// the key is outside of our prefix or below `since`.
+static int ndb_index_cursor_load(struct ndb_index_cursor *ic,
+				 MDB_val *k, MDB_val *v)
 {
-	struct ndb_id_u64_ts *tsa, *tsb;
-	MDB_val a2 = *a, b2 = *b;
+	size_t count, i;
 
-	a2.mv_size = sizeof(tsa->id);
-	b2.mv_size = sizeof(tsb->id);
+	ic->run_len = 0;
+	ic->run_pos = 0;
 
-	int cmp = mdb_cmp_memn(&a2, &b2);
-	if (cmp) return cmp;
+	if (k->mv_size != (size_t)ic->prefix_len + 8 ||
+	    memcmp(k->mv_data, ic->prefix, ic->prefix_len)) {
+		goto eof;
+	}
 
-	tsa = a->mv_data;
-	tsb = b->mv_data;
+	memcpy(&ic->created_at, (unsigned char *)k->mv_data + ic->prefix_len, 8);
+	if (ic->created_at < ic->since)
+		goto eof;
 
-	if (tsa->u64 < tsb->u64)
-		return -1;
-	else if (tsa->u64 > tsb->u64)
-		return 1;
+	ndb_profile_inc(ic->profile, rows_scanned);
 
-	if (tsa->timestamp < tsb->timestamp)
-		return -1;
-	else if (tsa->timestamp > tsb->timestamp)
+	if (mdb_cursor_count(ic->mc, &count) || count <= 1) {
+		if (!ndb_index_cursor_run_push(ic, *(uint64_t*)v->mv_data))
+			goto eof;
 		return 1;
+	}
 
-	return 0;
-}
-
-// custom kind+timestamp comparison function. This is used by lmdb to perform
-// b+ tree searches over the kind+timestamp index
-static int ndb_u64_ts_compare(const MDB_val *a, const MDB_val *b)
-{
-	struct ndb_u64_ts *tsa, *tsb;
-	tsa = a->mv_data;
-	tsb = b->mv_data;
+	if (mdb_cursor_get(ic->mc, k, v, MDB_FIRST_DUP))
+		goto eof;
 
-	if (tsa->u64 < tsb->u64)
-		return -1;
-	else if (tsa->u64 > tsb->u64)
-		return 1;
+	for (i = 0; i < count; i++) {
+		if (!ndb_index_cursor_run_push(ic, *(uint64_t*)v->mv_data))
+			goto eof;
+		if (i + 1 < count && mdb_cursor_get(ic->mc, k, v, MDB_NEXT_DUP))
+			break;
+	}
 
-	if (tsa->timestamp < tsb->timestamp)
-		return -1;
-	else if (tsa->timestamp > tsb->timestamp)
-		return 1;
+	qsort(ic->run, ic->run_len, sizeof(*ic->run), compare_note_keys_desc);
+	return 1;
 
+eof:
+	ic->eof = 1;
 	return 0;
 }
 
-static int ndb_tsid_compare(const MDB_val *a, const MDB_val *b)
+// position the cursor at the newest entry with created_at < `until`
+static int ndb_index_cursor_position(struct ndb_index_cursor *ic,
+				     uint64_t until)
 {
-	struct ndb_tsid *tsa, *tsb;
-	MDB_val a2 = *a, b2 = *b;
+	unsigned char key[sizeof(ic->prefix) + 8];
+	MDB_val k, v;
 
-	a2.mv_size = sizeof(tsa->id);
-	b2.mv_size = sizeof(tsb->id);
+	memcpy(key, ic->prefix, ic->prefix_len);
+	memcpy(key + ic->prefix_len, &until, 8);
 
-	int cmp = mdb_cmp_memn(&a2, &b2);
-	if (cmp) return cmp;
+	k.mv_data = key;
+	k.mv_size = ic->prefix_len + 8;
 
-	tsa = a->mv_data;
-	tsb = b->mv_data;
+	ndb_profile_inc(ic->profile, seeks);
+	if (!ndb_cursor_start(ic->mc, &k, &v)) {
+		ic->eof = 1;
+		return 0;
+	}
 
-	if (tsa->timestamp < tsb->timestamp)
-		return -1;
-	else if (tsa->timestamp > tsb->timestamp)
-		return 1;
-	return 0;
+	return ndb_index_cursor_load(ic, &k, &v);
 }
 
-enum ndb_ingester_msgtype {
-	NDB_INGEST_EVENT, // write json to the ingester queue for processing
-	NDB_INGEST_QUIT,  // kill ingester thread immediately
-};
+static int ndb_index_cursor_open(struct ndb_txn *txn,
+				 struct ndb_index_cursor *ic,
+				 enum ndb_dbs db,
+				 const unsigned char *prefix, int prefix_len,
+				 uint64_t since, uint64_t until,
+				 struct ndb_query_filter_profile *profile)
+{
+	ic->profile = profile;
+	ic->run = ic->run_buf;
+	ic->run_cap = sizeof(ic->run_buf) / sizeof(ic->run_buf[0]);
+	ic->run_len = 0;
+	ic->run_pos = 0;
+	ic->eof = 0;
+	ic->since = since;
+	ic->has_kind = 0;
+	ic->mc = NULL;
 
-struct ndb_ingester_event {
-	const char *relay;
-	char *json;
-	unsigned client : 1; // ["EVENT", {...}] messages
-	unsigned len : 31;
-};
+	if (prefix_len > (int)sizeof(ic->prefix))
+		return 0;
 
-struct ndb_writer_note_relay {
-	const char *relay;
-	uint64_t note_key;
-	uint64_t kind;
-	uint64_t created_at;
-};
+	memcpy(ic->prefix, prefix, prefix_len);
+	ic->prefix_len = prefix_len;
 
-struct ndb_writer_note {
-	struct ndb_note *note;
-	size_t note_len;
-	const char *relay;
-};
+	if (mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[db], &ic->mc))
+		return 0;
 
-static void ndb_writer_note_init(struct ndb_writer_note *writer_note, struct ndb_note *note, size_t note_len, const char *relay)
-{
-	writer_note->note = note;
-	writer_note->note_len = note_len;
-	writer_note->relay = relay;
+	ndb_index_cursor_position(ic, until);
+	return 1;
 }
 
-struct ndb_writer_profile {
-	struct ndb_writer_note note;
-	struct ndb_profile_record_builder record;
-};
+static void ndb_index_cursor_close(struct ndb_index_cursor *ic)
+{
+	if (ic->mc)
+		mdb_cursor_close(ic->mc);
+	if (ic->run != ic->run_buf)
+		free(ic->run);
+	ic->mc = NULL;
+	ic->run = ic->run_buf;
+}
 
-struct ndb_ingester_msg {
-	enum ndb_ingester_msgtype type;
-	union {
-		struct ndb_ingester_event event;
-	};
-};
+static void ndb_index_cursor_next(struct ndb_index_cursor *ic)
+{
+	MDB_val k, v;
 
-struct ndb_writer_ndb_meta {
-	// these are 64 bit because I'm paranoid of db-wide alignment issues
-	uint64_t version;
-};
+	if (ic->eof)
+		return;
 
-// Used in the writer thread when writing ndb_profile_fetch_record's
-//   kv = pubkey: recor
-struct ndb_writer_last_fetch {
-	unsigned char pubkey[32];
-	uint64_t fetched_at;
-};
+	if (++ic->run_pos < ic->run_len)
+		return;
 
-// write note blocks
-struct ndb_writer_blocks {
-	struct ndb_blocks *blocks;
-	uint64_t note_key;
-};
+	if (mdb_cursor_get(ic->mc, &k, &v, MDB_PREV_NODUP)) {
+		ic->eof = 1;
+		return;
+	}
 
-// The different types of messages that the writer thread can write to the
-// database
-struct ndb_writer_msg {
-	enum ndb_writer_msgtype type;
-	union {
-		struct ndb_writer_note_relay note_relay;
-		struct ndb_writer_note note;
-		struct ndb_writer_profile profile;
-		struct ndb_writer_ndb_meta ndb_meta;
-		struct ndb_writer_last_fetch last_fetch;
-		struct ndb_writer_blocks blocks;
-	};
-};
+	ndb_index_cursor_load(ic, &k, &v);
+}
 
-static inline int ndb_writer_queue_msg(struct ndb_writer *writer,
-				       struct ndb_writer_msg *msg)
+// Skip forward (towards older notes) until we are at or below
+// (created_at, note_key)
+static void ndb_index_cursor_seek(struct ndb_index_cursor *ic,
+				  uint64_t created_at, uint64_t note_key)
 {
-	return prot_queue_push(&writer->inbox, msg);
+	if (ic->eof)
+		return;
+
+	if (ic->created_at > created_at) {
+		if (created_at < ic->since) {
+			ic->eof = 1;
+			return;
+		}
+		// jump instead of walking, this is where we win on sparse
+		// intersections
+		if (!ndb_index_cursor_position(ic, created_at + 1))
+			return;
+	}
+
+	while (!ic->eof && ic->created_at == created_at &&
+	       ndb_index_cursor_note_key(ic) > note_key) {
+		ndb_index_cursor_next(ic);
+	}
 }
 
-static uint64_t ndb_write_note_and_profile(struct ndb_txn *txn, struct ndb_writer_profile *profile, unsigned char *scratch, size_t scratch_size, uint32_t ndb_flags);
-static int ndb_migrate_utf8_profile_names(struct ndb_txn *txn)
+// Count the rest of the cursor's entries without loading any dup runs.
+// This leaves the cursor at eof.
+static uint64_t ndb_index_cursor_count(struct ndb_index_cursor *ic)
 {
-	int rc;
-	MDB_cursor *cur;
+	uint64_t created_at, total;
+	size_t count;
 	MDB_val k, v;
-	void *profile_root;
-	NdbProfileRecord_table_t record;
-	struct ndb_note *note, *copied_note;
-	uint64_t note_key;
-	size_t len;
-	int count, failed, ret;
-	struct ndb_writer_profile profile;
 
-	if ((rc = mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_PROFILE], &cur))) {
-		fprintf(stderr, "ndb_migrate_utf8_profile_names: mdb_cursor_open failed, error %d\n", rc);
+	if (ic->eof)
 		return 0;
-	}
 
-	size_t scratch_size = 8 * 1024 * 1024;
-	unsigned char *scratch = malloc(scratch_size);
+	// the run we are sitting on is already loaded
+	total = ic->run_len - ic->run_pos;
 
-	ret = 1;
-	count = 0;
-	failed = 0;
+	while (!mdb_cursor_get(ic->mc, &k, &v, MDB_PREV_NODUP)) {
+		if (k.mv_size != (size_t)ic->prefix_len + 8 ||
+		    memcmp(k.mv_data, ic->prefix, ic->prefix_len))
+			break;
 
-	// loop through all profiles and write search indices
-	while (mdb_cursor_get(cur, &k, &v, MDB_NEXT) == 0) {
-		profile_root = v.mv_data;
-		record = NdbProfileRecord_as_root(profile_root);
-		note_key = NdbProfileRecord_note_key(record);
-		note = ndb_get_note_by_key(txn, note_key, &len);
+		memcpy(&created_at, (unsigned char *)k.mv_data + ic->prefix_len, 8);
+		if (created_at < ic->since)
+			break;
 
-		if (note == NULL) {
-			failed++;
-			continue;
-		}
+		ndb_profile_inc(ic->profile, rows_scanned);
+		if (mdb_cursor_count(ic->mc, &count))
+			break;
 
-		struct ndb_profile_record_builder *b = &profile.record;
+		total += count;
+	}
 
-		// reprocess profile
-		if (!ndb_process_profile_note(note, b)) {
-			failed++;
+	ic->eof = 1;
+	return total;
+}
+
+static void ndb_index_stream_update(struct ndb_index_stream *stream)
+{
+	struct ndb_index_cursor *ic;
+	uint64_t note_key;
+	int i;
+
+	stream->eof = 1;
+
+	for (i = 0; i < stream->num_cursors; i++) {
+		ic = &stream->cursors[i];
+		if (ic->eof)
 			continue;
+
+		note_key = ndb_index_cursor_note_key(ic);
+		if (stream->eof || ndb_ts_key_cmp(ic->created_at, note_key,
+						  stream->created_at,
+						  stream->note_key) < 0) {
+			stream->created_at = ic->created_at;
+			stream->note_key = note_key;
+			stream->kind = ic->kind;
+			stream->has_kind = ic->has_kind;
+			stream->eof = 0;
 		}
+	}
+}
 
-		// the writer needs to own this note, and its expected to free it
-		copied_note = malloc(len);
-		memcpy(copied_note, note, len);
+static void ndb_index_stream_next(struct ndb_index_stream *stream)
+{
+	struct ndb_index_cursor *ic;
+	int i;
 
-		ndb_writer_note_init(&profile.note, copied_note, len, NULL);
+	if (stream->eof)
+		return;
 
-		// we don't pass in flags when migrating... a bit sketchy but
-		// whatever. noone is using this to customize nostrdb atm
-		if (ndb_write_note_and_profile(txn, &profile, scratch, scratch_size, 0)) {
-			count++;
+	// advance every cursor sitting on the current entry so that we don't
+	// yield the same note twice (eg: a note with two matching tags)
+	for (i = 0; i < stream->num_cursors; i++) {
+		ic = &stream->cursors[i];
+		if (ic->eof)
+			continue;
+
+		if (ic->created_at == stream->created_at &&
+		    ndb_index_cursor_note_key(ic) == stream->note_key) {
+			ndb_index_cursor_next(ic);
 		}
 	}
 
-	fprintf(stderr, "migrated %d profiles to fix utf8 profile names\n", count);
+	ndb_index_stream_update(stream);
+}
 
-	if (failed != 0) {
-		fprintf(stderr, "failed to migrate %d profiles to fix utf8 profile names\n", failed);
-	}
+static void ndb_index_stream_seek(struct ndb_index_stream *stream,
+				  uint64_t created_at, uint64_t note_key)
+{
+	int i;
 
-	free(scratch);
-	mdb_cursor_close(cur);
+	if (stream->eof)
+		return;
 
-	return ret;
+	for (i = 0; i < stream->num_cursors; i++)
+		ndb_index_cursor_seek(&stream->cursors[i], created_at, note_key);
+
+	ndb_index_stream_update(stream);
 }
 
-static struct ndb_migration MIGRATIONS[] = {
-	{ .fn = ndb_migrate_user_search_indices },
-	{ .fn = ndb_migrate_lower_user_search_indices },
-	{ .fn = ndb_migrate_utf8_profile_names },
-	{ .fn = ndb_migrate_profile_indices },
-};
+static void ndb_index_stream_close(struct ndb_index_stream *stream)
+{
+	int i;
 
+	for (i = 0; i < stream->num_cursors; i++)
+		ndb_index_cursor_close(&stream->cursors[i]);
 
-int ndb_end_query(struct ndb_txn *txn)
-{
-#ifdef DEBUG
-	ndb_debug_unregister_query_txn(txn);
-#endif
-	// this works on read or write queries.
-	return mdb_txn_commit(txn->mdb_txn) == 0;
+	stream->num_cursors = 0;
 }
 
-int ndb_note_verify(void *ctx, unsigned char *scratch, size_t scratch_size,
-		    struct ndb_note *note)
+static int ndb_index_stream_open(struct ndb_txn *txn,
+				 struct ndb_index_stream *stream,
+				 struct ndb_filter *filter,
+				 struct ndb_stream_plan *plan,
+				 uint64_t since, uint64_t until,
+				 struct ndb_query_filter_profile *profile)
 {
-	unsigned char id[32];
-	secp256k1_xonly_pubkey xonly_pubkey;
-	int ok;
+	struct ndb_index_cursor *ic;
+	unsigned char prefix[NDB_TAG_KEY_MAX], *val;
+	uint64_t kind;
+	int i, j, len, nids, nkinds, ok;
 
-	// first, we ensure the id is valid by calculating the id independently
-	// from what is given to us
-	if (!ndb_calculate_id(note, scratch, scratch_size, id)) {
-		ndb_debug("ndb_note_verify: scratch buffer size too small");
-		return 0;
-	}
+	stream->num_cursors = 0;
+	stream->eof = 1;
 
-	if (memcmp(id, note->id, 32)) {
-		ndb_debug("ndb_note_verify: note id does not match!");
-		return 0;
-	}
+	nids = plan->ids ? plan->ids->count : 1;
+	nkinds = plan->kinds ? plan->kinds->count : 1;
 
-        // id is ok, let's check signature
+	for (i = 0; i < nids; i++) {
+	for (j = 0; j < nkinds; j++) {
+		kind = plan->kinds ? plan->kinds->elements[j] : 0;
 
-	ok = secp256k1_xonly_pubkey_parse((secp256k1_context*)ctx,
-					  &xonly_pubkey,
-					  ndb_note_pubkey(note)) != 0;
-	if (!ok) return 0;
+		switch (plan->db) {
+		case NDB_DB_NOTE_KIND:
+			memcpy(prefix, &kind, 8);
+			len = 8;
+			break;
+		case NDB_DB_NOTE_PUBKEY:
+		case NDB_DB_NOTE_PUBKEY_KIND:
+		case NDB_DB_NOTE_MENTION:
+			if (!(val = ndb_filter_get_id_element(filter, plan->ids, i)))
+				goto fail;
+			memcpy(prefix, val, 32);
+			len = 32;
+			if (plan->db != NDB_DB_NOTE_PUBKEY) {
+				memcpy(prefix + 32, &kind, 8);
+				len += 8;
+			}
+			break;
+		case NDB_DB_NOTE_TAGS:
+			if (!(len = ndb_tag_elements_prefix(filter, plan->ids, i,
+							    prefix, sizeof(prefix))))
+				goto fail;
+			break;
+		default:
+			goto fail;
+		}
 
-	ok = secp256k1_schnorrsig_verify((secp256k1_context*)ctx,
-					 ndb_note_sig(note), id, 32,
-					 &xonly_pubkey) > 0;
-	if (!ok) return 0;
+		ic = &stream->cursors[stream->num_cursors++];
+		ok = ndb_index_cursor_open(txn, ic, plan->db, prefix, len,
+					   since, until, profile);
+		if (!ok)
+			goto fail;
+
+		if (plan->kinds) {
+			ic->kind = kind;
+			ic->has_kind = 1;
+		}
+	}
+	}
 
+	ndb_index_stream_update(stream);
 	return 1;
+
+fail:
+	ndb_index_stream_close(stream);
+	return 0;
 }
 
-static void ndb_writer_last_profile_fetch(struct ndb_txn *txn,
-					  const unsigned char *pubkey,
-					  uint64_t fetched_at)
+static int ndb_tag_elements_indexable(struct ndb_filter *filter,
+				      struct ndb_filter_elements *els)
 {
-	int rc;
-	MDB_val key, val;
+	unsigned char prefix[NDB_TAG_KEY_MAX];
+	int i;
 
-	key.mv_data = (unsigned char*)pubkey;
-	key.mv_size = 32;
-	val.mv_data = &fetched_at;
-	val.mv_size = sizeof(fetched_at);
+	if (els->count == 0 || els->count > MAX_SCAN_CURSORS)
+		return 0;
 
-	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_PROFILE_LAST_FETCH],
-			  &key, &val, 0)))
-	{
-		ndb_debug("write version to ndb_meta failed: %s\n",
-				mdb_strerror(rc));
-		return;
+	if (els->field.elem_type != NDB_ELEMENT_ID &&
+	    els->field.elem_type != NDB_ELEMENT_STRING)
+		return 0;
+
+	for (i = 0; i < els->count; i++) {
+		if (!ndb_tag_elements_prefix(filter, els, i, prefix, sizeof(prefix)))
+			return 0;
 	}
 
-	//fprintf(stderr, "writing version %" PRIu64 "\n", version);
+	return 1;
 }
 
+// A #p field we can walk through the mention index. The index is split
+// by kind, so this needs kinds as well.
+static struct ndb_filter_elements *
+ndb_filter_mention_elements(struct ndb_filter *filter,
+			    struct ndb_filter_elements *kinds)
+{
+	struct ndb_filter_elements *els;
+	const char *tag;
+	int i, tag_len;
 
-// We just received a profile that we haven't processed yet, but it could
-// be an older one! Make sure we only write last fetched profile if it's a new
-// one
-//
-// To do this, we first check the latest profile in the database. If the
-// created_date for this profile note is newer, then we write a
-// last_profile_fetch record, otherwise we do not.
-//
-// WARNING: This function is only valid when called from the writer thread
-static int ndb_maybe_write_last_profile_fetch(struct ndb_txn *txn,
-					       struct ndb_note *note)
+	for (i = 0; i < filter->num_elements; i++) {
+		els = ndb_filter_get_elements(filter, i);
+		if (els->field.type != NDB_FILTER_TAGS ||
+		    els->field.elem_type != NDB_ELEMENT_ID)
+			continue;
+
+		tag = ndb_filter_tag_name(filter, els, &tag_len);
+		if (tag_len != 1 || tag[0] != 'p')
+			continue;
+
+		if (els->count > 0 &&
+		    els->count * kinds->count <= MAX_SCAN_CURSORS)
+			return els;
+	}
+
+	return NULL;
+}
+
+// Figure out which index streams we can intersect for this filter. Returns
+// the number of streams and the fields they cover, so that we don't need to
+// check those against the note again.
+static int ndb_filter_plan_streams(struct ndb_filter *filter,
+				   struct ndb_stream_plan *plans,
+				   int *matched)
 {
-	size_t len;
-	uint64_t profile_key, note_key;
-	void *root;
-	struct ndb_note *last_profile;
-	NdbProfileRecord_table_t record;
+	struct ndb_filter_elements *els, *kinds, *authors, *mentions;
+	int i, n = 0, tag_fields = 0, tag_streams = 0;
 
-	if ((root = ndb_get_profile_by_pubkey(txn, note->pubkey, &len, &profile_key))) {
-		record = NdbProfileRecord_as_root(root);
-		note_key = NdbProfileRecord_note_key(record);
-		last_profile = ndb_get_note_by_key(txn, note_key, &len);
-		if (last_profile == NULL) {
-			return 0;
+	*matched = (1 << NDB_FILTER_SINCE) | (1 << NDB_FILTER_UNTIL);
+
+	kinds = ndb_filter_find_elements(filter, NDB_FILTER_KINDS);
+	authors = ndb_filter_find_elements(filter, NDB_FILTER_AUTHORS);
+
+	if (kinds && (kinds->count == 0 || kinds->count > MAX_SCAN_CURSORS))
+		kinds = NULL;
+	if (authors && (authors->count == 0 || authors->count > MAX_SCAN_CURSORS))
+		authors = NULL;
+
+	// notifications: the mention index proves both the #p and the kinds
+	mentions = kinds ? ndb_filter_mention_elements(filter, kinds) : NULL;
+	if (mentions) {
+		plans[n++] = (struct ndb_stream_plan){
+			NDB_DB_NOTE_MENTION, mentions, kinds };
+		*matched |= 1 << NDB_FILTER_KINDS;
+	}
+
+	if (authors && kinds &&
+	    authors->count * kinds->count <= MAX_SCAN_CURSORS) {
+		plans[n++] = (struct ndb_stream_plan){
+			NDB_DB_NOTE_PUBKEY_KIND, authors, kinds };
+		*matched |= (1 << NDB_FILTER_AUTHORS) | (1 << NDB_FILTER_KINDS);
+	} else {
+		if (authors) {
+			plans[n++] = (struct ndb_stream_plan){
+				NDB_DB_NOTE_PUBKEY, authors, NULL };
+			*matched |= 1 << NDB_FILTER_AUTHORS;
+		}
+		if (kinds && !mentions) {
+			plans[n++] = (struct ndb_stream_plan){
+				NDB_DB_NOTE_KIND, NULL, kinds };
+			*matched |= 1 << NDB_FILTER_KINDS;
 		}
+	}
 
-		// found profile, let's see if it's newer than ours
-		if (note->created_at > last_profile->created_at) {
-			// this is a new profile note, record last fetched time
-			ndb_writer_last_profile_fetch(txn, note->pubkey, time(NULL));
+	for (i = 0; i < filter->num_elements; i++) {
+		els = ndb_filter_get_elements(filter, i);
+		if (els->field.type != NDB_FILTER_TAGS)
+			continue;
+
+		tag_fields++;
+
+		if (els == mentions) {
+			tag_streams++;
+			continue;
 		}
-	} else {
-		// couldn't fetch profile. record last fetched time
-		ndb_writer_last_profile_fetch(txn, note->pubkey, time(NULL));
+
+		if (n >= MAX_INTERSECT_STREAMS)
+			continue;
+
+		if (!ndb_tag_elements_indexable(filter, els))
+			continue;
+
+		plans[n++] = (struct ndb_stream_plan){
+			NDB_DB_NOTE_TAGS, els, NULL };
+		tag_streams++;
 	}
 
-	return 1;
+	// the tags bit covers every tag field, so we can only skip tag
+	// matching if every tag field is one of our streams
+	if (tag_fields && tag_fields == tag_streams)
+		*matched |= 1 << NDB_FILTER_TAGS;
+
+	return n;
 }
 
-int ndb_write_last_profile_fetch(struct ndb *ndb, const unsigned char *pubkey,
-				 uint64_t fetched_at)
+// Leapfrog the streams until they all agree on the same (created_at,
+// note_key). Returns 0 when any of the streams run out.
+static int ndb_index_streams_intersect(struct ndb_index_stream *streams,
+				       int num_streams)
 {
-	struct ndb_writer_msg msg;
-	msg.type = NDB_WRITER_PROFILE_LAST_FETCH;
-	memcpy(&msg.last_fetch.pubkey[0], pubkey, 32);
-	msg.last_fetch.fetched_at = fetched_at;
+	uint64_t created_at, note_key;
+	int i, agree;
 
-	return ndb_writer_queue_msg(&ndb->writer, &msg);
-}
+	if (streams[0].eof)
+		return 0;
 
+	created_at = streams[0].created_at;
+	note_key = streams[0].note_key;
 
-// When doing cursor scans from greatest to lowest, this function positions the
-// cursor at the first element before descending. MDB_SET_RANGE puts us right
-// after the first element, so we have to go back one.
-static int ndb_cursor_start(MDB_cursor *cur, MDB_val *k, MDB_val *v)
-{
-	int rc;
-	// Position cursor at the next key greater than or equal to the
-	// specified key
+	do {
+		agree = 1;
+		for (i = 0; i < num_streams; i++) {
+			ndb_index_stream_seek(&streams[i], created_at, note_key);
+			if (streams[i].eof)
+				return 0;
 
-	if ((rc = mdb_cursor_get(cur, k, v, MDB_SET_RANGE))) {
-		ndb_debug("MDB_SET_RANGE failed: '%s'\n", mdb_strerror(rc));
-		// Failed :(. It could be the last element?
-		if ((rc = mdb_cursor_get(cur, k, v, MDB_LAST))) {
-			ndb_debug("MDB_LAST failed: '%s'\n", mdb_strerror(rc));
-			return 0;
-		}
-	} else {
-		// if set range worked and our key exists, it should be
-		// the one right before this one
-		if ((rc = mdb_cursor_get(cur, k, v, MDB_PREV))) {
-			ndb_debug("moving back failed: '%s'\n", mdb_strerror(rc));
-			return 0;
+			if (streams[i].created_at != created_at ||
+			    streams[i].note_key != note_key) {
+				created_at = streams[i].created_at;
+				note_key = streams[i].note_key;
+				agree = 0;
+			}
 		}
-	}
+	} while (!agree);
 
 	return 1;
 }
 
-
-// get some value based on a clustered id key
-int ndb_get_tsid(struct ndb_txn *txn, enum ndb_dbs db, const unsigned char *id,
-		 MDB_val *val)
+// Query multi-constraint filters (eg: authors + kinds + #p) by walking each
+// index in created_at order at the same time, and only fetching note bodies
+// for note keys present in all of them
+static int ndb_query_plan_execute_intersect(struct ndb_txn *txn,
+					    struct ndb_filter *filter,
+					    struct ndb_query_collector *results,
+					    int limit,
+					    struct ndb_query_filter_profile *profile)
 {
-	MDB_val k, v;
-	MDB_cursor *cur;
-	int success = 0, rc;
-	struct ndb_tsid tsid;
+	struct ndb_index_stream streams[MAX_INTERSECT_STREAMS];
+	struct ndb_stream_plan plans[MAX_INTERSECT_STREAMS];
+	struct ndb_note_relay_iterator note_relay_iter;
+	struct ndb_query_result res;
+	struct ndb_note *note;
+	uint64_t since, until, note_key, *pint;
+	size_t note_size;
+	int i, num_streams, matched, need_relays, ok, ret = 0;
 
-	// position at the most recent
-	ndb_tsid_high(&tsid, id);
+	until = UINT64_MAX;
+	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
+		until = *pint;
 
-	k.mv_data = &tsid;
-	k.mv_size = sizeof(tsid);
+	since = 0;
+	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_SINCE)))
+		since = *pint;
 
-	if ((rc = mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[db], &cur))) {
-		ndb_debug("ndb_get_tsid: failed to open cursor: '%s'\n", mdb_strerror(rc));
+	need_relays = ndb_filter_find_elements(filter, NDB_FILTER_RELAYS) != NULL;
+
+	num_streams = ndb_filter_plan_streams(filter, plans, &matched);
+	if (num_streams == 0)
 		return 0;
+
+	for (i = 0; i < num_streams; i++) {
+		if (!ndb_index_stream_open(txn, &streams[i], filter, &plans[i],
+					   since, until, profile))
+			goto cleanup;
 	}
 
-	if (!ndb_cursor_start(cur, &k, &v))
-		goto cleanup;
+	while (!query_is_full(results, limit)) {
+		if (!ndb_index_streams_intersect(streams, num_streams))
+			break;
 
-	if (memcmp(k.mv_data, id, 32) == 0) {
-		*val = v;
-		success = 1;
+		note_key = streams[0].note_key;
+
+		if (!(note = ndb_get_note_by_key(txn, note_key, &note_size)))
+			goto next;
+		ndb_profile_inc(profile, notes_fetched);
+
+		if (need_relays)
+			ndb_note_relay_iterate_start(txn, &note_relay_iter, note_key);
+
+		ok = ndb_filter_matches_with(filter, note, matched,
+				need_relays ? &note_relay_iter : NULL);
+		if (need_relays)
+			ndb_note_relay_iterate_close(&note_relay_iter);
+
+		if (!ok) {
+			ndb_profile_inc(profile, rows_rejected);
+			goto next;
+		}
+
+		ndb_query_result_init(&res, note, note_size, note_key);
+		if (!push_query_result(results, &res))
+			break;
+next:
+		ndb_index_stream_next(&streams[0]);
 	}
 
+	ret = 1;
 cleanup:
-	mdb_cursor_close(cur);
-	return success;
+	while (i-- > 0)
+		ndb_index_stream_close(&streams[i]);
+	return ret;
 }
 
-static void *ndb_lookup_by_key(struct ndb_txn *txn, uint64_t key,
-			       enum ndb_dbs store, size_t *len)
+// does the fulltext index cover this kind?
+static int ndb_lmdb_fulltext_has_kind(struct ndb_lmdb *lmdb, uint64_t kind)
 {
-	MDB_val k, v;
-
-	k.mv_data = &key;
-	k.mv_size = sizeof(key);
+	int i;
 
-	if (mdb_get(txn->mdb_txn, txn->lmdb->dbs[store], &k, &v)) {
-		ndb_debug("ndb_lookup_by_key: mdb_get note failed\n");
-		return NULL;
+	for (i = 0; i < lmdb->num_fulltext_kinds; i++) {
+		if (lmdb->fulltext_kinds[i] == kind)
+			return 1;
 	}
 
-	if (len)
-		*len = v.mv_size;
-
-	return v.mv_data;
+	return 0;
 }
 
-static void *ndb_lookup_tsid(struct ndb_txn *txn, enum ndb_dbs ind,
-			     enum ndb_dbs store, const unsigned char *pk,
-			     size_t *len, uint64_t *primkey)
+static enum ndb_query_plan ndb_filter_plan(struct ndb_txn *txn,
+					   struct ndb_filter *filter)
 {
-	MDB_val k, v;
-	void *res = NULL;
-	if (len)
-		*len = 0;
+	struct ndb_filter_elements *ids, *kinds, *authors, *tags, *search, *relays;
+	struct ndb_stream_plan streams[MAX_INTERSECT_STREAMS];
+	int matched, num_streams;
 
-	if (!ndb_get_tsid(txn, ind, pk, &k)) {
-		//ndb_debug("ndb_get_profile_by_pubkey: ndb_get_tsid failed\n");
-		return 0;
+	ids = ndb_filter_find_elements(filter, NDB_FILTER_IDS);
+	search = ndb_filter_find_elements(filter, NDB_FILTER_SEARCH);
+	kinds = ndb_filter_find_elements(filter, NDB_FILTER_KINDS);
+	authors = ndb_filter_find_elements(filter, NDB_FILTER_AUTHORS);
+	tags = ndb_filter_find_elements(filter, NDB_FILTER_TAGS);
+	relays = ndb_filter_find_elements(filter, NDB_FILTER_RELAYS);
+
+	// profile search by name, unless profiles are fulltext indexed by
+	// their about field, then that's what we search
+	if (kinds && kinds->count == 1 && kinds->elements[0] == 0 && search &&
+	    !ndb_lmdb_fulltext_has_kind(txn->lmdb, 0)) {
+		return NDB_PLAN_PROFILE_SEARCH;
 	}
 
-	if (primkey)
-		*primkey = *(uint64_t*)k.mv_data;
+	// TODO: fix multi-author queries
+	if (search) {
+		return NDB_PLAN_SEARCH;
+	} else if (ids) {
+		return NDB_PLAN_IDS;
+	} else if (relays && kinds && !authors) {
+		return NDB_PLAN_RELAY_KINDS;
+	}
 
-	if (mdb_get(txn->mdb_txn, txn->lmdb->dbs[store], &k, &v)) {
-		ndb_debug("ndb_get_profile_by_pubkey: mdb_get note failed\n");
-		return 0;
+	num_streams = ndb_filter_plan_streams(filter, streams, &matched);
+	if (num_streams >= 2) {
+		return NDB_PLAN_INTERSECT;
+	} else if (num_streams == 1 && streams[0].db == NDB_DB_NOTE_MENTION) {
+		return NDB_PLAN_MENTIONS;
+	} else if (kinds && authors && authors->count == 1) {
+		return NDB_PLAN_AUTHOR_KINDS;
+	} else if (authors && authors->count == 1) {
+		return NDB_PLAN_AUTHORS;
+	} else if (tags && tags->count == 1 &&
+		   ndb_tag_elements_indexable(filter, tags)) {
+		return NDB_PLAN_TAGS;
+	} else if (kinds) {
+		return NDB_PLAN_KINDS;
 	}
 
-	res = v.mv_data;
-	assert(((uint64_t)res % 4) == 0);
-	if (len)
-		*len = v.mv_size;
-	return res;
+	return NDB_PLAN_CREATED;
 }
 
-void *ndb_get_profile_by_pubkey(struct ndb_txn *txn, const unsigned char *pk, size_t *len, uint64_t *key)
+// does the plan visit notes newest-first?
+static int ndb_query_plan_is_ordered(enum ndb_query_plan plan)
 {
-	return ndb_lookup_tsid(txn, NDB_DB_PROFILE_PK, NDB_DB_PROFILE, pk, len, key);
+	switch (plan) {
+	case NDB_PLAN_IDS:
+	case NDB_PLAN_TAGS:
+	case NDB_PLAN_CREATED:
+	case NDB_PLAN_RELAY_KINDS:
+		return 0;
+	default:
+		return 1;
+	}
 }
 
-struct ndb_note *ndb_get_note_by_id(struct ndb_txn *txn, const unsigned char *id, size_t *len, uint64_t *key)
+static const char *ndb_query_plan_name(enum ndb_query_plan plan_id)
 {
-	return ndb_lookup_tsid(txn, NDB_DB_NOTE_ID, NDB_DB_NOTE, id, len, key);
+	switch (plan_id) {
+		case NDB_PLAN_IDS:     return "ids";
+		case NDB_PLAN_SEARCH:  return "search";
+		case NDB_PLAN_KINDS:   return "kinds";
+		case NDB_PLAN_TAGS:    return "tags";
+		case NDB_PLAN_CREATED: return "created";
+		case NDB_PLAN_AUTHORS: return "authors";
+		case NDB_PLAN_RELAY_KINDS: return "relay_kinds";
+		case NDB_PLAN_AUTHOR_KINDS: return "author_kinds";
+		case NDB_PLAN_PROFILE_SEARCH: return "profile_search";
+		case NDB_PLAN_INTERSECT: return "intersect";
+		case NDB_PLAN_MENTIONS: return "mentions";
+	}
+
+	return "unknown";
 }
 
-static inline uint64_t ndb_get_indexkey_by_id(struct ndb_txn *txn,
-					      enum ndb_dbs db,
-					      const unsigned char *id)
+// Run the filter's plan to completion. *res is malloc'd, and is as big as it
+// needs to be for up to `limit` results.
+static int ndb_query_filter(struct ndb_txn *txn, struct ndb_filter *filter,
+			    struct ndb_query_result **res, int limit,
+			    uint64_t before_created_at, uint64_t before_key,
+			    int *results_out,
+			    struct ndb_query_filter_profile *profile)
 {
-	MDB_val k;
+	struct ndb_query_collector results;
+	enum ndb_query_plan plan;
+	unsigned char *buf;
+	size_t size;
+	int ok;
 
-	if (!ndb_get_tsid(txn, db, id, &k))
+	// the caller already took the filter's limit into account
+	size = min(limit, MAX_MATERIALIZED_RESULTS) * sizeof(**res);
+	if (!(buf = malloc(size)))
 		return 0;
+	make_cursor(buf, buf + size, &results.cur);
 
-	return *(uint32_t*)k.mv_data;
-}
+	plan = ndb_filter_plan(txn, filter);
+	results.limit = limit;
+	results.grow = 1;
+	results.heap = !ndb_query_plan_is_ordered(plan);
+	results.before_created_at = before_created_at;
+	results.before_key = before_key;
+	ndb_debug("using query plan '%s'\n", ndb_query_plan_name(plan));
+	ok = 1;
+	switch (plan) {
+	// We have a list of ids, just open a cursor and jump to each once
+	case NDB_PLAN_IDS:
+		ok = ndb_query_plan_execute_ids(txn, filter, &results, limit, profile);
+		break;
+	case NDB_PLAN_RELAY_KINDS:
+		ok = ndb_query_plan_execute_relay_kinds(txn, filter, &results, limit, profile);
+		break;
+	case NDB_PLAN_SEARCH:
+		ok = ndb_query_plan_execute_search(txn, filter, &results, limit, profile);
+		break;
 
-uint64_t ndb_get_notekey_by_id(struct ndb_txn *txn, const unsigned char *id)
-{
-	return ndb_get_indexkey_by_id(txn, NDB_DB_NOTE_ID, id);
-}
+	case NDB_PLAN_PROFILE_SEARCH:
+		ok = ndb_query_plan_execute_profile_search(txn, filter, &results, limit, profile);
+		break;
 
-uint64_t ndb_get_profilekey_by_pubkey(struct ndb_txn *txn, const unsigned char *id)
-{
-	return ndb_get_indexkey_by_id(txn, NDB_DB_PROFILE_PK, id);
-}
+	// We have just kinds, just scan the kind index
+	case NDB_PLAN_KINDS:
+		ok = ndb_query_plan_execute_kinds(txn, filter, &results, limit, profile);
+		break;
+	case NDB_PLAN_TAGS:
+		ok = ndb_query_plan_execute_tags(txn, filter, &results, limit, profile);
+		break;
+	case NDB_PLAN_CREATED:
+		ok = ndb_query_plan_execute_created_at(txn, filter, &results, limit, profile);
+		break;
+	case NDB_PLAN_AUTHORS:
+		ok = ndb_query_plan_execute_authors(txn, filter, &results, limit, profile);
+		break;
+	case NDB_PLAN_AUTHOR_KINDS:
+		ok = ndb_query_plan_execute_author_kinds(txn, filter, &results, limit, profile);
+		break;
+	// a single mention stream is just an intersection of one
+	case NDB_PLAN_MENTIONS:
+	case NDB_PLAN_INTERSECT:
+		ok = ndb_query_plan_execute_intersect(txn, filter, &results, limit, profile);
+		break;
+	}
 
-struct ndb_note *ndb_get_note_by_key(struct ndb_txn *txn, uint64_t key, size_t *len)
-{
-	return ndb_lookup_by_key(txn, key, NDB_DB_NOTE, len);
+	*res = (struct ndb_query_result *)results.cur.start;
+	*results_out = cursor_count(&results.cur, sizeof(**res));
+	if (!ok) {
+		free(*res);
+		*res = NULL;
+	}
+	return ok;
 }
 
-void *ndb_get_profile_by_key(struct ndb_txn *txn, uint64_t key, size_t *len)
-{
-	return ndb_lookup_by_key(txn, key, NDB_DB_PROFILE, len);
-}
+// A lazy, newest-first stream of results for a single filter. Plans that
+// walk our clustered indices are streamed straight off of the index
+// cursors. Everything else (ids, search, relays, ...) is executed once,
+// the first time we need a result, and sorted.
+struct ndb_query_source {
+	struct ndb_filter *filter;
+	enum ndb_query_plan plan;
+	uint64_t limit, count;
+	int matched, need_relays;
 
-uint64_t
-ndb_read_last_profile_fetch(struct ndb_txn *txn, const unsigned char *pubkey)
-{
-	MDB_val k, v;
+	// the index proves every constraint, see NDB_QUERY_KEYS_ONLY
+	int keys_only, covered;
 
-	k.mv_data = (unsigned char*)pubkey;
-	k.mv_size = 32;
+	struct ndb_query_filter_profile *profile;
 
-	if (mdb_get(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_PROFILE_LAST_FETCH], &k, &v)) {
-		//ndb_debug("ndb_read_last_profile_fetch: mdb_get note failed\n");
+	// index backed plans
+	struct ndb_index_stream *streams;
+	int num_streams;
+
+	// materialized plans, NULL until they run. Results at or above
+	// (before_created_at, before_key) are skipped when resuming.
+	struct ndb_query_result *results;
+	int num_results, pos;
+	int error;
+	uint64_t before_created_at, before_key;
+
+	// the next result of this source. note is NULL when we skipped
+	// fetching it
+	struct ndb_query_result current;
+	uint64_t created_at;
+	uint32_t kind;
+	int eof;
+};
+
+// Merges the sources of each filter newest-first, dropping notes matched
+// by more than one filter
+struct ndb_query_iter {
+	struct ndb_txn *txn;
+	struct ndb_query_source *sources;
+	int num_sources;
+	int limit, count;
+	int flags;
+	struct ndb_query_profile *profile;
+
+	// the last result we returned
+	uint64_t last_created_at;
+	uint64_t last_key;
+};
+
+static int ndb_query_plan_is_streamable(enum ndb_query_plan plan)
+{
+	switch (plan) {
+	case NDB_PLAN_KINDS:
+	case NDB_PLAN_AUTHORS:
+	case NDB_PLAN_AUTHOR_KINDS:
+	case NDB_PLAN_TAGS:
+	case NDB_PLAN_INTERSECT:
+	case NDB_PLAN_MENTIONS:
+	// several authors or tag values, when we can walk their indices
+	case NDB_PLAN_CREATED:
+		return 1;
+	case NDB_PLAN_IDS:
+	case NDB_PLAN_SEARCH:
+	case NDB_PLAN_RELAY_KINDS:
+	case NDB_PLAN_PROFILE_SEARCH:
 		return 0;
 	}
 
-	return *((uint64_t*)v.mv_data);
+	return 0;
 }
 
-
-static int ndb_has_note(struct ndb_txn *txn, const unsigned char *id)
+static void ndb_query_source_close(struct ndb_query_source *src)
 {
-	MDB_val val;
+	int i;
 
-	if (!ndb_get_tsid(txn, NDB_DB_NOTE_ID, id, &val))
-		return 0;
+	if (src->streams) {
+		for (i = 0; i < src->num_streams; i++)
+			ndb_index_stream_close(&src->streams[i]);
+		free(src->streams);
+		src->streams = NULL;
+	}
 
-	return 1;
+	free(src->results);
+	src->results = NULL;
 }
 
-static void ndb_txn_from_mdb(struct ndb_txn *txn, struct ndb_lmdb *lmdb,
-			     MDB_txn *mdb_txn)
+// Is every field of the filter proven by the index streams alone?
+static int ndb_filter_is_covered(struct ndb_filter *filter, int matched)
 {
-	txn->lmdb = lmdb;
-	txn->mdb_txn = mdb_txn;
+	struct ndb_filter_elements *els;
+	int i;
+
+	for (i = 0; i < filter->num_elements; i++) {
+		els = ndb_filter_get_elements(filter, i);
+		if (els->field.type == NDB_FILTER_LIMIT)
+			continue;
+		if (!((1 << els->field.type) & matched))
+			return 0;
+	}
+
+	return 1;
 }
 
-static enum ndb_idres ndb_ingester_json_controller(void *data, const char *hexid)
+static int ndb_query_source_open(struct ndb_txn *txn,
+				 struct ndb_query_source *src,
+				 struct ndb_filter *filter, int capacity,
+				 int flags,
+				 struct ndb_query_filter_profile *profile)
 {
-	unsigned char id[32];
-	struct ndb_ingest_controller *c = data;
-	struct ndb_txn txn;
+	struct ndb_stream_plan plans[MAX_INTERSECT_STREAMS];
+	uint64_t since, until, *pint;
+	int i, num_plans;
 
-	hex_decode(hexid, 64, id, sizeof(id));
+	memset(src, 0, sizeof(*src));
+	src->filter = filter;
+	src->profile = profile;
+	src->plan = ndb_filter_plan(txn, filter);
+	src->need_relays =
+		ndb_filter_find_elements(filter, NDB_FILTER_RELAYS) != NULL;
 
-	// let's see if we already have it
-	ndb_txn_from_mdb(&txn, c->lmdb, c->read_txn);
-	c->note = ndb_get_note_by_id(&txn, id, NULL, &c->note_key);
+	src->limit = capacity;
+	if (!ndb_flag_set(flags, NDB_QUERY_IGNORE_LIMIT) &&
+	    (pint = ndb_filter_get_int(filter, NDB_FILTER_LIMIT)))
+		src->limit = min(*pint, src->limit);
 
-	if (c->note == NULL)
-		return NDB_IDRES_CONT;
+	ndb_debug("using query plan '%s'\n", ndb_query_plan_name(src->plan));
 
-	return NDB_IDRES_STOP;
-}
+	num_plans = 0;
+	if (ndb_query_plan_is_streamable(src->plan))
+		num_plans = ndb_filter_plan_streams(filter, plans, &src->matched);
 
-static int ndbprofile_parse_json(flatcc_builder_t *B,
-        const char *buf, size_t bufsiz, int flags, NdbProfile_ref_t *profile)
-{
-	flatcc_json_parser_t parser, *ctx = &parser;
-	flatcc_json_parser_init(ctx, B, buf, buf + bufsiz, flags);
+	if (num_plans == 0) {
+		// the plan is run once we know where to start, see
+		// ndb_query_source_skip_to
+		src->before_created_at = UINT64_MAX;
+		src->before_key = UINT64_MAX;
+		return 1;
+	}
 
-	if (flatcc_builder_start_buffer(B, 0, 0, 0))
-		return 0;
+	until = UINT64_MAX;
+	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
+		until = *pint;
 
-	NdbProfile_parse_json_table(ctx, buf, buf + bufsiz, profile);
-	if (ctx->error)
-		return 0;
+	since = 0;
+	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_SINCE)))
+		since = *pint;
 
-	if (!flatcc_builder_end_buffer(B, *profile))
+	src->streams = malloc(num_plans * sizeof(*src->streams));
+	if (src->streams == NULL)
 		return 0;
 
-	ctx->end_loc = buf;
+	for (i = 0; i < num_plans; i++) {
+		if (!ndb_index_stream_open(txn, &src->streams[i], filter,
+					   &plans[i], since, until, profile)) {
+			src->num_streams = i;
+			ndb_query_source_close(src);
+			return 0;
+		}
+	}
+	src->num_streams = num_plans;
 
+	src->keys_only = ndb_flag_set(flags, NDB_QUERY_KEYS_ONLY);
+	src->covered = ndb_filter_is_covered(filter, src->matched);
 
 	return 1;
 }
 
-void ndb_profile_record_builder_init(struct ndb_profile_record_builder *b)
+// Skip everything at or above (created_at, note_key). This is how we pick
+// up where a query token left off.
+static void ndb_query_source_skip_to(struct ndb_query_source *src,
+				     uint64_t created_at, uint64_t note_key)
 {
-	b->builder = malloc(sizeof(*b->builder));
-	b->flatbuf = NULL;
+	int i;
+
+	if (src->streams == NULL) {
+		src->before_created_at = created_at;
+		src->before_key = note_key;
+		return;
+	}
+
+	// index streams seek inclusively, so seek to the entry right
+	// below our position
+	if (note_key > 0) {
+		note_key--;
+	} else if (created_at > 0) {
+		created_at--;
+		note_key = UINT64_MAX;
+	} else {
+		src->eof = 1;
+		return;
+	}
+
+	for (i = 0; i < src->num_streams; i++)
+		ndb_index_stream_seek(&src->streams[i], created_at, note_key);
 }
 
-void ndb_profile_record_builder_free(struct ndb_profile_record_builder *b)
+// Run a materialized plan, starting right below where we resumed
+static int ndb_query_source_materialize(struct ndb_txn *txn,
+					struct ndb_query_source *src)
 {
-	if (b->flatbuf)
-		flatcc_builder_aligned_free(b->flatbuf);
-	if (b->builder) {
-		flatcc_builder_clear(b->builder);
-		free(b->builder);
+	if (!ndb_query_filter(txn, src->filter, &src->results, src->limit,
+			      src->before_created_at, src->before_key,
+			      &src->num_results, src->profile)) {
+		return 0;
 	}
 
-	b->builder = NULL;
-	b->flatbuf = NULL;
+	qsort(src->results, src->num_results, sizeof(*src->results),
+	      compare_query_results);
+	src->pos = 0;
 
+	return 1;
 }
 
-int ndb_process_profile_note(struct ndb_note *note,
-			     struct ndb_profile_record_builder *profile)
+// Load the next matching note of this source into src->current
+static int ndb_query_source_next(struct ndb_txn *txn,
+				 struct ndb_query_source *src)
 {
-	int res;
+	struct ndb_note_relay_iterator note_relay_iter = {0};
+	struct ndb_note *note;
+	uint64_t note_key, created_at;
+	uint32_t kind = 0;
+	size_t note_size;
+	int i, ok, has_kind;
 
-	NdbProfile_ref_t profile_table;
-	flatcc_builder_t *builder;
+	if (src->eof)
+		return 0;
 
-	ndb_profile_record_builder_init(profile);
-	builder = profile->builder;
-	flatcc_builder_init(builder);
+	if (src->count >= src->limit)
+		goto eof;
 
-	NdbProfileRecord_start_as_root(builder);
+	if (src->streams == NULL) {
+		if (src->results == NULL &&
+		    !ndb_query_source_materialize(txn, src)) {
+			src->error = 1;
+			goto eof;
+		}
 
-	//printf("parsing profile '%.*s'\n", note->content_length, ndb_note_content(note));
-	if (!(res = ndbprofile_parse_json(builder, ndb_note_content(note),
-					  note->content_length,
-					  flatcc_json_parser_f_skip_unknown,
-					  &profile_table)))
-	{
-		ndb_debug("profile_parse_json failed %d '%.*s'\n", res,
-			  note->content_length, ndb_note_content(note));
-		ndb_profile_record_builder_free(profile);
-		return 0;
+		if (src->pos >= src->num_results)
+			goto eof;
+
+		src->current = src->results[src->pos++];
+		src->created_at = src->current.note->created_at;
+		src->kind = src->current.note->kind;
+		src->count++;
+		return 1;
 	}
 
-	uint64_t received_at = time(NULL);
-	const char *lnurl = "fixme";
+	for (;;) {
+		if (!ndb_index_streams_intersect(src->streams, src->num_streams))
+			goto eof;
 
-	NdbProfileRecord_profile_add(builder, profile_table);
-	NdbProfileRecord_received_at_add(builder, received_at);
+		note_key = src->streams[0].note_key;
+		created_at = src->streams[0].created_at;
+		has_kind = 0;
+		for (i = 0; i < src->num_streams; i++) {
+			if (src->streams[i].has_kind) {
+				kind = src->streams[i].kind;
+				has_kind = 1;
+				break;
+			}
+		}
+		ndb_index_stream_next(&src->streams[0]);
+
+		// the index already proved everything, don't fault in the
+		// note unless we have to
+		if (src->keys_only && src->covered && has_kind) {
+			ndb_query_result_init(&src->current, NULL, 0, note_key);
+			src->created_at = created_at;
+			src->kind = kind;
+			src->count++;
+			return 1;
+		}
 
-	flatcc_builder_ref_t lnurl_off;
-	lnurl_off = flatcc_builder_create_string_str(builder, lnurl);
+		if (!(note = ndb_get_note_by_key(txn, note_key, &note_size)))
+			continue;
+		ndb_profile_inc(src->profile, notes_fetched);
 
-	NdbProfileRecord_lnurl_add(builder, lnurl_off);
+		if (src->need_relays)
+			ndb_note_relay_iterate_start(txn, &note_relay_iter, note_key);
 
-	//*profile = flatcc_builder_finalize_aligned_buffer(builder, profile_len);
-	return 1;
+		ok = ndb_filter_matches_with(src->filter, note, src->matched,
+				src->need_relays ? &note_relay_iter : NULL);
+		ndb_note_relay_iterate_close(&note_relay_iter);
+
+		if (!ok) {
+			ndb_profile_inc(src->profile, rows_rejected);
+			continue;
+		}
+
+		ndb_query_result_init(&src->current, note, note_size, note_key);
+		src->created_at = created_at;
+		src->kind = note->kind;
+		src->count++;
+		return 1;
+	}
+
+eof:
+	src->eof = 1;
+	return 0;
 }
 
-static int ndb_ingester_queue_event(struct ndb_ingester *ingester,
-				    char *json, unsigned len,
-				    unsigned client, const char *relay)
+// did a materialized plan fail partway through?
+static int ndb_query_iter_failed(struct ndb_query_iter *iter)
 {
-	struct ndb_ingester_msg msg;
-	msg.type = NDB_INGEST_EVENT;
+	int i;
 
-	msg.event.json = json;
-	msg.event.len = len;
-	msg.event.client = client;
-	msg.event.relay = relay;
+	for (i = 0; i < iter->num_sources; i++) {
+		if (iter->sources[i].error)
+			return 1;
+	}
 
-	return threadpool_dispatch(&ingester->tp, &msg);
+	return 0;
 }
 
-void ndb_ingest_meta_init(struct ndb_ingest_meta *meta, unsigned client, const char *relay)
+static void ndb_query_iter_close(struct ndb_query_iter *iter)
 {
-	meta->client = client;
-	meta->relay = relay;
+	int i;
+
+	for (i = 0; i < iter->num_sources; i++)
+		ndb_query_source_close(&iter->sources[i]);
+
+	free(iter->sources);
+	iter->sources = NULL;
+	iter->num_sources = 0;
 }
 
-static int ndb_ingest_event(struct ndb_ingester *ingester, const char *json,
-			    int len, struct ndb_ingest_meta *meta)
+static uint64_t ndb_time_ns(void)
 {
-	const char *relay = meta->relay;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-	// Without this, we get bus errors in the json parser inside when
-	// trying to ingest empty kind 6 reposts... we should probably do fuzz
-	// testing on inputs to the json parser
-	if (len == 0)
-		return 0;
+// Fill out the plan and the indices we would use for a filter
+static void ndb_query_filter_explain(struct ndb_txn *txn,
+				     struct ndb_filter *filter,
+				     struct ndb_query_filter_profile *profile)
+{
+	struct ndb_stream_plan plans[MAX_INTERSECT_STREAMS];
+	enum ndb_query_plan plan;
+	int i, num_plans, matched;
+	enum ndb_dbs db;
 
-	// Since we need to return as soon as possible, and we're not
-	// making any assumptions about the lifetime of the string, we
-	// definitely need to copy the json here. In the future once we
-	// have our thread that manages a websocket connection, we can
-	// avoid the copy and just use the buffer we get from that
-	// thread.
-	char *json_copy = strdupn(json, len);
-	if (json_copy == NULL)
-		return 0;
+	memset(profile, 0, sizeof(*profile));
 
-	if (relay != NULL) {
-		relay = strdup(meta->relay);
-		if (relay == NULL)
-			return 0;
+	plan = ndb_filter_plan(txn, filter);
+	profile->plan = ndb_query_plan_name(plan);
+
+	num_plans = 0;
+	if (ndb_query_plan_is_streamable(plan))
+		num_plans = ndb_filter_plan_streams(filter, plans, &matched);
+
+	if (num_plans > 0) {
+		profile->streamed = 1;
+		for (i = 0; i < num_plans; i++)
+			profile->indices[i] = ndb_db_name(plans[i].db);
+		profile->num_indices = num_plans;
+		return;
 	}
 
-	return ndb_ingester_queue_event(ingester, json_copy, len, meta->client, relay);
-}
+	switch (plan) {
+	case NDB_PLAN_IDS:
+	case NDB_PLAN_CREATED:        db = NDB_DB_NOTE_ID; break;
+	case NDB_PLAN_KINDS:          db = NDB_DB_NOTE_KIND; break;
+	case NDB_PLAN_AUTHORS:        db = NDB_DB_NOTE_PUBKEY; break;
+	case NDB_PLAN_AUTHOR_KINDS:   db = NDB_DB_NOTE_PUBKEY_KIND; break;
+	case NDB_PLAN_TAGS:
+	case NDB_PLAN_INTERSECT:      db = NDB_DB_NOTE_TAGS; break;
+	case NDB_PLAN_MENTIONS:       db = NDB_DB_NOTE_MENTION; break;
+	case NDB_PLAN_SEARCH:         db = NDB_DB_NOTE_POSTINGS; break;
+	case NDB_PLAN_RELAY_KINDS:    db = NDB_DB_NOTE_RELAY_KIND; break;
+	case NDB_PLAN_PROFILE_SEARCH: db = NDB_DB_PROFILE_SEARCH; break;
+	default:                      db = NDB_DB_NOTE; break;
+	}
 
+	profile->indices[0] = ndb_db_name(db);
+	profile->num_indices = 1;
+}
 
-static int ndb_ingester_process_note(secp256k1_context *ctx,
-				     struct ndb_note *note,
-				     size_t note_size,
-				     struct ndb_writer_msg *out,
-				     struct ndb_ingester *ingester,
-				     unsigned char *scratch,
-				     const char *relay)
+static int ndb_query_iter_open(struct ndb_query_iter *iter,
+			       struct ndb_txn *txn,
+			       struct ndb_filter *filters, int num_filters,
+			       int limit, const struct ndb_query_token *resume,
+			       int flags, struct ndb_query_profile *profile)
 {
-	enum ndb_ingest_filter_action action;
-	struct ndb_ingest_meta meta;
-
-	action = NDB_INGEST_ACCEPT;
+	struct ndb_query_filter_profile *fprofile;
+	struct ndb_query_source *src;
+	int i;
 
-	if (ingester->filter)
-		action = ingester->filter(ingester->filter_context, note);
+	iter->txn = txn;
+	iter->flags = flags;
+	iter->profile = profile;
+	iter->limit = limit;
+	iter->count = 0;
+	iter->last_created_at = UINT64_MAX;
+	iter->last_key = 0;
+	iter->num_sources = 0;
+	iter->sources = NULL;
+
+	if (num_filters <= 0)
+		return 1;
 
-	if (action == NDB_INGEST_REJECT)
+	if (!(iter->sources = calloc(num_filters, sizeof(*iter->sources))))
 		return 0;
 
-	// some special situations we might want to skip sig validation,
-	// like during large imports
-	if (action == NDB_INGEST_SKIP_VALIDATION || (ingester->flags & NDB_FLAG_SKIP_NOTE_VERIFY)) {
-		// if we're skipping validation we don't need to verify
-	} else {
-		// verify! If it's an invalid note we don't need to
-		// bother writing it to the database
-		if (!ndb_note_verify(ctx, scratch, ingester->scratch_size, note)) {
-			ndb_debug("note verification failed\n");
+	for (i = 0; i < num_filters; i++) {
+		src = &iter->sources[i];
+
+		fprofile = NULL;
+		if (profile && i < NDB_QUERY_MAX_FILTERS) {
+			fprofile = &profile->filters[i];
+			ndb_query_filter_explain(txn, &filters[i], fprofile);
+		}
+
+		if (!ndb_query_source_open(txn, src, &filters[i], limit, flags,
+					   fprofile)) {
+			ndb_query_iter_close(iter);
+			return 0;
+		}
+		iter->num_sources++;
+
+		if (resume) {
+			if (i < (int)resume->num_filters &&
+			    i < NDB_QUERY_MAX_FILTERS) {
+				src->count = resume->filter_counts[i];
+			}
+			ndb_query_source_skip_to(src, resume->created_at,
+						 resume->note_key);
+		}
+
+		// prime the source with its first result
+		if (!ndb_query_source_next(txn, src) && src->error) {
+			ndb_query_iter_close(iter);
 			return 0;
 		}
 	}
 
-	// we didn't find anything. let's send it
-	// to the writer thread
-	note = realloc(note, note_size);
-	assert(((uint64_t)note % 4) == 0);
+	if (resume) {
+		iter->last_created_at = resume->created_at;
+		iter->last_key = resume->note_key;
+	}
 
-	if (note->kind == 0) {
-		struct ndb_profile_record_builder *b =
-			&out->profile.record;
+	return 1;
+}
 
-		ndb_process_profile_note(note, b);
+// Pop the newest result across all sources. result->note may be NULL for
+// NDB_QUERY_KEYS_ONLY iterators.
+static int ndb_query_iter_step(struct ndb_query_iter *iter,
+			       struct ndb_query_result *result,
+			       struct ndb_query_key *key)
+{
+	struct ndb_query_source *src, *best;
+	uint64_t created_at;
+	int i;
 
-		out->type = NDB_WRITER_PROFILE;
-		ndb_writer_note_init(&out->profile.note, note, note_size, relay);
+	while (iter->count < iter->limit) {
+		best = NULL;
+		for (i = 0; i < iter->num_sources; i++) {
+			src = &iter->sources[i];
+			if (src->eof)
+				continue;
+
+			if (best == NULL ||
+			    ndb_ts_key_cmp(src->created_at,
+					   src->current.note_id,
+					   best->created_at,
+					   best->current.note_id) < 0) {
+				best = src;
+			}
+		}
+
+		if (best == NULL)
+			return 0;
+
+		*result = best->current;
+		created_at = best->created_at;
+		if (key) {
+			key->note_key = best->current.note_id;
+			key->created_at = best->created_at;
+			key->kind = best->kind;
+		}
+		ndb_query_source_next(iter->txn, best);
+
+		// sources are ordered the same way, so a note matched by
+		// more than one filter will show up back to back
+		if (result->note_id == iter->last_key)
+			continue;
+
+		iter->last_created_at = created_at;
+		iter->last_key = result->note_id;
+		ndb_profile_inc(best->profile, results);
+		iter->count++;
 		return 1;
-	} else if (note->kind == 6) {
-		// process the repost if we have a repost event
-		ndb_debug("processing kind 6 repost\n");
-		// dup the relay string
-		ndb_ingest_meta_init(&meta, 0, relay);
-		ndb_ingest_event(ingester, ndb_note_content(note),
-					   ndb_note_content_length(note),
-					   &meta);
 	}
 
-	out->type = NDB_WRITER_NOTE;
-	ndb_writer_note_init(&out->note, note, note_size, relay);
+	return 0;
+}
+
+int ndb_query_explain(struct ndb_txn *txn, struct ndb_filter *filters,
+		      int num_filters, struct ndb_query_profile *profile)
+{
+	int i;
+
+	memset(profile, 0, sizeof(*profile));
+	profile->num_filters = min(num_filters, NDB_QUERY_MAX_FILTERS);
+
+	for (i = 0; i < profile->num_filters; i++)
+		ndb_query_filter_explain(txn, &filters[i], &profile->filters[i]);
 
 	return 1;
 }
 
-int ndb_note_seen_on_relay(struct ndb_txn *txn, uint64_t note_key, const char *relay)
-{
-	MDB_val k, v;
-	MDB_cursor *cur;
-	int rc, len;
-	char relay_buf[256];
+enum ndb_query_msg_type {
+	NDB_QUERY_JOB,
+	NDB_QUERY_QUIT,
+};
 
-	if (relay == NULL)
-		return 0;
+// one multi-filter query handed to the query pool
+struct ndb_query_batch {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	int pending;
+	size_t txn_id;
+};
 
-	len = strlen(relay);
+// a single filter of a batch
+struct ndb_query_job {
+	struct ndb_query_batch *batch;
+	struct ndb_filter *filter;
+	struct ndb_query_filter_profile *profile;
+	struct ndb_query_result *results;
+	int capacity, count, pos;
+	int ok;
+	int ran;
+};
 
-	if (!(len = prepare_relay_buf(relay_buf, sizeof(relay_buf), relay, len)))
-		return 0;
+struct ndb_query_msg {
+	enum ndb_query_msg_type type;
+	struct ndb_query_job *job;
+};
 
-	assert((len % 8) == 0);
+static void ndb_query_job_run(struct ndb_txn *txn, struct ndb_query_job *job)
+{
+	struct ndb_query_profile profile;
 
-	k.mv_data = &note_key;
-	k.mv_size = sizeof(note_key);
+	job->ok = ndb_query_with_profile(txn, job->filter, 1, job->results,
+					 job->capacity, &job->count,
+					 job->profile ? &profile : NULL);
+	if (job->ok && job->profile)
+		*job->profile = profile.filters[0];
+	job->ran = 1;
+}
+
+static void *ndb_query_thread(void *data)
+{
+	struct thread *thread = data;
+	struct ndb_query_pool *pool = (struct ndb_query_pool *)thread->ctx;
+	struct ndb_query_batch *batch;
+	struct ndb_query_msg msg;
+	struct ndb_txn txn;
+	MDB_txn *mdb_txn;
+	int rc;
 
-	v.mv_data = relay_buf;
-	v.mv_size = len;
+	for (;;) {
+		prot_queue_pop(&thread->inbox, &msg);
+		if (msg.type == NDB_QUERY_QUIT)
+			break;
 
-	if ((rc = mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_RELAYS], &cur)) != MDB_SUCCESS)
-		return 0;
+		batch = msg.job->batch;
 
-	rc = mdb_cursor_get(cur, &k, &v, MDB_GET_BOTH);
-	ndb_debug("seen_on_relay result: %s\n", mdb_strerror(rc));
-	mdb_cursor_close(cur);
+		if ((rc = mdb_txn_begin(pool->lmdb->env, NULL, MDB_RDONLY, &mdb_txn))) {
+			fprintf(stderr, "ndb_query_thread: mdb_txn_begin failed: '%s'\n",
+				mdb_strerror(rc));
+		} else {
+			// the writer may have committed since the caller
+			// started its query. Then our snapshot isn't the
+			// caller's, so the caller runs this filter itself once
+			// the batch is done.
+			txn.lmdb = pool->lmdb;
+			txn.mdb_txn = mdb_txn;
+			if (mdb_txn_id(mdb_txn) == batch->txn_id)
+				ndb_query_job_run(&txn, msg.job);
+			mdb_txn_abort(mdb_txn);
+		}
 
-	return rc == MDB_SUCCESS;
+		pthread_mutex_lock(&batch->lock);
+		if (--batch->pending == 0)
+			pthread_cond_signal(&batch->done);
+		pthread_mutex_unlock(&batch->lock);
+	}
+
+	ndb_debug("quitting query thread\n");
+	return NULL;
 }
 
-// process the relay for the note. this is called when we already have the
-// note in the database but still need to check if the relay needs to be
-// written to the relay indexes for corresponding note
-static int ndb_process_note_relay(struct ndb_txn *txn, struct ndb_writer_msg *out,
-				  uint64_t note_key, struct ndb_note *note,
-				  const char *relay)
+static int ndb_query_pool_init(struct ndb_query_pool *pool,
+			       struct ndb_lmdb *lmdb, int num_threads)
 {
-	// query to see if we already have the relay on this note
-	if (ndb_note_seen_on_relay(txn, note_key, relay)) {
+	static struct ndb_query_msg quit_msg = { .type = NDB_QUERY_QUIT };
+
+	pool->lmdb = lmdb;
+	lmdb->query_pool = NULL;
+
+	// queries run on the caller's thread
+	if (num_threads <= 0)
+		return 1;
+
+	if (!threadpool_init(&pool->tp, num_threads,
+			     sizeof(struct ndb_query_msg),
+			     DEFAULT_QUERY_QUEUE_SIZE, &quit_msg, pool,
+			     ndb_query_thread)) {
+		fprintf(stderr, "ndb query threadpool failed to init\n");
 		return 0;
 	}
 
-	// if not, tell the writer thread to emit a NOTE_RELAY event
-	out->type = NDB_WRITER_NOTE_RELAY;
+	lmdb->query_pool = pool;
+	return 1;
+}
 
-	ndb_debug("pushing NDB_WRITER_NOTE_RELAY with note_key %" PRIu64 "\n", note_key);
-	out->note_relay.relay = relay;
-	out->note_relay.note_key = note_key;
-	out->note_relay.kind = ndb_note_kind(note);
-	out->note_relay.created_at = ndb_note_created_at(note);
+static void ndb_query_pool_destroy(struct ndb_query_pool *pool)
+{
+	if (pool->lmdb == NULL || pool->lmdb->query_pool != pool)
+		return;
 
-	return 1;
+	threadpool_destroy(&pool->tp);
+	pool->lmdb->query_pool = NULL;
 }
 
-static int ndb_ingester_process_event(secp256k1_context *ctx,
-				      struct ndb_ingester *ingester,
-				      struct ndb_ingester_event *ev,
-				      struct ndb_writer_msg *out,
-				      unsigned char *scratch,
-				      MDB_txn *read_txn)
+// Run each filter in its own read transaction on the query pool and merge
+// the per-filter results newest-first. Workers only run filters when they
+// see the same snapshot as the caller. Any filter they couldn't run is run
+// here on the caller's transaction instead.
+static int ndb_query_parallel(struct ndb_query_pool *pool, struct ndb_txn *txn,
+			      struct ndb_filter *filters, int num_filters,
+			      struct ndb_query_result *results,
+			      int result_capacity, int *count,
+			      struct ndb_query_profile *profile)
 {
-	struct ndb_tce tce;
-	struct ndb_fce fce;
-	struct ndb_note *note;
-	struct ndb_ingest_controller controller;
-	struct ndb_id_cb cb;
-	void *buf;
-	int ok;
-	size_t bufsize, note_size;
+	struct ndb_query_batch batch;
+	struct ndb_query_job *jobs, *job, *best;
+	struct ndb_query_result *buf, *res;
+	struct ndb_query_msg msg;
+	uint64_t *limit;
+	size_t total;
+	int i, ok;
 
-	ok = 0;
+	if (!(jobs = calloc(num_filters, sizeof(*jobs)))) {
+		fprintf(stderr, "ndb_query_parallel: oom\n");
+		return 0;
+	}
 
-	// we will use this to check if we already have it in the DB during
-	// ID parsing
-	controller.read_txn = read_txn;
-	controller.lmdb = ingester->lmdb;
-	cb.fn = ndb_ingester_json_controller;
-	cb.data = &controller;
+	total = 0;
+	for (i = 0; i < num_filters; i++) {
+		job = &jobs[i];
+		job->capacity = result_capacity;
+		if ((limit = ndb_filter_get_int(&filters[i], NDB_FILTER_LIMIT)))
+			job->capacity = min(*limit, (uint64_t)result_capacity);
+		total += job->capacity;
+	}
 
-	// since we're going to be passing this allocated note to a different
-	// thread, we can't use thread-local buffers. just allocate a block
-        bufsize = max(ev->len * 8.0, 4096);
-	buf = malloc(bufsize);
-	if (!buf) {
-		ndb_debug("couldn't malloc buf\n");
+	if (!(buf = malloc(total * sizeof(*buf)))) {
+		fprintf(stderr, "ndb_query_parallel: oom\n");
+		free(jobs);
 		return 0;
 	}
 
-	note_size =
-		ev->client ?
-		ndb_client_event_from_json(ev->json, ev->len, &fce, buf, bufsize, &cb) :
-		ndb_ws_event_from_json(ev->json, ev->len, &tce, buf, bufsize, &cb);
+	pthread_mutex_init(&batch.lock, NULL);
+	pthread_cond_init(&batch.done, NULL);
+	batch.pending = 0;
+	batch.txn_id = mdb_txn_id(txn->mdb_txn);
 
-	// This is a result from our special json parser. It parsed the id
-	// and found that we already have it in the database
-	if ((int)note_size == -42) {
-		assert(controller.note != NULL);
-		assert(controller.note_key != 0);
-		struct ndb_txn txn;
-		ndb_txn_from_mdb(&txn, ingester->lmdb, read_txn);
+	total = 0;
+	for (i = 0; i < num_filters; i++) {
+		job = &jobs[i];
+		job->batch = &batch;
+		job->filter = &filters[i];
+		job->results = buf + total;
+		total += job->capacity;
+		if (profile && i < NDB_QUERY_MAX_FILTERS)
+			job->profile = &profile->filters[i];
+
+		// we run the first one ourselves once everything else is
+		// handed out
+		if (i == 0)
+			continue;
 
-		// we still need to process the relays on the note even
-		// if we already have it
-	 	if (ev->relay && ndb_process_note_relay(&txn, out,
-							controller.note_key,
-							controller.note,
-							ev->relay))
-		{
-			// free note buf here since we don't pass the note to the writer thread
-			free(buf);
-			goto success;
-		} else {
-			// we already have the note and there are no new
-			// relays to process. nothing to write.
-			goto cleanup;
+		msg.type = NDB_QUERY_JOB;
+		msg.job = job;
+
+		pthread_mutex_lock(&batch.lock);
+		batch.pending++;
+		pthread_mutex_unlock(&batch.lock);
+
+		if (!threadpool_dispatch(&pool->tp, &msg)) {
+			// queue is full, just run it ourselves
+			pthread_mutex_lock(&batch.lock);
+			batch.pending--;
+			pthread_mutex_unlock(&batch.lock);
+			ndb_query_job_run(txn, job);
 		}
-	} else if (note_size == 0) {
-		ndb_debug("failed to parse '%.*s'\n", ev->len, ev->json);
-		goto cleanup;
 	}
 
-	//ndb_debug("parsed evtype:%d '%.*s'\n", tce.evtype, ev->len, ev->json);
+	ndb_query_job_run(txn, &jobs[0]);
 
-	if (ev->client) {
-		switch (fce.evtype) {
-		case NDB_FCE_EVENT:
-			note = fce.event.note;
-			if (note != buf) {
-				ndb_debug("note buffer not equal to malloc'd buffer\n");
-				goto cleanup;
-			}
+	pthread_mutex_lock(&batch.lock);
+	while (batch.pending > 0)
+		pthread_cond_wait(&batch.done, &batch.lock);
+	pthread_mutex_unlock(&batch.lock);
 
-			if (!ndb_ingester_process_note(ctx, note, note_size,
-						       out, ingester, scratch,
-						       ev->relay)) {
-				ndb_debug("failed to process note\n");
-				goto cleanup;
-			} else {
-				goto success;
-			}
+	ok = 1;
+	for (i = 0; i < num_filters; i++) {
+		job = &jobs[i];
+		if (!job->ran)
+			ndb_query_job_run(txn, job);
+		if (!job->ok)
+			ok = 0;
+	}
+
+	// merge newest-first. The same note has the same position in every
+	// filter's results, so duplicates always come out back to back.
+	while (ok && *count < result_capacity) {
+		best = NULL;
+		for (i = 0; i < num_filters; i++) {
+			job = &jobs[i];
+			if (job->pos >= job->count)
+				continue;
+			if (best == NULL ||
+			    compare_query_results(&job->results[job->pos],
+						  &best->results[best->pos]) < 0)
+				best = job;
 		}
-	} else {
-		switch (tce.evtype) {
-		case NDB_TCE_AUTH:   goto cleanup;
-		case NDB_TCE_NOTICE: goto cleanup;
-		case NDB_TCE_EOSE:   goto cleanup;
-		case NDB_TCE_OK:     goto cleanup;
-		case NDB_TCE_EVENT:
-			note = tce.event.note;
-			if (note != buf) {
-				ndb_debug("note buffer not equal to malloc'd buffer\n");
-				goto cleanup;
-			}
 
-			if (!ndb_ingester_process_note(ctx, note, note_size,
-						       out, ingester, scratch,
-						       ev->relay)) {
-				ndb_debug("failed to process note\n");
-				goto cleanup;
-			} else {
-				goto success;
-			}
-		}
-	}
+		if (best == NULL)
+			break;
 
+		res = &best->results[best->pos++];
+		if (*count > 0 && results[*count - 1].note_id == res->note_id)
+			continue;
 
-success:
-	free(ev->json);
-	// we don't free relay or buf since those are passed to the writer thread
-	return 1;
+		results[(*count)++] = *res;
+	}
 
-cleanup:
-	free(ev->json);
-	if (ev->relay)
-		free((void*)ev->relay);
+	pthread_cond_destroy(&batch.done);
+	pthread_mutex_destroy(&batch.lock);
 	free(buf);
+	free(jobs);
 
 	return ok;
 }
 
-static uint64_t ndb_get_last_key(MDB_txn *txn, MDB_dbi db)
+int ndb_query_with_profile(struct ndb_txn *txn, struct ndb_filter *filters,
+			   int num_filters, struct ndb_query_result *results,
+			   int result_capacity, int *count,
+			   struct ndb_query_profile *profile)
 {
-	MDB_cursor *mc;
-	MDB_val key, val;
+	struct ndb_query_iter iter;
+	uint64_t start = 0;
+	int ok;
 
-	if (mdb_cursor_open(txn, db, &mc))
-		return 0;
+	*count = 0;
 
-	if (mdb_cursor_get(mc, &key, &val, MDB_LAST)) {
-		mdb_cursor_close(mc);
-		return 0;
+	if (profile) {
+		start = ndb_time_ns();
+		memset(profile, 0, sizeof(*profile));
+		profile->num_filters = min(num_filters, NDB_QUERY_MAX_FILTERS);
 	}
 
-	mdb_cursor_close(mc);
+	if (num_filters == 0 || result_capacity <= 0)
+		return 1;
 
-	assert(key.mv_size == 8);
-        return *((uint64_t*)key.mv_data);
+	if (num_filters > 1 && txn->lmdb->query_pool) {
+		if (!ndb_query_parallel(txn->lmdb->query_pool, txn, filters,
+					num_filters, results, result_capacity,
+					count, profile))
+			return 0;
+	} else {
+		if (!ndb_query_iter_open(&iter, txn, filters, num_filters,
+					 result_capacity, NULL, 0, profile))
+			return 0;
+
+		while (ndb_query_iter_step(&iter, &results[*count], NULL))
+			(*count)++;
+
+		ok = !ndb_query_iter_failed(&iter);
+		ndb_query_iter_close(&iter);
+		if (!ok)
+			return 0;
+	}
+
+	if (profile)
+		profile->elapsed_ns = ndb_time_ns() - start;
+
+	return 1;
 }
 
-//
-// make a search key meant for user queries without any other note info
-static void ndb_make_search_key_low(struct ndb_search_key *key, const char *search)
+static int ndb_query_cache_init(struct ndb_query_cache *cache,
+				struct ndb_lmdb *lmdb, int num_entries)
 {
-	memset(key->id, 0, sizeof(key->id));
-	key->timestamp = 0;
-	lowercase_strncpy(key->search, search, sizeof(key->search) - 1);
-	key->search[sizeof(key->search) - 1] = '\0';
+	lmdb->query_cache = NULL;
+
+	if (num_entries <= 0)
+		return 1;
+
+	cache->entries = calloc(num_entries, sizeof(*cache->entries));
+	if (cache->entries == NULL)
+		return 0;
+
+	cache->num_entries = num_entries;
+	cache->clock = 0;
+	cache->hits = 0;
+	cache->misses = 0;
+	cache->writer_txnid = 0;
+	pthread_mutex_init(&cache->lock, NULL);
+
+	lmdb->query_cache = cache;
+	return 1;
 }
 
-int ndb_search_profile(struct ndb_txn *txn, struct ndb_search *search, const char *query)
+static void ndb_query_cache_entry_free(struct ndb_query_cache_entry *entry)
 {
-	int rc;
-	struct ndb_search_key s;
-	MDB_val k, v;
-	search->cursor = NULL;
+	int i;
 
-	MDB_cursor **cursor = (MDB_cursor **)&search->cursor;
+	for (i = 0; i < entry->num_filters; i++)
+		ndb_filter_destroy(&entry->filters[i]);
 
-	ndb_make_search_key_low(&s, query);
+	free(entry->filters);
+	free(entry->note_keys);
+	memset(entry, 0, sizeof(*entry));
+}
 
-	k.mv_data = &s;
-	k.mv_size = sizeof(s);
+static void ndb_query_cache_destroy(struct ndb_query_cache *cache)
+{
+	int i;
 
-	if ((rc = mdb_cursor_open(txn->mdb_txn,
-				  txn->lmdb->dbs[NDB_DB_PROFILE_SEARCH],
-				  cursor))) {
-		printf("search_profile: cursor opened failed: %s\n",
-				mdb_strerror(rc));
-		return 0;
-	}
+	if (cache->entries == NULL)
+		return;
 
-	// Position cursor at the next key greater than or equal to the specified key
-	if (mdb_cursor_get(search->cursor, &k, &v, MDB_SET_RANGE)) {
-		printf("search_profile: cursor get failed\n");
-		goto cleanup;
-	} else {
-		search->key = k.mv_data;
-		assert(v.mv_size == 8);
-		search->profile_key = *((uint64_t*)v.mv_data);
-		return 1;
-	}
+	for (i = 0; i < cache->num_entries; i++)
+		ndb_query_cache_entry_free(&cache->entries[i]);
 
-cleanup:
-	mdb_cursor_close(search->cursor);
-	search->cursor = NULL;
-	return 0;
+	free(cache->entries);
+	cache->entries = NULL;
+	pthread_mutex_destroy(&cache->lock);
 }
 
-void ndb_search_profile_end(struct ndb_search *search)
+// Hash what the filter asks for, not its buffers, which have padding in
+// them. Returns 0 for filters we can't cache: custom filters can't be
+// hashed.
+static int ndb_query_cache_hash_filter(struct sha256_ctx *ctx,
+				       struct ndb_filter *filter)
 {
-	if (search->cursor)
-		mdb_cursor_close(search->cursor);
+	struct ndb_filter_elements *els;
+	const char *str;
+	uint64_t val;
+	int i, j, len;
+
+	if (!filter->finalized)
+		return 0;
+
+	sha256_update(ctx, &filter->num_elements, sizeof(filter->num_elements));
+
+	for (i = 0; i < filter->num_elements; i++) {
+		els = ndb_filter_get_elements(filter, i);
+
+		if (els->field.type == NDB_FILTER_CUSTOM)
+			return 0;
+
+		sha256_update(ctx, &els->field.type, sizeof(els->field.type));
+		sha256_update(ctx, &els->field.tag, sizeof(els->field.tag));
+		if (els->field.tag_len > 1) {
+			sha256_update(ctx, ndb_filter_tag_name(filter, els, &len),
+				      els->field.tag_len);
+		}
+		sha256_update(ctx, &els->count, sizeof(els->count));
+
+		for (j = 0; j < els->count; j++) {
+			switch (els->field.elem_type) {
+			case NDB_ELEMENT_INT:
+				val = ndb_filter_get_int_element(els, j);
+				sha256_update(ctx, &val, sizeof(val));
+				break;
+			case NDB_ELEMENT_ID:
+				sha256_update(ctx, ndb_filter_get_id_element(filter, els, j), 32);
+				break;
+			case NDB_ELEMENT_STRING:
+				str = ndb_filter_get_string_element(filter, els, j);
+				sha256_update(ctx, str, strlen(str) + 1);
+				break;
+			default:
+				return 0;
+			}
+		}
+	}
+
+	return 1;
 }
 
-int ndb_search_profile_next(struct ndb_search *search)
+static int ndb_query_cache_key(struct ndb_filter *filters, int num_filters,
+			       int capacity, unsigned char *hash)
 {
-	int rc;
-	MDB_val k, v;
-	unsigned char *init_id;
-
-	init_id = search->key->id;
-	k.mv_data = search->key;
-	k.mv_size = sizeof(*search->key);
+	struct sha256_ctx ctx;
+	int i;
 
-retry:
-	if ((rc = mdb_cursor_get(search->cursor, &k, &v, MDB_NEXT))) {
-		ndb_debug("ndb_search_profile_next: %s\n",
-				mdb_strerror(rc));
-		return 0;
-	} else {
-		search->key = k.mv_data;
-		assert(v.mv_size == 8);
-		search->profile_key = *((uint64_t*)v.mv_data);
+	sha256_init(&ctx);
+	sha256_update(&ctx, &capacity, sizeof(capacity));
 
-		// skip duplicate pubkeys
-		if (!memcmp(init_id, search->key->id, 32))
-			goto retry;
+	for (i = 0; i < num_filters; i++) {
+		if (!ndb_query_cache_hash_filter(&ctx, &filters[i]))
+			return 0;
 	}
 
+	sha256_done(&ctx, (struct sha256 *)hash);
 	return 1;
 }
 
-//
-// The relay kind index has a layout like so (so we don't need dupsort)
-//
-// - note_id:        00 + 8 bytes
-// - kind:           08 + 8 bytes
-// - created_at:     16 + 8 bytes
-// - relay_url_size: 24 + 1 byte
-// - relay_url:      25 + n byte null-terminated string
-// - pad to 8 byte alignment
-//
-// The key sort order is:
-//
-// relay_url, kind, created_at
-//
-static int ndb_relay_kind_cmp(const MDB_val *a, const MDB_val *b)
+static struct ndb_query_cache_entry *
+ndb_query_cache_find(struct ndb_query_cache *cache, const unsigned char *hash)
 {
-	int cmp;
-	MDB_val va, vb;
-	uint64_t iva, ivb;
-	unsigned char *ad = (unsigned char *)a->mv_data;
-	unsigned char *bd = (unsigned char *)b->mv_data;
-	assert(((uint64_t)a->mv_data % 8) == 0);
+	int i;
 
-	va.mv_size = *(ad + 24);
-	va.mv_data =   ad + 25;
+	for (i = 0; i < cache->num_entries; i++) {
+		if (cache->entries[i].used &&
+		    !memcmp(cache->entries[i].hash, hash, 32))
+			return &cache->entries[i];
+	}
 
-	vb.mv_size = *(bd + 24);
-	vb.mv_data =   bd + 25;
+	return NULL;
+}
 
-	cmp = mdb_cmp_memn(&va, &vb);
-	if (cmp) return cmp;
+static int ndb_query_cache_get(struct ndb_query_cache *cache,
+			       struct ndb_txn *txn, const unsigned char *hash,
+			       struct ndb_query_result *results, int *count)
+{
+	struct ndb_query_cache_entry *entry;
+	struct ndb_query_result *res;
+	size_t txn_id, note_size;
+	int i, n;
 
-	// kind
-	iva = *(uint64_t*)(ad + 8);
-	ivb = *(uint64_t*)(bd + 8);
+	txn_id = mdb_txn_id(txn->mdb_txn);
+	n = -1;
 
-	if (iva < ivb)
-		return -1;
-	else if (iva > ivb)
-		return 1;
+	// only copy the keys while holding the lock, the writer takes it
+	// before every commit
+	pthread_mutex_lock(&cache->lock);
 
-	// created_at
-	iva = *(uint64_t*)(ad + 16);
-	ivb = *(uint64_t*)(bd + 16);
+	// anything older than the entry might not have all of its notes
+	entry = ndb_query_cache_find(cache, hash);
+	if (entry != NULL && txn_id >= entry->txn_id) {
+		n = entry->count;
+		for (i = 0; i < n; i++)
+			results[i].note_id = entry->note_keys[i];
+		entry->last_used = ++cache->clock;
+		cache->hits++;
+	} else {
+		cache->misses++;
+	}
 
-	if (iva < ivb)
-		return -1;
-	else if (iva > ivb)
-		return 1;
+	pthread_mutex_unlock(&cache->lock);
 
-	// note_id (so we don't need dupsort logic)
-	iva = *(uint64_t*)ad;
-	ivb = *(uint64_t*)bd;
+	if (n < 0)
+		return 0;
 
-	if (iva < ivb)
-		return -1;
-	else if (iva > ivb)
-		return 1;
+	for (i = 0; i < n; i++) {
+		res = &results[i];
+		res->note = ndb_get_note_by_key(txn, res->note_id, &note_size);
+		res->note_size = note_size;
+		if (res->note == NULL)
+			return 0;
+	}
 
-	return 0;
+	*count = n;
+	return 1;
 }
 
-static int ndb_search_key_cmp(const MDB_val *a, const MDB_val *b)
+static void ndb_query_cache_put(struct ndb_query_cache *cache,
+				struct ndb_txn *txn, const unsigned char *hash,
+				struct ndb_filter *filters, int num_filters,
+				struct ndb_query_result *results, int count)
 {
-	int cmp;
-	struct ndb_search_key *ska, *skb;
+	struct ndb_query_cache_entry *entry, *victim;
+	size_t txn_id;
+	int i;
 
-	ska = a->mv_data;
-	skb = b->mv_data;
+	txn_id = mdb_txn_id(txn->mdb_txn);
 
-	MDB_val a2 = *a;
-	MDB_val b2 = *b;
+	pthread_mutex_lock(&cache->lock);
 
-	a2.mv_data = ska->search;
-	a2.mv_size = sizeof(ska->search) + sizeof(ska->id);
+	if (txn_id < cache->writer_txnid)
+		goto done;
 
-	cmp = mdb_cmp_memn(&a2, &b2);
-	if (cmp) return cmp;
+	if ((victim = ndb_query_cache_find(cache, hash))) {
+		if (txn_id <= victim->txn_id)
+			goto done;
+	} else {
+		victim = &cache->entries[0];
+		for (i = 0; i < cache->num_entries; i++) {
+			entry = &cache->entries[i];
+			if (!entry->used) {
+				victim = entry;
+				break;
+			}
+			if (entry->last_used < victim->last_used)
+				victim = entry;
+		}
+	}
 
-	if (ska->timestamp < skb->timestamp)
-		return -1;
-	else if (ska->timestamp > skb->timestamp)
-		return 1;
+	ndb_query_cache_entry_free(victim);
 
-	return 0;
-}
+	victim->filters = calloc(num_filters, sizeof(*victim->filters));
+	victim->note_keys = malloc(max(count, 1) * sizeof(*victim->note_keys));
+	if (victim->filters == NULL || victim->note_keys == NULL)
+		goto fail;
 
-static int ndb_write_profile_pk_index(struct ndb_txn *txn, struct ndb_note *note, uint64_t profile_key)
+	for (i = 0; i < num_filters; i++) {
+		if (!ndb_filter_clone(&victim->filters[i], &filters[i]))
+			goto fail;
+		victim->num_filters++;
+	}
+
+	for (i = 0; i < count; i++)
+		victim->note_keys[i] = results[i].note_id;
+
+	memcpy(victim->hash, hash, 32);
+	victim->count = count;
+	victim->txn_id = txn_id;
+	victim->last_used = ++cache->clock;
+	victim->used = 1;
+	goto done;
+
+fail:
+	ndb_query_cache_entry_free(victim);
+done:
+	pthread_mutex_unlock(&cache->lock);
+}
 
+// Relay filters are matched against the relays this txn has for the note,
+// including any it just wrote. With `relays_only` set, only entries with
+// a relay filter are checked, the note itself was already there.
+static int ndb_query_cache_entry_matches(struct ndb_query_cache_entry *entry,
+					 struct ndb_txn *txn,
+					 struct ndb_note *note,
+					 uint64_t note_key, int relays_only)
 {
-	MDB_val key, val;
-	int rc;
-	struct ndb_tsid tsid;
-	MDB_dbi pk_db;
+	struct ndb_note_relay_iterator iter;
+	struct ndb_filter *filter;
+	int i, match;
 
-	pk_db = txn->lmdb->dbs[NDB_DB_PROFILE_PK];
+	for (i = 0; i < entry->num_filters; i++) {
+		filter = &entry->filters[i];
 
-	// write profile_pk + created_at index
-	ndb_tsid_init(&tsid, note->pubkey, note->created_at);
+		if (!ndb_filter_find_elements(filter, NDB_FILTER_RELAYS)) {
+			if (!relays_only && ndb_filter_matches(filter, note))
+				return 1;
+			continue;
+		}
 
-	key.mv_data = &tsid;
-	key.mv_size = sizeof(tsid);
-	val.mv_data = &profile_key;
-	val.mv_size = sizeof(profile_key);
+		if (!ndb_note_relay_iterate_start(txn, &iter, note_key))
+			return 1;
+		match = ndb_filter_matches_with_relay(filter, note, &iter);
+		ndb_note_relay_iterate_close(&iter);
 
-	if ((rc = mdb_put(txn->mdb_txn, pk_db, &key, &val, 0))) {
-		ndb_debug("write profile_pk(%" PRIu64 ") to db failed: %s\n",
-				profile_key, mdb_strerror(rc));
-		return 0;
+		if (match)
+			return 1;
 	}
 
-	return 1;
+	return 0;
 }
 
-static int ndb_write_profile(struct ndb_txn *txn,
-			     struct ndb_writer_profile *profile,
-			     uint64_t note_key)
+// Called by the writer before it commits. Drops every entry one of the
+// written notes could show up in, or everything if `clear` is set.
+// `relay_notes` are notes that were already stored and just got seen on
+// another relay.
+static void ndb_query_cache_invalidate(struct ndb_query_cache *cache,
+				       struct ndb_txn *txn,
+				       struct written_note *wrote,
+				       int num_notes,
+				       uint64_t *relay_notes,
+				       int num_relay_notes, int clear)
 {
-	uint64_t profile_key;
+	struct ndb_query_cache_entry *entry;
 	struct ndb_note *note;
-	void *flatbuf;
-	size_t flatbuf_len;
-	int rc;
+	size_t note_size;
+	int i, j, match;
 
-	MDB_val key, val;
-	MDB_dbi profile_db;
+	if (cache == NULL || (num_notes == 0 && num_relay_notes == 0 && !clear))
+		return;
 
-	note = profile->note.note;
+	pthread_mutex_lock(&cache->lock);
 
-	// add note_key to profile record
-	NdbProfileRecord_note_key_add(profile->record.builder, note_key);
-	NdbProfileRecord_end_as_root(profile->record.builder);
+	cache->writer_txnid = mdb_txn_id(txn->mdb_txn);
 
-	flatbuf = profile->record.flatbuf =
-		flatcc_builder_finalize_aligned_buffer(profile->record.builder, &flatbuf_len);
+	for (i = 0; i < cache->num_entries; i++) {
+		entry = &cache->entries[i];
+		if (!entry->used)
+			continue;
 
-	assert(((uint64_t)flatbuf % 8) == 0);
+		match = clear;
+		for (j = 0; j < num_notes && !match; j++) {
+			match = ndb_query_cache_entry_matches(entry, txn,
+					wrote[j].note->note, wrote[j].note_id, 0);
+		}
 
-	// TODO: this may not be safe!?
-	flatbuf_len = (flatbuf_len + 7) & ~7;
+		for (j = 0; j < num_relay_notes && !match; j++) {
+			// can't tell what it matches without the note
+			if (!(note = ndb_get_note_by_key(txn, relay_notes[j],
+							 &note_size))) {
+				match = 1;
+				break;
+			}
+			match = ndb_query_cache_entry_matches(entry, txn, note,
+					relay_notes[j], 1);
+		}
 
-	//assert(NdbProfileRecord_verify_as_root(flatbuf, flatbuf_len) == 0);
+		if (match)
+			ndb_query_cache_entry_free(entry);
+	}
 
-	// get dbs
-	profile_db = txn->lmdb->dbs[NDB_DB_PROFILE];
+	pthread_mutex_unlock(&cache->lock);
+}
 
-	// get new key
-	profile_key = ndb_get_last_key(txn->mdb_txn, profile_db) + 1;
+// Search results change when the indexer catches up rather than when the
+// notes are written, so it drops every search entry before it commits.
+static void ndb_query_cache_clear_searches(struct ndb_query_cache *cache,
+					   struct ndb_txn *txn)
+{
+	struct ndb_query_cache_entry *entry;
+	int i, j;
 
-	// write profile to profile store
-	key.mv_data = &profile_key;
-	key.mv_size = sizeof(profile_key);
-	val.mv_data = flatbuf;
-	val.mv_size = flatbuf_len;
+	if (cache == NULL)
+		return;
 
-	if ((rc = mdb_put(txn->mdb_txn, profile_db, &key, &val, 0))) {
-		ndb_debug("write profile to db failed: %s\n", mdb_strerror(rc));
-		return 0;
-	}
+	pthread_mutex_lock(&cache->lock);
 
-	// write last fetched record
-	if (!ndb_maybe_write_last_profile_fetch(txn, note)) {
-		ndb_debug("failed to write last profile fetched record\n");
-	}
+	cache->writer_txnid = mdb_txn_id(txn->mdb_txn);
 
-	// write profile pubkey index
-	if (!ndb_write_profile_pk_index(txn, note, profile_key)) {
-		ndb_debug("failed to write profile pubkey index\n");
-		return 0;
-	}
+	for (i = 0; i < cache->num_entries; i++) {
+		entry = &cache->entries[i];
+		if (!entry->used)
+			continue;
 
-	// write name, display_name profile search indices
-	if (!ndb_write_profile_search_indices(txn, note, profile_key,
-					      flatbuf)) {
-		ndb_debug("failed to write profile search indices\n");
-		return 0;
+		for (j = 0; j < entry->num_filters; j++) {
+			if (ndb_filter_find_elements(&entry->filters[j],
+						     NDB_FILTER_SEARCH)) {
+				ndb_query_cache_entry_free(entry);
+				break;
+			}
+		}
 	}
 
-	return 1;
+	pthread_mutex_unlock(&cache->lock);
 }
 
-// find the last id tag in a note (e, p, etc)
-static unsigned char *ndb_note_last_id_tag(struct ndb_note *note, char type)
+int ndb_query(struct ndb_txn *txn, struct ndb_filter *filters, int num_filters,
+	      struct ndb_query_result *results, int result_capacity, int *count)
 {
-	unsigned char *last = NULL;
-	struct ndb_iterator iter;
-	struct ndb_str str;
+	struct ndb_query_cache *cache = txn->lmdb->query_cache;
+	unsigned char hash[32];
+	int cacheable;
 
-	// get the liked event id (last id)
-	ndb_tags_iterate_start(note, &iter);
+	cacheable = cache != NULL && num_filters > 0 && result_capacity > 0 &&
+		ndb_query_cache_key(filters, num_filters, result_capacity, hash);
 
-	while (ndb_tags_iterate_next(&iter)) {
-		if (iter.tag->count < 2)
-			continue;
+	if (cacheable && ndb_query_cache_get(cache, txn, hash, results, count))
+		return 1;
 
-		str = ndb_tag_str(note, iter.tag, 0);
+	if (!ndb_query_with_profile(txn, filters, num_filters, results,
+				    result_capacity, count, NULL))
+		return 0;
 
-		// assign liked to the last e tag
-		if (str.flag == NDB_PACKED_STR && str.str[0] == type) {
-			str = ndb_tag_str(note, iter.tag, 1);
-			if (str.flag == NDB_PACKED_ID)
-				last = str.id;
-		}
-	}
+	if (cacheable)
+		ndb_query_cache_put(cache, txn, hash, filters, num_filters,
+				    results, *count);
 
-	return last;
+	return 1;
 }
 
-void *ndb_get_note_meta(struct ndb_txn *txn, const unsigned char *id, size_t *len)
+int ndb_query_keys(struct ndb_txn *txn, struct ndb_filter *filters,
+		   int num_filters, struct ndb_query_key *keys, int capacity,
+		   int *count, struct ndb_query_profile *profile)
 {
-	MDB_val k, v;
+	struct ndb_query_iter iter;
+	struct ndb_query_result res;
+	uint64_t start = 0;
 
-	k.mv_data = (unsigned char*)id;
-	k.mv_size = 32;
+	*count = 0;
 
-	if (mdb_get(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_META], &k, &v)) {
-		//ndb_debug("ndb_get_note_meta: mdb_get note failed\n");
-		return NULL;
+	if (profile) {
+		start = ndb_time_ns();
+		memset(profile, 0, sizeof(*profile));
+		profile->num_filters = min(num_filters, NDB_QUERY_MAX_FILTERS);
 	}
 
-	if (len)
-		*len = v.mv_size;
-
-	return v.mv_data;
-}
-
-// When receiving a reaction note, look for the liked id and increase the
-// reaction counter in the note metadata database
-static int ndb_write_reaction_stats(struct ndb_txn *txn, struct ndb_note *note)
-{
-	size_t len;
-	void *root;
-	int reactions, rc;
-	MDB_val key, val;
-	NdbEventMeta_table_t meta;
-	unsigned char *liked = ndb_note_last_id_tag(note, 'e');
+	if (num_filters == 0 || capacity <= 0)
+		return 1;
 
-	if (liked == NULL)
+	if (!ndb_query_iter_open(&iter, txn, filters, num_filters, capacity,
+				 NULL, NDB_QUERY_KEYS_ONLY, profile))
 		return 0;
 
-	root = ndb_get_note_meta(txn, liked, &len);
+	while (ndb_query_iter_step(&iter, &res, &keys[*count]))
+		(*count)++;
 
-	flatcc_builder_t builder;
-	flatcc_builder_init(&builder);
-	NdbEventMeta_start_as_root(&builder);
+	ndb_query_iter_close(&iter);
 
-	// no meta record, let's make one
-	if (root == NULL) {
-		NdbEventMeta_reactions_add(&builder, 1);
-	} else {
-		// clone existing and add to it
-		meta = NdbEventMeta_as_root(root);
+	if (profile)
+		profile->elapsed_ns = ndb_time_ns() - start;
 
-		reactions = NdbEventMeta_reactions_get(meta);
-		NdbEventMeta_clone(&builder, meta);
-		NdbEventMeta_reactions_add(&builder, reactions + 1);
-	}
+	return 1;
+}
 
-	NdbProfileRecord_end_as_root(&builder);
-	root = flatcc_builder_finalize_aligned_buffer(&builder, &len);
-	assert(((uint64_t)root % 8) == 0);
+// Count a covered filter straight off its index. This only works when
+// every cursor of the stream sees a different set of notes, ie. a note
+// only has one kind and one author, but can have many tags.
+static int ndb_count_index(struct ndb_txn *txn, struct ndb_filter *filter,
+			   int *count)
+{
+	struct ndb_stream_plan plans[MAX_INTERSECT_STREAMS];
+	struct ndb_index_stream stream;
+	struct ndb_index_cursor *ic;
+	uint64_t since, until, total, *pint;
+	int i, j, matched;
 
-	if (root == NULL) {
-		ndb_debug("failed to create note metadata record\n");
-		goto fail;
-	}
+	if (ndb_filter_plan_streams(filter, plans, &matched) != 1)
+		return 0;
 
-	// metadata is keyed on id because we want to collect stats regardless
-	// if we have the note yet or not
-	key.mv_data = liked;
-	key.mv_size = 32;
+	if (!ndb_filter_is_covered(filter, matched))
+		return 0;
 
-	val.mv_data = root;
-	val.mv_size = len;
+	if ((plans[0].db == NDB_DB_NOTE_TAGS ||
+	     plans[0].db == NDB_DB_NOTE_MENTION) && plans[0].ids->count != 1)
+		return 0;
 
-	// write the new meta record
-	//ndb_debug("writing stats record for ");
-	//print_hex(liked, 32);
-	//ndb_debug("\n");
+	until = UINT64_MAX;
+	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
+		until = *pint;
 
-	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_META], &key, &val, 0))) {
-		ndb_debug("write reaction stats to db failed: %s\n", mdb_strerror(rc));
-		goto fail;
+	since = 0;
+	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_SINCE)))
+		since = *pint;
+
+	if (!ndb_index_stream_open(txn, &stream, filter, &plans[0], since,
+				   until, NULL))
+		return 0;
+
+	total = 0;
+	for (i = 0; i < stream.num_cursors; i++) {
+		ic = &stream.cursors[i];
+
+		// don't count repeated filter elements twice
+		for (j = 0; j < i; j++) {
+			if (stream.cursors[j].prefix_len == ic->prefix_len &&
+			    !memcmp(stream.cursors[j].prefix, ic->prefix,
+				    ic->prefix_len))
+				break;
+		}
+
+		if (j == i)
+			total += ndb_index_cursor_count(ic);
 	}
 
-	free(root);
-	flatcc_builder_clear(&builder);
+	ndb_index_stream_close(&stream);
 
+	*count = min(total, (uint64_t)INT_MAX);
 	return 1;
-
-fail:
-	free(root);
-	flatcc_builder_clear(&builder);
-	return 0;
 }
 
+int ndb_count(struct ndb_txn *txn, struct ndb_filter *filters, int num_filters,
+	      int *count)
+{
+	struct ndb_query_iter iter;
+	struct ndb_query_result res;
+	struct ndb_query_key key;
+	int ok;
 
-static int ndb_write_note_id_index(struct ndb_txn *txn, struct ndb_note *note,
-				   uint64_t note_key)
+	*count = 0;
 
-{
-	struct ndb_tsid tsid;
-	int rc;
-	MDB_val key, val;
-	MDB_dbi id_db;
+	if (num_filters == 0)
+		return 1;
 
-	ndb_tsid_init(&tsid, note->id, note->created_at);
+	// filters can overlap, so anything more than one needs to dedupe
+	if (num_filters == 1 && ndb_count_index(txn, filters, count))
+		return 1;
 
-	key.mv_data = &tsid;
-	key.mv_size = sizeof(tsid);
-	val.mv_data = &note_key;
-	val.mv_size = sizeof(note_key);
+	if (!ndb_query_iter_open(&iter, txn, filters, num_filters, INT_MAX,
+				 NULL, NDB_QUERY_KEYS_ONLY | NDB_QUERY_IGNORE_LIMIT,
+				 NULL))
+		return 0;
 
-	id_db = txn->lmdb->dbs[NDB_DB_NOTE_ID];
+	while (ndb_query_iter_step(&iter, &res, &key))
+		(*count)++;
 
-	if ((rc = mdb_put(txn->mdb_txn, id_db, &key, &val, 0))) {
-		ndb_debug("write note id index to db failed: %s\n",
-				mdb_strerror(rc));
+	ok = !ndb_query_iter_failed(&iter);
+	ndb_query_iter_close(&iter);
+	return ok;
+}
+
+int ndb_query_iter_begin_with(struct ndb_txn *txn,
+			      struct ndb_filter *filters, int num_filters,
+			      const struct ndb_query_token *resume, int flags,
+			      struct ndb_query_iter **iter)
+{
+	if (!(*iter = malloc(sizeof(**iter))))
+		return 0;
+
+	if (!ndb_query_iter_open(*iter, txn, filters, num_filters, INT_MAX,
+				 resume, flags, NULL)) {
+		free(*iter);
+		*iter = NULL;
 		return 0;
 	}
 
 	return 1;
 }
 
-static int ndb_filter_group_add_filters(struct ndb_filter_group *group,
-					struct ndb_filter *filters,
-					int num_filters)
+int ndb_query_iter_begin(struct ndb_txn *txn, struct ndb_filter *filters,
+			 int num_filters, const struct ndb_query_token *resume,
+			 struct ndb_query_iter **iter)
 {
-	int i;
+	return ndb_query_iter_begin_with(txn, filters, num_filters, resume, 0,
+					 iter);
+}
 
-	for (i = 0; i < num_filters; i++) {
-		if (!ndb_filter_group_add(group, &filters[i]))
-			return 0;
+int ndb_query_iter_next(struct ndb_query_iter *iter,
+			struct ndb_query_result *result)
+{
+	size_t note_size;
+
+	while (ndb_query_iter_step(iter, result, NULL)) {
+		if (result->note)
+			return 1;
+
+		// keys only iterators can skip the note, fetch it now
+		result->note = ndb_get_note_by_key(iter->txn, result->note_id,
+						   &note_size);
+		if (result->note == NULL)
+			continue;
+
+		result->note_size = note_size;
+		return 1;
 	}
 
-	return 1;
+	return 0;
 }
 
+int ndb_query_iter_next_key(struct ndb_query_iter *iter,
+			    struct ndb_query_key *key)
+{
+	struct ndb_query_result res;
+	return ndb_query_iter_step(iter, &res, key);
+}
 
-static struct ndb_filter_elements *
-ndb_filter_find_elements(struct ndb_filter *filter, enum ndb_filter_fieldtype typ)
+void ndb_query_iter_token(struct ndb_query_iter *iter,
+			  struct ndb_query_token *token)
 {
+	struct ndb_query_source *src;
+	uint32_t count;
 	int i;
-	struct ndb_filter_elements *els;
 
-	for (i = 0; i < filter->num_elements; i++) {
-		els = ndb_filter_get_elements(filter, i);
-		assert(els);
-		if (els->field.type == typ) {
-			return els;
+	memset(token, 0, sizeof(*token));
+	token->created_at = iter->last_created_at;
+	token->note_key = iter->last_key;
+	token->num_filters = min(iter->num_sources, NDB_QUERY_MAX_FILTERS);
+
+	for (i = 0; i < (int)token->num_filters; i++) {
+		src = &iter->sources[i];
+		count = src->count;
+
+		// sources count their next result as soon as they load it.
+		// don't count it unless it's the one we just returned (a
+		// duplicate that is about to be skipped)
+		if (!src->eof && count > 0 &&
+		    src->current.note_id != iter->last_key) {
+			count--;
 		}
-	}
 
-	return NULL;
+		token->filter_counts[i] = count;
+	}
 }
 
-static const char *ndb_filter_find_search(struct ndb_filter *filter)
+void ndb_query_iter_end(struct ndb_query_iter *iter)
 {
-	struct ndb_filter_elements *els;
-
-	if (!(els = ndb_filter_find_elements(filter, NDB_FILTER_SEARCH)))
-		return NULL;
+	if (iter == NULL)
+		return;
 
-	return ndb_filter_get_string_element(filter, els, 0);
+	ndb_query_iter_close(iter);
+	free(iter);
 }
 
-int ndb_filter_is_subset_of(const struct ndb_filter *a, const struct ndb_filter *b)
+// `long_tags` adds multi-char tags and overlong values to the index, see
+// ndb_encode_tag_prefix
+static int ndb_write_note_tag_index(struct ndb_txn *txn, struct ndb_note *note,
+				    uint64_t note_key, int long_tags)
 {
-	int i;
-	struct ndb_filter_elements *b_field, *a_field;
+	unsigned char key_buffer[NDB_TAG_KEY_MAX];
+	struct ndb_iterator iter;
+	struct ndb_str tkey, tval;
+	int len, tag_len, rc;
+	MDB_val key, val;
+	MDB_dbi tags_db;
 
-        // Everything is always a subset of {}
-	if (b->num_elements == 0)
-		return 1;
+	tags_db = txn->lmdb->dbs[NDB_DB_NOTE_TAGS];
 
-        // We can't be a subset if the number of elements in the other
-        // filter is larger then the number of elements we have.
-	if (b->num_elements > a->num_elements)
-		return 0;
+	ndb_tags_iterate_start(note, &iter);
 
-        // If our filter count matches, we can only be a subset if we are
-        // equal
-	if (b->num_elements == a->num_elements)
-		return ndb_filter_eq(a, b);
+	while (ndb_tags_iterate_next(&iter)) {
+		if (iter.tag->count < 2)
+			continue;
 
-        // If our element count is larger than the other filter, then we
-        // must see if every element in the other filter exists in ours. If
-        // so, then we are a subset of the other.
-        //
-        // eg: B={k:1, a:b} <- A={t:x, k:1, a:b}
-        //
-        // A is a subset of B because `k:1` and `a:b` both exist in A
+		tkey = ndb_tag_str(note, iter.tag, 0);
+		if (tkey.flag == NDB_PACKED_ID)
+			continue;
 
-	for (i = 0; i < b->num_elements; i++) {
-		b_field = ndb_filter_get_elements((struct ndb_filter*)b, i);
-		a_field = ndb_filter_find_elements((struct ndb_filter*)a,
-						   b_field->field.type);
+		if ((tag_len = strlen(tkey.str)) == 0)
+			continue;
 
-		if (a_field == NULL)
-			return 0;
+		tval = ndb_tag_str(note, iter.tag, 1);
+		len = ndb_str_len(&tval);
 
-		if (!ndb_filter_field_eq((struct ndb_filter*)a, a_field,
-					 (struct ndb_filter*)b, b_field))
+		if (tag_len == 1 && tkey.str[0] == 'p' &&
+		    tval.flag == NDB_PACKED_ID &&
+		    !ndb_write_note_mention(txn, note, tval.id, note_key))
 			return 0;
-	}
 
-	return 1;
-}
+		// without the extended index we only write 1-char tags
+		if (!long_tags && (tag_len > 1 || len > NDB_TAG_VALUE_MAX))
+			continue;
 
-int ndb_filter_eq(const struct ndb_filter *a, const struct ndb_filter *b)
-{
-	int i;
-	struct ndb_filter_elements *a_els, *b_els;
+		if (!(len = ndb_encode_tag_key(key_buffer, sizeof(key_buffer),
+					       tkey.str, tag_len, tval.id, len,
+					       ndb_note_created_at(note)))) {
+			// tag names that are too long aren't indexed
+			continue;
+		}
 
-	if (a->num_elements != b->num_elements)
-		return 0;
+		//ndb_debug("writing tag '%s':'data:%d' to index\n", tkey.str, len);
 
-	for (i = 0; i < a->num_elements; i++) {
-		a_els = ndb_filter_get_elements((struct ndb_filter*)a, i);
-		b_els = ndb_filter_find_elements((struct ndb_filter *)b,
-						 a_els->field.type);
+		key.mv_data = key_buffer;
+		key.mv_size = len;
 
-		if (b_els == NULL)
-			return 0;
+		val.mv_data = &note_key;
+		val.mv_size = sizeof(note_key);
 
-		if (!ndb_filter_field_eq((struct ndb_filter*)a, a_els,
-					 (struct ndb_filter*)b, b_els))
+		if ((rc = mdb_put(txn->mdb_txn, tags_db, &key, &val, 0))) {
+			ndb_debug("write note tag index to db failed: %s\n",
+					mdb_strerror(rc));
 			return 0;
+		}
 	}
 
 	return 1;
 }
 
-
-static uint64_t *
-ndb_filter_get_elem(struct ndb_filter *filter, enum ndb_filter_fieldtype typ)
-{
-	struct ndb_filter_elements *els;
-	if ((els = ndb_filter_find_elements(filter, typ)))
-		return &els->elements[0];
-	return NULL;
-}
-
-static uint64_t *ndb_filter_get_int(struct ndb_filter *filter,
-				    enum ndb_filter_fieldtype typ)
+// Add the normalized hashtags to the tag index under `t`. Most of these
+// are already there as t tags, in which case the put is a noop.
+static int ndb_write_note_hashtag_index(struct ndb_txn *txn,
+					struct ndb_note *note,
+					uint64_t note_key,
+					struct ndb_hashtags *tags)
 {
-	uint64_t *el;
-	if (NULL == (el = ndb_filter_get_elem(filter, typ)))
-		return NULL;
-	return el;
-}
+	unsigned char key_buffer[NDB_TAG_KEY_MAX];
+	MDB_val key, val;
+	int i, len, rc;
 
-static inline int push_query_result(struct ndb_query_results *results,
-				    struct ndb_query_result *result)
-{
-	return cursor_push(&results->cur, (unsigned char*)result, sizeof(*result));
-}
+	for (i = 0; i < tags->count; i++) {
+		if (!(len = ndb_encode_tag_key(key_buffer, sizeof(key_buffer),
+					       "t", 1,
+					       (unsigned char *)tags->tags[i],
+					       strlen(tags->tags[i]),
+					       ndb_note_created_at(note))))
+			continue;
 
-static int compare_query_results(const void *pa, const void *pb)
-{
-	struct ndb_query_result *a, *b;
+		key.mv_data = key_buffer;
+		key.mv_size = len;
 
-	a = (struct ndb_query_result *)pa;
-	b = (struct ndb_query_result *)pb;
+		val.mv_data = &note_key;
+		val.mv_size = sizeof(note_key);
 
-	if (a->note->created_at == b->note->created_at) {
-		return 0;
-	} else if (a->note->created_at > b->note->created_at) {
-		return -1;
-	} else {
-		return 1;
+		if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_TAGS], &key, &val, 0))) {
+			ndb_debug("write note hashtag index failed: %s\n",
+				  mdb_strerror(rc));
+			return 0;
+		}
 	}
+
+	return 1;
 }
 
-static void ndb_query_result_init(struct ndb_query_result *res,
-				  struct ndb_note *note,
-				  uint64_t note_size,
-				  uint64_t note_id)
+// hashtag counts:
+//
+//   u64  bucket (created_at rounded down to NDB_HASHTAG_BUCKET)
+//   [u8] normalized hashtag
+//
+// -> u64 number of notes
+//
+static int ndb_encode_hashtag_count_key(unsigned char *buf, uint64_t bucket,
+					const char *tag)
 {
-	*res = (struct ndb_query_result){
-		.note_id = note_id,
-		.note_size = note_size,
-		.note = note,
-	};
+	int len = strlen(tag);
+
+	memcpy(buf, &bucket, sizeof(bucket));
+	memcpy(buf + sizeof(bucket), tag, len);
+
+	return sizeof(bucket) + len;
 }
 
-static int query_is_full(struct ndb_query_results *results, int limit)
+static int ndb_write_hashtag_counts(struct ndb_txn *txn, struct ndb_note *note,
+				    struct ndb_hashtags *tags)
 {
-	if (results->cur.p >= results->cur.end)
-		return 1;
+	unsigned char key_buffer[8 + NDB_MAX_HASHTAG_LEN];
+	uint64_t bucket, count;
+	MDB_val k, v;
+	MDB_dbi db;
+	int i, rc;
 
-	return cursor_count(&results->cur, sizeof(struct ndb_query_result)) >= limit;
-}
+	db = txn->lmdb->dbs[NDB_DB_HASHTAG_COUNTS];
+	bucket = ndb_note_created_at(note) / NDB_HASHTAG_BUCKET * NDB_HASHTAG_BUCKET;
 
-static int ndb_query_plan_execute_search(struct ndb_txn *txn,
-					 struct ndb_filter *filter,
-					 struct ndb_query_results *results,
-					 int limit)
-{
-	const char *search;
-	int i;
-	struct ndb_text_search_results text_results;
-	struct ndb_text_search_result *text_result;
-	struct ndb_text_search_config config;
-	struct ndb_query_result result;
+	for (i = 0; i < tags->count; i++) {
+		k.mv_data = key_buffer;
+		k.mv_size = ndb_encode_hashtag_count_key(key_buffer, bucket,
+							 tags->tags[i]);
 
-	ndb_default_text_search_config(&config);
+		count = 0;
+		if (mdb_get(txn->mdb_txn, db, &k, &v) == 0)
+			count = *(uint64_t*)v.mv_data;
+		count++;
 
-	if (!(search = ndb_filter_find_search(filter)))
-		return 0;
+		v.mv_data = &count;
+		v.mv_size = sizeof(count);
 
-	if (!ndb_text_search_with(txn, search, &text_results, &config, filter))
-		return 0;
+		if ((rc = mdb_put(txn->mdb_txn, db, &k, &v, 0))) {
+			ndb_debug("write hashtag count failed: %s\n",
+				  mdb_strerror(rc));
+			return 0;
+		}
+	}
 
-	for (i = 0; i < text_results.num_results; i++) {
-		if (query_is_full(results, limit))
-			break;
+	return 1;
+}
 
-		text_result = &text_results.results[i];
+struct ndb_hashtag_tally {
+	const char *tag;
+	int len;
+	uint64_t count;
+};
 
-		result.note = text_result->note;
-		result.note_size = text_result->note_size;
-		result.note_id = text_result->key.note_id;
+static int ndb_hashtag_tally_tag_cmp(const void *a, const void *b)
+{
+	const struct ndb_hashtag_tally *ta = a, *tb = b;
+	int cmp;
 
-		if (!push_query_result(results, &result))
-			break;
-	}
+	if ((cmp = memcmp(ta->tag, tb->tag, min(ta->len, tb->len))))
+		return cmp;
 
-	return 1;
+	return ta->len - tb->len;
 }
 
-static int ndb_query_plan_execute_ids(struct ndb_txn *txn,
-				      struct ndb_filter *filter,
-				      struct ndb_query_results *results,
-				      int limit)
+static int ndb_hashtag_tally_count_cmp(const void *a, const void *b)
+{
+	const struct ndb_hashtag_tally *ta = a, *tb = b;
+
+	if (ta->count != tb->count)
+		return ta->count > tb->count ? -1 : 1;
+
+	return ndb_hashtag_tally_tag_cmp(a, b);
+}
+
+int ndb_trending_hashtags(struct ndb_txn *txn, uint64_t since, uint64_t until,
+			  struct ndb_hashtag_count *results, int capacity,
+			  int *count)
 {
+	struct ndb_hashtag_tally *tally, *p;
+	unsigned char key_buffer[8];
+	uint64_t bucket;
 	MDB_cursor *cur;
-	MDB_dbi db;
 	MDB_val k, v;
-	int rc, i, need_relays = 0;
-	struct ndb_filter_elements *ids;
-	struct ndb_note *note;
-	struct ndb_query_result res;
-	struct ndb_tsid tsid, *ptsid;
-	uint64_t note_id, until, *pint;
-	size_t note_size;
-	unsigned char *id;
-	struct ndb_note_relay_iterator note_relay_iter = {0};
-	struct ndb_note_relay_iterator *relay_iter = NULL;
+	int i, j, n, cap, rc;
 
-	until = UINT64_MAX;
+	*count = 0;
 
-	if (!(ids = ndb_filter_find_elements(filter, NDB_FILTER_IDS)))
+	if ((rc = mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_HASHTAG_COUNTS], &cur))) {
+		ndb_debug("ndb_trending_hashtags: cursor open failed: '%s'\n",
+			  mdb_strerror(rc));
 		return 0;
+	}
 
-	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
-		until = *pint;
-
-	if (ndb_filter_find_elements(filter, NDB_FILTER_RELAYS))
-		need_relays = 1;
-
-	db = txn->lmdb->dbs[NDB_DB_NOTE_ID];
-	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur)))
+	cap = 256;
+	if (!(tally = malloc(cap * sizeof(*tally)))) {
+		mdb_cursor_close(cur);
 		return 0;
+	}
 
-	// for each id in our ids filter, find in the db
-	for (i = 0; i < ids->count; i++) {
-		if (query_is_full(results, limit))
+	bucket = since / NDB_HASHTAG_BUCKET * NDB_HASHTAG_BUCKET;
+	memcpy(key_buffer, &bucket, sizeof(bucket));
+	k.mv_data = key_buffer;
+	k.mv_size = sizeof(key_buffer);
+
+	// the values live in the map, so we can point at the keys directly
+	n = 0;
+	rc = mdb_cursor_get(cur, &k, &v, MDB_SET_RANGE);
+	for (; rc == 0; rc = mdb_cursor_get(cur, &k, &v, MDB_NEXT)) {
+		memcpy(&bucket, k.mv_data, sizeof(bucket));
+		if (bucket >= until)
 			break;
 
-		id = ndb_filter_get_id_element(filter, ids, i);
-		ndb_tsid_init(&tsid, (unsigned char *)id, until);
+		if (n == cap) {
+			cap *= 2;
+			if (!(p = realloc(tally, cap * sizeof(*tally)))) {
+				free(tally);
+				mdb_cursor_close(cur);
+				return 0;
+			}
+			tally = p;
+		}
 
-		k.mv_data = &tsid;
-		k.mv_size = sizeof(tsid);
+		tally[n].tag = (const char *)k.mv_data + sizeof(bucket);
+		tally[n].len = k.mv_size - sizeof(bucket);
+		tally[n].count = *(uint64_t*)v.mv_data;
+		n++;
+	}
 
-		if (!ndb_cursor_start(cur, &k, &v))
-			continue;
+	mdb_cursor_close(cur);
 
-		ptsid = (struct ndb_tsid *)k.mv_data;
-		note_id = *(uint64_t*)v.mv_data;
+	// merge the buckets
+	qsort(tally, n, sizeof(*tally), ndb_hashtag_tally_tag_cmp);
+	for (i = 0, j = 0; i < n; i++) {
+		if (j > 0 && !ndb_hashtag_tally_tag_cmp(&tally[j-1], &tally[i]))
+			tally[j-1].count += tally[i].count;
+		else
+			tally[j++] = tally[i];
+	}
+	n = j;
 
-		if (memcmp(id, ptsid->id, 32))
-			continue;
+	qsort(tally, n, sizeof(*tally), ndb_hashtag_tally_count_cmp);
 
-		// get the note because we need it to match against the filter
-		if (!(note = ndb_get_note_by_key(txn, note_id, &note_size)))
-			continue;
+	for (i = 0; i < n && i < capacity; i++) {
+		memcpy(results[i].hashtag, tally[i].tag, tally[i].len);
+		results[i].hashtag[tally[i].len] = '\0';
+		results[i].count = tally[i].count;
+	}
 
-		relay_iter = need_relays ? &note_relay_iter : NULL;
-		if (relay_iter)
-			ndb_note_relay_iterate_start(txn, relay_iter, note_id);
+	*count = i;
+	free(tally);
 
-		// Sure this particular lookup matched the index query, but
-		// does it match the entire filter? Check! We also pass in
-		// things we've already matched via the filter so we don't have
-		// to check again. This can be pretty important for filters
-		// with a large number of entries.
-		if (!ndb_filter_matches_with(filter, note, 1 << NDB_FILTER_IDS, relay_iter)) {
-			ndb_note_relay_iterate_close(relay_iter);
-			continue;
-		}
-		ndb_note_relay_iterate_close(relay_iter);
+	return 1;
+}
 
-		ndb_query_result_init(&res, note, note_size, note_id);
-		if (!push_query_result(results, &res))
-			break;
+static int ndb_write_note_kind_index(struct ndb_txn *txn, struct ndb_note *note,
+				     uint64_t note_key)
+{
+	struct ndb_u64_ts tsid;
+	int rc;
+	MDB_val key, val;
+	MDB_dbi kind_db;
+
+	ndb_u64_ts_init(&tsid, note->kind, note->created_at);
+
+	key.mv_data = &tsid;
+	key.mv_size = sizeof(tsid);
+	val.mv_data = &note_key;
+	val.mv_size = sizeof(note_key);
+
+	kind_db = txn->lmdb->dbs[NDB_DB_NOTE_KIND];
+
+	if ((rc = mdb_put(txn->mdb_txn, kind_db, &key, &val, 0))) {
+		ndb_debug("write note kind index to db failed: %s\n",
+				mdb_strerror(rc));
+		return 0;
 	}
 
-	mdb_cursor_close(cur);
 	return 1;
 }
 
+// The fulltext index keeps one posting list per term, newest note first.
+// Lists are split into blocks of up to NDB_POSTING_BLOCK_MAX postings, each
+// keyed by its term and its first posting:
 //
-// encode a tag index key
-//
-// consists of:
+//   key:   term \0 ~created_at:be64 ~note_key:be64
+//   value: count:varint, then for each posting
+//            created_at:  varint, delta from the previous posting
+//            note_key:    varint, delta if created_at is the same, or as is
+//            term_freq:   varint
+//            doc_len:     varint, words indexed for the note
+//            pos_size:    varint, bytes of positions that follow
+//            positions:   varints, deltas of the word positions
 //
-//   u8   tag
-//   u8   tag_val_len
-//   [u8] tag_val_bytes
-//   u64  created_at
-//
-static int ndb_encode_tag_key(unsigned char *buf, int buf_size,
-			      char tag, const unsigned char *val,
-			      unsigned char val_len,
-			      uint64_t timestamp)
-{
-	struct cursor writer;
-	int ok;
-
-	// quick exit for obvious case where it will be too big. There can be
-	// values of val_len that still fail, but we just let the writer handle
-	// those failure cases
-	if (val_len >= buf_size)
-		return 0;
+// The first posting's deltas are from the block key. The complemented
+// big-endian key sorts newest-first with a plain memcmp, so a search can
+// seek straight to the block holding any (created_at, note_key).
+struct ndb_posting {
+	uint64_t created_at;
+	uint64_t note_key;
+	uint32_t term_freq;
+	uint32_t doc_len;
+	uint32_t pos_size;
+	const unsigned char *positions;
+};
 
-	make_cursor(buf, buf + buf_size, &writer);
+#define NDB_POSTING_KEY_SIZE(term_len) ((term_len) + 17)
 
-	ok =
-		cursor_push_byte(&writer, tag) &&
-		cursor_push(&writer, (unsigned char*)val, val_len) &&
-		cursor_push(&writer, (unsigned char*)&timestamp, sizeof(timestamp));
+// the biggest a block can encode to while it's being split
+#define NDB_POSTING_BLOCK_SIZE \
+	(10 + (NDB_POSTING_BLOCK_MAX + 1) * (40 + NDB_POSTING_MAX_POSITIONS * 5))
 
-	if (!ok)
-		return 0;
+static void ndb_put_be64(unsigned char *p, uint64_t v)
+{
+	int i;
 
-	return writer.p - writer.start;
+	for (i = 7; i >= 0; i--) {
+		p[i] = v & 0xFF;
+		v >>= 8;
+	}
 }
 
-static int ndb_query_plan_execute_authors(struct ndb_txn *txn,
-					  struct ndb_filter *filter,
-					  struct ndb_query_results *results,
-					  int limit)
+static uint64_t ndb_get_be64(const unsigned char *p)
 {
-	MDB_val k, v;
-	MDB_cursor *cur;
-	int rc, i, need_relays = 0;
-	uint64_t *pint, until, since, note_key;
-	unsigned char *author;
-	struct ndb_note *note;
-	size_t note_size;
-	struct ndb_filter_elements *authors;
-	struct ndb_query_result res;
-	struct ndb_tsid tsid, *ptsid;
-	struct ndb_note_relay_iterator note_relay_iter;
-	enum ndb_dbs db;
+	uint64_t v = 0;
+	int i;
 
-	db = txn->lmdb->dbs[NDB_DB_NOTE_PUBKEY];
+	for (i = 0; i < 8; i++)
+		v = (v << 8) | p[i];
 
-	if (!(authors = ndb_filter_find_elements(filter, NDB_FILTER_AUTHORS)))
-		return 0;
+	return v;
+}
 
-	until = UINT64_MAX;
-	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
-		until = *pint;
+static int ndb_make_posting_key(unsigned char *buf, const char *term,
+				int term_len, uint64_t created_at,
+				uint64_t note_key)
+{
+	memcpy(buf, term, term_len);
+	buf[term_len] = 0;
+	ndb_put_be64(buf + term_len + 1, ~created_at);
+	ndb_put_be64(buf + term_len + 9, ~note_key);
 
-	since = 0;
-	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_SINCE)))
-		since = *pint;
+	return NDB_POSTING_KEY_SIZE(term_len);
+}
 
-	if (ndb_filter_find_elements(filter, NDB_FILTER_RELAYS))
-		need_relays = 1;
+static int ndb_posting_key_term(MDB_val *k, const char **term, int *term_len)
+{
+	const char *p = k->mv_data;
 
-	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur)))
+	if (k->mv_size < NDB_POSTING_KEY_SIZE(1))
 		return 0;
 
-	for (i = 0; i < authors->count; i++) {
-		author = ndb_filter_get_id_element(filter, authors, i);
+	*term_len = k->mv_size - NDB_POSTING_KEY_SIZE(0);
+	if (p[*term_len] != 0)
+		return 0;
 
-		ndb_tsid_init(&tsid, author, until);
+	*term = p;
+	return 1;
+}
 
-		k.mv_data = &tsid;
-		k.mv_size = sizeof(tsid);
+static int ndb_posting_key_is_term(MDB_val *k, const char *term, int term_len)
+{
+	return k->mv_size == (size_t)NDB_POSTING_KEY_SIZE(term_len) &&
+		!memcmp(k->mv_data, term, term_len) &&
+		((const char *)k->mv_data)[term_len] == 0;
+}
 
-		if (!ndb_cursor_start(cur, &k, &v))
-			continue;
+static int ndb_posting_block_decode(MDB_val *k, MDB_val *v,
+				    struct ndb_posting *postings,
+				    int capacity, int *count)
+{
+	struct cursor cur;
+	struct ndb_posting *p;
+	const unsigned char *kp;
+	uint64_t n, created_at, note_key, delta, val;
+	int i;
 
-		// for each id in our ids filter, find in the db
-		while (!query_is_full(results, limit)) {
-			ptsid = (struct ndb_tsid *)k.mv_data;
-			note_key = *(uint64_t*)v.mv_data;
+	kp = (const unsigned char *)k->mv_data + k->mv_size - 16;
+	created_at = ~ndb_get_be64(kp);
+	note_key = ~ndb_get_be64(kp + 8);
 
-			// don't continue the scan if we're below `since`
-			if (ptsid->timestamp < since)
-				break;
+	make_cursor(v->mv_data, (unsigned char *)v->mv_data + v->mv_size, &cur);
 
-			// our author should match, if not bail
-			if (memcmp(author, ptsid->id, 32))
-				break;
+	if (!cursor_pull_varint(&cur, &n) || n > (uint64_t)capacity)
+		return 0;
 
-			// fetch the note, we need it for our query results
-			// and to match further against the filter
-			if (!(note = ndb_get_note_by_key(txn, note_key, &note_size)))
-				goto next;
+	for (i = 0; i < (int)n; i++) {
+		p = &postings[i];
 
-			if (need_relays)
-				ndb_note_relay_iterate_start(txn, &note_relay_iter, note_key);
+		if (!cursor_pull_varint(&cur, &delta) ||
+		    !cursor_pull_varint(&cur, &val))
+			return 0;
 
-			if (!ndb_filter_matches_with(filter, note,
-						     1 << NDB_FILTER_AUTHORS,
-						     need_relays ? &note_relay_iter : NULL))
-			{
-				goto next;
-			}
+		if (delta) {
+			created_at -= delta;
+			note_key = val;
+		} else {
+			note_key -= val;
+		}
 
-			ndb_query_result_init(&res, note, note_size, note_key);
-			if (!push_query_result(results, &res))
-				break;
+		p->created_at = created_at;
+		p->note_key = note_key;
 
-next:
-			if (mdb_cursor_get(cur, &k, &v, MDB_PREV))
-				break;
-		}
+		if (!cursor_pull_varint_u32(&cur, &p->term_freq) ||
+		    !cursor_pull_varint_u32(&cur, &p->doc_len) ||
+		    !cursor_pull_varint_u32(&cur, &p->pos_size))
+			return 0;
+
+		// the positions can run right up to the end of the block
+		p->positions = cur.p;
+		if (cur.p + p->pos_size > cur.end)
+			return 0;
+		cur.p += p->pos_size;
 	}
 
-	mdb_cursor_close(cur);
+	*count = n;
 	return 1;
 }
 
-static int ndb_query_plan_execute_created_at(struct ndb_txn *txn,
-					     struct ndb_filter *filter,
-					     struct ndb_query_results *results,
-					     int limit)
+static int ndb_posting_block_encode(struct ndb_posting *postings, int count,
+				    unsigned char *buf, int bufsize, int *size)
 {
-	MDB_dbi db;
-	MDB_val k, v;
-	MDB_cursor *cur;
-	int rc, need_relays = 0;
-	struct ndb_note *note;
-	struct ndb_tsid key, *pkey;
-	uint64_t *pint, until, since, note_id;
-	size_t note_size;
-	struct ndb_query_result res;
-	struct ndb_note_relay_iterator note_relay_iter;
-	unsigned char high_key[32] = {0xFF};
+	struct cursor cur;
+	struct ndb_posting *p, *prev;
+	uint64_t delta;
+	int i;
 
-	db = txn->lmdb->dbs[NDB_DB_NOTE_ID];
+	make_cursor(buf, buf + bufsize, &cur);
+
+	if (cursor_push_varint(&cur, count) < 0)
+		return 0;
+
+	prev = &postings[0];
+	for (i = 0; i < count; i++) {
+		p = &postings[i];
+		delta = prev->created_at - p->created_at;
+
+		if (cursor_push_varint(&cur, delta) < 0)
+			return 0;
 
-	until = UINT64_MAX;
-	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
-		until = *pint;
+		if (cursor_push_varint(&cur, delta ? p->note_key
+					: prev->note_key - p->note_key) < 0)
+			return 0;
 
-	since = 0;
-	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_SINCE)))
-		since = *pint;
+		if (cursor_push_varint(&cur, p->term_freq) < 0 ||
+		    cursor_push_varint(&cur, p->doc_len) < 0 ||
+		    cursor_push_varint(&cur, p->pos_size) < 0 ||
+		    !cursor_push(&cur, (unsigned char *)p->positions,
+				 p->pos_size))
+			return 0;
 
-	if (ndb_filter_find_elements(filter, NDB_FILTER_RELAYS))
-		need_relays = 1;
+		prev = p;
+	}
 
-	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur)))
-		return 0;
+	*size = cur.p - cur.start;
+	return 1;
+}
 
-	// if we have until, start there, otherwise just use max
-	ndb_tsid_init(&key, high_key, until);
-	k.mv_data = &key;
-	k.mv_size = sizeof(key);
+// Position the cursor on the block of the term that would hold `key`: the
+// last one starting at or before it, or else the term's first block.
+static int ndb_posting_seek_block(MDB_cursor *cur, const char *term,
+				  int term_len, MDB_val *key,
+				  MDB_val *k, MDB_val *v)
+{
+	int rc;
 
-	if (!ndb_cursor_start(cur, &k, &v))
+	*k = *key;
+	rc = mdb_cursor_get(cur, k, v, MDB_SET_RANGE);
+	if (rc == 0 && k->mv_size == key->mv_size &&
+	    !memcmp(k->mv_data, key->mv_data, key->mv_size))
 		return 1;
 
-	while (!query_is_full(results, limit)) {
-		pkey = (struct ndb_tsid *)k.mv_data;
-		note_id = *(uint64_t*)v.mv_data;
-		assert(v.mv_size == 8);
-
-		// don't continue the scan if we're below `since`
-		if (pkey->timestamp < since)
-			break;
+	if (mdb_cursor_get(cur, k, v, rc == 0 ? MDB_PREV : MDB_LAST) == 0 &&
+	    ndb_posting_key_is_term(k, term, term_len))
+		return 1;
 
-		if (!(note = ndb_get_note_by_key(txn, note_id, &note_size)))
-			goto next;
+	*k = *key;
+	return mdb_cursor_get(cur, k, v, MDB_SET_RANGE) == 0 &&
+		ndb_posting_key_is_term(k, term, term_len);
+}
 
-		if (need_relays)
-			ndb_note_relay_iterate_start(txn, &note_relay_iter, note_id);
+static int ndb_posting_put_block(struct ndb_txn *txn, MDB_dbi db,
+				 const char *term, int term_len,
+				 struct ndb_posting *first,
+				 unsigned char *buf, int size)
+{
+	unsigned char key[NDB_POSTING_KEY_SIZE(NDB_TERM_MAX)];
+	MDB_val k, v;
+	int rc;
 
-		// does this entry match our filter?
-		if (!ndb_filter_matches_with(filter, note, 0, need_relays ? &note_relay_iter : NULL))
-			goto next;
+	k.mv_data = key;
+	k.mv_size = ndb_make_posting_key(key, term, term_len,
+					 first->created_at, first->note_key);
+	v.mv_data = buf;
+	v.mv_size = size;
 
-		ndb_query_result_init(&res, note, (uint64_t)note_size, note_id);
-		if (!push_query_result(results, &res))
-			break;
-next:
-		if (mdb_cursor_get(cur, &k, &v, MDB_PREV))
-			break;
+	if ((rc = mdb_put(txn->mdb_txn, db, &k, &v, 0))) {
+		ndb_debug("write posting block failed: %s\n", mdb_strerror(rc));
+		return 0;
 	}
 
-	mdb_cursor_close(cur);
 	return 1;
 }
 
-static int ndb_query_plan_execute_tags(struct ndb_txn *txn,
-				       struct ndb_filter *filter,
-				       struct ndb_query_results *results,
-				       int limit)
+// Add a posting to the term's list, splitting its block in half when it
+// gets too big. `added` is cleared if the note was already in the list.
+static int ndb_posting_insert(struct ndb_txn *txn, MDB_cursor *cur,
+			      const char *term, int term_len,
+			      struct ndb_posting *posting,
+			      struct ndb_posting *block, unsigned char *buf,
+			      int *added)
 {
-	MDB_cursor *cur;
+	unsigned char key[NDB_POSTING_KEY_SIZE(NDB_TERM_MAX)];
+	unsigned char old_key[NDB_POSTING_KEY_SIZE(NDB_TERM_MAX)];
+	int i, cmp, rc, count, found, half, sizes[2];
+	MDB_val k, v, search;
 	MDB_dbi db;
-	MDB_val k, v;
-	int len, taglen, rc, i, need_relays = 0;
-	uint64_t *pint, until, note_id;
-	size_t note_size;
-	unsigned char key_buffer[255];
-	struct ndb_note *note;
-	struct ndb_filter_elements *tags;
-	unsigned char *tag;
-	struct ndb_query_result res;
-	struct ndb_note_relay_iterator note_relay_iter;
 
-	db = txn->lmdb->dbs[NDB_DB_NOTE_TAGS];
+	db = txn->lmdb->dbs[NDB_DB_NOTE_POSTINGS];
+	search.mv_data = key;
+	search.mv_size = ndb_make_posting_key(key, term, term_len,
+					      posting->created_at,
+					      posting->note_key);
 
-	if (!(tags = ndb_filter_find_elements(filter, NDB_FILTER_TAGS)))
-		return 0;
+	count = 0;
+	*added = 0;
+	found = ndb_posting_seek_block(cur, term, term_len, &search, &k, &v);
+	if (found) {
+		if (!ndb_posting_block_decode(&k, &v, block,
+					      NDB_POSTING_BLOCK_MAX, &count)) {
+			ndb_debug("corrupt posting block for '%.*s'\n",
+				  term_len, term);
+			return 0;
+		}
+		memcpy(old_key, k.mv_data, k.mv_size);
+	}
 
-	if (ndb_filter_find_elements(filter, NDB_FILTER_RELAYS))
-		need_relays = 1;
+	for (i = 0; i < count; i++) {
+		cmp = ndb_ts_key_cmp(block[i].created_at, block[i].note_key,
+				     posting->created_at, posting->note_key);
+		if (cmp == 0)
+			return 1; // already indexed
+		if (cmp > 0)
+			break;
+	}
 
-	until = UINT64_MAX;
-	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
-		until = *pint;
+	memmove(&block[i + 1], &block[i], (count - i) * sizeof(block[0]));
+	block[i] = *posting;
+	count++;
 
-	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur)))
+	// encode before we touch the db, the old postings point into it
+	half = count > NDB_POSTING_BLOCK_MAX ? count / 2 : count;
+	if (!ndb_posting_block_encode(block, half, buf,
+				      NDB_POSTING_BLOCK_SIZE, &sizes[0]))
+		return 0;
+	if (half < count && !ndb_posting_block_encode(&block[half],
+				count - half, buf + sizes[0],
+				NDB_POSTING_BLOCK_SIZE, &sizes[1]))
 		return 0;
 
-	for (i = 0; i < tags->count; i++) {
-		tag = ndb_filter_get_id_element(filter, tags, i);
-
-		taglen = tags->field.elem_type == NDB_ELEMENT_ID
-		       ? 32 : strlen((const char*)tag);
-
-		if (!(len = ndb_encode_tag_key(key_buffer, sizeof(key_buffer),
-					       tags->field.tag, tag, taglen,
-					       until))) {
-			goto fail;
+	if (found) {
+		k.mv_data = old_key;
+		k.mv_size = NDB_POSTING_KEY_SIZE(term_len);
+		if ((rc = mdb_del(txn->mdb_txn, db, &k, NULL))) {
+			ndb_debug("delete posting block failed: %s\n",
+				  mdb_strerror(rc));
+			return 0;
 		}
+	}
 
-		k.mv_data = key_buffer;
-		k.mv_size = len;
+	if (!ndb_posting_put_block(txn, db, term, term_len, block, buf,
+				   sizes[0]))
+		return 0;
 
-		if (!ndb_cursor_start(cur, &k, &v))
-			continue;
+	if (half < count && !ndb_posting_put_block(txn, db, term, term_len,
+						   &block[half],
+						   buf + sizes[0], sizes[1]))
+		return 0;
 
-		// for each id in our ids filter, find in the db
-		while (!query_is_full(results, limit)) {
-			// check if tag value matches, bail if not
-			if (((unsigned char *)k.mv_data)[0] != tags->field.tag)
-				break;
+	*added = 1;
+	return 1;
+}
 
-			// check if tag value matches, bail if not
-			if (taglen != k.mv_size - 9)
-				break;
+// The term stats db has how many notes each term is in, and the totals for
+// the whole index under a single \0 byte, which is never a term. Ranked
+// searches need both for BM25.
+struct ndb_fulltext_totals {
+	uint64_t notes;
+	uint64_t words;
+};
 
-			if (memcmp((unsigned char *)k.mv_data+1, tag, k.mv_size-9))
-				break;
+static const char ndb_fulltext_totals_key[1] = { 0 };
 
-			note_id = *(uint64_t*)v.mv_data;
+static int ndb_get_term_stat(struct ndb_txn *txn, const char *key, int key_len,
+			     void *stat, size_t size)
+{
+	MDB_val k, v;
 
-			if (!(note = ndb_get_note_by_key(txn, note_id, &note_size)))
-				goto next;
+	k.mv_data = (void *)key;
+	k.mv_size = key_len;
 
-			if (need_relays)
-				ndb_note_relay_iterate_start(txn, &note_relay_iter, note_id);
+	if (mdb_get(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_TERM_STATS],
+		    &k, &v) || v.mv_size != size) {
+		memset(stat, 0, size);
+		return 0;
+	}
 
-			if (!ndb_filter_matches_with(filter, note,
-						     1 << NDB_FILTER_TAGS,
-						     need_relays ? &note_relay_iter : NULL))
-				goto next;
+	// values aren't aligned
+	memcpy(stat, v.mv_data, size);
+	return 1;
+}
 
-			ndb_query_result_init(&res, note, note_size, note_id);
-			if (!push_query_result(results, &res))
-				break;
+static int ndb_put_term_stat(struct ndb_txn *txn, const char *key, int key_len,
+			     void *stat, size_t size)
+{
+	MDB_val k, v;
+	int rc;
 
-next:
-			if (mdb_cursor_get(cur, &k, &v, MDB_PREV))
-				break;
-		}
+	k.mv_data = (void *)key;
+	k.mv_size = key_len;
+	v.mv_data = stat;
+	v.mv_size = size;
+
+	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_TERM_STATS],
+			  &k, &v, 0))) {
+		ndb_debug("write term stats failed: %s\n", mdb_strerror(rc));
+		return 0;
 	}
 
-	mdb_cursor_close(cur);
 	return 1;
-fail:
-	mdb_cursor_close(cur);
-	return 0;
 }
 
-static int ndb_query_plan_execute_author_kinds(
-		struct ndb_txn *txn,
-		struct ndb_filter *filter,
-		struct ndb_query_results *results,
-		int limit)
+static uint64_t ndb_get_term_doc_freq(struct ndb_txn *txn, const char *term,
+				      int term_len)
 {
-	MDB_cursor *cur;
-	MDB_dbi db;
-	MDB_val k, v;
-	struct ndb_note *note;
-	struct ndb_filter_elements *kinds, *relays, *authors;
-	struct ndb_query_result res;
-	uint64_t kind, note_id, until, since, *pint;
-	size_t note_size;
-	unsigned char *author;
-	int i, j, rc;
-	struct ndb_id_u64_ts key, *pkey;
-	struct ndb_note_relay_iterator note_relay_iter;
+	uint64_t freq;
+	ndb_get_term_stat(txn, term, term_len, &freq, sizeof(freq));
+	return freq;
+}
 
-	// we should have kinds in a kinds filter!
-	if (!(kinds = ndb_filter_find_elements(filter, NDB_FILTER_KINDS)))
-		return 0;
-	//
-	// we should have kinds in a kinds filter!
-	if (!(authors = ndb_filter_find_elements(filter, NDB_FILTER_AUTHORS)))
-		return 0;
+static int ndb_incr_term_doc_freq(struct ndb_txn *txn, const char *term,
+				  int term_len)
+{
+	uint64_t freq;
 
-	relays = ndb_filter_find_elements(filter, NDB_FILTER_RELAYS);
+	freq = ndb_get_term_doc_freq(txn, term, term_len) + 1;
+	return ndb_put_term_stat(txn, term, term_len, &freq, sizeof(freq));
+}
 
-	until = UINT64_MAX;
-	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
-		until = *pint;
+static void ndb_get_fulltext_totals(struct ndb_txn *txn,
+				    struct ndb_fulltext_totals *totals)
+{
+	ndb_get_term_stat(txn, ndb_fulltext_totals_key,
+			  sizeof(ndb_fulltext_totals_key), totals,
+			  sizeof(*totals));
+}
 
-	since = 0;
-	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_SINCE)))
-		since = *pint;
+static int ndb_add_fulltext_totals(struct ndb_txn *txn, uint64_t words)
+{
+	struct ndb_fulltext_totals totals;
 
-	db = txn->lmdb->dbs[NDB_DB_NOTE_PUBKEY_KIND];
+	ndb_get_fulltext_totals(txn, &totals);
+	totals.notes++;
+	totals.words += words;
 
-	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur)))
+	return ndb_put_term_stat(txn, ndb_fulltext_totals_key,
+				 sizeof(ndb_fulltext_totals_key), &totals,
+				 sizeof(totals));
+}
+
+static int ndb_get_fulltext_state(struct ndb_txn *txn,
+				  struct ndb_fulltext_state *state)
+{
+	uint64_t meta_key = NDB_META_KEY_FULLTEXT;
+	MDB_val k, v;
+
+	k.mv_data = &meta_key;
+	k.mv_size = sizeof(meta_key);
+
+	if (mdb_get(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NDB_META], &k, &v) ||
+	    v.mv_size != sizeof(*state))
 		return 0;
 
-	for (j = 0; j < authors->count; j++) {
-		if (query_is_full(results, limit))
-			break;
+	memcpy(state, v.mv_data, sizeof(*state));
+	return 1;
+}
 
-		if (!(author = ndb_filter_get_id_element(filter, authors, j)))
-			continue;
+static int ndb_put_fulltext_state(struct ndb_txn *txn,
+				  struct ndb_fulltext_state *state)
+{
+	uint64_t meta_key = NDB_META_KEY_FULLTEXT;
+	MDB_val k, v;
+	int rc;
 
-	for (i = 0; i < kinds->count; i++) {
-		if (query_is_full(results, limit))
-			break;
+	k.mv_data = &meta_key;
+	k.mv_size = sizeof(meta_key);
+	v.mv_data = state;
+	v.mv_size = sizeof(*state);
 
-		kind = kinds->elements[i];
+	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NDB_META],
+			  &k, &v, 0))) {
+		ndb_debug("write fulltext state failed: %s\n", mdb_strerror(rc));
+		return 0;
+	}
 
-		ndb_debug("finding kind %"PRIu64"\n", kind);
+	return 1;
+}
 
-		ndb_id_u64_ts_init(&key, author, kind, until);
-		
-		k.mv_data = &key;
-		k.mv_size = sizeof(key);
+// the state of an index of the configured kinds, up to `high_water`
+static void ndb_fulltext_state_init(struct ndb_fulltext_state *state,
+				    struct ndb_lmdb *lmdb, uint64_t high_water)
+{
+	memset(state, 0, sizeof(*state));
+	state->high_water = high_water;
+	state->num_kinds = lmdb->num_fulltext_kinds;
+	memcpy(state->kinds, lmdb->fulltext_kinds,
+	       lmdb->num_fulltext_kinds * sizeof(*state->kinds));
+}
 
-		if (!ndb_cursor_start(cur, &k, &v))
-			continue;
+static int ndb_fulltext_state_has_kind(struct ndb_fulltext_state *state,
+				       uint64_t kind)
+{
+	uint64_t i;
 
-		// scan the kind subindex
-		while (!query_is_full(results, limit)) {
-			pkey = (struct ndb_id_u64_ts*)k.mv_data;
+	for (i = 0; i < state->num_kinds; i++) {
+		if (state->kinds[i] == kind)
+			return 1;
+	}
 
-			ndb_debug("scanning subindex kind:%"PRIu64" created_at:%"PRIu64" pubkey:",
-					pkey->u64,
-					pkey->timestamp);
+	return 0;
+}
 
-			if (pkey->u64 != kind)
-				break;
+uint64_t ndb_fulltext_indexed_key(struct ndb_txn *txn)
+{
+	struct ndb_fulltext_state state;
 
-			// don't continue the scan if we're below `since`
-			if (pkey->timestamp < since)
-				break;
+	if (!ndb_get_fulltext_state(txn, &state))
+		return 0;
 
-			if (memcmp(pkey->id, author, 32))
-				break;
+	return state.high_water;
+}
 
-			note_id = *(uint64_t*)v.mv_data;
-			if (!(note = ndb_get_note_by_key(txn, note_id, &note_size)))
-				goto next;
+// A word as the tokenizer found it, folded for searching. `raw` is where
+// it came from in the text.
+struct ndb_word {
+	const char *str;
+	int len;
+	const char *raw;
+	int raw_len;
+	int index;
+	int cjk; // a run of cjk characters, see ndb_tokenize
+};
 
-			if (relays)
-				ndb_note_relay_iterate_start(txn, &note_relay_iter, note_id);
+// Break a string into words for querying or for building the fulltext
+// index, folding case and accents as we go. Folded words are written to
+// `out`, which needs to be as big as the text. Chinese and japanese don't
+// separate words with spaces, so runs of cjk characters come through as one
+// word that takes up a position per character, and get split into pairs of
+// characters by whoever is indexing or searching for them.
+static int ndb_tokenize(const char *text, int text_len, char *out, void *ctx,
+			ndb_word_parser_fn fn)
+{
+	const unsigned char *p, *c, *end, *raw_start, *raw_end;
+	enum ndb_char_class cls, word_cls;
+	struct ndb_word word;
+	unsigned char *o, *w;
+	int index, chars;
+	uint32_t cp;
+
+	p = (const unsigned char *)text;
+	end = p + text_len;
+	o = w = (unsigned char *)out;
+	raw_start = raw_end = p;
+	word_cls = NDB_CHAR_SEP;
+	index = chars = 0;
+
+	for (;;) {
+		c = p;
+		if (p < end) {
+			p += ndb_utf8_decode(p, end, &cp);
+			cls = ndb_fold_char(&cp);
+			if (cls == NDB_CHAR_IGNORE) {
+				if (o > w)
+					raw_end = p;
+				continue;
+			}
+		} else {
+			cls = NDB_CHAR_SEP;
+		}
 
-			if (!ndb_filter_matches_with(filter, note,
-						     (1 << NDB_FILTER_KINDS) | (1 << NDB_FILTER_AUTHORS),
-						     relays? &note_relay_iter : NULL))
-				goto next;
+		if (cls != word_cls && o > w) {
+			word.str = (const char *)w;
+			word.len = o - w;
+			word.raw = (const char *)raw_start;
+			word.raw_len = raw_end - raw_start;
+			word.index = index;
+			word.cjk = word_cls == NDB_CHAR_CJK;
 
-			ndb_query_result_init(&res, note, note_size, note_id);
-			if (!push_query_result(results, &res))
-				break;
+			if (!fn(ctx, &word))
+				return 0;
 
-next:
-			if (mdb_cursor_get(cur, &k, &v, MDB_PREV))
-				break;
+			index += word.cjk ? chars : 1;
+			w = o;
+			chars = 0;
 		}
-	}
+
+		if (c >= end)
+			break;
+
+		word_cls = cls;
+		if (cls == NDB_CHAR_SEP)
+			continue;
+
+		if (o == w)
+			raw_start = c;
+		o += ndb_utf8_encode(cp, (unsigned char *)o);
+		raw_end = p;
+		chars++;
 	}
 
-	mdb_cursor_close(cur);
 	return 1;
 }
 
-static int ndb_query_plan_execute_profile_search(
-		struct ndb_txn *txn,
-		struct ndb_filter *filter,
-		struct ndb_query_results *results,
-		int limit)
+struct ndb_term_occurrence
 {
-	const char *search;
-	int i;
+	const char *term;
+	int len;
+	int pos;
+};
+
+struct ndb_term_collector
+{
+	struct ndb_term_occurrence *terms;
+	int num_terms;
+	int capacity;
+};
+
+// Single letters aren't worth indexing, in any script. A single cjk
+// character is a word of its own, so those still are.
+static int ndb_word_is_letter(struct ndb_word *word)
+{
+	return !word->cjk && ndb_utf8_char_len(word->str) >= word->len;
+}
 
-	// The filter pubkey is updated inplace for each note search
-	unsigned char *filter_pubkey;
-	unsigned char pubkey[32] = {0};
-	struct ndb_filter_elements *els;
-	struct ndb_search profile_search;
-	struct ndb_filter note_filter, *f = &note_filter;
+static int ndb_add_term(struct ndb_term_collector *c, const char *term,
+			int len, int pos)
+{
+	struct ndb_term_occurrence *t;
 
-	if (!(search = ndb_filter_find_search(filter)))
+	if (c->num_terms == c->capacity)
 		return 0;
 
-	if (!ndb_filter_init_with(f, 1))
-		return 0;
+	t = &c->terms[c->num_terms++];
+	t->term = term;
+	t->len = ndb_utf8_truncate(term, len, NDB_TERM_MAX);
+	t->pos = pos;
 
-	ndb_filter_start_field(f, NDB_FILTER_KINDS);
-	ndb_filter_add_int_element(f, 0);
-	ndb_filter_end_field(f);
+	return 1;
+}
 
-	ndb_filter_start_field(f, NDB_FILTER_AUTHORS);
-	ndb_filter_add_id_element(f, pubkey);
-	ndb_filter_end_field(f);
-	ndb_filter_end(f);
+// Runs of cjk characters are indexed as every pair of characters next to
+// each other, plus the last one on its own so a single character can
+// always be found by prefix.
+static int ndb_collect_term(void *ctx, struct ndb_word *word)
+{
+	struct ndb_term_collector *c = ctx;
+	const char *p, *end;
+	int a, b, pos;
 
-	// get the authors element after we finalize the filter, since
-	// the data could have moved
-	if (!(els = ndb_filter_find_elements(f, NDB_FILTER_AUTHORS)))
-		goto fail;
+	// single letters still take up a position so that phrases line up
+	if (ndb_word_is_letter(word))
+		return 1;
 
-	// grab pointer to pubkey in the filter so that we can
-	// update the filter as we go
-	if (!(filter_pubkey = ndb_filter_get_id_element(f, els, 0)))
-		goto fail;
+	if (!word->cjk)
+		return ndb_add_term(c, word->str, word->len, word->index);
 
-	for (i = 0; !query_is_full(results, limit); i++) {
-		if (i == 0) {
-			if (!ndb_search_profile(txn, &profile_search, search))
-				break;
-		} else {
-			if (!ndb_search_profile_next(&profile_search))
-				break;
-		}
+	p = word->str;
+	end = p + word->len;
+	pos = word->index;
 
-		// Copy pubkey into filter
-		memcpy(filter_pubkey, profile_search.key->id, 32);
+	for (;;) {
+		a = ndb_utf8_char_len(p);
+		if (p + a >= end)
+			return ndb_add_term(c, p, end - p, pos);
 
-		// Look up the corresponding note associated with that pubkey
-		if (!ndb_query_plan_execute_author_kinds(txn, f, results, limit))
-			goto fail;
+		b = ndb_utf8_char_len(p + a);
+		if (!ndb_add_term(c, p, a + b, pos++))
+			return 0;
+		p += a;
 	}
-
-	ndb_search_profile_end(&profile_search);
-	ndb_filter_destroy(f);
-	return 1;
-
-fail:
-	ndb_filter_destroy(f);
-	return 0;
 }
 
-static int ndb_query_plan_execute_relay_kinds(
-		struct ndb_txn *txn,
-		struct ndb_filter *filter,
-		struct ndb_query_results *results,
-		int limit)
+static int ndb_term_occurrence_cmp(const void *pa, const void *pb)
 {
-	MDB_cursor *cur;
-	MDB_dbi db;
-	MDB_val k, v;
-	struct ndb_note *note;
-	struct ndb_filter_elements *kinds, *relays;
-	struct ndb_query_result res;
-	uint64_t kind, note_id, until, since, *pint;
-	size_t note_size;
-	const char *relay;
-	int i, j, rc, len;
-	struct ndb_relay_kind_key relay_key;
-	unsigned char keybuf[256];
+	const struct ndb_term_occurrence *a = pa, *b = pb;
+	int cmp;
 
-	// we should have kinds in a kinds filter!
-	if (!(kinds = ndb_filter_find_elements(filter, NDB_FILTER_KINDS)))
-		return 0;
+	if ((cmp = memcmp(a->term, b->term, min(a->len, b->len))))
+		return cmp;
 
-	if (!(relays = ndb_filter_find_elements(filter, NDB_FILTER_RELAYS)))
-		return 0;
+	if (a->len != b->len)
+		return a->len < b->len ? -1 : 1;
 
-	until = UINT64_MAX;
-	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
-		until = *pint;
+	return a->pos - b->pos;
+}
 
-	since = 0;
-	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_SINCE)))
-		since = *pint;
+static int cursor_push_unescaped_char(struct cursor *cur, char c1, char c2);
 
-	db = txn->lmdb->dbs[NDB_DB_NOTE_RELAY_KIND];
+// Unescape the about field of a profile's json into `out`, which needs to
+// be as big as the json. Returns its length, 0 if there isn't one.
+static int ndb_profile_about(const char *json, int json_len, char *out)
+{
+	jsmntok_t stack_toks[256], *toks, *key, *val;
+	jsmn_parser parser;
+	struct cursor cur;
+	const char *p, *end;
+	unsigned char hex;
+	uint32_t cp;
+	int i, j, n, start, about_end;
+
+	// most profiles fit on the stack, count the tokens in bigger ones
+	toks = stack_toks;
+	jsmn_init(&parser);
+	n = jsmn_parse(&parser, json, json_len, toks,
+		       sizeof(stack_toks) / sizeof(stack_toks[0]), 0);
+	if (n == JSMN_ERROR_NOMEM) {
+		jsmn_init(&parser);
+		if ((n = jsmn_parse(&parser, json, json_len, NULL, 0, 0)) < 1 ||
+		    !(toks = malloc(n * sizeof(*toks))))
+			return 0;
+		jsmn_init(&parser);
+		n = jsmn_parse(&parser, json, json_len, toks, n, 0);
+	}
+
+	start = about_end = 0;
+	if (n >= 1 && toks[0].type == JSMN_OBJECT) {
+		for (i = 1; i + 1 < n; i++) {
+			key = &toks[i];
+			val = &toks[i + 1];
+			if (key->parent == 0 && key->type == JSMN_STRING &&
+			    val->type == JSMN_STRING &&
+			    key->end - key->start == 5 &&
+			    !memcmp(json + key->start, "about", 5)) {
+				start = val->start;
+				about_end = val->end;
+				break;
+			}
+		}
+	}
 
-	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur)))
+	if (toks != stack_toks)
+		free(toks);
+
+	if (about_end == 0)
 		return 0;
 
-	for (j = 0; j < relays->count; j++) {
-		if (query_is_full(results, limit))
-			break;
+	make_cursor((unsigned char *)out, (unsigned char *)out + json_len, &cur);
+	p = json + start;
+	end = json + about_end;
 
-		if (!(relay = ndb_filter_get_string_element(filter, relays, j)))
-			continue;
+	while (p < end) {
+		if (*p != '\\' || p + 1 == end) {
+			cursor_push_byte(&cur, *p++);
+		} else if (p[1] != 'u') {
+			cursor_push_unescaped_char(&cur, p[0], p[1]);
+			p += 2;
+		} else {
+			// decode unicode escapes. surrogates and anything
+			// malformed just break words
+			cp = 0;
+			for (j = 2; j < 6 && p + j < end &&
+				    char_to_hex(&hex, p[j]); j++)
+				cp = (cp << 4) | hex;
+			if (j < 6 || (cp >= 0xD800 && cp <= 0xDFFF))
+				cp = ' ';
+			cur.p += ndb_utf8_encode(cp, cur.p);
+			p += j;
+		}
+	}
 
-	for (i = 0; i < kinds->count; i++) {
-		if (query_is_full(results, limit))
-			break;
+	return cur.p - cur.start;
+}
 
-		kind = kinds->elements[i];
-		ndb_debug("kind %" PRIu64 "\n", kind);
-		
-		if (!ndb_relay_kind_key_init_high(&relay_key, relay, kind, until)) {
-			ndb_debug("ndb_relay_kind_key_init_high failed in relay query\n");
-			continue;
-		}
+static int ndb_write_note_fulltext_index(struct ndb_txn *txn,
+					 struct ndb_note *note,
+					 uint64_t note_key,
+					 unsigned char *scratch,
+					 size_t scratch_size)
+{
+	unsigned char positions[NDB_POSTING_MAX_POSITIONS * 5], *buf;
+	struct ndb_term_occurrence *t, *end;
+	struct ndb_term_collector terms;
+	struct ndb_posting posting, *block;
+	struct cursor pos_cur;
+	struct ndb_str str;
+	MDB_cursor *mdb_cur;
+	size_t used, about_size;
+	const char *text;
+	char *content;
+	int i, rc, ok, last_pos, added, any_added, text_len;
 
-		if (!(len = ndb_build_relay_kind_key(keybuf, sizeof(keybuf), &relay_key))) {
-			ndb_debug("ndb_build_relay_kind_key failed in relay query\n");
-			ndb_debug_relay_kind_key(&relay_key);
-			continue;
-		}
+	str = ndb_note_str(note, &note->content);
+	// I don't think this should happen?
+	if (unlikely(str.flag == NDB_PACKED_ID))
+		return 0;
 
-		k.mv_data = keybuf;
-		k.mv_size = len;
+	// profiles are json, only their about field gets indexed
+	about_size = note->kind == 0 ? note->content_length : 0;
 
-		ndb_debug("starting with key ");
-		ndb_debug_relay_kind_key(&relay_key);
+	// scratch holds the block we're updating, its encoded halves, a
+	// folded copy of the content and the words we find in it
+	used = (NDB_POSTING_BLOCK_MAX + 1) * sizeof(*block) +
+		2 * NDB_POSTING_BLOCK_SIZE + note->content_length + about_size;
+	used = (used + 7) & ~7;
+	if (used + sizeof(*terms.terms) > scratch_size) {
+		ndb_debug("note too big for the fulltext index\n");
+		return 1;
+	}
 
-		if (!ndb_cursor_start(cur, &k, &v))
-			continue;
+	block = (struct ndb_posting *)scratch;
+	buf = scratch + (NDB_POSTING_BLOCK_MAX + 1) * sizeof(*block);
+	content = (char *)buf + 2 * NDB_POSTING_BLOCK_SIZE;
+	terms.terms = (struct ndb_term_occurrence *)(scratch + used);
+	terms.capacity = (scratch_size - used) / sizeof(*terms.terms);
+	terms.num_terms = 0;
 
-		// scan the kind subindex
-		while (!query_is_full(results, limit)) {
-			ndb_parse_relay_kind_key(&relay_key, k.mv_data);
+	text = str.str;
+	text_len = note->content_length;
+	if (about_size) {
+		text = content + note->content_length;
+		text_len = ndb_profile_about(str.str, note->content_length,
+					     content + note->content_length);
+	}
 
-			ndb_debug("inside kind subindex ");
-			ndb_debug_relay_kind_key(&relay_key);
+	ndb_tokenize(text, text_len, content, &terms, ndb_collect_term);
 
-			if (relay_key.kind != kind)
-				break;
+	if (terms.num_terms == 0)
+		return 1;
 
-			if (strcmp(relay_key.relay, relay))
-				break;
+	// group each term's positions together
+	qsort(terms.terms, terms.num_terms, sizeof(*terms.terms),
+	      ndb_term_occurrence_cmp);
 
-			// don't continue the scan if we're below `since`
-			if (relay_key.created_at < since)
-				break;
+	if ((rc = mdb_cursor_open(txn->mdb_txn,
+				  txn->lmdb->dbs[NDB_DB_NOTE_POSTINGS],
+				  &mdb_cur))) {
+		ndb_debug("fulltext index: mdb_cursor_open failed: %s\n",
+			  mdb_strerror(rc));
+		return 0;
+	}
 
-			note_id = relay_key.note_key;
-			if (!(note = ndb_get_note_by_key(txn, note_id, &note_size)))
-				goto next;
+	posting.created_at = note->created_at;
+	posting.note_key = note_key;
+	posting.doc_len = terms.num_terms;
+	posting.positions = positions;
+	ok = 1;
+	any_added = 0;
 
-			if (!ndb_filter_matches_with(filter, note,
-						     (1 << NDB_FILTER_KINDS) | (1 << NDB_FILTER_RELAYS),
-						     NULL))
-				goto next;
+	end = terms.terms + terms.num_terms;
+	for (t = terms.terms; t < end; t += posting.term_freq) {
+		make_cursor(positions, positions + sizeof(positions), &pos_cur);
+		last_pos = 0;
 
-			ndb_query_result_init(&res, note, note_size, note_id);
-			if (!push_query_result(results, &res))
-				break;
+		for (i = 0; t + i < end && t[i].len == t->len &&
+			    !memcmp(t[i].term, t->term, t->len); i++) {
+			if (i < NDB_POSTING_MAX_POSITIONS)
+				cursor_push_varint(&pos_cur, t[i].pos - last_pos);
+			last_pos = t[i].pos;
+		}
 
-next:
-			if (mdb_cursor_get(cur, &k, &v, MDB_PREV))
-				break;
+		posting.term_freq = i;
+		posting.pos_size = pos_cur.p - pos_cur.start;
+
+		if (!ndb_posting_insert(txn, mdb_cur, t->term, t->len,
+					&posting, block, buf, &added) ||
+		    (added && !ndb_incr_term_doc_freq(txn, t->term, t->len))) {
+			ok = 0;
+			break;
 		}
-	}
+		any_added |= added;
 	}
 
-	mdb_cursor_close(cur);
-	return 1;
+	mdb_cursor_close(mdb_cur);
+
+	if (ok && any_added && !ndb_add_fulltext_totals(txn, terms.num_terms))
+		return 0;
+
+	return ok;
 }
 
-static int ndb_query_plan_execute_kinds(struct ndb_txn *txn,
-					struct ndb_filter *filter,
-					struct ndb_query_results *results,
-					int limit)
+// Walks one term's posting list a block at a time
+struct ndb_posting_cursor
 {
-	MDB_cursor *cur;
-	MDB_dbi db;
-	MDB_val k, v;
-	struct ndb_note *note;
-	struct ndb_u64_ts tsid, *ptsid;
-	struct ndb_filter_elements *kinds;
-	struct ndb_query_result res;
-	uint64_t kind, note_id, until, since, *pint;
-	size_t note_size;
-	int i, rc, need_relays = 0;
-	struct ndb_note_relay_iterator note_relay_iter;
+	MDB_cursor *mdb;
+	char term[NDB_TERM_MAX];
+	int term_len;
+	struct ndb_posting block[NDB_POSTING_BLOCK_MAX];
+	int count, i;
+	int eof;
+	double idf; // only for ranked searches
+};
 
-	// we should have kinds in a kinds filter!
-	if (!(kinds = ndb_filter_find_elements(filter, NDB_FILTER_KINDS)))
-		return 0;
+enum ndb_text_node_type {
+	NDB_TEXT_TERM,   // a word, or any of the words it's a prefix of
+	NDB_TEXT_AND,
+	NDB_TEXT_PHRASE, // an AND where the words are next to each other
+	NDB_TEXT_OR,
+};
 
-	if (ndb_filter_find_elements(filter, NDB_FILTER_RELAYS))
-		need_relays = 1;
+// A node in a parsed search query. Each node walks its matching notes in
+// the search order, so ANDs can leapfrog their children with seeks.
+struct ndb_text_node
+{
+	enum ndb_text_node_type type;
+	struct ndb_posting_cursor **cursors;
+	int num_cursors;
+	struct ndb_text_node *children[NDB_SEARCH_MAX_TERMS];
+	int num_children;
+	int offset; // where this word is in its phrase
 
-	until = UINT64_MAX;
-	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
-		until = *pint;
+	// the current match
+	uint64_t created_at;
+	uint64_t note_key;
+	int eof;
+};
 
-	since = 0;
-	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_SINCE)))
-		since = *pint;
+#define NDB_SEARCH_MAX_NODES (NDB_SEARCH_MAX_TERMS * 3 + 1)
 
-	db = txn->lmdb->dbs[NDB_DB_NOTE_KIND];
+struct ndb_text_search_iter
+{
+	struct ndb_txn *txn;
+	struct ndb_filter *filter;
+	int order; // 1 for newest first, -1 for oldest first
+	uint64_t since, until;
+	int started;
+
+	// for ranked searches
+	int ranked;
+	double avg_len;
+	double max_score; // bm25 can't go above this
+	uint64_t now;
+
+	struct ndb_text_node *root;
+	struct ndb_text_node nodes[NDB_SEARCH_MAX_NODES];
+	int num_nodes;
+	struct ndb_posting_cursor *cursors[NDB_SEARCH_MAX_TERMS *
+					   NDB_SEARCH_MAX_EXPANSIONS];
+	int num_cursors;
+	int num_terms;
+};
 
-	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur)))
-		return 0;
+static int ndb_text_cmp(struct ndb_text_search_iter *it,
+			uint64_t ts_a, uint64_t key_a,
+			uint64_t ts_b, uint64_t key_b)
+{
+	return it->order * ndb_ts_key_cmp(ts_a, key_a, ts_b, key_b);
+}
 
-	for (i = 0; i < kinds->count; i++) {
-		if (query_is_full(results, limit))
-			break;
+static int ndb_posting_cursor_load(struct ndb_posting_cursor *pc,
+				   MDB_val *k, MDB_val *v, int order)
+{
+	if (!ndb_posting_key_is_term(k, pc->term, pc->term_len) ||
+	    !ndb_posting_block_decode(k, v, pc->block, NDB_POSTING_BLOCK_MAX,
+				      &pc->count) ||
+	    pc->count == 0) {
+		pc->eof = 1;
+		return 0;
+	}
 
-		kind = kinds->elements[i];
-		ndb_debug("kind %" PRIu64 "\n", kind);
-		ndb_u64_ts_init(&tsid, kind, until);
+	pc->i = order > 0 ? 0 : pc->count - 1;
+	pc->eof = 0;
+	return 1;
+}
 
-		k.mv_data = &tsid;
-		k.mv_size = sizeof(tsid);
+static void ndb_posting_cursor_next(struct ndb_posting_cursor *pc, int order)
+{
+	MDB_val k, v;
 
-		if (!ndb_cursor_start(cur, &k, &v))
-			continue;
+	if (pc->eof)
+		return;
 
-		// for each id in our ids filter, find in the db
-		while (!query_is_full(results, limit)) {
-			ptsid = (struct ndb_u64_ts *)k.mv_data;
-			if (ptsid->u64 != kind)
-				break;
+	pc->i += order;
+	if (pc->i >= 0 && pc->i < pc->count)
+		return;
 
-			// don't continue the scan if we're below `since`
-			if (ptsid->timestamp < since)
-				break;
+	if (mdb_cursor_get(pc->mdb, &k, &v, order > 0 ? MDB_NEXT : MDB_PREV)) {
+		pc->eof = 1;
+		return;
+	}
 
-			note_id = *(uint64_t*)v.mv_data;
-			if (!(note = ndb_get_note_by_key(txn, note_id, &note_size)))
-				goto next;
+	ndb_posting_cursor_load(pc, &k, &v, order);
+}
 
-			if (need_relays)
-				ndb_note_relay_iterate_start(txn, &note_relay_iter, note_id);
+static void ndb_posting_cursor_skip(struct ndb_posting_cursor *pc, int order,
+				    uint64_t created_at, uint64_t note_key)
+{
+	struct ndb_posting *p;
 
-			if (!ndb_filter_matches_with(filter, note,
-						     1 << NDB_FILTER_KINDS,
-						     need_relays ? &note_relay_iter : NULL))
-				goto next;
+	while (!pc->eof) {
+		p = &pc->block[pc->i];
+		if (order * ndb_ts_key_cmp(p->created_at, p->note_key,
+					   created_at, note_key) >= 0)
+			break;
+		ndb_posting_cursor_next(pc, order);
+	}
+}
 
-			ndb_query_result_init(&res, note, note_size, note_id);
-			if (!push_query_result(results, &res))
-				break;
+static void ndb_posting_cursor_jump(struct ndb_posting_cursor *pc, int order,
+				    uint64_t created_at, uint64_t note_key)
+{
+	unsigned char key[NDB_POSTING_KEY_SIZE(NDB_TERM_MAX)];
+	MDB_val search, k, v;
 
-next:
-			if (mdb_cursor_get(cur, &k, &v, MDB_PREV))
-				break;
-		}
+	search.mv_data = key;
+	search.mv_size = ndb_make_posting_key(key, pc->term, pc->term_len,
+					      created_at, note_key);
+
+	if (!ndb_posting_seek_block(pc->mdb, pc->term, pc->term_len,
+				    &search, &k, &v) ||
+	    !ndb_posting_cursor_load(pc, &k, &v, order)) {
+		pc->eof = 1;
+		return;
 	}
 
-	mdb_cursor_close(cur);
-	return 1;
+	ndb_posting_cursor_skip(pc, order, created_at, note_key);
 }
 
-static enum ndb_query_plan ndb_filter_plan(struct ndb_filter *filter)
+// Move to the first posting at or past (created_at, note_key) in the
+// search order. Targets outside of the current block skip straight to the
+// block holding them.
+static void ndb_posting_cursor_seek(struct ndb_posting_cursor *pc, int order,
+				    uint64_t created_at, uint64_t note_key)
 {
-	struct ndb_filter_elements *ids, *kinds, *authors, *tags, *search, *relays;
+	struct ndb_posting *p;
 
-	ids = ndb_filter_find_elements(filter, NDB_FILTER_IDS);
-	search = ndb_filter_find_elements(filter, NDB_FILTER_SEARCH);
-	kinds = ndb_filter_find_elements(filter, NDB_FILTER_KINDS);
-	authors = ndb_filter_find_elements(filter, NDB_FILTER_AUTHORS);
-	tags = ndb_filter_find_elements(filter, NDB_FILTER_TAGS);
-	relays = ndb_filter_find_elements(filter, NDB_FILTER_RELAYS);
+	if (pc->eof)
+		return;
 
-	// profile search
-	if (kinds && kinds->count == 1 && kinds->elements[0] == 0 && search) {
-		return NDB_PLAN_PROFILE_SEARCH;
-	}
+	p = &pc->block[order > 0 ? pc->count - 1 : 0];
+	if (order * ndb_ts_key_cmp(p->created_at, p->note_key,
+				   created_at, note_key) < 0)
+		ndb_posting_cursor_jump(pc, order, created_at, note_key);
+	else
+		ndb_posting_cursor_skip(pc, order, created_at, note_key);
+}
 
-	// TODO: fix multi-author queries
-	if (search) {
-		return NDB_PLAN_SEARCH;
-	} else if (ids) {
-		return NDB_PLAN_IDS;
-	} else if (relays && kinds && !authors) {
-		return NDB_PLAN_RELAY_KINDS;
-	} else if (kinds && authors && authors->count == 1) {
-		return NDB_PLAN_AUTHOR_KINDS;
-	} else if (authors && authors->count == 1) {
-		return NDB_PLAN_AUTHORS;
-	} else if (tags && tags->count == 1) {
-		return NDB_PLAN_TAGS;
-	} else if (kinds) {
-		return NDB_PLAN_KINDS;
+static struct ndb_posting_cursor *
+ndb_posting_cursor_open(struct ndb_text_search_iter *it, const char *term,
+			int term_len)
+{
+	struct ndb_posting_cursor *pc;
+	int rc;
+
+	if (term_len > NDB_TERM_MAX)
+		return NULL;
+
+	if (!(pc = calloc(1, sizeof(*pc))))
+		return NULL;
+
+	if ((rc = mdb_cursor_open(it->txn->mdb_txn,
+				  it->txn->lmdb->dbs[NDB_DB_NOTE_POSTINGS],
+				  &pc->mdb))) {
+		fprintf(stderr, "ndb_text_search: mdb_cursor_open failed, error %d\n", rc);
+		free(pc);
+		return NULL;
 	}
 
-	return NDB_PLAN_CREATED;
+	it->cursors[it->num_cursors++] = pc;
+	memcpy(pc->term, term, term_len);
+	pc->term_len = term_len;
+
+	// until is exclusive
+	if (it->order > 0)
+		ndb_posting_cursor_jump(pc, 1, it->until ? it->until - 1 : 0,
+					UINT64_MAX);
+	else
+		ndb_posting_cursor_jump(pc, -1, it->since, 0);
+
+	return pc;
 }
 
-static const char *ndb_query_plan_name(enum ndb_query_plan plan_id)
+static int ndb_posting_positions(struct ndb_posting *p, int *positions)
 {
-	switch (plan_id) {
-		case NDB_PLAN_IDS:     return "ids";
-		case NDB_PLAN_SEARCH:  return "search";
-		case NDB_PLAN_KINDS:   return "kinds";
-		case NDB_PLAN_TAGS:    return "tags";
-		case NDB_PLAN_CREATED: return "created";
-		case NDB_PLAN_AUTHORS: return "authors";
-		case NDB_PLAN_RELAY_KINDS: return "relay_kinds";
-		case NDB_PLAN_AUTHOR_KINDS: return "author_kinds";
-		case NDB_PLAN_PROFILE_SEARCH: return "profile_search";
+	struct cursor cur;
+	uint64_t delta;
+	int n, pos;
+
+	make_cursor((unsigned char *)p->positions,
+		    (unsigned char *)p->positions + p->pos_size, &cur);
+
+	n = pos = 0;
+	while (n < NDB_POSTING_MAX_POSITIONS && cursor_pull_varint(&cur, &delta)) {
+		pos += delta;
+		positions[n++] = pos;
 	}
 
-	return "unknown";
+	return n;
 }
 
-static int ndb_query_filter(struct ndb_txn *txn, struct ndb_filter *filter,
-			    struct ndb_query_result *res, int capacity,
-			    int *results_out)
+// Do the words of a phrase show up in the same order somewhere in the
+// current note? Phrase words are always single posting lists.
+static int ndb_text_phrase_matches(struct ndb_text_node *node)
 {
-	struct ndb_query_results results;
-	uint64_t limit, *pint;
-	enum ndb_query_plan plan;
-	limit = capacity;
+	int positions[NDB_SEARCH_MAX_TERMS][NDB_POSTING_MAX_POSITIONS];
+	int counts[NDB_SEARCH_MAX_TERMS];
+	struct ndb_posting_cursor *pc;
+	struct ndb_text_node *c;
+	int i, j, k, start;
 
-	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_LIMIT)))
-		limit = *pint;
-
-	limit = min(capacity, limit);
-	make_cursor((unsigned char *)res,
-		    ((unsigned char *)res) + limit * sizeof(*res),
-		    &results.cur);
+	for (i = 0; i < node->num_children; i++) {
+		pc = node->children[i]->cursors[0];
+		counts[i] = ndb_posting_positions(&pc->block[pc->i], positions[i]);
+	}
 
-	plan = ndb_filter_plan(filter);
-	ndb_debug("using query plan '%s'\n", ndb_query_plan_name(plan));
-	switch (plan) {
-	// We have a list of ids, just open a cursor and jump to each once
-	case NDB_PLAN_IDS:
-		if (!ndb_query_plan_execute_ids(txn, filter, &results, limit))
-			return 0;
-		break;
-	case NDB_PLAN_RELAY_KINDS:
-		if (!ndb_query_plan_execute_relay_kinds(txn, filter, &results, limit))
-			return 0;
-		break;
-	case NDB_PLAN_SEARCH:
-		if (!ndb_query_plan_execute_search(txn, filter, &results, limit))
-			return 0;
-		break;
+	for (j = 0; j < counts[0]; j++) {
+		start = positions[0][j] - node->children[0]->offset;
 
-	case NDB_PLAN_PROFILE_SEARCH:
-		if (!ndb_query_plan_execute_profile_search(txn, filter, &results, limit))
-			return 0;
-		break;
+		for (i = 1; i < node->num_children; i++) {
+			c = node->children[i];
+			for (k = 0; k < counts[i]; k++) {
+				if (positions[i][k] == start + c->offset)
+					break;
+			}
+			if (k == counts[i])
+				break;
+		}
 
-	// We have just kinds, just scan the kind index
-	case NDB_PLAN_KINDS:
-		if (!ndb_query_plan_execute_kinds(txn, filter, &results, limit))
-			return 0;
-		break;
-	case NDB_PLAN_TAGS:
-		if (!ndb_query_plan_execute_tags(txn, filter, &results, limit))
-			return 0;
-		break;
-	case NDB_PLAN_CREATED:
-		if (!ndb_query_plan_execute_created_at(txn, filter, &results, limit))
-			return 0;
-		break;
-	case NDB_PLAN_AUTHORS:
-		if (!ndb_query_plan_execute_authors(txn, filter, &results, limit))
-			return 0;
-		break;
-	case NDB_PLAN_AUTHOR_KINDS:
-		if (!ndb_query_plan_execute_author_kinds(txn, filter, &results, limit))
-			return 0;
-		break;
+		if (i == node->num_children)
+			return 1;
 	}
 
-	*results_out = cursor_count(&results.cur, sizeof(*res));
-	return 1;
+	return 0;
 }
 
-int ndb_query(struct ndb_txn *txn, struct ndb_filter *filters, int num_filters,
-	      struct ndb_query_result *results, int result_capacity, int *count)
+static void ndb_text_node_seek(struct ndb_text_search_iter *it,
+			       struct ndb_text_node *node,
+			       uint64_t created_at, uint64_t note_key);
+static void ndb_text_node_next(struct ndb_text_search_iter *it,
+			       struct ndb_text_node *node);
+
+static void ndb_text_node_consider(struct ndb_text_search_iter *it,
+				   struct ndb_text_node *node,
+				   uint64_t created_at, uint64_t note_key)
 {
-	int i, out;
-	struct ndb_query_result *p = results;
+	if (node->eof || ndb_text_cmp(it, created_at, note_key,
+				      node->created_at, node->note_key) < 0) {
+		node->created_at = created_at;
+		node->note_key = note_key;
+		node->eof = 0;
+	}
+}
 
-	out = 0;
-	*count = 0;
+// TERM and OR nodes are on the first match of any of their lists
+static void ndb_text_node_union(struct ndb_text_search_iter *it,
+				struct ndb_text_node *node)
+{
+	struct ndb_posting_cursor *pc;
+	struct ndb_posting *p;
+	int i;
 
-	for (i = 0; i < num_filters; i++) {
-		if (!ndb_query_filter(txn, &filters[i], p,
-				      result_capacity, &out)) {
-			return 0;
-		}
+	node->eof = 1;
 
-		*count += out;
-		p += out;
-		result_capacity -= out;
-		if (result_capacity <= 0)
-			break;
+	if (node->type == NDB_TEXT_TERM) {
+		for (i = 0; i < node->num_cursors; i++) {
+			pc = node->cursors[i];
+			if (pc->eof)
+				continue;
+			p = &pc->block[pc->i];
+			ndb_text_node_consider(it, node, p->created_at,
+					       p->note_key);
+		}
+		return;
 	}
 
-	// sort results
-	qsort(results, *count, sizeof(*results), compare_query_results);
-	return 1;
+	for (i = 0; i < node->num_children; i++) {
+		if (node->children[i]->eof)
+			continue;
+		ndb_text_node_consider(it, node, node->children[i]->created_at,
+				       node->children[i]->note_key);
+	}
 }
 
-static int ndb_write_note_tag_index(struct ndb_txn *txn, struct ndb_note *note,
-				    uint64_t note_key)
+// Leapfrog the children of an AND until they agree on a note
+static void ndb_text_node_intersect(struct ndb_text_search_iter *it,
+				    struct ndb_text_node *node)
 {
-	unsigned char key_buffer[255];
-	struct ndb_iterator iter;
-	struct ndb_str tkey, tval;
-	char tchar;
-	int len, rc;
-	MDB_val key, val;
-	MDB_dbi tags_db;
+	struct ndb_text_node *c;
+	uint64_t created_at, note_key;
+	int i, agree;
 
-	tags_db = txn->lmdb->dbs[NDB_DB_NOTE_TAGS];
+	for (;;) {
+		c = node->children[0];
+		if (c->eof)
+			break;
 
-	ndb_tags_iterate_start(note, &iter);
+		created_at = c->created_at;
+		note_key = c->note_key;
+
+		do {
+			agree = 1;
+			for (i = 0; i < node->num_children; i++) {
+				c = node->children[i];
+				ndb_text_node_seek(it, c, created_at, note_key);
+				if (c->eof)
+					goto eof;
+
+				if (c->created_at != created_at ||
+				    c->note_key != note_key) {
+					created_at = c->created_at;
+					note_key = c->note_key;
+					agree = 0;
+				}
+			}
+		} while (!agree);
 
-	while (ndb_tags_iterate_next(&iter)) {
-		if (iter.tag->count < 2)
-			continue;
+		node->created_at = created_at;
+		node->note_key = note_key;
+		node->eof = 0;
 
-		tkey = ndb_tag_str(note, iter.tag, 0);
+		if (node->type != NDB_TEXT_PHRASE || ndb_text_phrase_matches(node))
+			return;
 
-		// we only write indices for 1-char tags.
-		tchar = tkey.str[0];
-		if (tchar == 0 || tkey.str[1] != 0)
-			continue;
+		ndb_text_node_next(it, node->children[0]);
+	}
 
-		tval = ndb_tag_str(note, iter.tag, 1);
-		len = ndb_str_len(&tval);
+eof:
+	node->eof = 1;
+}
 
-		if (!(len = ndb_encode_tag_key(key_buffer, sizeof(key_buffer),
-					       tchar, tval.id, (unsigned char)len,
-					       ndb_note_created_at(note)))) {
-			// this will fail when we try to encode a key that is
-			// too big
-			continue;
-		}
+static void ndb_text_node_next(struct ndb_text_search_iter *it,
+			       struct ndb_text_node *node)
+{
+	struct ndb_posting_cursor *pc;
+	struct ndb_text_node *c;
+	int i;
 
-		//ndb_debug("writing tag '%c':'data:%d' to index\n", tchar, len);
+	if (node->eof)
+		return;
 
-		key.mv_data = key_buffer;
-		key.mv_size = len;
+	switch (node->type) {
+	case NDB_TEXT_TERM:
+		for (i = 0; i < node->num_cursors; i++) {
+			pc = node->cursors[i];
+			if (!pc->eof &&
+			    pc->block[pc->i].created_at == node->created_at &&
+			    pc->block[pc->i].note_key == node->note_key)
+				ndb_posting_cursor_next(pc, it->order);
+		}
+		ndb_text_node_union(it, node);
+		break;
+	case NDB_TEXT_OR:
+		for (i = 0; i < node->num_children; i++) {
+			c = node->children[i];
+			if (!c->eof && c->created_at == node->created_at &&
+			    c->note_key == node->note_key)
+				ndb_text_node_next(it, c);
+		}
+		ndb_text_node_union(it, node);
+		break;
+	case NDB_TEXT_AND:
+	case NDB_TEXT_PHRASE:
+		ndb_text_node_next(it, node->children[0]);
+		ndb_text_node_intersect(it, node);
+		break;
+	}
+}
 
-		val.mv_data = &note_key;
-		val.mv_size = sizeof(note_key);
+static void ndb_text_node_seek(struct ndb_text_search_iter *it,
+			       struct ndb_text_node *node,
+			       uint64_t created_at, uint64_t note_key)
+{
+	int i;
 
-		if ((rc = mdb_put(txn->mdb_txn, tags_db, &key, &val, 0))) {
-			ndb_debug("write note tag index to db failed: %s\n",
-					mdb_strerror(rc));
-			return 0;
+	if (node->eof || ndb_text_cmp(it, node->created_at, node->note_key,
+				      created_at, note_key) >= 0)
+		return;
+
+	switch (node->type) {
+	case NDB_TEXT_TERM:
+		for (i = 0; i < node->num_cursors; i++) {
+			ndb_posting_cursor_seek(node->cursors[i], it->order,
+						created_at, note_key);
 		}
+		ndb_text_node_union(it, node);
+		break;
+	case NDB_TEXT_OR:
+		for (i = 0; i < node->num_children; i++)
+			ndb_text_node_seek(it, node->children[i], created_at,
+					   note_key);
+		ndb_text_node_union(it, node);
+		break;
+	case NDB_TEXT_AND:
+	case NDB_TEXT_PHRASE:
+		ndb_text_node_seek(it, node->children[0], created_at, note_key);
+		ndb_text_node_intersect(it, node);
+		break;
 	}
+}
 
-	return 1;
+// position every node on its first match, from the bottom up
+static void ndb_text_node_reset(struct ndb_text_search_iter *it,
+				struct ndb_text_node *node)
+{
+	int i;
+
+	for (i = 0; i < node->num_children; i++)
+		ndb_text_node_reset(it, node->children[i]);
+
+	if (node->type == NDB_TEXT_AND || node->type == NDB_TEXT_PHRASE)
+		ndb_text_node_intersect(it, node);
+	else
+		ndb_text_node_union(it, node);
 }
 
-static int ndb_write_note_kind_index(struct ndb_txn *txn, struct ndb_note *note,
-				     uint64_t note_key)
+static struct ndb_text_node *ndb_text_node_new(struct ndb_text_search_iter *it,
+					       enum ndb_text_node_type type)
 {
-	struct ndb_u64_ts tsid;
-	int rc;
-	MDB_val key, val;
-	MDB_dbi kind_db;
+	struct ndb_text_node *node;
 
-	ndb_u64_ts_init(&tsid, note->kind, note->created_at);
+	if (it->num_nodes == NDB_SEARCH_MAX_NODES)
+		return NULL;
 
-	key.mv_data = &tsid;
-	key.mv_size = sizeof(tsid);
-	val.mv_data = &note_key;
-	val.mv_size = sizeof(note_key);
+	node = &it->nodes[it->num_nodes++];
+	memset(node, 0, sizeof(*node));
+	node->type = type;
+	node->eof = 1;
 
-	kind_db = txn->lmdb->dbs[NDB_DB_NOTE_KIND];
+	return node;
+}
 
-	if ((rc = mdb_put(txn->mdb_txn, kind_db, &key, &val, 0))) {
-		ndb_debug("write note kind index to db failed: %s\n",
-				mdb_strerror(rc));
+static int ndb_text_node_add(struct ndb_text_node *parent,
+			     struct ndb_text_node *child)
+{
+	if (parent->num_children == NDB_SEARCH_MAX_TERMS)
 		return 0;
-	}
 
+	parent->children[parent->num_children++] = child;
 	return 1;
 }
 
-static int ndb_write_word_to_index(struct ndb_txn *txn, const char *word,
-				   int word_len, int word_index,
-				   uint64_t timestamp, uint64_t note_id)
+// Open the posting list of a word, or of up to NDB_SEARCH_MAX_EXPANSIONS
+// words that it is a prefix of
+static struct ndb_text_node *
+ndb_text_term_node(struct ndb_text_search_iter *it, const char *word,
+		   int word_len, int prefix)
 {
-	// cap to some reasonable key size
-	unsigned char buffer[1024];
-	int keysize, rc;
+	unsigned char key[NDB_POSTING_KEY_SIZE(NDB_TERM_MAX) + 1];
+	char term[NDB_TERM_MAX];
+	struct ndb_text_node *node;
+	MDB_cursor *scan;
+	const char *t;
 	MDB_val k, v;
-	MDB_dbi text_db;
+	int len, tlen, rc;
+
+	if (!(node = ndb_text_node_new(it, NDB_TEXT_TERM)))
+		return NULL;
 
-	// build our compressed text index key
-	if (!ndb_make_text_search_key(buffer, sizeof(buffer), word_index,
-				      word_len, word, timestamp, note_id,
-				      &keysize)) {
-		// probably too big
+	len = ndb_utf8_truncate(word, word_len, NDB_TERM_MAX);
+	memcpy(term, word, len);
+	node->cursors = &it->cursors[it->num_cursors];
 
-		return 0;
+	if (!prefix) {
+		if (!ndb_posting_cursor_open(it, term, len))
+			return NULL;
+		node->num_cursors = 1;
+		return node;
 	}
 
-	k.mv_data = buffer;
-	k.mv_size = keysize;
+	if ((rc = mdb_cursor_open(it->txn->mdb_txn,
+				  it->txn->lmdb->dbs[NDB_DB_NOTE_POSTINGS],
+				  &scan))) {
+		fprintf(stderr, "ndb_text_search: mdb_cursor_open failed, error %d\n", rc);
+		return NULL;
+	}
 
-	v.mv_data = NULL;
-	v.mv_size = 0;
+	k.mv_data = term;
+	k.mv_size = len;
+	rc = mdb_cursor_get(scan, &k, &v, MDB_SET_RANGE);
 
-	text_db = txn->lmdb->dbs[NDB_DB_NOTE_TEXT];
+	while (rc == 0 && node->num_cursors < NDB_SEARCH_MAX_EXPANSIONS) {
+		if (!ndb_posting_key_term(&k, &t, &tlen) || tlen < len ||
+		    memcmp(t, term, len))
+			break;
 
-	if ((rc = mdb_put(txn->mdb_txn, text_db, &k, &v, 0))) {
-		ndb_debug("write note text index to db failed: %s\n",
-				mdb_strerror(rc));
-		return 0;
+		if (!ndb_posting_cursor_open(it, t, tlen)) {
+			node = NULL;
+			break;
+		}
+		node->num_cursors++;
+
+		// skip the rest of this term's blocks
+		memcpy(key, t, tlen);
+		key[tlen] = 0;
+		memset(key + tlen + 1, 0xFF, 17);
+		k.mv_data = key;
+		k.mv_size = NDB_POSTING_KEY_SIZE(tlen) + 1;
+		rc = mdb_cursor_get(scan, &k, &v, MDB_SET_RANGE);
 	}
 
-	return 1;
-}
+	mdb_cursor_close(scan);
 
+	return node;
+}
 
+struct ndb_text_query_parser
+{
+	struct ndb_text_search_iter *it;
+	struct ndb_text_node *root;
+	struct ndb_text_node *clause;
+	struct ndb_text_node *phrase; // set while we're in quotes
+	int error;
+};
 
-// break a string into individual words for querying or for building the
-// fulltext search index. This is callback based so we don't need to
-// build up an intermediate structure
-static int ndb_parse_words(struct cursor *cur, void *ctx, ndb_word_parser_fn fn)
+static int ndb_parse_query_term(struct ndb_text_query_parser *p,
+				struct ndb_text_node *parent,
+				const char *term, int len, int offset)
 {
-	int word_len, words;
-	const char *word;
+	struct ndb_text_node *node;
 
-	words = 0;
+	if (p->it->num_terms == NDB_SEARCH_MAX_TERMS)
+		return 1;
 
-	while (cur->p < cur->end) {
-		consume_whitespace_or_punctuation(cur);
-		if (cur->p >= cur->end)
-			break;
-		word = (const char *)cur->p;
+	p->it->num_terms++;
 
-		if (!consume_until_boundary(cur))
-			break;
+	if (!(node = ndb_text_term_node(p->it, term, len,
+					parent->type != NDB_TEXT_PHRASE)) ||
+	    !ndb_text_node_add(parent, node)) {
+		p->error = 1;
+		return 0;
+	}
 
-		// start of word or end
-		word_len = cur->p - (unsigned char *)word;
-		if (word_len == 0 && cur->p >= cur->end)
-			break;
+	node->offset = offset;
+	return 1;
+}
 
-		if (word_len == 0) {
-			if (!cursor_skip(cur, 1))
-				break;
-			continue;
+static int ndb_parse_query_word(void *ctx, struct ndb_word *word)
+{
+	struct ndb_text_query_parser *p = ctx;
+	struct ndb_text_node *parent;
+	const char *c, *end;
+	int a, b, offset;
+
+	if (!p->phrase && word->raw_len == 2 && !memcmp(word->raw, "OR", 2)) {
+		if (p->clause->num_children == 0)
+			return 1;
+
+		if (!(p->clause = ndb_text_node_new(p->it, NDB_TEXT_AND)) ||
+		    !ndb_text_node_add(p->root, p->clause)) {
+			p->error = 1;
+			return 0;
 		}
 
-		//ndb_debug("writing word index '%.*s'\n", word_len, word);
+		return 1;
+	}
+
+	// these aren't in the index, see ndb_collect_term
+	if (ndb_word_is_letter(word))
+		return 1;
 
-		if (!fn(ctx, word, word_len, words))
-			continue;
+	parent = p->phrase ? p->phrase : p->clause;
+
+	c = word->str;
+	end = c + word->len;
+	a = ndb_utf8_char_len(c);
+
+	// one or two cjk characters are in the index as they are, longer runs
+	// are a phrase of the pairs they were indexed as
+	if (!word->cjk || c + a >= end ||
+	    c + a + ndb_utf8_char_len(c + a) >= end)
+		return ndb_parse_query_term(p, parent, word->str, word->len,
+					    word->index);
+
+	if (!p->phrase &&
+	    (!(parent = ndb_text_node_new(p->it, NDB_TEXT_PHRASE)) ||
+	     !ndb_text_node_add(p->clause, parent))) {
+		p->error = 1;
+		return 0;
+	}
 
-		words++;
+	for (offset = word->index; c + a < end; offset++) {
+		b = ndb_utf8_char_len(c + a);
+		if (!ndb_parse_query_term(p, parent, c, a + b, offset))
+			return 0;
+		c += a;
+		a = b;
 	}
 
 	return 1;
 }
 
-struct ndb_word_writer_ctx
-{
-	struct ndb_txn *txn;
-	struct ndb_note *note;
-	uint64_t note_id;
-};
-
-static int ndb_fulltext_word_writer(void *ctx,
-		const char *word, int word_len, int words)
+// Drop empty nodes, and replace nodes that only have one child with it
+static struct ndb_text_node *ndb_text_node_simplify(struct ndb_text_node *node)
 {
-	struct ndb_word_writer_ctx *wctx = ctx;
+	struct ndb_text_node *c;
+	int i, n;
 
-	if (!ndb_write_word_to_index(wctx->txn, word, word_len, words,
-				     wctx->note->created_at, wctx->note_id)) {
-		// too big to write this one, just skip it
-		ndb_debug("failed to write word '%.*s' to index\n", word_len, word);
+	if (node->type == NDB_TEXT_TERM)
+		return node;
 
-		return 0;
+	n = 0;
+	for (i = 0; i < node->num_children; i++) {
+		if ((c = ndb_text_node_simplify(node->children[i])))
+			node->children[n++] = c;
 	}
+	node->num_children = n;
 
-	//fprintf(stderr, "wrote '%.*s' to note text index\n", word_len, word);
-	return 1;
+	if (n == 0)
+		return NULL;
+	else if (n == 1)
+		return node->children[0];
+
+	return node;
 }
 
-static int ndb_write_note_fulltext_index(struct ndb_txn *txn,
-					 struct ndb_note *note,
-					 uint64_t note_id)
+// Parse a query into an OR of ANDs. Words between quotes become phrases.
+static int ndb_text_query_parse(struct ndb_text_search_iter *it,
+				const char *query)
 {
-	struct cursor cur;
-	unsigned char *content;
-	struct ndb_str str;
-	struct ndb_word_writer_ctx ctx;
+	struct ndb_text_query_parser p;
+	const char *start, *end;
+	char *words;
+	int quoted;
 
-	str = ndb_note_str(note, &note->content);
-	// I don't think this should happen?
-	if (unlikely(str.flag == NDB_PACKED_ID))
+	memset(&p, 0, sizeof(p));
+	p.it = it;
+
+	if (!(p.root = ndb_text_node_new(it, NDB_TEXT_OR)) ||
+	    !(p.clause = ndb_text_node_new(it, NDB_TEXT_AND)) ||
+	    !ndb_text_node_add(p.root, p.clause))
 		return 0;
 
-	content = (unsigned char *)str.str;
+	// the folded words never take more room than the query
+	if (!(words = malloc(strlen(query) + 1)))
+		return 0;
 
-	make_cursor(content, content + note->content_length, &cur);
+	start = query;
+	quoted = 0;
 
-	ctx.txn = txn;
-	ctx.note = note;
-	ctx.note_id = note_id;
+	for (;;) {
+		if (!(end = strchr(start, '"')))
+			end = start + strlen(start);
 
-	ndb_parse_words(&cur, &ctx, ndb_fulltext_word_writer);
+		if (quoted && (!(p.phrase = ndb_text_node_new(it, NDB_TEXT_PHRASE)) ||
+			       !ndb_text_node_add(p.clause, p.phrase))) {
+			p.error = 1;
+			break;
+		}
 
-	return 1;
-}
+		ndb_tokenize(start, end - start, words, &p,
+			     ndb_parse_query_word);
+		if (p.error)
+			break;
 
-static int ndb_parse_search_words(void *ctx, const char *word_str, int word_len, int word_index)
-{
-	(void)word_index;
-	struct ndb_search_words *words = ctx;
-	struct ndb_word *word;
+		p.phrase = NULL;
 
-	if (words->num_words + 1 > MAX_TEXT_SEARCH_WORDS)
-		return 0;
+		if (*end == 0)
+			break;
 
-	word = &words->words[words->num_words++];
-	word->word = word_str;
-	word->word_len = word_len;
+		quoted = !quoted;
+		start = end + 1;
+	}
 
-	return 1;
+	free(words);
+	if (p.error)
+		return 0;
+
+	it->root = ndb_text_node_simplify(p.root);
+	return it->root != NULL;
 }
 
-static void ndb_search_words_init(struct ndb_search_words *words)
+// BM25 parameters: how quickly repeating a word stops counting, and how
+// much longer notes are penalized
+#define NDB_BM25_K1 1.2
+#define NDB_BM25_B 0.75
+
+// notes this old only get half of the recency boost
+#define NDB_RECENCY_HALF_LIFE (60 * 60 * 24 * 7)
+
+static void ndb_text_search_rank_init(struct ndb_text_search_iter *it)
 {
-	words->num_words = 0;
-}
+	struct ndb_fulltext_totals totals;
+	struct ndb_posting_cursor *pc;
+	double n, df;
+	int i;
 
-static int prefix_count(const char *str1, int len1, const char *str2, int len2) {
-	int i, count = 0;
-	int min_len = len1 < len2 ? len1 : len2;
+	ndb_get_fulltext_totals(it->txn, &totals);
+	n = totals.notes;
+	it->avg_len = totals.notes ? (double)totals.words / totals.notes : 1.0;
+	it->now = time(NULL);
+	it->max_score = 0;
 
-	for (i = 0; i < min_len; i++) {
-		// case insensitive
-		if (tolower(str1[i]) == tolower(str2[i]))
-			count++;
-		else
-			break;
+	for (i = 0; i < it->num_cursors; i++) {
+		pc = it->cursors[i];
+		df = ndb_get_term_doc_freq(it->txn, pc->term, pc->term_len);
+		pc->idf = log(1.0 + (n - df + 0.5) / (df + 0.5));
+		it->max_score += pc->idf * (NDB_BM25_K1 + 1.0);
 	}
+}
 
-	return count;
+// Doubles the score of brand new notes, fading out with age
+static double ndb_text_recency_boost(struct ndb_text_search_iter *it,
+				     uint64_t created_at)
+{
+	double age;
+
+	age = created_at < it->now ? (double)(it->now - created_at) : 0.0;
+	return 1.0 + NDB_RECENCY_HALF_LIFE / (NDB_RECENCY_HALF_LIFE + age);
 }
 
-static int ndb_prefix_matches(struct ndb_text_search_result *result,
-			      struct ndb_word *search_word)
+// Score the current match with every word of the query that it has
+static double ndb_text_score(struct ndb_text_search_iter *it)
 {
-	// Empty strings shouldn't happen but let's
-	if (result->key.str_len < 2 || search_word->word_len < 2)
-		return 0;
+	struct ndb_text_node *root = it->root;
+	struct ndb_posting_cursor *pc;
+	struct ndb_posting *p;
+	double score, tf, norm;
+	int i;
 
-	// make sure we at least have two matching prefix characters. exact
-	// matches are nice but range searches allow us to match prefixes as
-	// well. A double-char prefix is suffient, but maybe we could up this
-	// in the future.
-	//
-	// TODO: How are we handling utf-8 prefix matches like
-	// japanese?
-	//
-	if (   result->key.str[0] != tolower(search_word->word[0])
-	    && result->key.str[1] != tolower(search_word->word[1])
-	    )
-		return 0;
+	score = 0;
+	for (i = 0; i < it->num_cursors; i++) {
+		pc = it->cursors[i];
+		if (pc->eof)
+			continue;
 
-	// count the number of prefix-matched characters. This will be used
-	// for ranking search results
-	result->prefix_chars = prefix_count(result->key.str,
-					    result->key.str_len,
-					    search_word->word,
-					    search_word->word_len);
+		p = &pc->block[pc->i];
+		if (p->created_at != root->created_at ||
+		    p->note_key != root->note_key)
+			continue;
 
-	if (result->prefix_chars <= (int)((double)search_word->word_len / 1.5))
-		return 0;
+		tf = p->term_freq;
+		norm = NDB_BM25_K1 * (1.0 - NDB_BM25_B +
+				      NDB_BM25_B * p->doc_len / it->avg_len);
+		score += pc->idf * tf * (NDB_BM25_K1 + 1.0) / (tf + norm);
+	}
 
-	return 1;
+	return score * ndb_text_recency_boost(it, root->created_at);
 }
 
-// This is called when scanning the full text search index. Scanning stops
-// when we no longer have a prefix match for the word
-static int ndb_text_search_next_word(MDB_cursor *cursor, MDB_cursor_op op,
-	MDB_val *k, struct ndb_word *search_word,
-	struct ndb_text_search_result *last_result,
-	struct ndb_text_search_result *result,
-	MDB_cursor_op order_op)
+int ndb_text_search_iter_begin(struct ndb_txn *txn, const char *query,
+			       struct ndb_text_search_config *config,
+			       struct ndb_filter *filter,
+			       struct ndb_text_search_iter **iter)
 {
-	struct cursor key_cursor;
-	//struct ndb_text_search_key search_key;
-	MDB_val v;
-	int retries;
-	retries = -1;
+	struct ndb_text_search_iter *it;
+	uint64_t *pint;
 
-	make_cursor(k->mv_data, (unsigned char *)k->mv_data + k->mv_size, &key_cursor);
+	if (!(it = calloc(1, sizeof(*it))))
+		return 0;
 
-	// When op is MDB_SET_RANGE, this initializes the search. Position
-	// the cursor at the next key greater than or equal to the specified
-	// key.
-	//
-	// Subsequent searches should use MDB_NEXT
-	if (mdb_cursor_get(cursor, k, &v, op)) {
-		// we should only do this if we're going in reverse
-		if (op == MDB_SET_RANGE && order_op == MDB_PREV) {
-			// if set range worked and our key exists, it should be
-			// the one right before this one
-			if (mdb_cursor_get(cursor, k, &v, MDB_PREV))
-				return 0;
-		} else {
-			return 0;
-		}
-	}
+	it->txn = txn;
+	it->filter = filter;
+	it->order = 1;
+	it->since = 0;
+	it->until = UINT64_MAX;
 
-retry:
-	retries++;
-	/*
-	printf("continuing from ");
-	if (ndb_unpack_text_search_key(k->mv_data, k->mv_size, &search_key)) {
-		ndb_print_text_search_key(&search_key);
-	} else { printf("??"); }
-	printf("\n");
-	*/
+	if (config && config->order == NDB_ORDER_ASCENDING)
+		it->order = -1;
+	else if (config && config->order == NDB_ORDER_RELEVANCE)
+		it->ranked = 1;
 
-	make_cursor(k->mv_data, (unsigned char *)k->mv_data + k->mv_size, &key_cursor);
+	if (filter) {
+		if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
+			it->until = *pint;
 
-	if (unlikely(!ndb_unpack_text_search_key_noteid(&key_cursor, &result->key.note_id))) {
-		fprintf(stderr, "UNUSUAL: failed to unpack text search key note_id\n");
-		return 0;
+		if ((pint = ndb_filter_get_int(filter, NDB_FILTER_SINCE)))
+			it->since = *pint;
 	}
 
-	// if the note id doesn't match the last result, then we stop trying
-	// each search word
-	if (last_result && last_result->key.note_id != result->key.note_id) {
+	if (!ndb_text_query_parse(it, query)) {
+		ndb_text_search_iter_end(it);
 		return 0;
 	}
 
-	// On success, this could still be not related at all.
-	// It could just be adjacent to the word. Let's check
-	// if we have a matching prefix at least.
+	if (it->ranked)
+		ndb_text_search_rank_init(it);
 
-	// Before we unpack the entire key, let's quickly
-	// unpack just the string to check the prefix. We don't
-	// need to unpack the entire key if the prefix doesn't
-	// match
-	if (!ndb_unpack_text_search_key_string(&key_cursor,
-					       &result->key.str,
-					       &result->key.str_len)) {
-		// this should never happen
-		fprintf(stderr, "UNUSUAL: failed to unpack text search key string\n");
-		return 0;
-	}
+	ndb_text_node_reset(it, it->root);
 
-	if (!ndb_prefix_matches(result, search_word)) {
-		/*
-		printf("result prefix '%.*s' didn't match search word '%.*s'\n",
-			result->key.str_len, result->key.str,
-			search_word->word_len, search_word->word);
-			*/
-		// we should only do this if we're going in reverse
-		if (retries == 0 && op == MDB_SET_RANGE && order_op == MDB_PREV) {
-			// if set range worked and our key exists, it should be
-			// the one right before this one
-			mdb_cursor_get(cursor, k, &v, MDB_PREV);
-			goto retry;
-		} else {
+	*iter = it;
+	return 1;
+}
+
+int ndb_text_search_iter_next(struct ndb_text_search_iter *it,
+			      struct ndb_text_search_result *result)
+{
+	struct ndb_text_node *root = it->root;
+	struct ndb_note *note;
+	size_t note_size;
+
+	for (;;) {
+		if (it->started)
+			ndb_text_node_next(it, root);
+		it->started = 1;
+
+		if (root->eof)
+			return 0;
+
+		// the lists are in time order, so we're done once we leave
+		// the since/until range. until is exclusive, like in filters
+		if (root->created_at < it->since || root->created_at >= it->until) {
+			root->eof = 1;
 			return 0;
 		}
-	}
 
-	// Unpack the remaining text search key, we will need this information
-	// when building up our search results.
-	if (!ndb_unpack_remaining_text_search_key(&key_cursor, &result->key)) {
-		// This should never happen
-		fprintf(stderr, "UNUSUAL: failed to unpack text search key\n");
-		return 0;
-	}
+		note = NULL;
+		note_size = 0;
 
-			/*
-	if (last_result) {
-		if (result->key.word_index < last_result->key.word_index) {
-			fprintf(stderr, "skipping '%.*s' because it is before last result '%.*s'\n",
-					result->key.str_len, result->key.str,
-					last_result->key.str_len, last_result->key.str);
-			return 0;
+		if (it->filter) {
+			note = ndb_get_note_by_key(it->txn, root->note_key,
+						   &note_size);
+			if (!note || !ndb_filter_matches(it->filter, note))
+				continue;
 		}
-	}
-					*/
 
-	return 1;
+		memset(result, 0, sizeof(*result));
+		result->key.note_id = root->note_key;
+		result->key.timestamp = root->created_at;
+		result->note = note;
+		result->note_size = note_size;
+		if (it->ranked)
+			result->score = ndb_text_score(it);
+
+		return 1;
+	}
 }
 
-static void ndb_text_search_results_init(
-		struct ndb_text_search_results *results) {
-	results->num_results = 0;
+void ndb_text_search_iter_end(struct ndb_text_search_iter *it)
+{
+	int i;
+
+	for (i = 0; i < it->num_cursors; i++) {
+		mdb_cursor_close(it->cursors[i]->mdb);
+		free(it->cursors[i]);
+	}
+
+	free(it);
 }
 
 void ndb_default_text_search_config(struct ndb_text_search_config *cfg)
@@ -5161,6 +10806,12 @@ void ndb_default_text_search_config(struct ndb_text_search_config *cfg)
 	cfg->limit = MAX_TEXT_SEARCH_RESULTS;
 }
 
+void ndb_default_ranked_search_config(struct ndb_text_search_config *cfg)
+{
+	cfg->order = NDB_ORDER_RELEVANCE;
+	cfg->limit = MAX_RANKED_SEARCH_RESULTS;
+}
+
 void ndb_text_search_config_set_order(struct ndb_text_search_config *cfg,
 				     enum ndb_search_order order)
 {
@@ -5172,257 +10823,124 @@ void ndb_text_search_config_set_limit(struct ndb_text_search_config *cfg, int li
 	cfg->limit = limit;
 }
 
-static int compare_search_words(const void *pa, const void *pb)
+// keep the lowest score on top of the heap so it's the one that gets
+// bumped
+static int ndb_text_result_better(struct ndb_text_search_result *a,
+				  struct ndb_text_search_result *b)
 {
-	struct ndb_word *a, *b;
+	if (a->score != b->score)
+		return a->score > b->score;
+	return ndb_ts_key_cmp(a->key.timestamp, a->key.note_id,
+			      b->key.timestamp, b->key.note_id) < 0;
+}
 
-	a = (struct ndb_word *)pa;
-	b = (struct ndb_word *)pb;
+static void ndb_text_heap_down(struct ndb_text_search_result *heap, int n,
+			       int i)
+{
+	struct ndb_text_search_result tmp;
+	int c;
 
-	if (a->word_len == b->word_len) {
-		return 0;
-	} else if (a->word_len > b->word_len) {
-		// biggest words should be at the front of the list,
-		// so we say it's "smaller" here
-		return -1;
-	} else {
-		return 1;
+	while ((c = 2 * i + 1) < n) {
+		if (c + 1 < n && ndb_text_result_better(&heap[c], &heap[c + 1]))
+			c++;
+		if (!ndb_text_result_better(&heap[i], &heap[c]))
+			break;
+		tmp = heap[i];
+		heap[i] = heap[c];
+		heap[c] = tmp;
+		i = c;
 	}
 }
 
-// Sort search words from largest to smallest. Larger words are less likely
-// in the index, allowing our scan to walk fewer words at the root when
-// recursively matching.
-void sort_largest_to_smallest(struct ndb_search_words *words)
+static void ndb_text_heap_up(struct ndb_text_search_result *heap, int i)
 {
-	qsort(words->words, words->num_words, sizeof(words->words[0]), compare_search_words);
+	struct ndb_text_search_result tmp;
+	int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!ndb_text_result_better(&heap[parent], &heap[i]))
+			break;
+		tmp = heap[i];
+		heap[i] = heap[parent];
+		heap[parent] = tmp;
+		i = parent;
+	}
 }
 
+// Score every match and keep the best `limit` of them. Matches come newest
+// first, so once even a perfect score at this age can't beat the worst one
+// we're keeping, nothing after it can either.
+static void ndb_text_search_ranked(struct ndb_text_search_iter *it,
+				   struct ndb_text_search_results *results,
+				   int limit)
+{
+	struct ndb_text_search_result *heap = results->results;
+	struct ndb_text_search_result result, tmp;
+	int n, i;
+
+	n = 0;
+	while (limit > 0 && ndb_text_search_iter_next(it, &result)) {
+		if (n < limit) {
+			heap[n] = result;
+			ndb_text_heap_up(heap, n++);
+			continue;
+		}
+
+		if (ndb_text_result_better(&result, &heap[0])) {
+			heap[0] = result;
+			ndb_text_heap_down(heap, n, 0);
+		}
+
+		if (it->max_score * ndb_text_recency_boost(it,
+				result.key.timestamp) <= heap[0].score)
+			break;
+	}
+
+	// pop the worst off the end until it's sorted best first
+	for (i = n - 1; i > 0; i--) {
+		tmp = heap[0];
+		heap[0] = heap[i];
+		heap[i] = tmp;
+		ndb_text_heap_down(heap, i, 0);
+	}
+
+	results->num_results = n;
+}
 
 int ndb_text_search_with(struct ndb_txn *txn, const char *query,
 		    struct ndb_text_search_results *results,
 		    struct ndb_text_search_config *config,
 		    struct ndb_filter *filter)
 {
-	unsigned char buffer[1024], *buf;
-	unsigned char saved_buf[1024], *saved;
-	struct ndb_text_search_result *result, *last_result;
-	struct ndb_text_search_result candidate, last_candidate;
-	struct ndb_search_words search_words;
-	//struct ndb_text_search_key search_key;
-	struct ndb_word *search_word;
-	struct ndb_note *note;
-	struct cursor cur;
-	uint64_t since, until, timestamp_op, *pint;
-	size_t note_size;
-	ndb_text_search_key_order_fn key_order_fn;
-	MDB_dbi text_db;
-	MDB_cursor *cursor;
-	MDB_val k, v;
-	int i, j, keysize, saved_size, limit;
-	MDB_cursor_op op, order_op;
+	struct ndb_text_search_iter *iter;
+	uint64_t *pint;
+	int limit;
 
-	note_size = 0;
-	note = 0;
-	saved = NULL;
-	ndb_text_search_results_init(results);
-	ndb_search_words_init(&search_words);
+	results->num_results = 0;
 
-	until = UINT64_MAX;
-	since = 0;
 	limit = MAX_TEXT_SEARCH_RESULTS;
-
-	// until, since from filter
-	if (filter != NULL) {
-		if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
-			until = *pint;
-
-		if ((pint = ndb_filter_get_int(filter, NDB_FILTER_SINCE)))
-			since = *pint;
-
-		if ((pint = ndb_filter_get_int(filter, NDB_FILTER_LIMIT)))
-			limit = *pint;
-	}
-
-	order_op = MDB_PREV;
-	key_order_fn = ndb_make_text_search_key_high;
-	timestamp_op = until;
-	if (config) {
-		if (config->order == NDB_ORDER_ASCENDING) {
-			order_op = MDB_NEXT;
-			// set the min timestamp value to since when ascending
-			timestamp_op = since;
-			key_order_fn = ndb_make_text_search_key_low;
-		}
+	if (filter && (pint = ndb_filter_get_int(filter, NDB_FILTER_LIMIT)))
+		limit = min(limit, (int)min(*pint, (uint64_t)INT_MAX));
+	if (config)
 		limit = min(limit, config->limit);
-	}
-	// end search config
 
-	text_db = txn->lmdb->dbs[NDB_DB_NOTE_TEXT];
-	make_cursor((unsigned char *)query, (unsigned char *)query + strlen(query), &cur);
-
-	ndb_parse_words(&cur, &search_words, ndb_parse_search_words);
-	if (search_words.num_words == 0)
+	if (!ndb_text_search_iter_begin(txn, query, config, filter, &iter))
 		return 0;
 
-	if ((i = mdb_cursor_open(txn->mdb_txn, text_db, &cursor))) {
-		fprintf(stderr, "nd_text_search: mdb_cursor_open failed, error %d\n", i);
-		return 0;
+	if (iter->ranked) {
+		ndb_text_search_ranked(iter, results, limit);
+		ndb_text_search_iter_end(iter);
+		return 1;
 	}
 
-	// This should complete the query quicker because the larger words are
-	// likely to have fewer entries in the search index. This is not always
-	// true. Words with higher frequency (like bitcoin on nostr in 2024)
-	// may be slower. TODO: Skip word recursion by leveraging a minimal
-	// perfect hashmap of parsed words on a note
-	sort_largest_to_smallest(&search_words);
-
-	// for each word, we recursively find all of the submatches
-	while (results->num_results < limit) {
-		last_result = NULL;
-		result = &results->results[results->num_results];
-
-		// if we have saved, then we continue from the last root search
-		// sequence
-		if (saved) {
-			buf = saved_buf;
-			saved = NULL;
-			keysize = saved_size;
-
-			k.mv_data = buf;
-			k.mv_size = saved_size;
-
-			// reposition the cursor so we can continue
-			if (mdb_cursor_get(cursor, &k, &v, MDB_SET_RANGE))
-				break;
-
-			op = order_op;
-		} else {
-			// construct a packed fulltext search key using this
-			// word. This key doesn't contain any timestamp or index
-			// info, so it should range match instead of exact
-			// match
-			if (!key_order_fn(buffer, sizeof(buffer),
-					  search_words.words[0].word_len,
-					  search_words.words[0].word,
-					  timestamp_op,
-					  &keysize))
-			{
-				// word is too big to fit in 1024-sized key
-				continue;
-			}
-
-			buf = buffer;
-			op = MDB_SET_RANGE;
-		}
-
-		for (j = 0; j < search_words.num_words; j++) {
-			search_word = &search_words.words[j];
-
-			// shouldn't happen but let's be defensive a bit
-			if (search_word->word_len == 0)
-				continue;
-
-			// if we already matched a note in this phrase, make
-			// sure we're including the note id in the query
-			if (last_result) {
-				// we are narrowing down a search.
-				// if we already have this note id, just continue
-				for (i = 0; i < results->num_results; i++) {
-					if (results->results[i].key.note_id == last_result->key.note_id)
-						// we can't break here to
-						// leave the word loop so
-						// have to use a goto
-						goto cont;
-				}
-
-				if (!ndb_make_noted_text_search_key(
-					buffer, sizeof(buffer),
-					search_word->word_len,
-					search_word->word,
-					last_result->key.timestamp,
-					last_result->key.note_id,
-					&keysize))
-				{
-					continue;
-				}
-
-				buf = buffer;
-			}
-
-			k.mv_data = buf;
-			k.mv_size = keysize;
-
-			// TODO: we can speed this up with the minimal perfect
-			// hashmap by quickly rejecting the remaining words
-			// by looking in the word hashmap on the note. This
-			// would allow us to skip the recursive word lookup
-			// thing
-			if (!ndb_text_search_next_word(cursor, op, &k,
-						       search_word,
-						       last_result,
-						       &candidate,
-						       order_op)) {
-				// we didn't find a match for this note_id
-				if (j == 0)
-					// if we're at one of the root words,
-					// this means that there are no further
-					// root word matches for any note, so
-					// we know we're done
-					goto done;
-				else
-					break;
-			}
-
-			*result = candidate;
-			op = MDB_SET_RANGE;
-
-			// save the first key match, since we will continue from
-			// this on the next root word result
-			if (j == 0) {
-				if (!saved) {
-					memcpy(saved_buf, k.mv_data, k.mv_size);
-					saved = saved_buf;
-					saved_size = k.mv_size;
-				}
-
-				// since we will be trying to match the same
-				// note_id on all subsequent word matches,
-				// let's lookup this note and make sure it
-				// matches the filter if we have one. If it
-				// doesn't match, we can quickly skip the
-				// remaining word queries
-				if (filter) {
-					if ((note = ndb_get_note_by_key(txn,
-							result->key.note_id,
-							&note_size)))
-					{
-						if (!ndb_filter_matches(filter, note)) {
-							break;
-						}
-						result->note = note;
-						result->note_size = note_size;
-					}
-				}
-			}
-
-			result->note = note;
-			result->note_size = note_size;
-			last_candidate = *result;
-			last_result = &last_candidate;
-		}
-
-		// we matched all of the queries!
-		if (j == search_words.num_words) {
-			results->num_results++;
-		}
-
-cont:
-		;
+	while (results->num_results < limit &&
+	       ndb_text_search_iter_next(iter,
+			&results->results[results->num_results])) {
+		results->num_results++;
 	}
 
-done:
-	mdb_cursor_close(cursor);
+	ndb_text_search_iter_end(iter);
 
 	return 1;
 }
@@ -5456,9 +10974,9 @@ static void ndb_write_blocks(struct ndb_txn *txn, uint64_t note_key,
 	}
 }
 
-static int ndb_write_new_blocks(struct ndb_txn *txn, struct ndb_note *note,
-				uint64_t note_key, unsigned char *scratch,
-				size_t scratch_size)
+static struct ndb_blocks *ndb_parse_note_blocks(struct ndb_note *note,
+						unsigned char *scratch,
+						size_t scratch_size)
 {
 	size_t content_len;
 	const char *content;
@@ -5469,21 +10987,45 @@ static int ndb_write_new_blocks(struct ndb_txn *txn, struct ndb_note *note,
 
 	if (!ndb_parse_content(scratch, scratch_size, content, content_len, &blocks)) {
 		//ndb_debug("failed to parse content '%.*s'\n", content_len, content);
-		return 0;
+		return NULL;
 	}
 
-	ndb_write_blocks(txn, note_key, blocks);
+	return blocks;
+}
+
+// Fulltext index a note as it's written, unless the indexer is still
+// catching up. It will get to this one too when it does. This only moves
+// the high water in `state`, the writer saves it once per transaction.
+static int ndb_write_note_fulltext(struct ndb_txn *txn, struct ndb_note *note,
+				   uint64_t note_key,
+				   struct ndb_fulltext_state *state,
+				   unsigned char *scratch, size_t scratch_size)
+{
+	if (state->high_water + 1 != note_key)
+		return 1;
+
+	if (ndb_fulltext_state_has_kind(state, note->kind) &&
+	    !ndb_write_note_fulltext_index(txn, note, note_key, scratch,
+					   scratch_size))
+		return 0;
+
+	state->high_water = note_key;
 	return 1;
 }
 
+// `fulltext` is the writer's fulltext state for this transaction, or NULL
+// to leave the note to the indexer
 static uint64_t ndb_write_note(struct ndb_txn *txn,
 			       struct ndb_writer_note *note,
+			       struct ndb_fulltext_state *fulltext,
 			       unsigned char *scratch, size_t scratch_size,
 			       uint32_t ndb_flags)
 {
 	int rc;
 	uint64_t note_key, kind;
 	struct ndb_relay_kind_key relay_key;
+	struct ndb_blocks *blocks = NULL;
+	struct ndb_hashtags hashtags;
 	MDB_dbi note_db;
 	MDB_val key, val;
 
@@ -5515,102 +11057,317 @@ static uint64_t ndb_write_note(struct ndb_txn *txn,
 
 	ndb_write_note_id_index(txn, note->note, note_key);
 	ndb_write_note_kind_index(txn, note->note, note_key);
-	ndb_write_note_tag_index(txn, note->note, note_key);
+	ndb_write_note_tag_index(txn, note->note, note_key,
+				 !ndb_flag_set(ndb_flags, NDB_FLAG_NO_LONG_TAGS));
 	ndb_write_note_pubkey_index(txn, note->note, note_key);
 	ndb_write_note_pubkey_kind_index(txn, note->note, note_key);
+	ndb_write_note_thread_index(txn, note->note, note_key);
+	ndb_write_note_addr_index(txn, note->note, note_key);
 
 	if (ndb_relay_kind_key_init(&relay_key, note_key, kind, ndb_note_created_at(note->note), note->relay))
 		ndb_write_note_relay_indexes(txn, &relay_key);
 
-	// only parse content and do fulltext index on text and longform notes
-	if (kind == 1 || kind == 30023) {
-		if (!ndb_flag_set(ndb_flags, NDB_FLAG_NO_FULLTEXT)) {
-			if (!ndb_write_note_fulltext_index(txn, note->note, note_key))
-				return 0;
-		}
+	if (fulltext && !ndb_write_note_fulltext(txn, note->note, note_key,
+						 fulltext, scratch,
+						 scratch_size)) {
+		return 0;
+	}
+
+	// only parse content on text and longform notes
+	if (ndb_kind_has_hashtag_content(kind)) {
+		// we need the blocks for hashtags even if we don't store them
+		blocks = ndb_parse_note_blocks(note->note, scratch, scratch_size);
 
 		// write note blocks
-		if (!ndb_flag_set(ndb_flags, NDB_FLAG_NO_NOTE_BLOCKS)) {
-			ndb_write_new_blocks(txn, note->note, note_key, scratch, scratch_size);
+		if (blocks && !ndb_flag_set(ndb_flags, NDB_FLAG_NO_NOTE_BLOCKS)) {
+			ndb_write_blocks(txn, note_key, blocks);
 		}
 	} else if (kind == 7 && !ndb_flag_set(ndb_flags, NDB_FLAG_NO_STATS)) {
 		ndb_write_reaction_stats(txn, note->note);
 	}
 
+	ndb_note_hashtags(note->note, blocks, &hashtags);
+	ndb_write_note_hashtag_index(txn, note->note, note_key, &hashtags);
+	ndb_write_hashtag_counts(txn, note->note, &hashtags);
+
 	return note_key;
 }
 
-static void ndb_monitor_lock(struct ndb_monitor *mon) {
-	pthread_mutex_lock(&mon->mutex);
+static void ndb_monitor_read_lock(struct ndb_monitor *mon) {
+	pthread_rwlock_rdlock(&mon->lock);
 }
 
-static void ndb_monitor_unlock(struct ndb_monitor *mon) {
-	pthread_mutex_unlock(&mon->mutex);
+static void ndb_monitor_write_lock(struct ndb_monitor *mon) {
+	pthread_rwlock_wrlock(&mon->lock);
 }
 
-struct written_note {
-	uint64_t note_id;
-	struct ndb_writer_note *note;
-};
+static void ndb_monitor_read_unlock(struct ndb_monitor *mon) {
+	RWLOCK_RDUNLOCK(&mon->lock);
+}
+
+static void ndb_monitor_write_unlock(struct ndb_monitor *mon) {
+	RWLOCK_WRUNLOCK(&mon->lock);
+}
+
+// make a subscription's fd readable
+static void ndb_subscription_signal(struct ndb_subscription *sub)
+{
+#ifdef __linux__
+	uint64_t one = 1;
+	// the eventfd counter won't realistically overflow
+	(void)!write(sub->fd_write, &one, sizeof(one));
+#elif !defined(_WIN32)
+	char c = 0;
+	// if the pipe is full it is already readable, so EAGAIN is fine
+	(void)!write(sub->fd_write, &c, 1);
+#else
+	(void)sub;
+#endif
+}
+
+static void ndb_subscription_drain(struct ndb_subscription *sub)
+{
+#ifdef __linux__
+	uint64_t count;
+	(void)!read(sub->fd_read, &count, sizeof(count));
+#elif !defined(_WIN32)
+	char buf[64];
+	while (read(sub->fd_read, buf, sizeof(buf)) > 0)
+		;
+#else
+	(void)sub;
+#endif
+}
+
+// Append an entry to the notification log without publishing it. The
+// oldest entries are dropped until both the entry and its bitmap fit.
+static void ndb_notify_ring_append(struct ndb_notify_ring *ring,
+				   uint64_t *head, uint64_t txnid,
+				   uint64_t note_key, const uint64_t *bits,
+				   uint32_t num_words)
+{
+	struct ndb_notify_entry *entry;
+	uint64_t tail;
+	uint32_t i;
+
+	tail = ring->tail;
+	while (*head - tail >= NDB_NOTIFY_RING_ENTRIES ||
+	       (*head != tail && ring->word_head + num_words -
+		ring->entries[tail % NDB_NOTIFY_RING_ENTRIES].words >
+		NDB_NOTIFY_RING_WORDS)) {
+		tail++;
+	}
+
+	if (tail != ring->tail) {
+		// readers have to see the new tail before we overwrite
+		// anything they might be copying
+		ATOMIC_STORE_U64(&ring->tail, tail);
+		ATOMIC_FENCE();
+	}
+
+	entry = &ring->entries[*head % NDB_NOTIFY_RING_ENTRIES];
+	entry->txnid = txnid;
+	entry->note_key = note_key;
+	entry->words = ring->word_head;
+	entry->num_words = num_words;
+
+	for (i = 0; i < num_words; i++) {
+		ring->words[(ring->word_head + i) % NDB_NOTIFY_RING_WORDS] =
+			bits[i];
+	}
+
+	ring->word_head += num_words;
+	(*head)++;
+}
+
+static void ndb_notify_ring_publish(struct ndb_notify_ring *ring,
+				    uint64_t head)
+{
+	ATOMIC_STORE_U64(&ring->head, head);
+
+	pthread_mutex_lock(&ring->mutex);
+	pthread_cond_broadcast(&ring->cond);
+	pthread_mutex_unlock(&ring->mutex);
+}
+
+// When the subscription's delivery policy lets it wake up next, or
+// UINT64_MAX if it is waiting on more notes
+static uint64_t ndb_subscription_wakeup_at(struct ndb_subscription *sub)
+{
+	struct ndb_delivery_policy *policy = &sub->policy;
+	uint64_t at = UINT64_MAX, latency_at;
+
+	if ((int64_t)sub->pending >= policy->min_batch)
+		at = sub->last_wakeup + policy->min_interval_ms * 1000000ULL;
+
+	if (policy->max_latency_ms > 0) {
+		latency_at = sub->pending_since +
+			policy->max_latency_ms * 1000000ULL;
+		if (latency_at < at)
+			at = latency_at;
+	}
+
+	return at;
+}
+
+// Signal the subscription's fd and remember it for the subscription
+// callback, which the notify pass calls once it has dropped the monitor
+// lock so callbacks are free to unsubscribe or change delivery policies.
+static void ndb_subscription_wakeup(struct ndb_monitor *monitor,
+				    struct ndb_subscription *sub,
+				    int *num_woken)
+{
+	if (sub->fd_write != -1)
+		ndb_subscription_signal(sub);
+
+	if (monitor->sub_cb != NULL && *num_woken < monitor->woken_capacity)
+		monitor->woken[(*num_woken)++] = sub->subid;
+}
+
+// make room for a wakeup per subscription. Please hold the monitor lock.
+static int ndb_monitor_reserve_woken(struct ndb_monitor *monitor)
+{
+	uint64_t *woken;
+	int capacity;
+
+	if (monitor->sub_cb == NULL ||
+	    monitor->woken_capacity >= monitor->num_subscriptions)
+		return 1;
+
+	capacity = monitor->capacity;
+	if (!(woken = realloc(monitor->woken, capacity * sizeof(*woken))))
+		return 0;
+
+	monitor->woken = woken;
+	monitor->woken_capacity = capacity;
+	return 1;
+}
 
 // When the data has been committed to the database, take all of the written
-// notes, check them against subscriptions, and then write to the subscription
-// inbox for all matching notes
-static void ndb_notify_subscriptions(struct ndb_monitor *monitor,
-				     struct written_note *wrote, int num_notes)
-{
-	int i, k;
-	int pushed;
-	struct written_note *written;
-	struct ndb_note *note;
+// notes, check them against subscriptions, and then append every note that
+// matched something to the notification log along with a bitmap of the
+// subscriptions it matched. Returns when the notify pass needs to run again
+// for wakeups that were held back, or 0 if none were.
+static uint64_t ndb_notify_subscriptions(struct ndb_monitor *monitor,
+					 struct ndb_notifier_msg *msgs,
+					 int num_msgs)
+{
+	int i, k, num_woken = 0;
+	uint32_t w, num_words;
+	uint64_t head, now, at, next = 0;
+	struct ndb_notifier_msg *msg;
 	struct ndb_subscription *sub;
 
-	ndb_monitor_lock(monitor);
+	ndb_monitor_read_lock(monitor);
+
+	if (monitor->num_subscriptions == 0) {
+		ndb_monitor_read_unlock(monitor);
+		return 0;
+	}
+
+	if (!ndb_monitor_reserve_woken(monitor))
+		fprintf(stderr, "ndb_notify_subscriptions: oom, subscription callbacks will be missed\n");
+
+	now = ndb_time_ns();
+
+	head = monitor->ring.head;
+	memset(monitor->bits_notified, 0,
+	       monitor->bit_words * sizeof(uint64_t));
+
+	for (k = 0; k < num_msgs; k++) {
+		msg = &msgs[k];
+		if (msg->type != NDB_NOTIFIER_NOTE)
+			continue;
+
+		memset(monitor->bits_match, 0,
+		       monitor->bit_words * sizeof(uint64_t));
+		num_words = 0;
+
+		for (i = 0; i < monitor->num_subscriptions; i++) {
+			sub = monitor->subscriptions[i];
+
+			if (!ndb_filter_group_matches(&sub->group, msg->note))
+				continue;
+
+			// the subscription's snapshot already has this one,
+			// see ndb_subscribe_with_query
+			if (msg->txnid < sub->min_txnid)
+				continue;
+
+			if (sub->pending++ == 0)
+				sub->pending_since = now;
+
+			w = sub->bit / 64;
+			monitor->bits_match[w] |= 1ULL << (sub->bit % 64);
+			if (w + 1 > num_words)
+				num_words = w + 1;
+		}
+
+		if (num_words == 0) {
+			ndb_debug("note %" PRIu64 " matched nothing\n",
+				  msg->note_key);
+			continue;
+		}
+
+		ndb_notify_ring_append(&monitor->ring, &head, msg->txnid,
+				       msg->note_key, monitor->bits_match,
+				       num_words);
 
-	for (i = 0; i < monitor->num_subscriptions; i++) {
-		sub = &monitor->subscriptions[i];
-		ndb_debug("checking subscription %d, %d notes\n", i, num_notes);
+		for (w = 0; w < num_words; w++)
+			monitor->bits_notified[w] |= monitor->bits_match[w];
+	}
 
-		pushed = 0;
-		for (k = 0; k < num_notes; k++) {
-			written = &wrote[k];
-			note = written->note->note;
+	if (head != monitor->ring.head)
+		ndb_notify_ring_publish(&monitor->ring, head);
 
-			if (ndb_filter_group_matches(&sub->group, note)) {
-				ndb_debug("pushing note\n");
+	// After publishing all of the matching notes, wake up every
+	// subscription with pending notes that its delivery policy allows,
+	// through its fd if it has one and the registered subscription
+	// callback if there is one. The callback needs to call
+	// ndb_poll_for_notes to pull the notes we just published.
+	for (i = 0; i < monitor->num_subscriptions; i++) {
+		sub = monitor->subscriptions[i];
+		if (sub->pending == 0)
+			continue;
 
-				if (!prot_queue_push(&sub->inbox, &written->note_id)) {
-					ndb_debug("couldn't push note to subscriber");
-				} else {
-					pushed++;
-				}
-			} else {
-				ndb_debug("not pushing note\n");
-			}
+		at = ndb_subscription_wakeup_at(sub);
+		if (at <= now) {
+			sub->pending = 0;
+			sub->last_wakeup = now;
+			ndb_subscription_wakeup(monitor, sub, &num_woken);
+			continue;
 		}
 
-		// After pushing all of the matching notes, check to see if we
-		// have a registered subscription callback. If so, we call it.
-		// The callback needs to call ndb_poll_for_notes to pull data
-		// that was just pushed to the queue in the for loop above.
-		if (monitor->sub_cb != NULL && pushed > 0) {
-			monitor->sub_cb(monitor->sub_cb_ctx, sub->subid);
+		// held back, it'll go out with a later wakeup
+		if (monitor->bits_notified[sub->bit / 64] &
+		    (1ULL << (sub->bit % 64))) {
+			ATOMIC_STORE_U64(&sub->coalesced, sub->coalesced + 1);
 		}
+
+		if (at != UINT64_MAX && (next == 0 || at < next))
+			next = at;
 	}
 
-	ndb_monitor_unlock(monitor);
+	ndb_monitor_read_unlock(monitor);
+
+	for (i = 0; i < num_woken; i++)
+		monitor->sub_cb(monitor->sub_cb_ctx, monitor->woken[i]);
+
+	return next;
 }
 
 uint64_t ndb_write_note_and_profile(
 		struct ndb_txn *txn,
 		struct ndb_writer_profile *profile,
+		struct ndb_fulltext_state *fulltext,
 		unsigned char *scratch,
 		size_t scratch_size,
 		uint32_t ndb_flags)
 {
 	uint64_t note_nkey;
 
-	note_nkey = ndb_write_note(txn, &profile->note, scratch, scratch_size, ndb_flags);
+	note_nkey = ndb_write_note(txn, &profile->note, fulltext, scratch,
+				   scratch_size, ndb_flags);
 
 	if (profile->record.builder) {
 		// only write if parsing didn't fail
@@ -5648,6 +11405,7 @@ static int ndb_write_version(struct ndb_txn *txn, uint64_t version)
 static int ndb_run_migrations(struct ndb_txn *txn)
 {
 	int64_t version, latest_version, i;
+	uint64_t rebuild;
 
 	latest_version = sizeof(MIGRATIONS) / sizeof(MIGRATIONS[0]);
 
@@ -5670,12 +11428,15 @@ static int ndb_run_migrations(struct ndb_txn *txn)
 		fprintf(stderr, "nostrdb: migrating v%d -> v%d\n",
 				(int)version, (int)latest_version);
 
+	rebuild = 0;
 	for (i = version; i < latest_version; i++) {
-		if (!MIGRATIONS[i].fn(txn)) {
+		if (MIGRATIONS[i].fn && !MIGRATIONS[i].fn(txn)) {
 			fprintf(stderr, "run_migrations: migration v%d -> v%d failed\n", (int)i, (int)(i+1));
 			return 0;
 		}
 
+		rebuild |= MIGRATIONS[i].rebuild;
+
 		if (!ndb_write_version(txn, i+1)) {
 			fprintf(stderr, "run_migrations: failed writing db version");
 			return 0;
@@ -5684,18 +11445,299 @@ static int ndb_run_migrations(struct ndb_txn *txn)
 		version = i+1;
 	}
 
+	// the versions are written in this same txn, so they only stick if
+	// this does too
+	if (rebuild && !ndb_migrate_rebuild_indices(txn, rebuild))
+		return 0;
+
 	return 1;
 }
 
 
+// Hand committed notes over to the notifier thread. The notifier owns (and
+// frees) the notes after this.
+static void ndb_writer_notify(struct ndb_notifier *notifier, uint64_t txnid,
+			      struct written_note *written, int num_notes)
+{
+	struct ndb_notifier_msg msgs[THREAD_QUEUE_BATCH];
+	int i;
+
+	if (num_notes == 0)
+		return;
+
+	for (i = 0; i < num_notes; i++) {
+		msgs[i].type = NDB_NOTIFIER_NOTE;
+		msgs[i].txnid = txnid;
+		msgs[i].note_key = written[i].note_id;
+		msgs[i].note = written[i].note->note;
+		written[i].note->note = NULL;
+	}
+
+	// If the notifier is this far behind, wait for it instead of
+	// dropping notes. This slows ingestion down to what subscribers can
+	// keep up with.
+	prot_queue_push_all_wait(&notifier->inbox, msgs, num_notes);
+}
+
+static void *ndb_notifier_thread(void *data)
+{
+	struct ndb_notifier *notifier = data;
+	struct ndb_notifier_msg msgs[THREAD_QUEUE_BATCH];
+	int i, popped, done;
+	uint64_t next, now;
+
+	ndb_debug("started notifier thread\n");
+
+	done = 0;
+	next = 0;
+	while (!done) {
+		// if some wakeups are being held back, don't sleep past them
+		if (next == 0) {
+			popped = prot_queue_pop_all(&notifier->inbox, msgs,
+						    THREAD_QUEUE_BATCH);
+		} else {
+			now = ndb_time_ns();
+			popped = prot_queue_timed_pop_all(&notifier->inbox, msgs,
+				THREAD_QUEUE_BATCH,
+				next > now ? (next - now + 999999) / 1000000 : 0);
+		}
+
+		for (i = 0; i < popped; i++) {
+			if (msgs[i].type == NDB_NOTIFIER_QUIT)
+				done = 1;
+		}
+
+		ndb_debug("notifying subscriptions, %d notes\n", popped);
+		next = ndb_notify_subscriptions(notifier->monitor, msgs, popped);
+
+		for (i = 0; i < popped; i++)
+			free(msgs[i].note);
+	}
+
+	ndb_debug("quitting notifier thread\n");
+	return NULL;
+}
+
+// Fulltext index the next batch of notes past the high water mark. Returns
+// how many notes it got through, 0 when it's caught up and -1 on errors.
+static int ndb_indexer_run_batch(struct ndb_indexer *indexer)
+{
+	struct ndb_fulltext_state state;
+	struct ndb_txn txn;
+	struct ndb_note *note;
+	MDB_cursor *cur;
+	MDB_txn *mdb_txn;
+	MDB_val k, v;
+	uint64_t note_key, last_key;
+	int count, rc, ok;
+
+	// check for work with a read txn so we only take the write lock from
+	// the writer when there is some
+	if ((rc = mdb_txn_begin(indexer->lmdb->env, NULL, MDB_RDONLY, &mdb_txn))) {
+		fprintf(stderr, "indexer: txn_begin failed: %s\n", mdb_strerror(rc));
+		return -1;
+	}
+	ndb_txn_from_mdb(&txn, indexer->lmdb, mdb_txn);
+	ok = ndb_get_fulltext_state(&txn, &state);
+	last_key = ndb_get_last_key(mdb_txn, indexer->lmdb->dbs[NDB_DB_NOTE]);
+	mdb_txn_abort(mdb_txn);
+
+	if (!ok || state.high_water >= last_key)
+		return 0;
+
+	if ((rc = mdb_txn_begin(indexer->lmdb->env, NULL, 0, &mdb_txn))) {
+		fprintf(stderr, "indexer: txn_begin failed: %s\n", mdb_strerror(rc));
+		return -1;
+	}
+	ndb_txn_from_mdb(&txn, indexer->lmdb, mdb_txn);
+
+	// the writer may have caught us up in the meantime
+	if (!ndb_get_fulltext_state(&txn, &state) ||
+	    (rc = mdb_cursor_open(mdb_txn, indexer->lmdb->dbs[NDB_DB_NOTE], &cur))) {
+		mdb_txn_abort(mdb_txn);
+		return -1;
+	}
+
+	note_key = state.high_water + 1;
+	k.mv_data = &note_key;
+	k.mv_size = sizeof(note_key);
+
+	count = 0;
+	rc = mdb_cursor_get(cur, &k, &v, MDB_SET_RANGE);
+	while (rc == 0 && count < NDB_INDEXER_BATCH) {
+		note = v.mv_data;
+		note_key = *(uint64_t *)k.mv_data;
+
+		// one bad note shouldn't hold up everything after it
+		if (ndb_fulltext_state_has_kind(&state, note->kind) &&
+		    !ndb_write_note_fulltext_index(&txn, note, note_key,
+						   indexer->scratch,
+						   indexer->scratch_size)) {
+			fprintf(stderr, "indexer: failed to index note %" PRIu64
+				", skipping it\n", note_key);
+		}
+
+		state.high_water = note_key;
+		count++;
+		rc = mdb_cursor_get(cur, &k, &v, MDB_NEXT);
+	}
+
+	mdb_cursor_close(cur);
+
+	if (count == 0 || !ndb_put_fulltext_state(&txn, &state)) {
+		mdb_txn_abort(mdb_txn);
+		return 0;
+	}
+
+	// readers can't see the new search results until we commit
+	ndb_query_cache_clear_searches(indexer->lmdb->query_cache, &txn);
+
+	if ((rc = mdb_txn_commit(mdb_txn))) {
+		fprintf(stderr, "indexer: txn_commit failed: %s\n", mdb_strerror(rc));
+		return -1;
+	}
+
+	ndb_debug("indexer: indexed up to note %" PRIu64 "\n", state.high_water);
+	return count;
+}
+
+static void *ndb_indexer_thread(void *data)
+{
+	struct ndb_indexer *indexer = data;
+	struct ndb_indexer_msg msgs[NDB_INDEXER_QUEUE_SIZE];
+	int i, popped, done, indexed;
+
+	ndb_debug("started indexer thread\n");
+
+	done = 0;
+	// catch up on whatever was left from last time first
+	indexed = 1;
+	while (!done) {
+		// only wait for the writer once we're caught up, but check for
+		// quits between batches
+		if (indexed > 0) {
+			popped = prot_queue_try_pop_all(&indexer->inbox, msgs,
+							NDB_INDEXER_QUEUE_SIZE);
+		} else {
+			popped = prot_queue_pop_all(&indexer->inbox, msgs,
+						    NDB_INDEXER_QUEUE_SIZE);
+		}
+
+		for (i = 0; i < popped; i++) {
+			if (msgs[i].type == NDB_INDEXER_QUIT)
+				done = 1;
+		}
+
+		if (!done)
+			indexed = ndb_indexer_run_batch(indexer);
+	}
+
+	ndb_debug("quitting indexer thread\n");
+	return NULL;
+}
+
+// Let the indexer know there are new notes. If its inbox is full it
+// already has wakeups it hasn't gotten to.
+static void ndb_writer_wake_indexer(struct ndb_indexer *indexer)
+{
+	struct ndb_indexer_msg msg = { .type = NDB_INDEXER_WAKE };
+
+	if (indexer)
+		prot_queue_push(&indexer->inbox, &msg);
+}
+
+// Rebuild the next batch of notes of a pending index rebuild in its own
+// transaction. Returns how many notes it got through, 0 when there is
+// nothing left to rebuild and -1 on errors.
+static int ndb_rebuild_batch(struct ndb_lmdb *lmdb, unsigned char *scratch,
+			     size_t scratch_size, uint32_t ndb_flags)
+{
+	struct ndb_rebuild_state state;
+	struct ndb_txn txn;
+	struct ndb_note *note;
+	MDB_cursor *cur;
+	MDB_txn *mdb_txn;
+	MDB_val k, v;
+	uint64_t note_key;
+	int count, rc;
+
+	if ((rc = mdb_txn_begin(lmdb->env, NULL, 0, &mdb_txn))) {
+		fprintf(stderr, "rebuild: txn_begin failed: %s\n", mdb_strerror(rc));
+		return -1;
+	}
+	ndb_txn_from_mdb(&txn, lmdb, mdb_txn);
+
+	if (!ndb_get_rebuild_state(&txn, &state)) {
+		mdb_txn_abort(mdb_txn);
+		return 0;
+	}
+
+	if ((rc = mdb_cursor_open(mdb_txn, lmdb->dbs[NDB_DB_NOTE], &cur))) {
+		mdb_txn_abort(mdb_txn);
+		return -1;
+	}
+
+	note_key = state.next_key;
+	k.mv_data = &note_key;
+	k.mv_size = sizeof(note_key);
+
+	count = 0;
+	rc = mdb_cursor_get(cur, &k, &v, MDB_SET_RANGE);
+	while (rc == 0 && count < NDB_REBUILD_BATCH) {
+		note = v.mv_data;
+		note_key = *(uint64_t *)k.mv_data;
+
+		// the writer indexed everything after this as it came in
+		if (note_key > state.last_key)
+			break;
+
+		if (!ndb_rebuild_note(&txn, note, note_key, state.indices,
+				      scratch, scratch_size, ndb_flags)) {
+			fprintf(stderr, "rebuild: failed to index note %" PRIu64
+				", skipping it\n", note_key);
+		}
+
+		state.next_key = note_key + 1;
+		count++;
+		rc = mdb_cursor_get(cur, &k, &v, MDB_NEXT);
+	}
+
+	mdb_cursor_close(cur);
+
+	if (rc != 0 || count < NDB_REBUILD_BATCH)
+		state.next_key = state.last_key + 1;
+
+	if (!ndb_put_rebuild_state(&txn, &state)) {
+		mdb_txn_abort(mdb_txn);
+		return -1;
+	}
+
+	// queries see more of the rebuilt indices after this
+	ndb_query_cache_invalidate(lmdb->query_cache, &txn, NULL, 0, NULL, 0, 1);
+
+	if ((rc = mdb_txn_commit(mdb_txn))) {
+		fprintf(stderr, "rebuild: txn_commit failed: %s\n", mdb_strerror(rc));
+		return -1;
+	}
+
+	if (state.next_key > state.last_key)
+		fprintf(stderr, "rebuilt note indices up to note %" PRIu64 "\n",
+			state.last_key);
+
+	return count;
+}
+
 static void *ndb_writer_thread(void *data)
 {
 	ndb_debug("started writer thread\n");
 	struct ndb_writer *writer = data;
 	struct ndb_writer_msg msgs[THREAD_QUEUE_BATCH], *msg;
 	struct written_note written_notes[THREAD_QUEUE_BATCH];
-	int i, popped, done, needs_commit, num_notes;
-	uint64_t note_nkey;
+	uint64_t relay_notes[THREAD_QUEUE_BATCH];
+	int i, popped, done, needs_commit, num_notes, num_relay_notes, migrated;
+	int rebuilding, index_fulltext, have_fulltext;
+	uint64_t note_nkey, txnid, high_water;
+	struct ndb_fulltext_state fulltext;
 	struct ndb_txn txn;
 	unsigned char *scratch;
 	struct ndb_relay_kind_key relay_key;
@@ -5705,12 +11747,27 @@ static void *ndb_writer_thread(void *data)
 	MDB_txn *mdb_txn = NULL;
 	ndb_txn_from_mdb(&txn, writer->lmdb, mdb_txn);
 
+	index_fulltext =
+		!ndb_flag_set(writer->ndb_flags, NDB_FLAG_NO_FULLTEXT) &&
+		!ndb_flag_set(writer->ndb_flags, NDB_FLAG_ASYNC_FULLTEXT);
+
 	done = 0;
+	// pick up an index rebuild that didn't finish last time
+	rebuilding = 1;
 	while (!done) {
 		txn.mdb_txn = NULL;
 		num_notes = 0;
+		num_relay_notes = 0;
+		migrated = 0;
 		ndb_debug("writer waiting for items\n");
-		popped = prot_queue_pop_all(&writer->inbox, msgs, THREAD_QUEUE_BATCH);
+		// keep rebuilding between writes until there's nothing left
+		if (rebuilding) {
+			popped = prot_queue_try_pop_all(&writer->inbox, msgs,
+							THREAD_QUEUE_BATCH);
+		} else {
+			popped = prot_queue_pop_all(&writer->inbox, msgs,
+						    THREAD_QUEUE_BATCH);
+		}
 		ndb_debug("writer popped %d items\n", popped);
 
 		needs_commit = 0;
@@ -5736,6 +11793,12 @@ static void *ndb_writer_thread(void *data)
 			continue;
 		}
 
+		// notes move the fulltext high water along as they're
+		// indexed, and it's saved once before we commit
+		have_fulltext = needs_commit && index_fulltext &&
+			ndb_get_fulltext_state(&txn, &fulltext);
+		high_water = have_fulltext ? fulltext.high_water : 0;
+
 		for (i = 0; i < popped; i++) {
 			msg = &msgs[i];
 
@@ -5750,6 +11813,7 @@ static void *ndb_writer_thread(void *data)
 					ndb_write_note_and_profile(
 						&txn,
 						&msg->profile,
+						have_fulltext ? &fulltext : NULL,
 						scratch,
 						writer->scratch_size,
 						writer->ndb_flags);
@@ -5766,6 +11830,7 @@ static void *ndb_writer_thread(void *data)
 				break;
 			case NDB_WRITER_NOTE:
 				note_nkey = ndb_write_note(&txn, &msg->note,
+							   have_fulltext ? &fulltext : NULL,
 							   scratch,
 							   writer->scratch_size,
 							   writer->ndb_flags);
@@ -5784,7 +11849,8 @@ static void *ndb_writer_thread(void *data)
 							    msg->note_relay.created_at,
 							    msg->note_relay.relay))
 				{
-					ndb_write_note_relay_indexes(&txn, &relay_key);
+					if (ndb_write_note_relay_indexes(&txn, &relay_key))
+						relay_notes[num_relay_notes++] = msg->note_relay.note_key;
 				}
 				break;
 			case NDB_WRITER_DBMETA:
@@ -5795,10 +11861,19 @@ static void *ndb_writer_thread(void *data)
 						       msg->blocks.blocks);
 				break;
 			case NDB_WRITER_MIGRATE:
+				// migrations can reset the fulltext state, so
+				// save ours first and leave the rest of this
+				// txn's notes to the indexer
+				if (have_fulltext &&
+				    fulltext.high_water != high_water)
+					ndb_put_fulltext_state(&txn, &fulltext);
+				have_fulltext = 0;
+
 				if (!ndb_run_migrations(&txn)) {
 					mdb_txn_abort(txn.mdb_txn);
 					goto bail;
 				}
+				migrated = 1;
 				break;
 			case NDB_WRITER_PROFILE_LAST_FETCH:
 				ndb_writer_last_profile_fetch(&txn,
@@ -5811,15 +11886,35 @@ static void *ndb_writer_thread(void *data)
 
 		// commit writes
 		if (needs_commit) {
+			if (have_fulltext && fulltext.high_water != high_water &&
+			    !ndb_put_fulltext_state(&txn, &fulltext)) {
+				ndb_debug("writer thread fulltext state write failed\n");
+			}
+
+			// readers can't see these writes until we commit, so
+			// drop any cached results they make stale first
+			ndb_query_cache_invalidate(writer->lmdb->query_cache,
+						   &txn, written_notes,
+						   num_notes, relay_notes,
+						   num_relay_notes, migrated);
+
+			// read transactions started after this commit see
+			// this id as their snapshot
+			txnid = mdb_txn_id(txn.mdb_txn);
+
 			if (!ndb_end_query(&txn)) {
 				ndb_debug("writer thread txn commit failed\n");
-			} else {
-				ndb_debug("notifying subscriptions, %d notes\n", num_notes);
-				ndb_notify_subscriptions(writer->monitor,
-							 written_notes,
-							 num_notes);
-				// update subscriptions
+			} else if (num_notes > 0) {
+				ndb_debug("handing %d notes to the notifier\n", num_notes);
+				ndb_writer_notify(writer->notifier, txnid,
+						  written_notes, num_notes);
+				ndb_writer_wake_indexer(writer->indexer);
+			} else if (migrated) {
+				ndb_writer_wake_indexer(writer->indexer);
 			}
+
+			if (migrated)
+				rebuilding = 1;
 		}
 
 		// free notes
@@ -5838,6 +11933,13 @@ static void *ndb_writer_thread(void *data)
 				free((void*)msg->note_relay.relay);
 			}
 		}
+
+		// a failed batch is logged, and everything else keeps going
+		if (rebuilding && !done) {
+			rebuilding = ndb_rebuild_batch(writer->lmdb, scratch,
+						       writer->scratch_size,
+						       writer->ndb_flags) > 0;
+		}
 	}
 
 bail:
@@ -5925,12 +12027,95 @@ static void *ndb_ingester_thread(void *data)
 }
 
 
+static int ndb_notifier_init(struct ndb_notifier *notifier,
+			     struct ndb_monitor *monitor)
+{
+	int buflen;
+
+	notifier->monitor = monitor;
+
+	buflen = sizeof(struct ndb_notifier_msg) * DEFAULT_QUEUE_SIZE;
+	if (!(notifier->queue_buf = malloc(buflen))) {
+		fprintf(stderr, "ndb: failed to allocate space for notifier queue");
+		return 0;
+	}
+
+	prot_queue_init(&notifier->inbox, notifier->queue_buf, buflen,
+			sizeof(struct ndb_notifier_msg));
+
+	if (THREAD_CREATE(notifier->thread_id, ndb_notifier_thread, notifier))
+	{
+		fprintf(stderr, "ndb notifier thread failed to create\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+// the writer pushes to us, so destroy it first
+static void ndb_notifier_destroy(struct ndb_notifier *notifier)
+{
+	struct ndb_notifier_msg msg = { .type = NDB_NOTIFIER_QUIT };
+
+	prot_queue_push_all_wait(&notifier->inbox, &msg, 1);
+
+	THREAD_FINISH(notifier->thread_id);
+
+	prot_queue_destroy(&notifier->inbox);
+	free(notifier->queue_buf);
+}
+
+static int ndb_indexer_init(struct ndb_indexer *indexer,
+			    struct ndb_lmdb *lmdb, int scratch_size)
+{
+	int buflen;
+
+	indexer->lmdb = lmdb;
+	indexer->scratch_size = scratch_size;
+
+	buflen = sizeof(struct ndb_indexer_msg) * NDB_INDEXER_QUEUE_SIZE;
+	indexer->queue_buf = malloc(buflen);
+	indexer->scratch = malloc(scratch_size);
+	if (indexer->queue_buf == NULL || indexer->scratch == NULL) {
+		fprintf(stderr, "ndb: failed to allocate space for indexer");
+		return 0;
+	}
+
+	prot_queue_init(&indexer->inbox, indexer->queue_buf, buflen,
+			sizeof(struct ndb_indexer_msg));
+
+	if (THREAD_CREATE(indexer->thread_id, ndb_indexer_thread, indexer))
+	{
+		fprintf(stderr, "ndb indexer thread failed to create\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+// the writer wakes us up, so destroy it first
+static void ndb_indexer_destroy(struct ndb_indexer *indexer)
+{
+	struct ndb_indexer_msg msg = { .type = NDB_INDEXER_QUIT };
+
+	while (!prot_queue_push(&indexer->inbox, &msg))
+		THREAD_YIELD();
+
+	THREAD_FINISH(indexer->thread_id);
+
+	prot_queue_destroy(&indexer->inbox);
+	free(indexer->queue_buf);
+	free(indexer->scratch);
+}
+
 static int ndb_writer_init(struct ndb_writer *writer, struct ndb_lmdb *lmdb,
-			   struct ndb_monitor *monitor, uint32_t ndb_flags,
+			   struct ndb_notifier *notifier,
+			   struct ndb_indexer *indexer, uint32_t ndb_flags,
 			   int scratch_size)
 {
 	writer->lmdb = lmdb;
-	writer->monitor = monitor;
+	writer->notifier = notifier;
+	writer->indexer = indexer;
 	writer->ndb_flags = ndb_flags;
 	writer->scratch_size = scratch_size;
 	writer->queue_buflen = sizeof(struct ndb_writer_msg) * DEFAULT_QUEUE_SIZE;
@@ -6143,31 +12328,127 @@ static int ndb_init_lmdb(const char *filename, struct ndb_lmdb *lmdb, size_t map
 		fprintf(stderr, "mdb_dbi_open note_pubkey_kind failed: %s\n", mdb_strerror(rc));
 		return 0;
 	}
-	mdb_set_compare(txn, lmdb->dbs[NDB_DB_NOTE_PUBKEY_KIND], ndb_id_u64_ts_compare);
+	mdb_set_compare(txn, lmdb->dbs[NDB_DB_NOTE_PUBKEY_KIND], ndb_id_u64_ts_compare);
+
+	if ((rc = mdb_dbi_open(txn, "note_text", MDB_CREATE | MDB_DUPSORT,
+			       &lmdb->dbs[NDB_DB_NOTE_TEXT]))) {
+		fprintf(stderr, "mdb_dbi_open note_text failed: %s\n", mdb_strerror(rc));
+		return 0;
+	}
+	// the old fulltext index, only kept around so it can be emptied
+	mdb_set_compare(txn, lmdb->dbs[NDB_DB_NOTE_TEXT], ndb_text_search_key_compare);
+
+	if ((rc = mdb_dbi_open(txn, "note_postings", MDB_CREATE,
+			       &lmdb->dbs[NDB_DB_NOTE_POSTINGS]))) {
+		fprintf(stderr, "mdb_dbi_open note_postings failed: %s\n", mdb_strerror(rc));
+		return 0;
+	}
+
+	if ((rc = mdb_dbi_open(txn, "note_term_stats", MDB_CREATE,
+			       &lmdb->dbs[NDB_DB_NOTE_TERM_STATS]))) {
+		fprintf(stderr, "mdb_dbi_open note_term_stats failed: %s\n", mdb_strerror(rc));
+		return 0;
+	}
+
+	if ((rc = mdb_dbi_open(txn, "note_blocks", MDB_CREATE | MDB_INTEGERKEY,
+			       &lmdb->dbs[NDB_DB_NOTE_BLOCKS]))) {
+		fprintf(stderr, "mdb_dbi_open note_blocks failed: %s\n", mdb_strerror(rc));
+		return 0;
+	}
+
+	if ((rc = mdb_dbi_open(txn, "note_tags", MDB_CREATE | MDB_DUPSORT | MDB_DUPFIXED,
+			       &lmdb->dbs[NDB_DB_NOTE_TAGS]))) {
+		fprintf(stderr, "mdb_dbi_open note_tags failed: %s\n", mdb_strerror(rc));
+		return 0;
+	}
+	mdb_set_compare(txn, lmdb->dbs[NDB_DB_NOTE_TAGS], ndb_tag_key_compare);
+
+	if ((rc = mdb_dbi_open(txn, "note_thread",
+			       MDB_CREATE | MDB_DUPSORT | MDB_INTEGERDUP | MDB_DUPFIXED,
+			       &lmdb->dbs[NDB_DB_NOTE_THREAD]))) {
+		fprintf(stderr, "mdb_dbi_open note_thread failed: %s\n", mdb_strerror(rc));
+		return 0;
+	}
+	mdb_set_compare(txn, lmdb->dbs[NDB_DB_NOTE_THREAD], ndb_id_u64_ts_compare);
+
+	if ((rc = mdb_dbi_open(txn, "note_addr", MDB_CREATE,
+			       &lmdb->dbs[NDB_DB_NOTE_ADDR]))) {
+		fprintf(stderr, "mdb_dbi_open note_addr failed: %s\n", mdb_strerror(rc));
+		return 0;
+	}
+
+	if ((rc = mdb_dbi_open(txn, "hashtag_counts", MDB_CREATE,
+			       &lmdb->dbs[NDB_DB_HASHTAG_COUNTS]))) {
+		fprintf(stderr, "mdb_dbi_open hashtag_counts failed: %s\n", mdb_strerror(rc));
+		return 0;
+	}
+	mdb_set_compare(txn, lmdb->dbs[NDB_DB_HASHTAG_COUNTS], ndb_hashtag_count_compare);
+
+	if ((rc = mdb_dbi_open(txn, "note_mention",
+			       MDB_CREATE | MDB_DUPSORT | MDB_INTEGERDUP | MDB_DUPFIXED,
+			       &lmdb->dbs[NDB_DB_NOTE_MENTION]))) {
+		fprintf(stderr, "mdb_dbi_open note_mention failed: %s\n", mdb_strerror(rc));
+		return 0;
+	}
+	mdb_set_compare(txn, lmdb->dbs[NDB_DB_NOTE_MENTION], ndb_id_u64_ts_compare);
+
+	// Commit the transaction
+	if ((rc = mdb_txn_commit(txn))) {
+		fprintf(stderr, "mdb_txn_commit failed, error %d\n", rc);
+		return 0;
+	}
+
+	return 1;
+}
+
+// Set up the fulltext state before any threads start. Databases from
+// before there was one were indexed as notes came in for kinds 1 and 30023.
+// If the configured kinds are different the index is emptied, and the
+// indexer rebuilds it in the background.
+static int ndb_init_fulltext(struct ndb_lmdb *lmdb)
+{
+	static const uint64_t legacy_kinds[] = { 1, 30023 };
+	struct ndb_fulltext_state state, want;
+	struct ndb_txn txn;
+	MDB_txn *mdb_txn;
+	int rc;
+
+	if ((rc = mdb_txn_begin(lmdb->env, NULL, 0, &mdb_txn))) {
+		fprintf(stderr, "ndb_init_fulltext: txn_begin failed: %s\n",
+			mdb_strerror(rc));
+		return 0;
+	}
+	ndb_txn_from_mdb(&txn, lmdb, mdb_txn);
 
-	if ((rc = mdb_dbi_open(txn, "note_text", MDB_CREATE | MDB_DUPSORT,
-			       &lmdb->dbs[NDB_DB_NOTE_TEXT]))) {
-		fprintf(stderr, "mdb_dbi_open note_text failed: %s\n", mdb_strerror(rc));
-		return 0;
+	if (!ndb_get_fulltext_state(&txn, &state)) {
+		memset(&state, 0, sizeof(state));
+		state.high_water = ndb_get_last_key(mdb_txn,
+						    lmdb->dbs[NDB_DB_NOTE]);
+		state.num_kinds = sizeof(legacy_kinds) / sizeof(legacy_kinds[0]);
+		memcpy(state.kinds, legacy_kinds, sizeof(legacy_kinds));
 	}
-	mdb_set_compare(txn, lmdb->dbs[NDB_DB_NOTE_TEXT], ndb_text_search_key_compare);
 
-	if ((rc = mdb_dbi_open(txn, "note_blocks", MDB_CREATE | MDB_INTEGERKEY,
-			       &lmdb->dbs[NDB_DB_NOTE_BLOCKS]))) {
-		fprintf(stderr, "mdb_dbi_open note_blocks failed: %s\n", mdb_strerror(rc));
-		return 0;
+	ndb_fulltext_state_init(&want, lmdb, state.high_water);
+
+	if (memcmp(&state, &want, sizeof(state))) {
+		if (state.high_water > 0)
+			fprintf(stderr, "fulltext kinds changed, reindexing\n");
+		if (mdb_drop(mdb_txn, lmdb->dbs[NDB_DB_NOTE_POSTINGS], 0) ||
+		    mdb_drop(mdb_txn, lmdb->dbs[NDB_DB_NOTE_TERM_STATS], 0)) {
+			mdb_txn_abort(mdb_txn);
+			return 0;
+		}
+		want.high_water = 0;
 	}
 
-	if ((rc = mdb_dbi_open(txn, "note_tags", MDB_CREATE | MDB_DUPSORT | MDB_DUPFIXED,
-			       &lmdb->dbs[NDB_DB_NOTE_TAGS]))) {
-		fprintf(stderr, "mdb_dbi_open note_tags failed: %s\n", mdb_strerror(rc));
+	if (!ndb_put_fulltext_state(&txn, &want)) {
+		mdb_txn_abort(mdb_txn);
 		return 0;
 	}
-	mdb_set_compare(txn, lmdb->dbs[NDB_DB_NOTE_TAGS], ndb_tag_key_compare);
 
-	// Commit the transaction
-	if ((rc = mdb_txn_commit(txn))) {
-		fprintf(stderr, "mdb_txn_commit failed, error %d\n", rc);
+	if ((rc = mdb_txn_commit(mdb_txn))) {
+		fprintf(stderr, "ndb_init_fulltext: txn_commit failed: %s\n",
+			mdb_strerror(rc));
 		return 0;
 	}
 
@@ -6182,13 +12463,42 @@ static int ndb_queue_write_version(struct ndb *ndb, uint64_t version)
 	return ndb_writer_queue_msg(&ndb->writer, &msg);
 }
 
-static void ndb_monitor_init(struct ndb_monitor *monitor, ndb_sub_fn cb,
-			     void *sub_cb_ctx)
+static int ndb_monitor_init(struct ndb_monitor *monitor, ndb_sub_fn cb,
+			    void *sub_cb_ctx)
 {
+	struct ndb_notify_ring *ring = &monitor->ring;
+
+	monitor->subscriptions = NULL;
 	monitor->num_subscriptions = 0;
+	monitor->capacity = 0;
+	monitor->map.slots = NULL;
+	monitor->map.capacity = 0;
+	monitor->map.count = 0;
+	monitor->bits_used = NULL;
+	monitor->bits_match = NULL;
+	monitor->bits_notified = NULL;
+	monitor->bit_words = 0;
 	monitor->sub_cb = cb;
 	monitor->sub_cb_ctx = sub_cb_ctx;
-	pthread_mutex_init(&monitor->mutex, NULL);
+	monitor->woken = NULL;
+	monitor->woken_capacity = 0;
+
+	ring->head = 0;
+	ring->tail = 0;
+	ring->word_head = 0;
+	ring->entries = malloc(NDB_NOTIFY_RING_ENTRIES * sizeof(*ring->entries));
+	ring->words = malloc(NDB_NOTIFY_RING_WORDS * sizeof(*ring->words));
+	if (!ring->entries || !ring->words) {
+		free(ring->entries);
+		free(ring->words);
+		return 0;
+	}
+
+	pthread_mutex_init(&ring->mutex, NULL);
+	pthread_cond_init(&ring->cond, NULL);
+	pthread_rwlock_init(&monitor->lock, NULL);
+
+	return 1;
 }
 
 void ndb_filter_group_destroy(struct ndb_filter_group *group)
@@ -6204,27 +12514,45 @@ void ndb_filter_group_destroy(struct ndb_filter_group *group)
 static void ndb_subscription_destroy(struct ndb_subscription *sub)
 {
 	ndb_filter_group_destroy(&sub->group);
-	// this was malloc'd inside ndb_subscribe
-	free(sub->inbox.buf);
-	prot_queue_destroy(&sub->inbox);
-	sub->subid = 0;
+#ifndef _WIN32
+	if (sub->fd_read != -1)
+		close(sub->fd_read);
+	if (sub->fd_write != -1 && sub->fd_write != sub->fd_read)
+		close(sub->fd_write);
+#endif
+	pthread_mutex_destroy(&sub->lock);
+	free(sub);
 }
 
 static void ndb_monitor_destroy(struct ndb_monitor *monitor)
 {
 	int i;
 
-	ndb_monitor_lock(monitor);
+	ndb_monitor_write_lock(monitor);
 
 	for (i = 0; i < monitor->num_subscriptions; i++) {
-		ndb_subscription_destroy(&monitor->subscriptions[i]);
-	}
-
+		ndb_subscription_destroy(monitor->subscriptions[i]);
+	}
+
+	free(monitor->subscriptions);
+	free(monitor->map.slots);
+	free(monitor->bits_used);
+	free(monitor->woken);
+	free(monitor->ring.entries);
+	free(monitor->ring.words);
+	monitor->subscriptions = NULL;
+	monitor->woken = NULL;
+	monitor->map.slots = NULL;
+	monitor->bits_used = NULL;
+	monitor->ring.entries = NULL;
+	monitor->ring.words = NULL;
 	monitor->num_subscriptions = 0;
 
-	ndb_monitor_unlock(monitor);
+	ndb_monitor_write_unlock(monitor);
 
-	pthread_mutex_destroy(&monitor->mutex);
+	pthread_mutex_destroy(&monitor->ring.mutex);
+	pthread_cond_destroy(&monitor->ring.cond);
+	pthread_rwlock_destroy(&monitor->lock);
 }
 
 int ndb_init(struct ndb **pndb, const char *filename, const struct ndb_config *config)
@@ -6243,10 +12571,43 @@ int ndb_init(struct ndb **pndb, const char *filename, const struct ndb_config *c
 	if (!ndb_init_lmdb(filename, &ndb->lmdb, config->mapsize))
 		return 0;
 
-	ndb_monitor_init(&ndb->monitor, config->sub_cb, config->sub_cb_ctx);
+	// the indexer compares these with what's in the index, so keep them
+	// in a canonical order
+	memcpy(ndb->lmdb.fulltext_kinds, config->fulltext_kinds,
+	       config->num_fulltext_kinds * sizeof(*config->fulltext_kinds));
+	ndb->lmdb.num_fulltext_kinds = config->num_fulltext_kinds;
+	qsort(ndb->lmdb.fulltext_kinds, ndb->lmdb.num_fulltext_kinds,
+	      sizeof(*ndb->lmdb.fulltext_kinds), compare_kinds);
+
+	if (!ndb_flag_set(config->flags, NDB_FLAG_NO_FULLTEXT)) {
+		if (!ndb_init_fulltext(&ndb->lmdb) ||
+		    !ndb_indexer_init(&ndb->indexer, &ndb->lmdb,
+				      config->writer_scratch_buffer_size)) {
+			fprintf(stderr, "failed to initialize fulltext indexer\n");
+			return 0;
+		}
+	}
+
+	if (!ndb_monitor_init(&ndb->monitor, config->sub_cb, config->sub_cb_ctx)) {
+		fprintf(stderr, "failed to initialize subscription monitor\n");
+		return 0;
+	}
+
+	if (!ndb_query_cache_init(&ndb->query_cache, &ndb->lmdb,
+				  config->query_cache_size)) {
+		fprintf(stderr, "failed to initialize query cache\n");
+		return 0;
+	}
+
+	if (!ndb_notifier_init(&ndb->notifier, &ndb->monitor)) {
+		fprintf(stderr, "ndb_notifier_init failed\n");
+		return 0;
+	}
 
-	if (!ndb_writer_init(&ndb->writer, &ndb->lmdb, &ndb->monitor, ndb->flags,
-			     config->writer_scratch_buffer_size)) {
+	if (!ndb_writer_init(&ndb->writer, &ndb->lmdb, &ndb->notifier,
+			     ndb_flag_set(ndb->flags, NDB_FLAG_NO_FULLTEXT) ?
+				     NULL : &ndb->indexer,
+			     ndb->flags, config->writer_scratch_buffer_size)) {
 		fprintf(stderr, "ndb_writer_init failed\n");
 		return 0;
 	}
@@ -6258,6 +12619,13 @@ int ndb_init(struct ndb **pndb, const char *filename, const struct ndb_config *c
 		return 0;
 	}
 
+	if (!ndb_query_pool_init(&ndb->query_pool, &ndb->lmdb,
+				 config->query_threads)) {
+		fprintf(stderr, "failed to initialize %d query thread(s)\n",
+				config->query_threads);
+		return 0;
+	}
+
 	if (!ndb_flag_set(config->flags, NDB_FLAG_NOMIGRATE)) {
 		struct ndb_writer_msg msg = { .type = NDB_WRITER_MIGRATE };
 		ndb_writer_queue_msg(&ndb->writer, &msg);
@@ -6276,13 +12644,24 @@ void ndb_destroy(struct ndb *ndb)
 	if (ndb == NULL)
 		return;
 
+	ndb_debug("destroying query pool\n");
+	ndb_query_pool_destroy(&ndb->query_pool);
+
 	// ingester depends on writer and must be destroyed first
 	ndb_debug("destroying ingester\n");
 	ndb_ingester_destroy(&ndb->ingester);
 	ndb_debug("destroying writer\n");
 	ndb_writer_destroy(&ndb->writer);
+	if (ndb->writer.indexer) {
+		ndb_debug("destroying indexer\n");
+		ndb_indexer_destroy(&ndb->indexer);
+	}
+	ndb_debug("destroying notifier\n");
+	ndb_notifier_destroy(&ndb->notifier);
 	ndb_debug("destroying monitor\n");
 	ndb_monitor_destroy(&ndb->monitor);
+	ndb_debug("destroying query cache\n");
+	ndb_query_cache_destroy(&ndb->query_cache);
 
 	ndb_debug("closing env\n");
 	mdb_env_close(ndb->lmdb.env);
@@ -6792,10 +13171,10 @@ static int cursor_push_json_elem_array(struct cursor *cur,
 
 int ndb_filter_json(const struct ndb_filter *filter, char *buf, int buflen)
 {
-	const char *str;
+	const char *str, *tag_name;
 	struct cursor cur, *c = &cur;
 	struct ndb_filter_elements *elems;
-	int i;
+	int i, tag_len;
 
 	if (!filter->finalized) {
 		ndb_debug("filter not finalized in ndb_filter_json\n");
@@ -6842,7 +13221,8 @@ int ndb_filter_json(const struct ndb_filter *filter, char *buf, int buflen)
 		case NDB_FILTER_TAGS:
 			if (!cursor_push_str(c, "\"#"))
 				return 0;
-			if (!cursor_push_byte(c, elems->field.tag))
+			tag_name = ndb_filter_tag_name(filter, elems, &tag_len);
+			if (!cursor_push(c, (unsigned char *)tag_name, tag_len))
 				return 0;
 			if (!cursor_push_str(c, "\":"))
 				return 0;
@@ -7433,9 +13813,11 @@ int ndb_ws_event_from_json(const char *json, int len, struct ndb_tce *tce,
 }
 
 static enum ndb_filter_fieldtype
-ndb_filter_parse_field(const char *tok, int len, char *tagchar)
+ndb_filter_parse_field(const char *tok, int len, const char **tag,
+		       int *tag_len)
 {
-	*tagchar = 0;
+	*tag = NULL;
+	*tag_len = 0;
 
 	if (len == 0)
 		return 0;
@@ -7446,8 +13828,9 @@ ndb_filter_parse_field(const char *tok, int len, char *tagchar)
 		return NDB_FILTER_IDS;
 	} else if (len == 5 && !strncmp(tok, "kinds", 5)) {
 		return NDB_FILTER_KINDS;
-	} else if (len == 2 && tok[0] == '#') {
-		*tagchar = tok[1];
+	} else if (len >= 2 && tok[0] == '#') {
+		*tag = tok + 1;
+		*tag_len = len - 1;
 		return NDB_FILTER_TAGS;
 	} else if (len == 5 && !strncmp(tok, "since", 5)) {
 		return NDB_FILTER_SINCE;
@@ -7644,9 +14027,8 @@ static int ndb_filter_parse_json(struct ndb_json_parser *parser,
 {
 	jsmntok_t *tok = NULL;
 	const char *json = parser->json;
-	const char *start;
-	char tag;
-	int tok_len;
+	const char *start, *tag;
+	int tok_len, tag_len;
 	enum ndb_filter_fieldtype field;
 
 	if (parser->toks[parser->i++].type != JSMN_OBJECT)
@@ -7657,15 +14039,15 @@ static int ndb_filter_parse_json(struct ndb_json_parser *parser,
 		start = json + tok->start;
 		tok_len = toksize(tok);
 
-		if (!(field = ndb_filter_parse_field(start, tok_len, &tag))) {
+		if (!(field = ndb_filter_parse_field(start, tok_len, &tag, &tag_len))) {
 			ndb_debug("failed field '%.*s'\n", tok_len, start);
 			continue;
 		}
 
 		if (tag) {
-			ndb_debug("starting tag field '%c'\n", tag);
-			if (!ndb_filter_start_tag_field(filter, tag)) {
-				ndb_debug("failed to start tag field '%c'\n", tag);
+			ndb_debug("starting tag field '%.*s'\n", tag_len, tag);
+			if (!ndb_filter_start_tag_field_len(filter, tag, tag_len)) {
+				ndb_debug("failed to start tag field '%.*s'\n", tag_len, tag);
 				return 0;
 			}
 		} else if (!ndb_filter_start_field(filter, field)) {
@@ -7906,6 +14288,9 @@ static void ndb_stat_init(struct ndb_stat *stat)
 	}
 
 	ndb_stat_counts_init(&stat->other_kinds);
+
+	stat->query_cache_hits = 0;
+	stat->query_cache_misses = 0;
 }
 
 int ndb_stat(struct ndb *ndb, struct ndb_stat *stat)
@@ -7922,6 +14307,13 @@ int ndb_stat(struct ndb *ndb, struct ndb_stat *stat)
 	// initialize to 0
 	ndb_stat_init(stat);
 
+	if (ndb->lmdb.query_cache) {
+		pthread_mutex_lock(&ndb->query_cache.lock);
+		stat->query_cache_hits = ndb->query_cache.hits;
+		stat->query_cache_misses = ndb->query_cache.misses;
+		pthread_mutex_unlock(&ndb->query_cache.lock);
+	}
+
 	if (!ndb_begin_query(ndb, &txn)) {
 		fprintf(stderr, "ndb_stat failed at ndb_begin_query\n");
 		return 0;
@@ -8003,12 +14395,29 @@ void ndb_default_config(struct ndb_config *config)
 	int cores = get_cpu_cores();
 	config->mapsize = 1024UL * 1024UL * 1024UL * 32UL; // 32 GiB
 	config->ingester_threads = cores == -1 ? 4 : cores;
+	// multi-filter queries run on the caller's thread unless asked
+	config->query_threads = 0;
+	config->query_cache_size = DEFAULT_QUERY_CACHE_SIZE;
 	config->flags = 0;
 	config->ingest_filter = NULL;
 	config->filter_context = NULL;
 	config->sub_cb_ctx = NULL;
 	config->sub_cb = NULL;
 	config->writer_scratch_buffer_size = DEFAULT_WRITER_SCRATCH_SIZE;
+	config->num_fulltext_kinds = 2;
+	config->fulltext_kinds[0] = 1;
+	config->fulltext_kinds[1] = 30023;
+}
+
+int ndb_config_set_fulltext_kinds(struct ndb_config *config,
+				  const uint64_t *kinds, int num_kinds)
+{
+	if (num_kinds < 0 || num_kinds > NDB_MAX_FULLTEXT_KINDS)
+		return 0;
+
+	memcpy(config->fulltext_kinds, kinds, num_kinds * sizeof(*kinds));
+	config->num_fulltext_kinds = num_kinds;
+	return 1;
 }
 
 void ndb_config_set_subscription_callback(struct ndb_config *config, ndb_sub_fn fn, void *context)
@@ -8027,6 +14436,16 @@ void ndb_config_set_ingest_threads(struct ndb_config *config, int threads)
 	config->ingester_threads = threads;
 }
 
+void ndb_config_set_query_threads(struct ndb_config *config, int threads)
+{
+	config->query_threads = threads;
+}
+
+void ndb_config_set_query_cache_size(struct ndb_config *config, int entries)
+{
+	config->query_cache_size = entries;
+}
+
 void ndb_config_set_flags(struct ndb_config *config, int flags)
 {
 	config->flags = flags;
@@ -8143,25 +14562,31 @@ int ndb_print_kind_keys(struct ndb_txn *txn)
 // used by ndb.c
 int ndb_print_search_keys(struct ndb_txn *txn)
 {
+	struct ndb_posting postings[NDB_POSTING_BLOCK_MAX];
+	const char *term;
 	MDB_cursor *cur;
 	MDB_val k, v;
-	int i;
-	struct ndb_text_search_key search_key;
+	int i, count, term_len;
 
-	if (mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_TEXT], &cur))
+	if (mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_POSTINGS], &cur))
 		return 0;
 
-	i = 1;
 	while (mdb_cursor_get(cur, &k, &v, MDB_NEXT) == 0) {
-		if (!ndb_unpack_text_search_key(k.mv_data, k.mv_size, &search_key)) {
-			fprintf(stderr, "error decoding key %d\n", i);
+		if (!ndb_posting_key_term(&k, &term, &term_len) ||
+		    !ndb_posting_block_decode(&k, &v, postings,
+					      NDB_POSTING_BLOCK_MAX, &count)) {
+			fprintf(stderr, "error decoding posting block\n");
 			continue;
 		}
 
-		ndb_print_text_search_key(k.mv_size, &search_key);
-		printf("\n");
+		printf("'%.*s' postings:%d bytes:%zu\n", term_len, term, count,
+		       v.mv_size);
 
-		i++;
+		for (i = 0; i < count; i++) {
+			printf("  %" PRIu64 " note_key:%" PRIu64 " freq:%u\n",
+			       postings[i].created_at, postings[i].note_key,
+			       postings[i].term_freq);
+		}
 	}
 
 	mdb_cursor_close(cur);
@@ -8430,6 +14855,18 @@ const char *ndb_db_name(enum ndb_dbs db)
 			return "note_relay_kind_index";
 		case NDB_DB_NOTE_RELAYS:
 			return "note_relays";
+		case NDB_DB_NOTE_THREAD:
+			return "note_thread_index";
+		case NDB_DB_NOTE_ADDR:
+			return "note_addr_index";
+		case NDB_DB_NOTE_MENTION:
+			return "note_mention_index";
+		case NDB_DB_HASHTAG_COUNTS:
+			return "hashtag_counts";
+		case NDB_DB_NOTE_POSTINGS:
+			return "note_postings";
+		case NDB_DB_NOTE_TERM_STATS:
+			return "note_term_stats";
 		case NDB_DBS:
 			return "count";
 	}
@@ -8514,24 +14951,159 @@ struct ndb_blocks *ndb_get_blocks_by_key(struct ndb *ndb, struct ndb_txn *txn, u
 	 return blocks;
 }
 
-// please call ndb_monitor_lock before calling this
+static inline uint32_t ndb_sub_map_hash(uint64_t subid)
+{
+	return (uint32_t)((subid * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+// please hold the monitor lock when calling this
 static struct ndb_subscription *
-ndb_monitor_find_subscription(struct ndb_monitor *monitor, uint64_t subid, int *index)
+ndb_monitor_find_subscription(struct ndb_monitor *monitor, uint64_t subid)
 {
-	struct ndb_subscription *sub, *tsub;
-	int i;
+	struct ndb_sub_map *map = &monitor->map;
+	struct ndb_subscription *sub;
+	uint32_t i, mask;
+
+	if (map->count == 0)
+		return NULL;
+
+	mask = map->capacity - 1;
+	for (i = ndb_sub_map_hash(subid) & mask; (sub = map->slots[i]);
+	     i = (i + 1) & mask) {
+		if (sub->subid == subid)
+			return sub;
+	}
+
+	return NULL;
+}
+
+static void ndb_sub_map_insert(struct ndb_sub_map *map,
+			       struct ndb_subscription *sub)
+{
+	uint32_t i, mask = map->capacity - 1;
+
+	for (i = ndb_sub_map_hash(sub->subid) & mask; map->slots[i];
+	     i = (i + 1) & mask)
+		;
+
+	map->slots[i] = sub;
+	map->count++;
+}
+
+static int ndb_sub_map_grow(struct ndb_sub_map *map)
+{
+	struct ndb_subscription **old = map->slots;
+	uint32_t i, old_capacity = map->capacity;
+
+	map->capacity = old_capacity ? old_capacity * 2 : 64;
+	if (!(map->slots = calloc(map->capacity, sizeof(*map->slots)))) {
+		map->slots = old;
+		map->capacity = old_capacity;
+		return 0;
+	}
+
+	map->count = 0;
+	for (i = 0; i < old_capacity; i++) {
+		if (old[i])
+			ndb_sub_map_insert(map, old[i]);
+	}
+
+	free(old);
+	return 1;
+}
 
-	for (i = 0, sub = NULL; i < monitor->num_subscriptions; i++) {
-		tsub = &monitor->subscriptions[i];
-		if (tsub->subid == subid) {
-			sub = tsub;
-			if (index)
-				*index = i;
+// backward shift deletion, so lookups never need tombstones
+static void ndb_sub_map_remove(struct ndb_sub_map *map, uint64_t subid)
+{
+	uint32_t i, j, home, mask = map->capacity - 1;
+
+	for (i = ndb_sub_map_hash(subid) & mask; map->slots[i];
+	     i = (i + 1) & mask) {
+		if (map->slots[i]->subid == subid)
 			break;
+	}
+
+	if (!map->slots[i])
+		return;
+
+	for (j = (i + 1) & mask; map->slots[j]; j = (j + 1) & mask) {
+		home = ndb_sub_map_hash(map->slots[j]->subid) & mask;
+		// can slot j move back to the hole at i?
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			map->slots[i] = map->slots[j];
+			i = j;
+		}
+	}
+
+	map->slots[i] = NULL;
+	map->count--;
+}
+
+// Pull this subscription's notes out of the notification log, starting at
+// its cursor. Please hold the monitor read lock when calling this.
+static int ndb_subscription_poll(struct ndb_notify_ring *ring,
+				 struct ndb_subscription *sub,
+				 uint64_t *note_ids, int note_id_capacity)
+{
+	struct ndb_notify_entry entry;
+	uint64_t cursor, head, tail, bits;
+	uint32_t w;
+	int n = 0;
+
+	pthread_mutex_lock(&sub->lock);
+
+	// ndb_subscribe_with_query hasn't opened its snapshot yet
+	if (sub->min_txnid == UINT64_MAX) {
+		pthread_mutex_unlock(&sub->lock);
+		return 0;
+	}
+
+	// drain before looking at head, anything published after this
+	// signals the fd again
+	if (sub->fd_read != -1)
+		ndb_subscription_drain(sub);
+
+	cursor = sub->cursor;
+	head = ATOMIC_LOAD_U64(&ring->head);
+
+	while (cursor < head && n < note_id_capacity) {
+		tail = ATOMIC_LOAD_U64(&ring->tail);
+		if (cursor < tail) {
+			sub->overflowed = 1;
+			cursor = tail;
+			continue;
 		}
+
+		entry = ring->entries[cursor % NDB_NOTIFY_RING_ENTRIES];
+		w = sub->bit / 64;
+		bits = 0;
+		if (w < entry.num_words)
+			bits = ring->words[(entry.words + w) % NDB_NOTIFY_RING_WORDS];
+
+		// if the writer moved past us while we were copying, the copy
+		// might be garbage
+		ATOMIC_FENCE();
+		if (cursor < ATOMIC_LOAD_U64(&ring->tail))
+			continue;
+
+		if ((bits & (1ULL << (sub->bit % 64))) &&
+		    entry.txnid >= sub->min_txnid) {
+			note_ids[n++] = entry.note_key;
+		}
+
+		cursor++;
 	}
 
-	return sub;
+	sub->cursor = cursor;
+
+	// we ran out of room, so there may be more for us. keep the fd
+	// readable until the caller comes back for the rest
+	if (sub->fd_write != -1 && cursor < head)
+		ndb_subscription_signal(sub);
+
+	pthread_mutex_unlock(&sub->lock);
+
+	return n;
 }
 
 int ndb_poll_for_notes(struct ndb *ndb, uint64_t subid, uint64_t *note_ids,
@@ -8543,14 +15115,15 @@ int ndb_poll_for_notes(struct ndb *ndb, uint64_t subid, uint64_t *note_ids,
 	if (subid == 0)
 		return 0;
 
-	ndb_monitor_lock(&ndb->monitor);
+	ndb_monitor_read_lock(&ndb->monitor);
 
-	if (!(sub = ndb_monitor_find_subscription(&ndb->monitor, subid, NULL)))
+	if (!(sub = ndb_monitor_find_subscription(&ndb->monitor, subid)))
 		res = 0;
 	else
-		res = prot_queue_try_pop_all(&sub->inbox, note_ids, note_id_capacity);
+		res = ndb_subscription_poll(&ndb->monitor.ring, sub, note_ids,
+					    note_id_capacity);
 
-	ndb_monitor_unlock(&ndb->monitor);
+	ndb_monitor_read_unlock(&ndb->monitor);
 
 	return res;
 }
@@ -8558,56 +15131,215 @@ int ndb_poll_for_notes(struct ndb *ndb, uint64_t subid, uint64_t *note_ids,
 int ndb_wait_for_notes(struct ndb *ndb, uint64_t subid, uint64_t *note_ids,
                        int note_id_capacity)
 {
+	struct ndb_notify_ring *ring = &ndb->monitor.ring;
 	struct ndb_subscription *sub;
-	struct prot_queue *queue_inbox;
+	uint64_t head;
+	int res;
 
         // this is not a valid subscription id
 	if (subid == 0)
 		return 0;
 
-	ndb_monitor_lock(&ndb->monitor);
+	for (;;) {
+		ndb_monitor_read_lock(&ndb->monitor);
+
+		if (!(sub = ndb_monitor_find_subscription(&ndb->monitor, subid))) {
+			ndb_monitor_read_unlock(&ndb->monitor);
+			return 0;
+		}
+
+		head = ATOMIC_LOAD_U64(&ring->head);
+		res = ndb_subscription_poll(ring, sub, note_ids,
+					    note_id_capacity);
+
+		ndb_monitor_read_unlock(&ndb->monitor);
+
+		if (res > 0)
+			return res;
+
+		// nothing for us yet, sleep until the log moves past what
+		// we just looked at
+		pthread_mutex_lock(&ring->mutex);
+		while (ATOMIC_LOAD_U64(&ring->head) == head)
+			pthread_cond_wait(&ring->cond, &ring->mutex);
+		pthread_mutex_unlock(&ring->mutex);
+	}
+}
+
+int ndb_subscription_overflowed(struct ndb *ndb, uint64_t subid)
+{
+	struct ndb_subscription *sub;
+	int res = 0;
+
+	ndb_monitor_read_lock(&ndb->monitor);
+
+	if ((sub = ndb_monitor_find_subscription(&ndb->monitor, subid))) {
+		pthread_mutex_lock(&sub->lock);
+		res = sub->overflowed;
+		sub->overflowed = 0;
+		pthread_mutex_unlock(&sub->lock);
+	}
+
+	ndb_monitor_read_unlock(&ndb->monitor);
+
+	return res;
+}
+
+int ndb_subscription_set_delivery(struct ndb *ndb, uint64_t subid,
+				  const struct ndb_delivery_policy *policy)
+{
+	struct ndb_subscription *sub;
+
+	// the notify pass reads the policy under the read lock
+	ndb_monitor_write_lock(&ndb->monitor);
+
+	if ((sub = ndb_monitor_find_subscription(&ndb->monitor, subid)))
+		sub->policy = *policy;
+
+	ndb_monitor_write_unlock(&ndb->monitor);
+
+	return sub != NULL;
+}
+
+uint64_t ndb_subscription_coalesced(struct ndb *ndb, uint64_t subid)
+{
+	struct ndb_subscription *sub;
+	uint64_t coalesced = 0;
+
+	ndb_monitor_read_lock(&ndb->monitor);
+
+	if ((sub = ndb_monitor_find_subscription(&ndb->monitor, subid)))
+		coalesced = ATOMIC_LOAD_U64(&sub->coalesced);
+
+	ndb_monitor_read_unlock(&ndb->monitor);
+
+	return coalesced;
+}
+
+#ifndef _WIN32
+static int ndb_subscription_open_fd(struct ndb_subscription *sub)
+{
+#ifdef __linux__
+	int fd;
+
+	if ((fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+		return 0;
+
+	sub->fd_read = sub->fd_write = fd;
+#else
+	int i, fds[2];
 
-        if (!(sub = ndb_monitor_find_subscription(&ndb->monitor, subid, NULL))) {
-		ndb_monitor_unlock(&ndb->monitor);
+	if (pipe(fds) == -1)
 		return 0;
+
+	for (i = 0; i < 2; i++) {
+		fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	sub->fd_read = fds[0];
+	sub->fd_write = fds[1];
+#endif
+	return 1;
+}
+
+int ndb_subscription_fd(struct ndb *ndb, uint64_t subid)
+{
+	struct ndb_monitor *monitor = &ndb->monitor;
+	struct ndb_subscription *sub;
+	int fd = -1;
+
+	// the notify pass reads fd_write, so create it under the write lock
+	ndb_monitor_write_lock(monitor);
+
+	if (!(sub = ndb_monitor_find_subscription(monitor, subid)))
+		goto done;
+
+	if (sub->fd_read == -1) {
+		if (!ndb_subscription_open_fd(sub)) {
+			fprintf(stderr, "ndb_subscription_fd: couldn't create fd\n");
+			goto done;
+		}
+
+		// there might already be notes waiting
+		if (sub->cursor < monitor->ring.head)
+			ndb_subscription_signal(sub);
+	}
+
+	fd = sub->fd_read;
+
+done:
+	ndb_monitor_write_unlock(monitor);
+	return fd;
+}
+#endif
+
+// hand out the lowest free subscription bit so match bitmaps stay short.
+// Please hold the monitor write lock when calling this.
+static int ndb_monitor_alloc_bit(struct ndb_monitor *monitor, uint32_t *bit)
+{
+	uint64_t *bits;
+	uint32_t w, b, words;
+
+	for (w = 0; w < monitor->bit_words; w++) {
+		if (monitor->bits_used[w] == ~0ULL)
+			continue;
+
+		for (b = 0; monitor->bits_used[w] & (1ULL << b); b++)
+			;
+
+		monitor->bits_used[w] |= 1ULL << b;
+		*bit = w * 64 + b;
+		return 1;
 	}
 
-	queue_inbox = &sub->inbox;
+	words = monitor->bit_words ? monitor->bit_words * 2 : 4;
+	if (!(bits = calloc(words * 3, sizeof(uint64_t))))
+		return 0;
+
+	if (monitor->bit_words)
+		memcpy(bits, monitor->bits_used,
+		       monitor->bit_words * sizeof(uint64_t));
+	free(monitor->bits_used);
 
-	ndb_monitor_unlock(&ndb->monitor);
+	monitor->bits_used = bits;
+	monitor->bits_match = bits + words;
+	monitor->bits_notified = bits + words * 2;
 
-	// there is technically a race condition if the thread yeilds at this
-	// comment and a subscription is added/removed. A deadlock in the
-	// writer queue would be much worse though. This function is dubious
-	// anyways.
+	*bit = monitor->bit_words * 64;
+	monitor->bits_used[monitor->bit_words] = 1;
+	monitor->bit_words = words;
 
-        return prot_queue_pop_all(queue_inbox, note_ids, note_id_capacity);
+	return 1;
 }
 
 int ndb_unsubscribe(struct ndb *ndb, uint64_t subid)
 {
-	struct ndb_subscription *sub;
-	int index, res, elems_to_move;
+	struct ndb_monitor *monitor = &ndb->monitor;
+	struct ndb_subscription *sub, *last;
+	int res;
 
-	ndb_monitor_lock(&ndb->monitor);
+	ndb_monitor_write_lock(monitor);
 
-	if (!(sub = ndb_monitor_find_subscription(&ndb->monitor, subid, &index))) {
+	if (!(sub = ndb_monitor_find_subscription(monitor, subid))) {
 		res = 0;
 		goto done;
 	}
 
-	ndb_subscription_destroy(sub);
+	ndb_sub_map_remove(&monitor->map, subid);
+	monitor->bits_used[sub->bit / 64] &= ~(1ULL << (sub->bit % 64));
 
-	elems_to_move = (--ndb->monitor.num_subscriptions) - index;
+	// move the last subscription into our slot
+	last = monitor->subscriptions[--monitor->num_subscriptions];
+	monitor->subscriptions[sub->slot] = last;
+	last->slot = sub->slot;
 
-	memmove(&ndb->monitor.subscriptions[index],
-		&ndb->monitor.subscriptions[index+1],
-		elems_to_move * sizeof(*sub));
+	ndb_subscription_destroy(sub);
 
 	res = 1;
 
 done:
-	ndb_monitor_unlock(&ndb->monitor);
+	ndb_monitor_write_unlock(monitor);
 
 	return res;
 }
@@ -8617,45 +15349,120 @@ int ndb_num_subscriptions(struct ndb *ndb)
 	return ndb->monitor.num_subscriptions;
 }
 
-uint64_t ndb_subscribe(struct ndb *ndb, struct ndb_filter *filters, int num_filters)
+static uint64_t ndb_subscribe_from(struct ndb *ndb, struct ndb_filter *filters,
+				   int num_filters, uint64_t min_txnid)
 {
 	static uint64_t subids = 0;
-	struct ndb_subscription *sub;
-	size_t buflen;
+	struct ndb_monitor *monitor = &ndb->monitor;
+	struct ndb_subscription *sub, **subs;
 	uint64_t subid;
-	char *buf;
 
-	ndb_monitor_lock(&ndb->monitor);
+	if (!(sub = calloc(1, sizeof(*sub))))
+		return 0;
 
-	if (ndb->monitor.num_subscriptions + 1 >= MAX_SUBSCRIPTIONS) {
-		fprintf(stderr, "too many subscriptions\n");
-		subid = 0;
-		goto done;
+	ndb_filter_group_init(&sub->group);
+	if (!ndb_filter_group_add_filters(&sub->group, filters, num_filters)) {
+		ndb_filter_group_destroy(&sub->group);
+		free(sub);
+		return 0;
+	}
+
+	pthread_mutex_init(&sub->lock, NULL);
+	sub->min_txnid = min_txnid;
+	sub->fd_read = -1;
+	sub->fd_write = -1;
+
+	ndb_monitor_write_lock(monitor);
+
+	if (monitor->num_subscriptions == monitor->capacity) {
+		monitor->capacity = monitor->capacity ? monitor->capacity * 2 : 32;
+		subs = realloc(monitor->subscriptions,
+			       monitor->capacity * sizeof(*subs));
+		if (subs == NULL) {
+			monitor->capacity = monitor->num_subscriptions;
+			goto fail;
+		}
+		monitor->subscriptions = subs;
 	}
 
-	sub = &ndb->monitor.subscriptions[ndb->monitor.num_subscriptions];
+	// keep the map at most half full
+	if ((monitor->map.count + 1) * 2 > monitor->map.capacity &&
+	    !ndb_sub_map_grow(&monitor->map)) {
+		goto fail;
+	}
+
+	if (!ndb_monitor_alloc_bit(monitor, &sub->bit))
+		goto fail;
+
 	subid = ++subids;
 	sub->subid = subid;
+	sub->slot = monitor->num_subscriptions;
 
-	ndb_filter_group_init(&sub->group);
-	if (!ndb_filter_group_add_filters(&sub->group, filters, num_filters)) {
-		subid = 0;
-		goto done;
-	}
+	// the notify pass can't be running while we hold the write lock, so
+	// everything before head was matched without us
+	sub->cursor = monitor->ring.head;
 
-	// 500k ought to be enough for anyone
-	buflen = sizeof(uint64_t) * DEFAULT_QUEUE_SIZE;
-	buf = malloc(buflen);
+	monitor->subscriptions[monitor->num_subscriptions++] = sub;
+	ndb_sub_map_insert(&monitor->map, sub);
 
-	if (!prot_queue_init(&sub->inbox, buf, buflen, sizeof(uint64_t))) {
-		fprintf(stderr, "failed to push prot queue\n");
-		subid = 0;
-		goto done;
+	ndb_monitor_write_unlock(monitor);
+
+	return subid;
+
+fail:
+	ndb_monitor_write_unlock(monitor);
+	ndb_subscription_destroy(sub);
+	return 0;
+}
+
+uint64_t ndb_subscribe(struct ndb *ndb, struct ndb_filter *filters, int num_filters)
+{
+	return ndb_subscribe_from(ndb, filters, num_filters, 0);
+}
+
+// Subscribe, then run the initial query in a read transaction that starts
+// after the subscription exists. Anything committed after that snapshot
+// is matched against the subscription, so it only has to skip what the
+// snapshot already saw. The caller owns txn and ends it with
+// ndb_end_query once it's done with the results.
+uint64_t ndb_subscribe_with_query(struct ndb *ndb, struct ndb_txn *txn,
+				  struct ndb_filter *filters, int num_filters,
+				  struct ndb_query_result *results,
+				  int result_capacity, int *count)
+{
+	struct ndb_subscription *sub;
+	uint64_t subid;
+
+	*count = 0;
+
+	// hold back delivery until we know the snapshot
+	if (!(subid = ndb_subscribe_from(ndb, filters, num_filters, UINT64_MAX)))
+		return 0;
+
+	// Keep the notify pass out while we open the snapshot. Notes it saw
+	// before this were committed before the snapshot, and everything
+	// after it sees the real min_txnid, so it only counts notes that
+	// will be delivered towards the delivery policy.
+	ndb_monitor_write_lock(&ndb->monitor);
+	if (!ndb_begin_query(ndb, txn)) {
+		ndb_monitor_write_unlock(&ndb->monitor);
+		ndb_unsubscribe(ndb, subid);
+		return 0;
 	}
 
-	ndb->monitor.num_subscriptions++;
-done:
-	ndb_monitor_unlock(&ndb->monitor);
+	if ((sub = ndb_monitor_find_subscription(&ndb->monitor, subid))) {
+		pthread_mutex_lock(&sub->lock);
+		sub->min_txnid = mdb_txn_id(txn->mdb_txn) + 1;
+		pthread_mutex_unlock(&sub->lock);
+	}
+	ndb_monitor_write_unlock(&ndb->monitor);
+
+	if (!ndb_query(txn, filters, num_filters, results, result_capacity,
+		       count)) {
+		ndb_end_query(txn);
+		ndb_unsubscribe(ndb, subid);
+		return 0;
+	}
 
 	return subid;
 }
@@ -15,6 +15,11 @@
 #define NDB_FLAG_NO_FULLTEXT      (1 << 2)
 #define NDB_FLAG_NO_NOTE_BLOCKS   (1 << 3)
 #define NDB_FLAG_NO_STATS         (1 << 4)
+#define NDB_FLAG_NO_LONG_TAGS     (1 << 5)
+#define NDB_FLAG_ASYNC_FULLTEXT   (1 << 6)
+
+// query flags
+#define NDB_QUERY_KEYS_ONLY (1 << 0)
 
 //#define DEBUG 1
 
@@ -34,6 +39,8 @@ struct ndb_note;
 struct ndb_tag;
 struct ndb_tags;
 struct ndb_lmdb;
+struct ndb_query_iter;
+struct ndb_text_search_iter;
 union ndb_packed_str;
 struct bolt11;
 
@@ -182,6 +189,7 @@ enum ndb_generic_element_type {
 enum ndb_search_order {
 	NDB_ORDER_DESCENDING,
 	NDB_ORDER_ASCENDING,
+	NDB_ORDER_RELEVANCE, // best bm25 score first, see ndb_default_ranked_search_config
 };
 
 enum ndb_dbs {
@@ -201,6 +209,12 @@ enum ndb_dbs {
 	NDB_DB_NOTE_PUBKEY_KIND, // note pubkey kind index
 	NDB_DB_NOTE_RELAY_KIND, // relay+kind+created -> note_id
 	NDB_DB_NOTE_RELAYS, // note_id -> relays
+	NDB_DB_NOTE_THREAD, // root/parent id + created -> reply note_key
+	NDB_DB_NOTE_ADDR, // kind + pubkey + d tag -> latest note_key
+	NDB_DB_NOTE_MENTION, // p tag pubkey + kind + created -> note_key
+	NDB_DB_HASHTAG_COUNTS, // time bucket + hashtag -> note count
+	NDB_DB_NOTE_POSTINGS, // term + first posting -> block of postings
+	NDB_DB_NOTE_TERM_STATS, // term -> number of notes with it, for ranking
 	NDB_DBS,
 };
 
@@ -272,6 +286,8 @@ struct ndb_filter_field {
 	enum ndb_filter_fieldtype type;
 	enum ndb_generic_element_type elem_type;
 	char tag; // for generic queries like #t
+	unsigned char tag_len; // set for multi-char tags like #emoji
+	uint32_t tag_name; // data offset of the multi-char tag name
 };
 
 struct ndb_filter_elements {
@@ -283,6 +299,8 @@ struct ndb_filter_elements {
 	uint64_t elements[0];
 };
 
+struct ndb_filter_matcher;
+
 struct ndb_filter {
 	struct cursor elem_buf;
 	struct cursor data_buf;
@@ -295,17 +313,35 @@ struct ndb_filter {
 	// TODO(jb55): this should probably be called fields. elements are
 	// the things within fields
 	int elements[NDB_NUM_FILTERS]; 
+
+	// built by ndb_filter_end, speeds up ndb_filter_matches
+	struct ndb_filter_matcher *matcher;
 };
 
+// the most kinds ndb_config_set_fulltext_kinds accepts
+#define NDB_MAX_FULLTEXT_KINDS 16
+
 struct ndb_config {
 	int flags;
 	int ingester_threads;
+	int query_threads;
+	int query_cache_size;
 	int writer_scratch_buffer_size;
 	size_t mapsize;
 	void *filter_context;
 	ndb_ingest_filter_fn ingest_filter;
 	void *sub_cb_ctx;
 	ndb_sub_fn sub_cb;
+	int num_fulltext_kinds;
+	uint64_t fulltext_kinds[NDB_MAX_FULLTEXT_KINDS];
+};
+
+// How eagerly a subscription is woken up (sub_cb and its fd) when notes
+// match. All zeros, the default, wakes it after every commit that matched.
+struct ndb_delivery_policy {
+	int min_interval_ms; // at most one wakeup per interval
+	int min_batch; // hold wakeups until this many notes are pending...
+	int max_latency_ms; // ...but never longer than this, 0 for no limit
 };
 
 struct ndb_text_search_config {
@@ -323,9 +359,14 @@ struct ndb_stat {
 	struct ndb_stat_counts dbs[NDB_DBS];
 	struct ndb_stat_counts common_kinds[NDB_CKIND_COUNT];
 	struct ndb_stat_counts other_kinds;
+
+	// ndb_query result cache lookups since ndb_init
+	size_t query_cache_hits;
+	size_t query_cache_misses;
 };
 
 #define MAX_TEXT_SEARCH_RESULTS 128
+#define MAX_RANKED_SEARCH_RESULTS 50
 #define MAX_TEXT_SEARCH_WORDS 8
 
 // unpacked form of the actual lmdb fulltext search key
@@ -339,9 +380,12 @@ struct ndb_text_search_key
 	uint64_t word_index;
 };
 
+// key.str and key.word_index are not filled in by searches, only the note
+// key and timestamp
 struct ndb_text_search_result {
 	struct ndb_text_search_key key;
 	int prefix_chars;
+	double score; // only set for NDB_ORDER_RELEVANCE
 
 	// This is only set if we passed a filter for nip50 searches
 	struct ndb_note *note;
@@ -363,6 +407,11 @@ enum ndb_block_type {
 };
 #define NDB_NUM_BLOCK_TYPES 6
 #define NDB_MAX_RELAYS 24
+#define NDB_MAX_HASHTAGS 32
+#define NDB_MAX_HASHTAG_LEN 64
+#define NDB_HASHTAG_BUCKET 3600
+#define NDB_QUERY_MAX_FILTERS 16
+#define NDB_QUERY_MAX_INDICES 4
 
 struct ndb_relays {
 	struct ndb_str_block relays[NDB_MAX_RELAYS];
@@ -469,22 +518,89 @@ struct ndb_block_iterator {
 	unsigned char *p;
 };
 
+// A single hit from ndb_get_notes_by_ids or ndb_get_profiles_by_pubkeys.
+// `data` is NULL when the id wasn't found.
+struct ndb_lookup_result {
+	void *data;
+	size_t len;
+	uint64_t key;
+};
+
+// A hashtag and the number of notes that used it, see ndb_trending_hashtags
+struct ndb_hashtag_count {
+	char hashtag[NDB_MAX_HASHTAG_LEN];
+	uint64_t count;
+};
+
+// A note in a thread from ndb_thread_query. `depth` is 0 for the root,
+// 1 for direct replies and so on.
+struct ndb_thread_result {
+	struct ndb_note *note;
+	uint64_t note_key;
+	uint64_t note_size;
+	int depth;
+};
+
 struct ndb_query_result {
 	struct ndb_note *note;
 	uint64_t note_size;
 	uint64_t note_id;
 };
 
+// What a query did for a single filter, see `ndb_query_explain`,
+// `ndb_query_with_profile` and `ndb_query_keys`
+struct ndb_query_filter_profile {
+	const char *plan;
+	const char *indices[NDB_QUERY_MAX_INDICES];
+	int num_indices;
+	int streamed;           // results come straight off the index cursors
+
+	uint64_t seeks;         // cursor positioning via MDB_SET_RANGE
+	uint64_t rows_scanned;  // index entries visited
+	uint64_t notes_fetched; // note bodies looked up
+	uint64_t rows_rejected; // notes that failed ndb_filter_matches_with
+	uint64_t results;
+};
+
+struct ndb_query_profile {
+	int num_filters;
+	struct ndb_query_filter_profile filters[NDB_QUERY_MAX_FILTERS];
+	uint64_t elapsed_ns;
+};
+
 struct ndb_query_results {
 	struct cursor cur;
 };
 
+// A query result without the note, see `ndb_query_keys`
+struct ndb_query_key {
+	uint64_t note_key;
+	uint64_t created_at;
+	uint32_t kind;
+};
+
+// A position in a query, handed out by `ndb_query_iter_token`. Pass it to
+// `ndb_query_iter_begin` in a later transaction to continue the same query
+// right after the last result that was returned. Treat it as opaque.
+struct ndb_query_token {
+	uint64_t created_at;
+	uint64_t note_key;
+	uint32_t num_filters;
+	uint32_t filter_counts[NDB_QUERY_MAX_FILTERS];
+};
+
 // CONFIG
 void ndb_default_config(struct ndb_config *);
 void ndb_config_set_ingest_threads(struct ndb_config *config, int threads);
+void ndb_config_set_query_threads(struct ndb_config *config, int threads);
+void ndb_config_set_query_cache_size(struct ndb_config *config, int entries);
 void ndb_config_set_flags(struct ndb_config *config, int flags);
 void ndb_config_set_mapsize(struct ndb_config *config, size_t mapsize);
 void ndb_config_set_ingest_filter(struct ndb_config *config, ndb_ingest_filter_fn fn, void *);
+// called on the notifier thread, so a slow callback delays other
+// subscriptions first. If the notifier falls a whole queue of notes
+// (32768) behind, the writer waits for it to catch up, so a callback that
+// stays slow does hold up ingestion.
 void ndb_config_set_subscription_callback(struct ndb_config *config, ndb_sub_fn fn, void *ctx);
 
 /// Configurable scratch buffer size for the writer thread. Default is 2MB. If you have smaller notes
@@ -492,6 +608,19 @@ void ndb_config_set_subscription_callback(struct ndb_config *config, ndb_sub_fn
 /// that the writer thread can properly parse larger notes.
 void ndb_config_set_writer_scratch_buffer_size(struct ndb_config *config, int scratch_size);
 
+/// Which kinds get fulltext indexed, 1 and 30023 by default. Profiles (kind
+/// 0) are indexed by their about field, everything else by its content.
+/// With kind 0 in the set, ndb_query searches of `kinds: [0]` go through
+/// the about index; otherwise they search profile names, like
+/// ndb_search_profile.
+/// Changing the set rebuilds the fulltext index in the background the next
+/// time the database is opened. Returns 0 if there are too many kinds.
+///
+/// Notes are indexed on the writer thread as they come in, unless
+/// NDB_FLAG_ASYNC_FULLTEXT is set: then a background indexer picks them
+/// up after they are written, so search can lag a bit behind ingestion.
+int ndb_config_set_fulltext_kinds(struct ndb_config *config, const uint64_t *kinds, int num_kinds);
+
 // HELPERS
 int ndb_calculate_id(struct ndb_note *note, unsigned char *buf, int buflen, unsigned char *id);
 int ndb_sign_id(struct ndb_keypair *keypair, unsigned char id[32], unsigned char sig[64]);
@@ -535,6 +664,24 @@ uint64_t ndb_get_notekey_by_id(struct ndb_txn *txn, const unsigned char *id);
 uint64_t ndb_get_profilekey_by_pubkey(struct ndb_txn *txn, const unsigned char *id);
 struct ndb_note *ndb_get_note_by_id(struct ndb_txn *txn, const unsigned char *id, size_t *len, uint64_t *primkey);
 struct ndb_note *ndb_get_note_by_key(struct ndb_txn *txn, uint64_t key, size_t *len);
+// batch lookups, `ids` and `pubkeys` are packed 32 byte keys. Fills one
+// result per key in the same order and returns the number found, or -1 on
+// errors.
+int ndb_get_notes_by_ids(struct ndb_txn *txn, const unsigned char *ids, int num_ids, struct ndb_lookup_result *results);
+int ndb_get_profiles_by_pubkeys(struct ndb_txn *txn, const unsigned char *pubkeys, int num_pubkeys, struct ndb_lookup_result *results);
+// latest version of a replaceable or addressable note. The identifier is
+// ignored for kinds outside of 30000-39999.
+struct ndb_note *ndb_get_note_by_naddr(struct ndb_txn *txn, const struct bech32_naddr *naddr, size_t *len, uint64_t *primkey);
+// batched, returns like ndb_get_notes_by_ids
+int ndb_get_notes_by_naddrs(struct ndb_txn *txn, const struct bech32_naddr *naddrs, int num_naddrs, struct ndb_lookup_result *results);
+// Load the reply tree under `root` (NIP-10), ordered for display: depth
+// first, siblings oldest first. `depth` < 0 means no depth limit, `results`
+// must have room for `limit` entries.
+int ndb_thread_query(struct ndb_txn *txn, const unsigned char *root, int depth, int limit, struct ndb_thread_result *results, int *count);
+// Most used hashtags (t tags and content #hashtags, lowercased) of notes
+// created in [since, until), most used first. Counts are kept per
+// NDB_HASHTAG_BUCKET seconds, every bucket overlapping the range counts.
+int ndb_trending_hashtags(struct ndb_txn *txn, uint64_t since, uint64_t until, struct ndb_hashtag_count *results, int capacity, int *count);
 void *ndb_get_note_meta(struct ndb_txn *txn, const unsigned char *id, size_t *len);
 int ndb_note_seen_on_relay(struct ndb_txn *txn, uint64_t note_key, const char *relay);
 void ndb_destroy(struct ndb *);
@@ -586,6 +733,7 @@ struct ndb_filter_elements *ndb_filter_current_element(const struct ndb_filter *
 struct ndb_filter_elements *ndb_filter_get_elements(const struct ndb_filter *, int);
 int ndb_filter_start_field(struct ndb_filter *, enum ndb_filter_fieldtype);
 int ndb_filter_start_tag_field(struct ndb_filter *, char tag);
+int ndb_filter_start_tag_field_str(struct ndb_filter *, const char *tag);
 int ndb_filter_matches(struct ndb_filter *, struct ndb_note *);
 int ndb_filter_matches_with_relay(struct ndb_filter *, struct ndb_note *, struct ndb_note_relay_iterator *iter);
 int ndb_filter_clone(struct ndb_filter *dst, struct ndb_filter *src);
@@ -598,18 +746,67 @@ int ndb_filter_json(const struct ndb_filter *, char *buf, int buflen);
 uint64_t ndb_subscribe(struct ndb *, struct ndb_filter *, int num_filters);
 int ndb_wait_for_notes(struct ndb *, uint64_t subid, uint64_t *note_ids, int note_id_capacity);
 int ndb_poll_for_notes(struct ndb *, uint64_t subid, uint64_t *note_ids, int note_id_capacity);
+// Subscribe and backfill in one go: the initial results come from a read
+// transaction opened after the subscription, and the subscription only
+// delivers notes committed after that snapshot, so nothing is missed or
+// seen twice. txn is left open for the results, end it with ndb_end_query.
+uint64_t ndb_subscribe_with_query(struct ndb *, struct ndb_txn *txn, struct ndb_filter *, int num_filters, struct ndb_query_result *results, int result_capacity, int *count);
 int ndb_unsubscribe(struct ndb *, uint64_t subid);
 int ndb_num_subscriptions(struct ndb *);
 
+int ndb_subscription_set_delivery(struct ndb *, uint64_t subid, const struct ndb_delivery_policy *);
+// how many times a wakeup was held back and folded into a later one
+uint64_t ndb_subscription_coalesced(struct ndb *, uint64_t subid);
+
+// 1 if the subscription fell behind the shared notification log and lost
+// notes since the last time this was called
+int ndb_subscription_overflowed(struct ndb *, uint64_t subid);
+#ifndef _WIN32
+// A nonblocking fd (an eventfd on linux, a pipe elsewhere) that is readable
+// while the subscription has notes waiting, for use with poll/epoll/kqueue.
+// Don't read from it, just call ndb_poll_for_notes, which can come back
+// empty after a wakeup that raced with an earlier poll. It belongs to the
+// subscription and is closed by ndb_unsubscribe. Returns -1 on failure.
+int ndb_subscription_fd(struct ndb *, uint64_t subid);
+#endif
+
 // FULLTEXT SEARCH
+//
+// Words in the query must all appear in a note, and match any word they are
+// a prefix of. "Quoted words" must appear next to each other, and OR
+// between words matches notes that match either side: `nostr "hello world"
+// OR bitcoin`. ndb_text_search returns up to MAX_TEXT_SEARCH_RESULTS, the
+// iterator streams every match in order.
+//
+// With NDB_ORDER_RELEVANCE matches are scored with BM25, boosted for
+// recent notes, and the best ones come back highest score first. The
+// iterator can't know the best until it has seen them all, so it goes
+// newest first and only fills in the scores.
+int ndb_text_search_iter_begin(struct ndb_txn *txn, const char *query, struct ndb_text_search_config *, struct ndb_filter *filter, struct ndb_text_search_iter **iter);
+int ndb_text_search_iter_next(struct ndb_text_search_iter *iter, struct ndb_text_search_result *result);
+void ndb_text_search_iter_end(struct ndb_text_search_iter *iter);
 int ndb_text_search(struct ndb_txn *txn, const char *query, struct ndb_text_search_results *, struct ndb_text_search_config *);
 int ndb_text_search_with(struct ndb_txn *txn, const char *query, struct ndb_text_search_results *, struct ndb_text_search_config *, struct ndb_filter *filter);
 void ndb_default_text_search_config(struct ndb_text_search_config *);
+void ndb_default_ranked_search_config(struct ndb_text_search_config *);
 void ndb_text_search_config_set_order(struct ndb_text_search_config *, enum ndb_search_order);
 void ndb_text_search_config_set_limit(struct ndb_text_search_config *, int limit);
+// every note key up to this one has been fulltext indexed
+uint64_t ndb_fulltext_indexed_key(struct ndb_txn *txn);
 
 // QUERY
 int ndb_query(struct ndb_txn *txn, struct ndb_filter *filters, int num_filters, struct ndb_query_result *results, int result_capacity, int *count);
+int ndb_query_with_profile(struct ndb_txn *txn, struct ndb_filter *filters, int num_filters, struct ndb_query_result *results, int result_capacity, int *count, struct ndb_query_profile *profile);
+int ndb_query_explain(struct ndb_txn *txn, struct ndb_filter *filters, int num_filters, struct ndb_query_profile *profile);
+int ndb_count(struct ndb_txn *txn, struct ndb_filter *filters, int num_filters, int *count);
+// `profile` is optional, pass NULL unless you want to see what the query did
+int ndb_query_keys(struct ndb_txn *txn, struct ndb_filter *filters, int num_filters, struct ndb_query_key *keys, int capacity, int *count, struct ndb_query_profile *profile);
+int ndb_query_iter_begin(struct ndb_txn *txn, struct ndb_filter *filters, int num_filters, const struct ndb_query_token *resume, struct ndb_query_iter **iter);
+int ndb_query_iter_begin_with(struct ndb_txn *txn, struct ndb_filter *filters, int num_filters, const struct ndb_query_token *resume, int flags, struct ndb_query_iter **iter);
+int ndb_query_iter_next(struct ndb_query_iter *iter, struct ndb_query_result *result);
+int ndb_query_iter_next_key(struct ndb_query_iter *iter, struct ndb_query_key *key);
+void ndb_query_iter_token(struct ndb_query_iter *iter, struct ndb_query_token *token);
+void ndb_query_iter_end(struct ndb_query_iter *iter);
 
 // STATS
 int ndb_stat(struct ndb *ndb, struct ndb_stat *stat);
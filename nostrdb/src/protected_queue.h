@@ -15,6 +15,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <string.h>
+#include <time.h>
 #include "cursor.h"
 #include "util.h"
 #include "thread.h"
@@ -37,6 +38,9 @@ struct prot_queue {
 
 	pthread_mutex_t mutex;
 	pthread_cond_t cond;
+
+	// signaled when elements are popped, for blocking pushes
+	pthread_cond_t not_full;
 };
 
 
@@ -65,6 +69,7 @@ static inline int prot_queue_init(struct prot_queue* q, void* buf,
 
 	pthread_mutex_init(&q->mutex, NULL);
 	pthread_cond_init(&q->cond, NULL);
+	pthread_cond_init(&q->not_full, NULL);
 
 	return 1;
 }
@@ -108,6 +113,30 @@ static int prot_queue_push(struct prot_queue* q, void *data)
 	return 1;
 }
 
+// copy elements in, the caller holds the lock and made sure they fit
+static void prot_queue_push_locked(struct prot_queue* q, void *data, int count)
+{
+	int cap;
+	int first_copy_count, second_copy_count;
+
+	cap = prot_queue_capacity(q);
+	first_copy_count = min(count, cap - q->tail); // Elements until the end of the buffer
+	second_copy_count = count - first_copy_count; // Remaining elements if wrap around
+
+	memcpy(&q->buf[q->tail * q->elem_size], data, first_copy_count * q->elem_size);
+	q->tail = (q->tail + first_copy_count) % cap;
+
+	if (second_copy_count > 0) {
+		// If there is a wrap around, copy the remaining elements
+		memcpy(&q->buf[q->tail * q->elem_size], (char *)data + first_copy_count * q->elem_size, second_copy_count * q->elem_size);
+		q->tail = (q->tail + second_copy_count) % cap;
+	}
+
+	q->count += count;
+
+	pthread_cond_signal(&q->cond); // Signal a waiting thread
+}
+
 /*
  * Push multiple elements onto the queue.
  * Params:
@@ -119,32 +148,40 @@ static int prot_queue_push(struct prot_queue* q, void *data)
  */
 static int prot_queue_push_all(struct prot_queue* q, void *data, int count)
 {
-	int cap;
-	int first_copy_count, second_copy_count;
-
 	pthread_mutex_lock(&q->mutex);
 
-	cap = prot_queue_capacity(q);
-	if (q->count + count > cap) {
+	if (q->count + count > (int)prot_queue_capacity(q)) {
 		pthread_mutex_unlock(&q->mutex);
 		return 0; // Return failure if the queue is full
 	}
 
-	first_copy_count = min(count, cap - q->tail); // Elements until the end of the buffer
-	second_copy_count = count - first_copy_count; // Remaining elements if wrap around
+	prot_queue_push_locked(q, data, count);
+	pthread_mutex_unlock(&q->mutex);
 
-	memcpy(&q->buf[q->tail * q->elem_size], data, first_copy_count * q->elem_size);
-	q->tail = (q->tail + first_copy_count) % cap;
+	return count;
+}
 
-	if (second_copy_count > 0) {
-		// If there is a wrap around, copy the remaining elements
-		memcpy(&q->buf[q->tail * q->elem_size], (char *)data + first_copy_count * q->elem_size, second_copy_count * q->elem_size);
-		q->tail = (q->tail + second_copy_count) % cap;
-	}
+/*
+ * Like prot_queue_push_all, but wait for the consumer to make room instead
+ * of failing when the queue is full.
+ *
+ * Returns the number of elements pushed, 0 if there could never be room
+ * for them.
+ */
+static int prot_queue_push_all_wait(struct prot_queue* q, void *data, int count)
+{
+	int cap;
 
-	q->count += count;
+	cap = prot_queue_capacity(q);
+	if (count > cap)
+		return 0;
 
-	pthread_cond_signal(&q->cond); // Signal a waiting thread
+	pthread_mutex_lock(&q->mutex);
+
+	while (q->count + count > cap)
+		pthread_cond_wait(&q->not_full, &q->mutex);
+
+	prot_queue_push_locked(q, data, count);
 	pthread_mutex_unlock(&q->mutex);
 
 	return count;
@@ -174,6 +211,8 @@ static inline int prot_queue_try_pop_all(struct prot_queue *q, void *data, int m
 	memcpy(data, &q->buf[q->head * q->elem_size], items_to_pop * q->elem_size);
 	q->head = (q->head + items_to_pop) % prot_queue_capacity(q);
 	q->count -= items_to_pop;
+	if (items_to_pop > 0)
+		pthread_cond_broadcast(&q->not_full);
 
 	pthread_mutex_unlock(&q->mutex);
 	return items_to_pop;
@@ -204,6 +243,57 @@ static int prot_queue_pop_all(struct prot_queue *q, void *dest, int max_items) {
 	memcpy(dest, &q->buf[q->head * q->elem_size], items_to_pop * q->elem_size);
 	q->head = (q->head + items_to_pop) % prot_queue_capacity(q);
 	q->count -= items_to_pop;
+	if (items_to_pop > 0)
+		pthread_cond_broadcast(&q->not_full);
+
+	pthread_mutex_unlock(&q->mutex);
+
+	return items_to_pop;
+}
+
+/*
+ * Like prot_queue_pop_all, but give up after timeout_ms milliseconds.
+ * Returns the number of items popped, 0 if it timed out.
+ */
+static int prot_queue_timed_pop_all(struct prot_queue *q, void *dest,
+				    int max_items, uint64_t timeout_ms) {
+#ifdef _WIN32
+	uint64_t deadline = GetTickCount64() + timeout_ms, now;
+#else
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+#endif
+
+	pthread_mutex_lock(&q->mutex);
+
+	while (q->count == 0) {
+#ifdef _WIN32
+		now = GetTickCount64();
+		if (now >= deadline ||
+		    !SleepConditionVariableCS(&q->cond, &q->mutex,
+					      (DWORD)(deadline - now)))
+			break;
+#else
+		if (pthread_cond_timedwait(&q->cond, &q->mutex, &deadline))
+			break;
+#endif
+	}
+
+	int items_until_end = (q->buflen - q->head * q->elem_size) / q->elem_size;
+	int items_to_pop = min(q->count, max_items);
+	items_to_pop = min(items_to_pop, items_until_end);
+
+	memcpy(dest, &q->buf[q->head * q->elem_size], items_to_pop * q->elem_size);
+	q->head = (q->head + items_to_pop) % prot_queue_capacity(q);
+	q->count -= items_to_pop;
+	if (items_to_pop > 0)
+		pthread_cond_broadcast(&q->not_full);
 
 	pthread_mutex_unlock(&q->mutex);
 
@@ -225,6 +315,7 @@ static inline void prot_queue_pop(struct prot_queue *q, void *data) {
 	memcpy(data, &q->buf[q->head * q->elem_size], q->elem_size);
 	q->head = (q->head + 1) % prot_queue_capacity(q);
 	q->count--;
+	pthread_cond_broadcast(&q->not_full);
 
 	pthread_mutex_unlock(&q->mutex);
 }
@@ -237,6 +328,7 @@ static inline void prot_queue_pop(struct prot_queue *q, void *data) {
 static inline void prot_queue_destroy(struct prot_queue* q) {
 	pthread_mutex_destroy(&q->mutex);
 	pthread_cond_destroy(&q->cond);
+	pthread_cond_destroy(&q->not_full);
 }
 
 #endif // PROT_QUEUE_H
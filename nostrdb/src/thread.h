@@ -34,9 +34,45 @@ typedef CONDITION_VARIABLE pthread_cond_t;
 #define pthread_cond_signal(cond) \
     (WakeConditionVariable(cond), 0)
 
+#define pthread_cond_broadcast(cond) \
+    (WakeAllConditionVariable(cond), 0)
+
 #define pthread_cond_wait(cond, mutex) \
     (SleepConditionVariableCS(cond, mutex, INFINITE) ? 0 : ErrCode())
 
+// Reader/writer locks
+typedef SRWLOCK pthread_rwlock_t;
+
+#define pthread_rwlock_init(lock, attr) \
+    (InitializeSRWLock(lock), 0)
+
+#define pthread_rwlock_destroy(lock)
+
+#define pthread_rwlock_rdlock(lock) \
+    (AcquireSRWLockShared(lock), 0)
+
+#define pthread_rwlock_wrlock(lock) \
+    (AcquireSRWLockExclusive(lock), 0)
+
+// SRW locks need to know which side is being released
+#define RWLOCK_RDUNLOCK(lock) \
+    (ReleaseSRWLockShared(lock), 0)
+
+#define RWLOCK_WRUNLOCK(lock) \
+    (ReleaseSRWLockExclusive(lock), 0)
+
+// 64-bit atomics, the interlocked functions are full barriers
+#define ATOMIC_LOAD_U64(ptr) \
+    ((uint64_t)InterlockedCompareExchange64((volatile LONG64 *)(ptr), 0, 0))
+
+#define ATOMIC_STORE_U64(ptr, val) \
+    ((void)InterlockedExchange64((volatile LONG64 *)(ptr), (LONG64)(val)))
+
+#define ATOMIC_INC_U64(ptr) \
+    ((uint64_t)InterlockedIncrement64((volatile LONG64 *)(ptr)))
+
+#define ATOMIC_FENCE() MemoryBarrier()
+
 // Thread functions
 #define THREAD_CREATE(thr, start, arg) \
     (((thr = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)start, arg, 0, NULL)) != NULL) ? 0 : ErrCode())
@@ -47,16 +83,27 @@ typedef CONDITION_VARIABLE pthread_cond_t;
 #define THREAD_TERMINATE(thr) \
     (TerminateThread(thr, 0) ? ErrCode() : 0)
 
+#define THREAD_YIELD() SwitchToThread()
+
 #else // _WIN32
   #include <pthread.h>
+  #include <sched.h>
 
   //#define     ErrCode()       errno
   #define THREAD_CREATE(thr,start,arg)	pthread_create(&thr,NULL,start,arg)
   #define THREAD_FINISH(thr)	pthread_join(thr,NULL)
   #define THREAD_TERMINATE(thr)	pthread_exit(&thr)
+  #define THREAD_YIELD()	sched_yield()
   
   #define LOCK_MUTEX(mutex)	pthread_mutex_lock(mutex)
   #define UNLOCK_MUTEX(mutex)	pthread_mutex_unlock(mutex)
+  #define RWLOCK_RDUNLOCK(lock)	pthread_rwlock_unlock(lock)
+  #define RWLOCK_WRUNLOCK(lock)	pthread_rwlock_unlock(lock)
+
+  #define ATOMIC_LOAD_U64(ptr)	__atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+  #define ATOMIC_STORE_U64(ptr,val)	__atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+  #define ATOMIC_INC_U64(ptr)	__atomic_add_fetch(ptr, 1, __ATOMIC_RELAXED)
+  #define ATOMIC_FENCE()	__atomic_thread_fence(__ATOMIC_SEQ_CST)
 
 #endif
 
@@ -16,7 +16,7 @@ struct threadpool
 {
 	int num_threads;
 	struct thread *pool;
-	int next_thread;
+	uint64_t next_thread;
 	void *quit_msg;
 };
 
@@ -33,7 +33,7 @@ static int threadpool_init(struct threadpool *tp, int num_threads,
 	tp->num_threads = num_threads;
 	tp->pool = malloc(sizeof(*tp->pool) * num_threads);
 	tp->quit_msg = quit_msg;
-	tp->next_thread = -1;
+	tp->next_thread = (uint64_t)-1;
 
 	if (tp->pool == NULL) {
 		fprintf(stderr, "threadpool_init: couldn't allocate memory for pool");
@@ -66,8 +66,9 @@ static int threadpool_init(struct threadpool *tp, int num_threads,
 
 static inline struct thread *threadpool_next_thread(struct threadpool *tp)
 {
-	tp->next_thread = (tp->next_thread + 1) % tp->num_threads;
-	return &tp->pool[tp->next_thread];
+	// dispatch can happen from several threads at once
+	uint64_t next = ATOMIC_INC_U64(&tp->next_thread);
+	return &tp->pool[next % tp->num_threads];
 }
 
 static inline int threadpool_dispatch(struct threadpool *tp, void *msg)
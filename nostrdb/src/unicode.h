@@ -0,0 +1,438 @@
+#ifndef NDB_UNICODE_H
+#define NDB_UNICODE_H
+
+#include <stdint.h>
+
+// Just enough unicode for search: telling words apart from punctuation,
+// and folding case and accents away so that "Café" finds "cafe".
+// Chinese, japanese and korean don't put spaces between words, so runs of
+// those characters get their own class, see ndb_tokenize.
+
+enum ndb_char_class {
+	NDB_CHAR_SEP,    // whitespace, punctuation, symbols and emoji
+	NDB_CHAR_WORD,
+	NDB_CHAR_CJK,    // han, kana and hangul
+	NDB_CHAR_IGNORE, // combining marks and joiners, skipped over
+};
+
+struct ndb_char_range {
+	uint32_t start, end;
+	enum ndb_char_class cls;
+};
+
+// Sorted, and anything from U+0080 up that isn't in here is a letter.
+// The folding tables below take care of the blocks they cover.
+static const struct ndb_char_range ndb_char_ranges[] = {
+	{ 0x0080, 0x00AC, NDB_CHAR_SEP },    // control, latin-1 punctuation
+	{ 0x00AD, 0x00AD, NDB_CHAR_IGNORE }, // soft hyphen
+	{ 0x00AE, 0x00BF, NDB_CHAR_SEP },
+	{ 0x02B0, 0x036F, NDB_CHAR_IGNORE }, // modifiers, combining marks
+	{ 0x0591, 0x05C7, NDB_CHAR_IGNORE }, // hebrew points
+	{ 0x05F3, 0x05F4, NDB_CHAR_SEP },
+	{ 0x0600, 0x060F, NDB_CHAR_SEP },    // arabic punctuation
+	{ 0x0610, 0x061A, NDB_CHAR_IGNORE },
+	{ 0x061B, 0x061F, NDB_CHAR_SEP },
+	{ 0x0640, 0x0640, NDB_CHAR_IGNORE }, // tatweel
+	{ 0x064B, 0x065F, NDB_CHAR_IGNORE }, // harakat
+	{ 0x066A, 0x066D, NDB_CHAR_SEP },
+	{ 0x0670, 0x0670, NDB_CHAR_IGNORE },
+	{ 0x06D4, 0x06D4, NDB_CHAR_SEP },
+	{ 0x06D6, 0x06ED, NDB_CHAR_IGNORE },
+	{ 0x0964, 0x0965, NDB_CHAR_SEP },    // danda
+	{ 0x0E3F, 0x0E3F, NDB_CHAR_SEP },    // baht
+	{ 0x1100, 0x11FF, NDB_CHAR_CJK },    // hangul jamo
+	{ 0x1AB0, 0x1AFF, NDB_CHAR_IGNORE },
+	{ 0x1DC0, 0x1DFF, NDB_CHAR_IGNORE },
+	{ 0x2000, 0x200B, NDB_CHAR_SEP },    // spaces
+	{ 0x200C, 0x200D, NDB_CHAR_IGNORE }, // zero width (non)joiner
+	{ 0x200E, 0x205F, NDB_CHAR_SEP },    // general punctuation
+	{ 0x2060, 0x206F, NDB_CHAR_IGNORE },
+	{ 0x20A0, 0x20CF, NDB_CHAR_SEP },    // currency
+	{ 0x20D0, 0x20FF, NDB_CHAR_IGNORE },
+	{ 0x2100, 0x2BFF, NDB_CHAR_SEP },    // symbols, arrows, math, dingbats
+	{ 0x2E00, 0x2E7F, NDB_CHAR_SEP },
+	{ 0x2E80, 0x2FDF, NDB_CHAR_CJK },    // radicals
+	{ 0x2FF0, 0x3004, NDB_CHAR_SEP },    // cjk punctuation
+	{ 0x3005, 0x3007, NDB_CHAR_CJK },
+	{ 0x3008, 0x3020, NDB_CHAR_SEP },
+	{ 0x3021, 0x3029, NDB_CHAR_CJK },
+	{ 0x302A, 0x302F, NDB_CHAR_IGNORE },
+	{ 0x3030, 0x3030, NDB_CHAR_SEP },
+	{ 0x3031, 0x3035, NDB_CHAR_CJK },
+	{ 0x3036, 0x303A, NDB_CHAR_SEP },
+	{ 0x303B, 0x303C, NDB_CHAR_CJK },
+	{ 0x303D, 0x303F, NDB_CHAR_SEP },
+	{ 0x3040, 0x3098, NDB_CHAR_CJK },    // hiragana
+	{ 0x3099, 0x309A, NDB_CHAR_IGNORE }, // combining (semi-)voiced marks
+	{ 0x309B, 0x30FA, NDB_CHAR_CJK },    // katakana
+	{ 0x30FB, 0x30FB, NDB_CHAR_SEP },    // katakana middle dot
+	{ 0x30FC, 0x31FF, NDB_CHAR_CJK },    // bopomofo, hangul compatibility jamo
+	{ 0x3200, 0x33FF, NDB_CHAR_SEP },    // enclosed and squared cjk
+	{ 0x3400, 0x4DBF, NDB_CHAR_CJK },
+	{ 0x4DC0, 0x4DFF, NDB_CHAR_SEP },
+	{ 0x4E00, 0x9FFF, NDB_CHAR_CJK },
+	{ 0xA960, 0xA97F, NDB_CHAR_CJK },
+	{ 0xAC00, 0xD7FF, NDB_CHAR_CJK },    // hangul syllables
+	{ 0xD800, 0xF8FF, NDB_CHAR_SEP },    // surrogates, private use
+	{ 0xF900, 0xFAFF, NDB_CHAR_CJK },
+	{ 0xFE00, 0xFE0F, NDB_CHAR_IGNORE }, // variation selectors
+	{ 0xFE10, 0xFE1F, NDB_CHAR_SEP },
+	{ 0xFE20, 0xFE2F, NDB_CHAR_IGNORE },
+	{ 0xFE30, 0xFE6F, NDB_CHAR_SEP },
+	{ 0xFEFF, 0xFEFF, NDB_CHAR_IGNORE }, // byte order mark
+	{ 0xFF00, 0xFF65, NDB_CHAR_SEP },    // fullwidth, folded before this
+	{ 0xFF66, 0xFFDC, NDB_CHAR_CJK },    // halfwidth kana and hangul
+	{ 0xFFE0, 0xFFFF, NDB_CHAR_SEP },
+	{ 0x1F000, 0x1FAFF, NDB_CHAR_SEP },  // emoji
+	{ 0x20000, 0x3FFFF, NDB_CHAR_CJK },
+	{ 0xE0000, 0xE01EF, NDB_CHAR_IGNORE },
+};
+
+// 0 for separators, otherwise the lowercase letter
+static const unsigned char ndb_ascii_fold[128] = {
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+	0x38, 0x39, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67,
+	0x68, 0x69, 0x6A, 0x6B, 0x6C, 0x6D, 0x6E, 0x6F,
+	0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77,
+	0x78, 0x79, 0x7A, 0x00, 0x00, 0x00, 0x00, 0x5F,
+	0x00, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67,
+	0x68, 0x69, 0x6A, 0x6B, 0x6C, 0x6D, 0x6E, 0x6F,
+	0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77,
+	0x78, 0x79, 0x7A, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+// Letters in these blocks map to their lowercase form without accents.
+// 0 is a separator, 0xFFFF a combining mark. Generated from python's
+// unicodedata, by case folding and stripping combining marks from the
+// NFD decomposition.
+// U+00C0 to U+024F
+static const uint16_t ndb_fold_latin[] = {
+	0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x00E6, 0x0063,
+	0x0065, 0x0065, 0x0065, 0x0065, 0x0069, 0x0069, 0x0069, 0x0069,
+	0x00F0, 0x006E, 0x006F, 0x006F, 0x006F, 0x006F, 0x006F, 0x0000,
+	0x006F, 0x0075, 0x0075, 0x0075, 0x0075, 0x0079, 0x00FE, 0x00DF,
+	0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x00E6, 0x0063,
+	0x0065, 0x0065, 0x0065, 0x0065, 0x0069, 0x0069, 0x0069, 0x0069,
+	0x00F0, 0x006E, 0x006F, 0x006F, 0x006F, 0x006F, 0x006F, 0x0000,
+	0x006F, 0x0075, 0x0075, 0x0075, 0x0075, 0x0079, 0x00FE, 0x0079,
+	0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x0063, 0x0063,
+	0x0063, 0x0063, 0x0063, 0x0063, 0x0063, 0x0063, 0x0064, 0x0064,
+	0x0064, 0x0064, 0x0065, 0x0065, 0x0065, 0x0065, 0x0065, 0x0065,
+	0x0065, 0x0065, 0x0065, 0x0065, 0x0067, 0x0067, 0x0067, 0x0067,
+	0x0067, 0x0067, 0x0067, 0x0067, 0x0068, 0x0068, 0x0068, 0x0068,
+	0x0069, 0x0069, 0x0069, 0x0069, 0x0069, 0x0069, 0x0069, 0x0069,
+	0x0069, 0x0069, 0x0133, 0x0133, 0x006A, 0x006A, 0x006B, 0x006B,
+	0x0138, 0x006C, 0x006C, 0x006C, 0x006C, 0x006C, 0x006C, 0x0140,
+	0x0140, 0x006C, 0x006C, 0x006E, 0x006E, 0x006E, 0x006E, 0x006E,
+	0x006E, 0x0149, 0x014B, 0x014B, 0x006F, 0x006F, 0x006F, 0x006F,
+	0x006F, 0x006F, 0x0153, 0x0153, 0x0072, 0x0072, 0x0072, 0x0072,
+	0x0072, 0x0072, 0x0073, 0x0073, 0x0073, 0x0073, 0x0073, 0x0073,
+	0x0073, 0x0073, 0x0074, 0x0074, 0x0074, 0x0074, 0x0074, 0x0074,
+	0x0075, 0x0075, 0x0075, 0x0075, 0x0075, 0x0075, 0x0075, 0x0075,
+	0x0075, 0x0075, 0x0075, 0x0075, 0x0077, 0x0077, 0x0079, 0x0079,
+	0x0079, 0x007A, 0x007A, 0x007A, 0x007A, 0x007A, 0x007A, 0x0073,
+	0x0180, 0x0253, 0x0183, 0x0183, 0x0185, 0x0185, 0x0254, 0x0188,
+	0x0188, 0x0256, 0x0257, 0x018C, 0x018C, 0x018D, 0x01DD, 0x0259,
+	0x025B, 0x0192, 0x0192, 0x0260, 0x0263, 0x0195, 0x0269, 0x0268,
+	0x0199, 0x0199, 0x019A, 0x019B, 0x026F, 0x0272, 0x019E, 0x0275,
+	0x006F, 0x006F, 0x01A3, 0x01A3, 0x01A5, 0x01A5, 0x0280, 0x01A8,
+	0x01A8, 0x0283, 0x01AA, 0x01AB, 0x01AD, 0x01AD, 0x0288, 0x0075,
+	0x0075, 0x028A, 0x028B, 0x01B4, 0x01B4, 0x01B6, 0x01B6, 0x0292,
+	0x01B9, 0x01B9, 0x01BA, 0x01BB, 0x01BD, 0x01BD, 0x01BE, 0x01BF,
+	0x01C0, 0x01C1, 0x01C2, 0x01C3, 0x01C6, 0x01C6, 0x01C6, 0x01C9,
+	0x01C9, 0x01C9, 0x01CC, 0x01CC, 0x01CC, 0x0061, 0x0061, 0x0069,
+	0x0069, 0x006F, 0x006F, 0x0075, 0x0075, 0x0075, 0x0075, 0x0075,
+	0x0075, 0x0075, 0x0075, 0x0075, 0x0075, 0x01DD, 0x0061, 0x0061,
+	0x0061, 0x0061, 0x00E6, 0x00E6, 0x01E5, 0x01E5, 0x0067, 0x0067,
+	0x006B, 0x006B, 0x006F, 0x006F, 0x006F, 0x006F, 0x0292, 0x0292,
+	0x006A, 0x01F3, 0x01F3, 0x01F3, 0x0067, 0x0067, 0x0195, 0x01BF,
+	0x006E, 0x006E, 0x0061, 0x0061, 0x00E6, 0x00E6, 0x00F8, 0x00F8,
+	0x0061, 0x0061, 0x0061, 0x0061, 0x0065, 0x0065, 0x0065, 0x0065,
+	0x0069, 0x0069, 0x0069, 0x0069, 0x006F, 0x006F, 0x006F, 0x006F,
+	0x0072, 0x0072, 0x0072, 0x0072, 0x0075, 0x0075, 0x0075, 0x0075,
+	0x0073, 0x0073, 0x0074, 0x0074, 0x021D, 0x021D, 0x0068, 0x0068,
+	0x019E, 0x0221, 0x0223, 0x0223, 0x0225, 0x0225, 0x0061, 0x0061,
+	0x0065, 0x0065, 0x006F, 0x006F, 0x006F, 0x006F, 0x006F, 0x006F,
+	0x006F, 0x006F, 0x0079, 0x0079, 0x0234, 0x0235, 0x0236, 0x0237,
+	0x0238, 0x0239, 0x023A, 0x023C, 0x023C, 0x019A, 0x023E, 0x023F,
+	0x0240, 0x0242, 0x0242, 0x0180, 0x0289, 0x028C, 0x0247, 0x0247,
+	0x0249, 0x0249, 0x024B, 0x024B, 0x024D, 0x024D, 0x024F, 0x024F,
+};
+
+// U+0370 to U+058F
+static const uint16_t ndb_fold_greek_cyrillic[] = {
+	0x0371, 0x0371, 0x0373, 0x0373, 0x02B9, 0x0000, 0x0377, 0x0377,
+	0x0000, 0x0000, 0x037A, 0x037B, 0x037C, 0x037D, 0x0000, 0x03F3,
+	0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x03B1, 0x0000,
+	0x03B5, 0x03B7, 0x03B9, 0x0000, 0x03BF, 0x0000, 0x03C5, 0x03C9,
+	0x03B9, 0x03B1, 0x03B2, 0x03B3, 0x03B4, 0x03B5, 0x03B6, 0x03B7,
+	0x03B8, 0x03B9, 0x03BA, 0x03BB, 0x03BC, 0x03BD, 0x03BE, 0x03BF,
+	0x03C0, 0x03C1, 0x0000, 0x03C3, 0x03C4, 0x03C5, 0x03C6, 0x03C7,
+	0x03C8, 0x03C9, 0x03B9, 0x03C5, 0x03B1, 0x03B5, 0x03B7, 0x03B9,
+	0x03C5, 0x03B1, 0x03B2, 0x03B3, 0x03B4, 0x03B5, 0x03B6, 0x03B7,
+	0x03B8, 0x03B9, 0x03BA, 0x03BB, 0x03BC, 0x03BD, 0x03BE, 0x03BF,
+	0x03C0, 0x03C1, 0x03C3, 0x03C3, 0x03C4, 0x03C5, 0x03C6, 0x03C7,
+	0x03C8, 0x03C9, 0x03B9, 0x03C5, 0x03BF, 0x03C5, 0x03C9, 0x03D7,
+	0x03B2, 0x03B8, 0x03D2, 0x03D2, 0x03D2, 0x03C6, 0x03C0, 0x03D7,
+	0x03D9, 0x03D9, 0x03DB, 0x03DB, 0x03DD, 0x03DD, 0x03DF, 0x03DF,
+	0x03E1, 0x03E1, 0x03E3, 0x03E3, 0x03E5, 0x03E5, 0x03E7, 0x03E7,
+	0x03E9, 0x03E9, 0x03EB, 0x03EB, 0x03ED, 0x03ED, 0x03EF, 0x03EF,
+	0x03BA, 0x03C1, 0x03F2, 0x03F3, 0x03B8, 0x03B5, 0x0000, 0x03F8,
+	0x03F8, 0x03F2, 0x03FB, 0x03FB, 0x03FC, 0x037B, 0x037C, 0x037D,
+	0x0435, 0x0435, 0x0452, 0x0433, 0x0454, 0x0455, 0x0456, 0x0456,
+	0x0458, 0x0459, 0x045A, 0x045B, 0x043A, 0x0438, 0x0443, 0x045F,
+	0x0430, 0x0431, 0x0432, 0x0433, 0x0434, 0x0435, 0x0436, 0x0437,
+	0x0438, 0x0438, 0x043A, 0x043B, 0x043C, 0x043D, 0x043E, 0x043F,
+	0x0440, 0x0441, 0x0442, 0x0443, 0x0444, 0x0445, 0x0446, 0x0447,
+	0x0448, 0x0449, 0x044A, 0x044B, 0x044C, 0x044D, 0x044E, 0x044F,
+	0x0430, 0x0431, 0x0432, 0x0433, 0x0434, 0x0435, 0x0436, 0x0437,
+	0x0438, 0x0438, 0x043A, 0x043B, 0x043C, 0x043D, 0x043E, 0x043F,
+	0x0440, 0x0441, 0x0442, 0x0443, 0x0444, 0x0445, 0x0446, 0x0447,
+	0x0448, 0x0449, 0x044A, 0x044B, 0x044C, 0x044D, 0x044E, 0x044F,
+	0x0435, 0x0435, 0x0452, 0x0433, 0x0454, 0x0455, 0x0456, 0x0456,
+	0x0458, 0x0459, 0x045A, 0x045B, 0x043A, 0x0438, 0x0443, 0x045F,
+	0x0461, 0x0461, 0x0463, 0x0463, 0x0465, 0x0465, 0x0467, 0x0467,
+	0x0469, 0x0469, 0x046B, 0x046B, 0x046D, 0x046D, 0x046F, 0x046F,
+	0x0471, 0x0471, 0x0473, 0x0473, 0x0475, 0x0475, 0x0475, 0x0475,
+	0x0479, 0x0479, 0x047B, 0x047B, 0x047D, 0x047D, 0x047F, 0x047F,
+	0x0481, 0x0481, 0x0000, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF,
+	0xFFFF, 0xFFFF, 0x048B, 0x048B, 0x048D, 0x048D, 0x048F, 0x048F,
+	0x0491, 0x0491, 0x0493, 0x0493, 0x0495, 0x0495, 0x0497, 0x0497,
+	0x0499, 0x0499, 0x049B, 0x049B, 0x049D, 0x049D, 0x049F, 0x049F,
+	0x04A1, 0x04A1, 0x04A3, 0x04A3, 0x04A5, 0x04A5, 0x04A7, 0x04A7,
+	0x04A9, 0x04A9, 0x04AB, 0x04AB, 0x04AD, 0x04AD, 0x04AF, 0x04AF,
+	0x04B1, 0x04B1, 0x04B3, 0x04B3, 0x04B5, 0x04B5, 0x04B7, 0x04B7,
+	0x04B9, 0x04B9, 0x04BB, 0x04BB, 0x04BD, 0x04BD, 0x04BF, 0x04BF,
+	0x04CF, 0x0436, 0x0436, 0x04C4, 0x04C4, 0x04C6, 0x04C6, 0x04C8,
+	0x04C8, 0x04CA, 0x04CA, 0x04CC, 0x04CC, 0x04CE, 0x04CE, 0x04CF,
+	0x0430, 0x0430, 0x0430, 0x0430, 0x04D5, 0x04D5, 0x0435, 0x0435,
+	0x04D9, 0x04D9, 0x04D9, 0x04D9, 0x0436, 0x0436, 0x0437, 0x0437,
+	0x04E1, 0x04E1, 0x0438, 0x0438, 0x0438, 0x0438, 0x043E, 0x043E,
+	0x04E9, 0x04E9, 0x04E9, 0x04E9, 0x044D, 0x044D, 0x0443, 0x0443,
+	0x0443, 0x0443, 0x0443, 0x0443, 0x0447, 0x0447, 0x04F7, 0x04F7,
+	0x044B, 0x044B, 0x04FB, 0x04FB, 0x04FD, 0x04FD, 0x04FF, 0x04FF,
+	0x0501, 0x0501, 0x0503, 0x0503, 0x0505, 0x0505, 0x0507, 0x0507,
+	0x0509, 0x0509, 0x050B, 0x050B, 0x050D, 0x050D, 0x050F, 0x050F,
+	0x0511, 0x0511, 0x0513, 0x0513, 0x0515, 0x0515, 0x0517, 0x0517,
+	0x0519, 0x0519, 0x051B, 0x051B, 0x051D, 0x051D, 0x051F, 0x051F,
+	0x0521, 0x0521, 0x0523, 0x0523, 0x0525, 0x0525, 0x0527, 0x0527,
+	0x0529, 0x0529, 0x052B, 0x052B, 0x052D, 0x052D, 0x052F, 0x052F,
+	0x0000, 0x0561, 0x0562, 0x0563, 0x0564, 0x0565, 0x0566, 0x0567,
+	0x0568, 0x0569, 0x056A, 0x056B, 0x056C, 0x056D, 0x056E, 0x056F,
+	0x0570, 0x0571, 0x0572, 0x0573, 0x0574, 0x0575, 0x0576, 0x0577,
+	0x0578, 0x0579, 0x057A, 0x057B, 0x057C, 0x057D, 0x057E, 0x057F,
+	0x0580, 0x0581, 0x0582, 0x0583, 0x0584, 0x0585, 0x0586, 0x0000,
+	0x0000, 0x0559, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+	0x0560, 0x0561, 0x0562, 0x0563, 0x0564, 0x0565, 0x0566, 0x0567,
+	0x0568, 0x0569, 0x056A, 0x056B, 0x056C, 0x056D, 0x056E, 0x056F,
+	0x0570, 0x0571, 0x0572, 0x0573, 0x0574, 0x0575, 0x0576, 0x0577,
+	0x0578, 0x0579, 0x057A, 0x057B, 0x057C, 0x057D, 0x057E, 0x057F,
+	0x0580, 0x0581, 0x0582, 0x0583, 0x0584, 0x0585, 0x0586, 0x0587,
+	0x0588, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+};
+
+// U+1E00 to U+1EFF
+static const uint16_t ndb_fold_latin_extended[] = {
+	0x0061, 0x0061, 0x0062, 0x0062, 0x0062, 0x0062, 0x0062, 0x0062,
+	0x0063, 0x0063, 0x0064, 0x0064, 0x0064, 0x0064, 0x0064, 0x0064,
+	0x0064, 0x0064, 0x0064, 0x0064, 0x0065, 0x0065, 0x0065, 0x0065,
+	0x0065, 0x0065, 0x0065, 0x0065, 0x0065, 0x0065, 0x0066, 0x0066,
+	0x0067, 0x0067, 0x0068, 0x0068, 0x0068, 0x0068, 0x0068, 0x0068,
+	0x0068, 0x0068, 0x0068, 0x0068, 0x0069, 0x0069, 0x0069, 0x0069,
+	0x006B, 0x006B, 0x006B, 0x006B, 0x006B, 0x006B, 0x006C, 0x006C,
+	0x006C, 0x006C, 0x006C, 0x006C, 0x006C, 0x006C, 0x006D, 0x006D,
+	0x006D, 0x006D, 0x006D, 0x006D, 0x006E, 0x006E, 0x006E, 0x006E,
+	0x006E, 0x006E, 0x006E, 0x006E, 0x006F, 0x006F, 0x006F, 0x006F,
+	0x006F, 0x006F, 0x006F, 0x006F, 0x0070, 0x0070, 0x0070, 0x0070,
+	0x0072, 0x0072, 0x0072, 0x0072, 0x0072, 0x0072, 0x0072, 0x0072,
+	0x0073, 0x0073, 0x0073, 0x0073, 0x0073, 0x0073, 0x0073, 0x0073,
+	0x0073, 0x0073, 0x0074, 0x0074, 0x0074, 0x0074, 0x0074, 0x0074,
+	0x0074, 0x0074, 0x0075, 0x0075, 0x0075, 0x0075, 0x0075, 0x0075,
+	0x0075, 0x0075, 0x0075, 0x0075, 0x0076, 0x0076, 0x0076, 0x0076,
+	0x0077, 0x0077, 0x0077, 0x0077, 0x0077, 0x0077, 0x0077, 0x0077,
+	0x0077, 0x0077, 0x0078, 0x0078, 0x0078, 0x0078, 0x0079, 0x0079,
+	0x007A, 0x007A, 0x007A, 0x007A, 0x007A, 0x007A, 0x0068, 0x0074,
+	0x0077, 0x0079, 0x1E9A, 0x0073, 0x1E9C, 0x1E9D, 0x00DF, 0x1E9F,
+	0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x0061,
+	0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x0061,
+	0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x0061, 0x0061,
+	0x0065, 0x0065, 0x0065, 0x0065, 0x0065, 0x0065, 0x0065, 0x0065,
+	0x0065, 0x0065, 0x0065, 0x0065, 0x0065, 0x0065, 0x0065, 0x0065,
+	0x0069, 0x0069, 0x0069, 0x0069, 0x006F, 0x006F, 0x006F, 0x006F,
+	0x006F, 0x006F, 0x006F, 0x006F, 0x006F, 0x006F, 0x006F, 0x006F,
+	0x006F, 0x006F, 0x006F, 0x006F, 0x006F, 0x006F, 0x006F, 0x006F,
+	0x006F, 0x006F, 0x006F, 0x006F, 0x0075, 0x0075, 0x0075, 0x0075,
+	0x0075, 0x0075, 0x0075, 0x0075, 0x0075, 0x0075, 0x0075, 0x0075,
+	0x0075, 0x0075, 0x0079, 0x0079, 0x0079, 0x0079, 0x0079, 0x0079,
+	0x0079, 0x0079, 0x1EFB, 0x1EFB, 0x1EFD, 0x1EFD, 0x1EFF, 0x1EFF,
+};
+
+struct ndb_fold_block {
+	uint32_t start, end;
+	const uint16_t *map;
+};
+
+static const struct ndb_fold_block ndb_fold_blocks[] = {
+	{ 0x00C0, 0x024F, ndb_fold_latin },
+	{ 0x0370, 0x058F, ndb_fold_greek_cyrillic },
+	{ 0x1E00, 0x1EFF, ndb_fold_latin_extended },
+};
+
+// Decode one character, returning how many bytes it took. Invalid
+// sequences come back as U+FFFD one byte at a time.
+static inline int ndb_utf8_decode(const unsigned char *p,
+				  const unsigned char *end, uint32_t *cp)
+{
+	int i, len;
+	uint32_t c;
+
+	c = p[0];
+	if (c < 0x80) {
+		*cp = c;
+		return 1;
+	} else if ((c & 0xE0) == 0xC0) {
+		len = 2;
+		c &= 0x1F;
+	} else if ((c & 0xF0) == 0xE0) {
+		len = 3;
+		c &= 0x0F;
+	} else if ((c & 0xF8) == 0xF0) {
+		len = 4;
+		c &= 0x07;
+	} else {
+		*cp = 0xFFFD;
+		return 1;
+	}
+
+	if (end - p < len) {
+		*cp = 0xFFFD;
+		return 1;
+	}
+
+	for (i = 1; i < len; i++) {
+		if ((p[i] & 0xC0) != 0x80) {
+			*cp = 0xFFFD;
+			return 1;
+		}
+		c = (c << 6) | (p[i] & 0x3F);
+	}
+
+	// overlong or out of range
+	if ((len == 2 && c < 0x80) || (len == 3 && c < 0x800) ||
+	    (len == 4 && (c < 0x10000 || c > 0x10FFFF))) {
+		*cp = 0xFFFD;
+		return 1;
+	}
+
+	*cp = c;
+	return len;
+}
+
+static inline int ndb_utf8_encode(uint32_t cp, unsigned char *out)
+{
+	if (cp < 0x80) {
+		out[0] = cp;
+		return 1;
+	} else if (cp < 0x800) {
+		out[0] = 0xC0 | (cp >> 6);
+		out[1] = 0x80 | (cp & 0x3F);
+		return 2;
+	} else if (cp < 0x10000) {
+		out[0] = 0xE0 | (cp >> 12);
+		out[1] = 0x80 | ((cp >> 6) & 0x3F);
+		out[2] = 0x80 | (cp & 0x3F);
+		return 3;
+	}
+
+	out[0] = 0xF0 | (cp >> 18);
+	out[1] = 0x80 | ((cp >> 12) & 0x3F);
+	out[2] = 0x80 | ((cp >> 6) & 0x3F);
+	out[3] = 0x80 | (cp & 0x3F);
+	return 4;
+}
+
+// the length of a character from its first byte
+static inline int ndb_utf8_char_len(const char *s)
+{
+	unsigned char c = *s;
+
+	if (c < 0x80)
+		return 1;
+	else if ((c & 0xE0) == 0xC0)
+		return 2;
+	else if ((c & 0xF0) == 0xE0)
+		return 3;
+	return 4;
+}
+
+// the length of the longest prefix of s that doesn't split a character
+static inline int ndb_utf8_truncate(const char *s, int len, int max)
+{
+	if (len <= max)
+		return len;
+
+	while (max > 0 && (s[max] & 0xC0) == 0x80)
+		max--;
+
+	return max;
+}
+
+// Classify a character, and fold it to what we search for. Folding never
+// makes a character take more bytes.
+static inline enum ndb_char_class ndb_fold_char(uint32_t *cp)
+{
+	const struct ndb_fold_block *block;
+	int lo, hi, mid;
+	uint32_t c = *cp;
+	unsigned int i;
+
+	if (c < 0x80) {
+		if (!(*cp = ndb_ascii_fold[c]))
+			return NDB_CHAR_SEP;
+		return NDB_CHAR_WORD;
+	}
+
+	// fullwidth ascii
+	if (c >= 0xFF01 && c <= 0xFF5E) {
+		*cp = c - 0xFEE0;
+		return ndb_fold_char(cp);
+	}
+
+	for (i = 0; i < sizeof(ndb_fold_blocks) / sizeof(ndb_fold_blocks[0]); i++) {
+		block = &ndb_fold_blocks[i];
+		if (c < block->start || c > block->end)
+			continue;
+
+		switch ((*cp = block->map[c - block->start])) {
+		case 0:
+			return NDB_CHAR_SEP;
+		case 0xFFFF:
+			return NDB_CHAR_IGNORE;
+		default:
+			return NDB_CHAR_WORD;
+		}
+	}
+
+	lo = 0;
+	hi = sizeof(ndb_char_ranges) / sizeof(ndb_char_ranges[0]) - 1;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (c < ndb_char_ranges[mid].start)
+			hi = mid - 1;
+		else if (c > ndb_char_ranges[mid].end)
+			lo = mid + 1;
+		else
+			return ndb_char_ranges[mid].cls;
+	}
+
+	return NDB_CHAR_WORD;
+}
+
+#endif // NDB_UNICODE_H
@@ -5,6 +5,7 @@
 #include "bolt11/bolt11.h"
 #include "bolt11/amount.h"
 #include "protected_queue.h"
+#include "lmdb.h"
 #include "memchr.h"
 #include "print_util.h"
 #include "bindings/c/profile_reader.h"
@@ -15,6 +16,8 @@
 #include <stdio.h>
 #include <assert.h>
 #include <unistd.h>
+#include <poll.h>
+#include <time.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
 
@@ -633,15 +636,1882 @@ static void test_fetch_last_noteid()
 	printf("note_key %" PRIu64 "\n", key);
 
 	struct ndb_note *n = ndb_get_note_by_key(&txn, key, NULL);
+	assert(memcmp(profile_note_id, ndb_note_id(n), 32) == 0);
+
+	// batch lookups should agree with the single ones, misses included
+	struct ndb_lookup_result lookups[3];
+	unsigned char ids[3][32];
+	memcpy(ids[0], profile_note_id, 32);
+	memset(ids[1], 0, 32);
+	memcpy(ids[2], id, 32);
+
+	assert(ndb_get_notes_by_ids(&txn, ids[0], 3, lookups) == 2);
+	assert(lookups[0].data == n && lookups[0].key == key);
+	assert(lookups[1].data == NULL);
+	assert(lookups[2].data == note);
+
+	assert(ndb_get_profiles_by_pubkeys(&txn, pk, 1, lookups) == 1);
+	assert(lookups[0].data == root);
+
+	// nothing to look up isn't an error
+	assert(ndb_get_notes_by_ids(&txn, ids[0], 0, lookups) == 0);
+	assert(ndb_get_profiles_by_pubkeys(&txn, ids[1], 1, lookups) == 0);
+	assert(lookups[0].data == NULL);
+	ndb_end_query(&txn);
+
+	//fwrite(profile, len, 1, stdout);
+
+	ndb_destroy(ndb);
+
+	free(json);
+	free(buf);
+}
+
+// Ingest a made up note. The id and pubkey are numbers padded out to 64
+// hex characters, and tags is the inside of the tags array.
+static void ingest_test_event_from(struct ndb *ndb, const char *relay,
+				   int id, int pubkey, int created_at, int kind,
+				   const char *tags, const char *content)
+{
+	struct ndb_ingest_meta meta;
+	char json[1024];
+	int len;
+
+	len = snprintf(json, sizeof(json), "[\"EVENT\",\"s\",{\"id\":\"%064x\",\"pubkey\":\"%064x\",\"created_at\":%d,\"kind\":%d,\"tags\":[%s],\"content\":\"%s\",\"sig\":\"%0128x\"}]", id, pubkey, created_at, kind, tags, content, 0);
+	ndb_ingest_meta_init(&meta, 0, relay);
+	assert(ndb_process_event_with(ndb, json, len, &meta));
+}
+
+static void ingest_test_event(struct ndb *ndb, int id, int pubkey,
+			      int created_at, int kind, const char *tags, const char *content)
+{
+	ingest_test_event_from(ndb, NULL, id, pubkey, created_at, kind, tags,
+			       content);
+}
+
+static void test_query_iter_pagination()
+{
+	static const int alloc_size = 1024 * 1024;
+	static struct ndb_query_result all[512], paged[512];
+	char *json = malloc(alloc_size);
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_filter filter, *f = &filter;
+	struct ndb_query_iter *iter;
+	struct ndb_query_token token;
+	struct ndb_query_result res;
+	struct ndb_config config;
+	int written, count, npaged = 0, got, i;
+	ndb_default_config(&config);
+
+	assert(ndb_init(&ndb, test_dir, &config));
+
+	read_file("testdata/random.json", (unsigned char*)json, alloc_size, &written);
+	assert(ndb_process_events(ndb, json, written));
+
+	ndb_destroy(ndb);
+	assert(ndb_init(&ndb, test_dir, &config));
+
+	ndb_filter_init(f);
+	ndb_filter_start_field(f, NDB_FILTER_KINDS);
+	ndb_filter_add_int_element(f, 1);
+	ndb_filter_end_field(f);
+	ndb_filter_end(f);
+
+	assert(ndb_begin_query(ndb, &txn));
+	assert(ndb_query(&txn, f, 1, all, ARRAY_SIZE(all), &count));
+	ndb_end_query(&txn);
+	assert(count > 0);
+
+	// page through the same query 7 results at a time, in a new
+	// transaction each time
+	do {
+		assert(ndb_begin_query(ndb, &txn));
+		assert(ndb_query_iter_begin(&txn, f, 1, npaged ? &token : NULL, &iter));
+		for (got = 0; got < 7 && ndb_query_iter_next(iter, &res); got++)
+			paged[npaged++] = res;
+		ndb_query_iter_token(iter, &token);
+		ndb_query_iter_end(iter);
+		ndb_end_query(&txn);
+	} while (got == 7);
+
+	assert(npaged == count);
+	for (i = 0; i < count; i++)
+		assert(paged[i].note_id == all[i].note_id);
+
+	ndb_filter_destroy(f);
+	ndb_destroy(ndb);
+	free(json);
+}
+
+// Plans that aren't streamed off of an index are run in chunks, so neither
+// big queries nor iterators stop at the chunk size
+static void test_query_materialized_paging()
+{
+	static struct ndb_query_result all[9100];
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_config config;
+	struct ndb_filter filter, *f = &filter;
+	struct ndb_query_iter *iter;
+	struct ndb_query_token token;
+	struct ndb_query_result res;
+	int i, count, npaged = 0, got;
+	const int n = 9000, t = 1500000000;
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	for (i = 0; i < n; i++)
+		ingest_test_event(ndb, 0x50000 + i, 1, t + i, 1, "", "");
+	ndb_destroy(ndb);
+
+	// just a time range uses the created plan
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_SINCE));
+	assert(ndb_filter_add_int_element(f, t));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_start_field(f, NDB_FILTER_UNTIL));
+	assert(ndb_filter_add_int_element(f, t + n));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	assert(ndb_begin_query(ndb, &txn));
+	assert(ndb_query(&txn, f, 1, all, ARRAY_SIZE(all), &count));
+	assert(count == n);
+	for (i = 0; i < count; i++)
+		assert(ndb_note_created_at(all[i].note) == (uint32_t)(t + n - 1 - i));
+
+	do {
+		assert(ndb_query_iter_begin(&txn, f, 1, npaged ? &token : NULL, &iter));
+		for (got = 0; got < 4000 && ndb_query_iter_next(iter, &res); got++)
+			assert(res.note_id == all[npaged++].note_id);
+		ndb_query_iter_token(iter, &token);
+		ndb_query_iter_end(iter);
+	} while (got == 4000);
+	assert(npaged == n);
+
+	ndb_end_query(&txn);
+	ndb_filter_destroy(f);
+	ndb_destroy(ndb);
+}
+
+// Thread reconstruction from the reply graph index, mixing marked and
+// positional NIP-10 replies
+static void test_thread_query()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_config config;
+	struct ndb_thread_result results[16];
+	unsigned char root[32];
+	char tags[512];
+	int count;
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+
+	assert(ndb_init(&ndb, test_dir, &config));
+
+	//  1
+	//  ├─ 3 (105)
+	//  │  └─ 6
+	//  └─ 2 (110)
+	//     └─ 4
+	//        └─ 5 (positional)
+	ingest_test_event(ndb, 1, 1, 100, 1, "", "");
+	snprintf(tags, sizeof(tags), "[\"e\",\"%064x\",\"\",\"root\"]", 1);
+	ingest_test_event(ndb, 2, 1, 110, 1, tags, "");
+	ingest_test_event(ndb, 3, 1, 105, 1, tags, "");
+	snprintf(tags, sizeof(tags), "[\"e\",\"%064x\",\"\",\"root\"],[\"e\",\"%064x\",\"\",\"reply\"]", 1, 2);
+	ingest_test_event(ndb, 4, 1, 120, 1, tags, "");
+	snprintf(tags, sizeof(tags), "[\"e\",\"%064x\"],[\"e\",\"%064x\"]", 1, 4);
+	ingest_test_event(ndb, 5, 1, 130, 1, tags, "");
+	snprintf(tags, sizeof(tags), "[\"e\",\"%064x\",\"\",\"reply\"],[\"e\",\"%064x\",\"\",\"root\"]", 3, 1);
+	ingest_test_event(ndb, 6, 1, 125, 1, tags, "");
+	ndb_destroy(ndb);
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	assert(ndb_begin_query(ndb, &txn));
+
+	memset(root, 0, 32);
+	root[31] = 1;
+	assert(ndb_thread_query(&txn, root, -1, 16, results, &count));
+	assert(count == 6);
+	assert(results[0].depth == 0 && ndb_note_id(results[0].note)[31] == 1);
+	assert(results[1].depth == 1 && ndb_note_id(results[1].note)[31] == 3);
+	assert(results[2].depth == 2 && ndb_note_id(results[2].note)[31] == 6);
+	assert(results[3].depth == 1 && ndb_note_id(results[3].note)[31] == 2);
+	assert(results[4].depth == 2 && ndb_note_id(results[4].note)[31] == 4);
+	assert(results[5].depth == 3 && ndb_note_id(results[5].note)[31] == 5);
+
+	// depth limit
+	assert(ndb_thread_query(&txn, root, 1, 16, results, &count));
+	assert(count == 3);
+
+	// subthreads are walked through direct replies
+	root[31] = 2;
+	assert(ndb_thread_query(&txn, root, -1, 16, results, &count));
+	assert(count == 3);
+	assert(ndb_note_id(results[2].note)[31] == 5);
+
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+}
+
+// Replaceable and addressable notes resolve to their latest version
+static void test_naddr_lookup()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_config config;
+	struct ndb_note *note;
+	struct ndb_lookup_result results[4];
+	struct bech32_naddr naddrs[4];
+	unsigned char pubkey[32];
+	int i;
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	ingest_test_event(ndb, 0xa1, 0xadd, 100, 30023, "[\"d\",\"article\"]", "");
+	ingest_test_event(ndb, 0xa2, 0xadd, 300, 30023, "[\"d\",\"article\"]", "");
+	ingest_test_event(ndb, 0xa3, 0xadd, 200, 30023, "[\"d\",\"article\"]", "");
+	ingest_test_event(ndb, 0xa4, 0xadd, 100, 30023, "[\"d\",\"other\"]", "");
+	ingest_test_event(ndb, 0xa5, 0xadd, 100, 10000, "[\"d\",\"ignored\"]", "");
+	ndb_destroy(ndb);
+
+	memset(pubkey, 0, 32);
+	pubkey[30] = 0x0a;
+	pubkey[31] = 0xdd;
+
+	memset(naddrs, 0, sizeof(naddrs));
+	for (i = 0; i < 4; i++) {
+		naddrs[i].pubkey = pubkey;
+		naddrs[i].kind = 30023;
+	}
+	naddrs[0].identifier.str = "article";
+	naddrs[0].identifier.len = 7;
+	naddrs[1].identifier.str = "other";
+	naddrs[1].identifier.len = 5;
+	naddrs[2].identifier.str = "missing";
+	naddrs[2].identifier.len = 7;
+	naddrs[3].kind = 10000;
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	assert(ndb_begin_query(ndb, &txn));
+
+	assert((note = ndb_get_note_by_naddr(&txn, &naddrs[0], NULL, NULL)));
+	assert(ndb_note_id(note)[31] == 0xa2);
+
+	assert(ndb_get_notes_by_naddrs(&txn, naddrs, 4, results) == 3);
+	assert(ndb_note_id(results[0].data)[31] == 0xa2);
+	assert(ndb_note_id(results[1].data)[31] == 0xa4);
+	assert(results[2].data == NULL);
+	assert(ndb_note_id(results[3].data)[31] == 0xa5);
+
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+}
+
+// Notification style #p + kinds filters are answered by the mention index
+static void test_mention_query()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_config config;
+	struct ndb_filter filter, *f = &filter;
+	struct ndb_query_profile profile;
+	struct ndb_query_result results[4];
+	unsigned char pubkey[32];
+	char tags[128];
+	int count;
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+
+	snprintf(tags, sizeof(tags), "[\"p\",\"%064x\"]", 0xbeef);
+	assert(ndb_init(&ndb, test_dir, &config));
+	ingest_test_event(ndb, 0xb1, 1, 100, 1, tags, "");
+	ingest_test_event(ndb, 0xb2, 1, 200, 7, tags, "");
+	ingest_test_event(ndb, 0xb3, 1, 300, 6, tags, "");
+	ndb_destroy(ndb);
+
+	memset(pubkey, 0, 32);
+	pubkey[30] = 0xbe;
+	pubkey[31] = 0xef;
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 1));
+	assert(ndb_filter_add_int_element(f, 7));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_start_tag_field(f, 'p'));
+	assert(ndb_filter_add_id_element(f, pubkey));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	assert(ndb_begin_query(ndb, &txn));
+
+	assert(ndb_query_explain(&txn, f, 1, &profile));
+	assert(!strcmp(profile.filters[0].plan, "mentions"));
+
+	assert(ndb_query(&txn, f, 1, results, 4, &count));
+	assert(count == 2);
+	assert(ndb_note_id(results[0].note)[31] == 0xb2);
+	assert(ndb_note_id(results[1].note)[31] == 0xb1);
+
+	assert(ndb_count(&txn, f, 1, &count));
+	assert(count == 2);
+
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+	ndb_filter_destroy(f);
+}
+
+// Explain reports the plan without running it, and profiled queries
+// count the work they did
+static void test_query_profile()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_config config;
+	struct ndb_filter filter, *f = &filter;
+	struct ndb_query_profile profile;
+	struct ndb_query_result results[4];
+	unsigned char pubkey[32];
+	int count;
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	ingest_test_event(ndb, 0x301, 0x7a, 100, 1, "", "");
+	ingest_test_event(ndb, 0x302, 0x7a, 200, 1, "", "");
+	ingest_test_event(ndb, 0x303, 0x7a, 300, 7, "", "");
+	ingest_test_event(ndb, 0x304, 0x7b, 400, 1, "", "");
+	ndb_destroy(ndb);
+
+	memset(pubkey, 0, 32);
+	pubkey[31] = 0x7a;
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_AUTHORS));
+	assert(ndb_filter_add_id_element(f, pubkey));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 1));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	assert(ndb_begin_query(ndb, &txn));
+
+	// explain doesn't touch any rows
+	assert(ndb_query_explain(&txn, f, 1, &profile));
+	assert(profile.num_filters == 1);
+	assert(!strcmp(profile.filters[0].plan, "author_kinds"));
+	assert(profile.filters[0].num_indices >= 1);
+	assert(profile.filters[0].rows_scanned == 0);
+	assert(profile.filters[0].notes_fetched == 0);
+
+	assert(ndb_query_with_profile(&txn, f, 1, results, 4, &count, &profile));
+	assert(count == 2);
+	assert(profile.num_filters == 1);
+	assert(!strcmp(profile.filters[0].plan, "author_kinds"));
+	assert(profile.filters[0].results == 2);
+	assert(profile.filters[0].rows_scanned >= 2);
+	assert(profile.filters[0].notes_fetched >= 2);
+	assert(profile.elapsed_ns > 0);
+
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+	ndb_filter_destroy(f);
+}
+
+// An author and a tag are two index streams, leapfrogged to the notes in
+// both of them
+static void test_intersect_query()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_config config;
+	struct ndb_filter filter, *f = &filter;
+	struct ndb_query_profile profile;
+	struct ndb_query_result results[4];
+	unsigned char pubkey[32];
+	const char *tag = "[\"t\",\"leapfrog\"]";
+	int count;
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	ingest_test_event(ndb, 0x311, 0x7c, 501, 1, tag, "");
+	ingest_test_event(ndb, 0x312, 0x7c, 502, 1, "", "");
+	ingest_test_event(ndb, 0x313, 0x7c, 503, 1, tag, "");
+	ingest_test_event(ndb, 0x314, 0x7d, 504, 1, tag, "");
+	ingest_test_event(ndb, 0x315, 0x7c, 505, 7, tag, "");
+	ndb_destroy(ndb);
+
+	memset(pubkey, 0, 32);
+	pubkey[31] = 0x7c;
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_AUTHORS));
+	assert(ndb_filter_add_id_element(f, pubkey));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_start_tag_field(f, 't'));
+	assert(ndb_filter_add_str_element(f, "leapfrog"));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	assert(ndb_begin_query(ndb, &txn));
+
+	assert(ndb_query_with_profile(&txn, f, 1, results, 4, &count, &profile));
+	assert(!strcmp(profile.filters[0].plan, "intersect"));
+	assert(profile.filters[0].num_indices == 2);
+	assert(count == 3);
+	assert(ndb_note_created_at(results[0].note) == 505);
+	assert(ndb_note_created_at(results[1].note) == 503);
+	assert(ndb_note_created_at(results[2].note) == 501);
+
+	// only notes in both streams are fetched
+	assert(profile.filters[0].notes_fetched == 3);
+
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+	ndb_filter_destroy(f);
+}
+
+// Overlapping filters are merged newest-first, each note shows up once, and
+// the capacity is a limit on the merged results
+static void test_multi_filter_query()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_config config;
+	struct ndb_filter filters[2], *f;
+	struct ndb_query_result results[10];
+	unsigned char pubkey[32];
+	int i, count;
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	for (i = 0; i < 6; i++) {
+		ingest_test_event(ndb, 0x321 + i, 0x7e, 601 + i,
+				  i % 2 == 0 ? 1 : 7, "", "");
+	}
+	ndb_destroy(ndb);
+
+	memset(pubkey, 0, 32);
+	pubkey[31] = 0x7e;
+
+	// the kind 1 notes, and then all of them
+	f = &filters[0];
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_AUTHORS));
+	assert(ndb_filter_add_id_element(f, pubkey));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 1));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+
+	f = &filters[1];
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_AUTHORS));
+	assert(ndb_filter_add_id_element(f, pubkey));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	assert(ndb_begin_query(ndb, &txn));
+
+	assert(ndb_query(&txn, filters, 2, results, 10, &count));
+	assert(count == 6);
+	for (i = 0; i < count; i++)
+		assert(ndb_note_created_at(results[i].note) == 606 - i);
+
+	// the first filter doesn't get to use up the capacity
+	assert(ndb_query(&txn, filters, 2, results, 2, &count));
+	assert(count == 2);
+	assert(ndb_note_created_at(results[0].note) == 606);
+	assert(ndb_note_created_at(results[1].note) == 605);
+
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+	ndb_filter_destroy(&filters[0]);
+	ndb_filter_destroy(&filters[1]);
+}
+
+// Key-only queries return the same rows as ndb_query, and don't fault in
+// notes when the index covers the filter
+static void test_query_keys()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_config config;
+	struct ndb_filter filter, *f = &filter;
+	struct ndb_query_result results[8];
+	struct ndb_query_key keys[8], key;
+	struct ndb_query_profile profile;
+	struct ndb_query_iter *iter;
+	unsigned char pubkey[32];
+	int i, count, nkeys;
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	for (i = 0; i < 5; i++) {
+		ingest_test_event(ndb, 0x331 + i, 0x7f, 611 + i,
+				  i % 2 == 0 ? 1 : 7, "", "");
+	}
+	ndb_destroy(ndb);
+
+	memset(pubkey, 0, 32);
+	pubkey[31] = 0x7f;
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_AUTHORS));
+	assert(ndb_filter_add_id_element(f, pubkey));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 1));
+	assert(ndb_filter_add_int_element(f, 7));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	assert(ndb_begin_query(ndb, &txn));
+
+	assert(ndb_query(&txn, f, 1, results, 8, &count));
+	assert(ndb_query_keys(&txn, f, 1, keys, 8, &nkeys, NULL));
+	assert(count == 5);
+	assert(nkeys == count);
+	for (i = 0; i < count; i++) {
+		assert(keys[i].note_key == results[i].note_id);
+		assert(keys[i].created_at == ndb_note_created_at(results[i].note));
+		assert(keys[i].kind == ndb_note_kind(results[i].note));
+	}
+
+	assert(ndb_query_iter_begin_with(&txn, f, 1, NULL,
+					 NDB_QUERY_KEYS_ONLY, &iter));
+	for (i = 0; ndb_query_iter_next_key(iter, &key); i++) {
+		assert(i < count);
+		assert(key.note_key == keys[i].note_key);
+		assert(key.created_at == keys[i].created_at);
+		assert(key.kind == keys[i].kind);
+	}
+	assert(i == count);
+	ndb_query_iter_end(iter);
+
+	// the author/kind index proves the filter, so the note never
+	// gets looked up
+	assert(ndb_query_keys(&txn, f, 1, keys, 8, &nkeys, &profile));
+	assert(nkeys == count);
+	assert(profile.filters[0].streamed);
+	assert(profile.filters[0].results == (uint64_t)count);
+	assert(profile.filters[0].notes_fetched == 0);
+
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+	ndb_filter_destroy(f);
+}
+
+// Content hashtags are indexed and counted along with t tags
+static void test_hashtag_index()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_config config;
+	struct ndb_filter filter, *f = &filter;
+	struct ndb_query_result results[4];
+	struct ndb_hashtag_count counts[4];
+	int count;
+
+	// a bucket of our own, away from the other tests
+	const int t = 2000000000;
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	ingest_test_event(ndb, 0xc1, 1, t, 1, "", "gm #Plebchain");
+	ingest_test_event(ndb, 0xc2, 1, t + 1, 1, "[\"t\",\"plebchain\"]", "#plebchain #coffee");
+	ingest_test_event(ndb, 0xc3, 1, t + 2, 1, "", "https://example.com/#coffee");
+	ndb_destroy(ndb);
+
+	// hashtags are matched regardless of case
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_tag_field(f, 't'));
+	assert(ndb_filter_add_str_element(f, "PlebChain"));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	assert(ndb_begin_query(ndb, &txn));
+
+	assert(ndb_query(&txn, f, 1, results, 4, &count));
+	assert(count == 2);
+	assert(ndb_note_id(results[0].note)[31] == 0xc2);
+	assert(ndb_note_id(results[1].note)[31] == 0xc1);
+	assert(ndb_filter_matches(f, results[0].note));
+	assert(ndb_filter_matches(f, results[1].note));
+
+	assert(ndb_trending_hashtags(&txn, t, t + 3, counts, 4, &count));
+	assert(count == 2);
+	assert(!strcmp(counts[0].hashtag, "plebchain") && counts[0].count == 2);
+	assert(!strcmp(counts[1].hashtag, "coffee") && counts[1].count == 1);
+
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+	ndb_filter_destroy(f);
+}
+
+// Is the profile with this pubkey among the search results for `query`,
+// whose search keys start with `folded`?
+static int profile_search_finds(struct ndb_txn *txn, const char *query,
+				const char *folded, int pubkey)
+{
+	struct ndb_search search;
+	unsigned char pk[32] = {0};
+	int found = 0, len = strlen(folded);
+
+	pk[30] = pubkey >> 8;
+	pk[31] = pubkey & 0xFF;
+
+	if (!ndb_search_profile(txn, &search, query))
+		return 0;
+
+	do {
+		if (strncmp(search.key->search, folded, len))
+			break;
+		found = !memcmp(search.key->id, pk, 32);
+	} while (!found && ndb_search_profile_next(&search));
+
+	ndb_search_profile_end(&search);
+	return found;
+}
+
+// Profile names are folded for searching, so case, accents and fullwidth
+// forms don't matter in any script
+static void test_unicode_profile_search()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_config config;
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	ingest_test_event(ndb, 0x363, 0x363, 2001200000, 0, "", "{\\\"name\\\":\\\"Zoëthilde\\\"}");
+	ingest_test_event(ndb, 0x364, 0x364, 2001200000, 0, "", "{\\\"name\\\":\\\"Людмилавна\\\"}");
+	ingest_test_event(ndb, 0x365, 0x365, 2001200000, 0, "", "{\\\"name\\\":\\\"ｔａｋｅｓｈｉｍｏｔｏ\\\"}");
+	ndb_destroy(ndb);
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	assert(ndb_begin_query(ndb, &txn));
+
+	assert(profile_search_finds(&txn, "zoethil", "zoethilde", 0x363));
+	assert(profile_search_finds(&txn, "ZOËTH", "zoethilde", 0x363));
+	assert(profile_search_finds(&txn, "ЛЮДМИЛ", "людмилавна", 0x364));
+	assert(profile_search_finds(&txn, "людм", "людмилавна", 0x364));
+	assert(profile_search_finds(&txn, "Takeshi", "takeshimoto", 0x365));
+	assert(profile_search_finds(&txn, "ＴＡＫＥ", "takeshimoto", 0x365));
+	assert(!profile_search_finds(&txn, "takeshx", "takeshimoto", 0x365));
+
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+}
+
+// Pretend the db at `dir` is an older version, so the next ndb_init
+// migrates it
+static void set_db_version(const char *dir, uint64_t version)
+{
+	MDB_env *env;
+	MDB_txn *txn;
+	MDB_dbi meta;
+	MDB_val k, v;
+	uint64_t key = 1; // NDB_META_KEY_VERSION
+
+	assert(!mdb_env_create(&env));
+	assert(!mdb_env_set_maxdbs(env, 64));
+	assert(!mdb_env_open(env, dir, 0, 0664));
+	assert(!mdb_txn_begin(env, NULL, 0, &txn));
+	assert(!mdb_dbi_open(txn, "ndb_meta", MDB_INTEGERKEY, &meta));
+
+	k.mv_data = &key;
+	k.mv_size = sizeof(key);
+	v.mv_data = &version;
+	v.mv_size = sizeof(version);
+	assert(!mdb_put(txn, meta, &k, &v, 0));
+
+	assert(!mdb_txn_commit(txn));
+	mdb_env_close(env);
+}
+
+// Migrations rebuild their indices a batch of notes at a time after
+// ndb_init, and the db takes new notes while they do
+static void test_migrate_rebuild()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_config config;
+	struct ndb_filter filters[2];
+	struct ndb_hashtag_count counts[4];
+	unsigned char id[32] = {0};
+	uint64_t note_key;
+	int i, tagged, searched, num_counts;
+
+	// a bucket of our own, away from the other tests
+	const int t = 2000900000;
+	// more than one rebuild batch
+	const int num_notes = 1500;
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+	ndb_config_set_ingest_threads(&config, 1);
+
+	assert(ndb_filter_init(&filters[0]));
+	assert(ndb_filter_start_tag_field(&filters[0], 't'));
+	assert(ndb_filter_add_str_element(&filters[0], "glorpwave"));
+	ndb_filter_end_field(&filters[0]);
+	assert(ndb_filter_end(&filters[0]));
+
+	assert(ndb_filter_init(&filters[1]));
+	assert(ndb_filter_start_field(&filters[1], NDB_FILTER_SEARCH));
+	assert(ndb_filter_add_str_element(&filters[1], "frobnozzle"));
+	ndb_filter_end_field(&filters[1]);
+	assert(ndb_filter_end(&filters[1]));
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	for (i = 0; i < num_notes; i++) {
+		ingest_test_event(ndb, 0x70000 + i, 1, t + i, 1, "",
+				  "frobnozzle #glorpwave");
+	}
+
+	// notes come out of the writer in order with one ingester
+	id[29] = 0x07;
+	id[30] = ((0x70000 + num_notes - 1) >> 8) & 0xff;
+	id[31] = (0x70000 + num_notes - 1) & 0xff;
+	for (i = 0, note_key = 0; i < 1000 && !note_key; i++) {
+		assert(ndb_begin_query(ndb, &txn));
+		note_key = ndb_get_notekey_by_id(&txn, id);
+		ndb_end_query(&txn);
+		if (!note_key)
+			usleep(10000);
+	}
+	assert(note_key);
+	ndb_destroy(ndb);
+
+	// from before content hashtags were indexed
+	set_db_version(test_dir, 8);
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	ingest_test_event(ndb, 0x70000 + num_notes, 1, t + num_notes, 1, "",
+			  "frobnozzle #glorpwave");
+
+	for (i = 0; i < 1000; i++) {
+		assert(ndb_begin_query(ndb, &txn));
+		assert(ndb_count(&txn, &filters[0], 1, &tagged));
+		assert(ndb_count(&txn, &filters[1], 1, &searched));
+		assert(ndb_trending_hashtags(&txn, t, t + num_notes + 1,
+					     counts, 4, &num_counts));
+		ndb_end_query(&txn);
+
+		if (tagged == num_notes + 1 && searched == num_notes + 1 &&
+		    num_counts == 1 && counts[0].count == num_notes + 1)
+			break;
+		usleep(10000);
+	}
+
+	assert(tagged == num_notes + 1);
+	assert(searched == num_notes + 1);
+	assert(num_counts == 1);
+	assert(!strcmp(counts[0].hashtag, "glorpwave"));
+	assert(counts[0].count == num_notes + 1);
+
+	assert(ndb_begin_query(ndb, &txn));
+	assert(ndb_db_version(&txn) == 12);
+	ndb_end_query(&txn);
+
+	ndb_destroy(ndb);
+	ndb_filter_destroy(&filters[0]);
+	ndb_filter_destroy(&filters[1]);
+}
+
+// A subscription fd is readable exactly while notes are waiting
+static void test_subscription_fd()
+{
+	struct ndb *ndb;
+	struct ndb_config config;
+	struct ndb_filter filter, *f = &filter;
+	struct pollfd pfd;
+	uint64_t subid, note_ids[4];
+	int n, total;
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_SINCE));
+	assert(ndb_filter_add_int_element(f, 2000100000));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	assert((subid = ndb_subscribe(ndb, f, 1)));
+
+	pfd.fd = ndb_subscription_fd(ndb, subid);
+	pfd.events = POLLIN;
+	assert(pfd.fd != -1);
+	assert(poll(&pfd, 1, 0) == 0);
+
+	ingest_test_event(ndb, 0xd1, 1, 2000100000, 1, "", "one");
+	ingest_test_event(ndb, 0xd2, 1, 2000100001, 1, "", "two");
+	ingest_test_event(ndb, 0xd3, 1, 2000100002, 1, "", "three");
+
+	// they may land in separate commits
+	for (total = 0; total < 3; total += n) {
+		assert(poll(&pfd, 1, 10000) == 1);
+		n = ndb_poll_for_notes(ndb, subid, note_ids, 2);
+	}
+	assert(total == 3);
+
+	// a wakeup can race with a poll that already took its notes
+	if (poll(&pfd, 1, 0) == 1)
+		assert(ndb_poll_for_notes(ndb, subid, note_ids, 2) == 0);
+	assert(poll(&pfd, 1, 0) == 0);
+
+	assert(ndb_unsubscribe(ndb, subid));
+	ndb_destroy(ndb);
+	ndb_filter_destroy(f);
+}
+
+// The backfill and the live subscription meet without gaps or repeats
+static void test_subscribe_with_query()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_config config;
+	struct ndb_filter filter, *f = &filter;
+	struct ndb_query_result results[4];
+	uint64_t subid, note_ids[4];
+	int count;
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_SINCE));
+	assert(ndb_filter_add_int_element(f, 2000200000));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	ingest_test_event(ndb, 0xe1, 1, 2000200000, 1, "", "old");
+	ndb_destroy(ndb);
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	assert((subid = ndb_subscribe_with_query(ndb, &txn, f, 1, results, 4,
+						 &count)));
+	assert(count == 1);
+	assert(ndb_note_id(results[0].note)[31] == 0xe1);
+	ndb_end_query(&txn);
+
+	ingest_test_event(ndb, 0xe2, 1, 2000200001, 1, "", "new");
+
+	// only the note committed after the snapshot shows up
+	assert(ndb_wait_for_notes(ndb, subid, note_ids, 4) == 1);
+	assert(ndb_begin_query(ndb, &txn));
+	assert(ndb_note_id(ndb_get_note_by_key(&txn, note_ids[0], NULL))[31] == 0xe2);
+	ndb_end_query(&txn);
+
+	assert(ndb_unsubscribe(ndb, subid));
+	ndb_destroy(ndb);
+	ndb_filter_destroy(f);
+}
+
+struct blocking_callback {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int blocked;
+	int calls;
+};
+
+static void block_subscription_callback(void *ctx, uint64_t subid)
+{
+	struct blocking_callback *cb = ctx;
+
+	pthread_mutex_lock(&cb->lock);
+	cb->calls++;
+	pthread_cond_broadcast(&cb->cond);
+	while (cb->blocked)
+		pthread_cond_wait(&cb->cond, &cb->lock);
+	pthread_mutex_unlock(&cb->lock);
+}
+
+// Subscription callbacks run on the notifier thread, so a slow one doesn't
+// hold up the writer
+static void test_subscription_notifier()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_config config;
+	struct ndb_filter filter, *f = &filter;
+	struct blocking_callback cb;
+	unsigned char id[32] = {0};
+	uint64_t subid, note_ids[4], note_key;
+	int i, n, total;
+
+	pthread_mutex_init(&cb.lock, NULL);
+	pthread_cond_init(&cb.cond, NULL);
+	cb.blocked = 1;
+	cb.calls = 0;
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+	ndb_config_set_subscription_callback(&config,
+					     block_subscription_callback, &cb);
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_SINCE));
+	assert(ndb_filter_add_int_element(f, 2000200100));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	assert((subid = ndb_subscribe(ndb, f, 1)));
+
+	ingest_test_event(ndb, 0xe3, 1, 2000200100, 1, "", "first");
+
+	pthread_mutex_lock(&cb.lock);
+	while (cb.calls == 0)
+		pthread_cond_wait(&cb.cond, &cb.lock);
+	pthread_mutex_unlock(&cb.lock);
+
+	// the callback is stuck, but the writer keeps going
+	ingest_test_event(ndb, 0xe4, 1, 2000200101, 1, "", "second");
+	id[31] = 0xe4;
+	for (i = 0, note_key = 0; i < 1000 && !note_key; i++) {
+		assert(ndb_begin_query(ndb, &txn));
+		note_key = ndb_get_notekey_by_id(&txn, id);
+		ndb_end_query(&txn);
+		if (!note_key)
+			usleep(10000);
+	}
+	assert(note_key);
+
+	pthread_mutex_lock(&cb.lock);
+	cb.blocked = 0;
+	pthread_cond_broadcast(&cb.cond);
+	pthread_mutex_unlock(&cb.lock);
+
+	// they may come in one batch or two
+	for (total = 0, n = 0; total < 2; total += n)
+		n = ndb_wait_for_notes(ndb, subid, note_ids, 4);
+	assert(total == 2);
+	assert(note_ids[n - 1] == note_key);
+
+	assert(ndb_unsubscribe(ndb, subid));
+	ndb_destroy(ndb);
+	ndb_filter_destroy(f);
+	pthread_mutex_destroy(&cb.lock);
+	pthread_cond_destroy(&cb.cond);
+}
+
+// There's no cap on subscriptions, and unsubscribing frees the slot for
+// the next one without breaking lookups of the others
+static void test_many_subscriptions()
+{
+	static uint64_t subids[300];
+	struct ndb *ndb;
+	struct ndb_config config;
+	struct ndb_filter filter, *f = &filter;
+	uint64_t subid, note_ids[4], note_key = 0;
+	int i, j;
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_SINCE));
+	assert(ndb_filter_add_int_element(f, 2000500000));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+
+	assert(ndb_init(&ndb, test_dir, &config));
+
+	for (i = 0; i < 300; i++)
+		assert((subids[i] = ndb_subscribe(ndb, f, 1)));
+	assert(ndb_num_subscriptions(ndb) == 300);
+
+	for (i = 0; i < 300; i += 3)
+		assert(ndb_unsubscribe(ndb, subids[i]));
+	assert(ndb_num_subscriptions(ndb) == 200);
+	assert(!ndb_unsubscribe(ndb, subids[0]));
+
+	// take the freed slots, the old ids stay dead
+	for (i = 0; i < 300; i += 3) {
+		assert((subid = ndb_subscribe(ndb, f, 1)));
+		for (j = 0; j < 300; j++)
+			assert(subids[j] != subid);
+		subids[i] = subid;
+	}
+	assert(ndb_num_subscriptions(ndb) == 300);
+
+	ingest_test_event(ndb, 0x341, 1, 2000500000, 1, "", "");
+
+	// every subscription gets the note
+	for (i = 0; i < 300; i++) {
+		assert(ndb_wait_for_notes(ndb, subids[i], note_ids, 4) == 1);
+		if (note_key == 0)
+			note_key = note_ids[0];
+		assert(note_ids[0] == note_key);
+	}
+
+	for (i = 0; i < 300; i++)
+		assert(ndb_unsubscribe(ndb, subids[i]));
+	assert(ndb_num_subscriptions(ndb) == 0);
+
+	ndb_destroy(ndb);
+	ndb_filter_destroy(f);
+}
+
+// A subscription that doesn't keep up with the notification log finds out
+// that it lost notes once the log wraps around on it
+static void test_subscription_overflow()
+{
+	static uint64_t fillers[2046], note_ids[4096];
+	struct ndb *ndb;
+	struct ndb_config config;
+	struct ndb_filter filters[3];
+	uint64_t sentinel, slow, note_key, last;
+	int i, n, total;
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+	// the sentinel has to come out of the writer last
+	ndb_config_set_ingest_threads(&config, 1);
+
+	// the sentinel note, everything, and nothing
+	assert(ndb_filter_init(&filters[0]));
+	assert(ndb_filter_start_field(&filters[0], NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(&filters[0], 7));
+	ndb_filter_end_field(&filters[0]);
+	assert(ndb_filter_start_field(&filters[0], NDB_FILTER_SINCE));
+	assert(ndb_filter_add_int_element(&filters[0], 2000600000));
+	ndb_filter_end_field(&filters[0]);
+	assert(ndb_filter_end(&filters[0]));
+
+	assert(ndb_filter_init(&filters[1]));
+	assert(ndb_filter_start_field(&filters[1], NDB_FILTER_SINCE));
+	assert(ndb_filter_add_int_element(&filters[1], 2000600000));
+	ndb_filter_end_field(&filters[1]);
+	assert(ndb_filter_end(&filters[1]));
+
+	assert(ndb_filter_init(&filters[2]));
+	assert(ndb_filter_start_field(&filters[2], NDB_FILTER_SINCE));
+	assert(ndb_filter_add_int_element(&filters[2], 2100000000));
+	ndb_filter_end_field(&filters[2]);
+	assert(ndb_filter_end(&filters[2]));
+
+	assert(ndb_init(&ndb, test_dir, &config));
+
+	// put the slow subscription way out at bit 2047, so every note it
+	// matches takes up 32 words of the log's match bitmaps
+	assert((sentinel = ndb_subscribe(ndb, &filters[0], 1)));
+	for (i = 0; i < 2046; i++)
+		assert((fillers[i] = ndb_subscribe(ndb, &filters[2], 1)));
+	assert((slow = ndb_subscribe(ndb, &filters[1], 1)));
+	assert(!ndb_subscription_overflowed(ndb, slow));
+
+	for (i = 0; i < 4500; i++)
+		ingest_test_event(ndb, 0x60000 + i, 1, 2000600000 + i, 1, "", "");
+	ingest_test_event(ndb, 0x60000 + i, 1, 2000600000 + i, 7, "", "");
+
+	// once the sentinel is out, so is everything before it
+	assert(ndb_wait_for_notes(ndb, sentinel, note_ids, 4) == 1);
+	note_key = note_ids[0];
+
+	for (total = 0, last = 0;
+	     (n = ndb_poll_for_notes(ndb, slow, note_ids, 4096)); ) {
+		total += n;
+		last = note_ids[n - 1];
+	}
+
+	// the oldest notes were dropped, the newest are still there
+	assert(total > 0 && total < 4501);
+	assert(last == note_key);
+	assert(ndb_subscription_overflowed(ndb, slow));
+	assert(!ndb_subscription_overflowed(ndb, slow));
+
+	for (i = 0; i < 2046; i++)
+		assert(ndb_unsubscribe(ndb, fillers[i]));
+	assert(ndb_unsubscribe(ndb, sentinel));
+	assert(ndb_unsubscribe(ndb, slow));
+
+	ndb_destroy(ndb);
+	for (i = 0; i < 3; i++)
+		ndb_filter_destroy(&filters[i]);
+}
+
+struct delivery_callback {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint64_t subids[2];
+	int calls[2];
+	int blocked;
+};
+
+static void count_subscription_callback(void *ctx, uint64_t subid)
+{
+	struct delivery_callback *cb = ctx;
+	int i;
+
+	pthread_mutex_lock(&cb->lock);
+	for (i = 0; i < 2; i++) {
+		if (cb->subids[i] == subid)
+			cb->calls[i]++;
+	}
+	pthread_cond_broadcast(&cb->cond);
+	while (cb->blocked)
+		pthread_cond_wait(&cb->cond, &cb->lock);
+	pthread_mutex_unlock(&cb->lock);
+}
+
+static uint64_t monotonic_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+// Delivery policies hold wakeups back until enough notes are pending or
+// they've waited long enough, and count the wakeups they folded together
+static void test_delivery_policy()
+{
+	struct ndb *ndb;
+	struct ndb_config config;
+	struct ndb_filter filters[2];
+	struct ndb_delivery_policy batch = { 0, 3, 0 };
+	struct ndb_delivery_policy latency = { 0, 100, 50 };
+	struct delivery_callback cb;
+	uint64_t note_ids[4], start;
+	int i, n, total;
+
+	pthread_mutex_init(&cb.lock, NULL);
+	pthread_cond_init(&cb.cond, NULL);
+	memset(cb.calls, 0, sizeof(cb.calls));
+	cb.blocked = 0;
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+	ndb_config_set_subscription_callback(&config,
+					     count_subscription_callback, &cb);
+
+	for (i = 0; i < 2; i++) {
+		assert(ndb_filter_init(&filters[i]));
+		assert(ndb_filter_start_field(&filters[i], NDB_FILTER_KINDS));
+		assert(ndb_filter_add_int_element(&filters[i], i == 0 ? 1 : 7));
+		ndb_filter_end_field(&filters[i]);
+		assert(ndb_filter_start_field(&filters[i], NDB_FILTER_SINCE));
+		assert(ndb_filter_add_int_element(&filters[i], 2000700000));
+		ndb_filter_end_field(&filters[i]);
+		assert(ndb_filter_end(&filters[i]));
+	}
+
+	assert(ndb_init(&ndb, test_dir, &config));
+
+	pthread_mutex_lock(&cb.lock);
+	for (i = 0; i < 2; i++)
+		assert((cb.subids[i] = ndb_subscribe(ndb, &filters[i], 1)));
+	pthread_mutex_unlock(&cb.lock);
+
+	assert(ndb_subscription_set_delivery(ndb, cb.subids[0], &batch));
+	assert(ndb_subscription_set_delivery(ndb, cb.subids[1], &latency));
+	assert(!ndb_subscription_set_delivery(ndb, 0, &batch));
+
+	// one note isn't a batch yet
+	ingest_test_event(ndb, 0x351, 1, 2000700000, 1, "", "");
+	for (i = 0; i < 1000 && !ndb_subscription_coalesced(ndb, cb.subids[0]); i++)
+		usleep(1000);
+	assert(ndb_subscription_coalesced(ndb, cb.subids[0]) >= 1);
+	pthread_mutex_lock(&cb.lock);
+	assert(cb.calls[0] == 0);
+	pthread_mutex_unlock(&cb.lock);
+
+	ingest_test_event(ndb, 0x352, 1, 2000700001, 1, "", "");
+	ingest_test_event(ndb, 0x353, 1, 2000700002, 1, "", "");
+
+	pthread_mutex_lock(&cb.lock);
+	while (cb.calls[0] == 0)
+		pthread_cond_wait(&cb.cond, &cb.lock);
+	pthread_mutex_unlock(&cb.lock);
+
+	for (total = 0; (n = ndb_poll_for_notes(ndb, cb.subids[0], note_ids, 4)); )
+		total += n;
+	assert(total == 3);
+
+	// this batch never fills up, so it goes out after max_latency_ms
+	start = monotonic_ms();
+	ingest_test_event(ndb, 0x354, 1, 2000700003, 7, "", "");
+
+	pthread_mutex_lock(&cb.lock);
+	while (cb.calls[1] == 0)
+		pthread_cond_wait(&cb.cond, &cb.lock);
+	pthread_mutex_unlock(&cb.lock);
+
+	assert(monotonic_ms() - start >= 50);
+	assert(ndb_subscription_coalesced(ndb, cb.subids[1]) == 1);
+	assert(ndb_poll_for_notes(ndb, cb.subids[1], note_ids, 4) == 1);
+
+	for (i = 0; i < 2; i++)
+		assert(ndb_unsubscribe(ndb, cb.subids[i]));
+	ndb_destroy(ndb);
+	for (i = 0; i < 2; i++)
+		ndb_filter_destroy(&filters[i]);
+	pthread_mutex_destroy(&cb.lock);
+	pthread_cond_destroy(&cb.cond);
+}
+
+// Notes a subscribe_with_query snapshot already returned don't count
+// towards the delivery policy, even when the notifier sees them after
+// the subscription was made
+static void test_delivery_policy_snapshot()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_config config;
+	struct ndb_filter filters[2];
+	struct ndb_delivery_policy batch = { 0, 2, 0 };
+	struct ndb_query_result results[4];
+	struct delivery_callback cb;
+	unsigned char id[32] = {0};
+	uint64_t note_ids[4], note_key;
+	int i, n, total, count;
+
+	pthread_mutex_init(&cb.lock, NULL);
+	pthread_cond_init(&cb.cond, NULL);
+	memset(cb.calls, 0, sizeof(cb.calls));
+	cb.blocked = 1;
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+	ndb_config_set_subscription_callback(&config,
+					     count_subscription_callback, &cb);
+
+	for (i = 0; i < 2; i++) {
+		assert(ndb_filter_init(&filters[i]));
+		assert(ndb_filter_start_field(&filters[i], NDB_FILTER_KINDS));
+		assert(ndb_filter_add_int_element(&filters[i], 1));
+		if (i == 0)
+			assert(ndb_filter_add_int_element(&filters[i], 7));
+		ndb_filter_end_field(&filters[i]);
+		assert(ndb_filter_start_field(&filters[i], NDB_FILTER_SINCE));
+		assert(ndb_filter_add_int_element(&filters[i], 2001300000));
+		ndb_filter_end_field(&filters[i]);
+		assert(ndb_filter_end(&filters[i]));
+	}
+
+	assert(ndb_init(&ndb, test_dir, &config));
+
+	pthread_mutex_lock(&cb.lock);
+	assert((cb.subids[0] = ndb_subscribe(ndb, &filters[0], 1)));
+	pthread_mutex_unlock(&cb.lock);
+
+	// park the notifier in the first callback
+	ingest_test_event(ndb, 0x367, 1, 2001300000, 1, "", "");
+	pthread_mutex_lock(&cb.lock);
+	while (cb.calls[0] == 0)
+		pthread_cond_wait(&cb.cond, &cb.lock);
+	pthread_mutex_unlock(&cb.lock);
+
+	// committed, but the notifier hasn't got to it yet
+	ingest_test_event(ndb, 0x368, 1, 2001300001, 1, "", "");
+	id[30] = 0x03;
+	id[31] = 0x68;
+	for (i = 0, note_key = 0; i < 1000 && !note_key; i++) {
+		assert(ndb_begin_query(ndb, &txn));
+		note_key = ndb_get_notekey_by_id(&txn, id);
+		ndb_end_query(&txn);
+		if (!note_key)
+			usleep(10000);
+	}
+	assert(note_key);
+
+	pthread_mutex_lock(&cb.lock);
+	assert((cb.subids[1] = ndb_subscribe_with_query(ndb, &txn, &filters[1],
+						       1, results, 4, &count)));
+	pthread_mutex_unlock(&cb.lock);
+	assert(count == 2);
+	ndb_end_query(&txn);
+	assert(ndb_subscription_set_delivery(ndb, cb.subids[1], &batch));
+
+	pthread_mutex_lock(&cb.lock);
+	cb.blocked = 0;
+	pthread_cond_broadcast(&cb.cond);
+	pthread_mutex_unlock(&cb.lock);
+
+	// only this one is pending, so it isn't a batch yet
+	ingest_test_event(ndb, 0x369, 1, 2001300002, 1, "", "");
+	id[31] = 0x69;
+	for (i = 0, note_key = 0; i < 1000 && !note_key; i++) {
+		assert(ndb_begin_query(ndb, &txn));
+		note_key = ndb_get_notekey_by_id(&txn, id);
+		ndb_end_query(&txn);
+		if (!note_key)
+			usleep(10000);
+	}
+	assert(note_key);
+
+	// the notifier has finished with the others once this one shows up
+	ingest_test_event(ndb, 0x36a, 1, 2001300003, 7, "", "");
+	for (total = 0; total < 4; total += n)
+		n = ndb_wait_for_notes(ndb, cb.subids[0], note_ids, 4);
+	assert(total == 4);
+
+	pthread_mutex_lock(&cb.lock);
+	assert(cb.calls[1] == 0);
+	pthread_mutex_unlock(&cb.lock);
+	assert(ndb_subscription_coalesced(ndb, cb.subids[1]) == 1);
+	assert(ndb_poll_for_notes(ndb, cb.subids[1], note_ids, 4) == 1);
+	assert(note_ids[0] == note_key);
+
+	for (i = 0; i < 2; i++)
+		assert(ndb_unsubscribe(ndb, cb.subids[i]));
+	ndb_destroy(ndb);
+	for (i = 0; i < 2; i++)
+		ndb_filter_destroy(&filters[i]);
+	pthread_mutex_destroy(&cb.lock);
+	pthread_cond_destroy(&cb.cond);
+}
+
+struct unsubscribe_callback {
+	struct ndb *ndb;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int calls;
+	int unsubscribed;
+};
+
+static void unsubscribe_subscription_callback(void *ctx, uint64_t subid)
+{
+	struct unsubscribe_callback *cb = ctx;
+	int unsubscribed;
+
+	// takes the monitor write lock
+	unsubscribed = ndb_unsubscribe(cb->ndb, subid);
+
+	pthread_mutex_lock(&cb->lock);
+	cb->calls++;
+	cb->unsubscribed += unsubscribed;
+	pthread_cond_broadcast(&cb->cond);
+	pthread_mutex_unlock(&cb->lock);
+}
+
+// Subscription callbacks run outside of the monitor lock, so they can
+// unsubscribe without deadlocking the notifier
+static void test_unsubscribe_in_callback()
+{
+	struct ndb_config config;
+	struct ndb_filter filter;
+	struct unsubscribe_callback cb;
+	uint64_t subid;
+
+	pthread_mutex_init(&cb.lock, NULL);
+	pthread_cond_init(&cb.cond, NULL);
+	cb.calls = 0;
+	cb.unsubscribed = 0;
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+	ndb_config_set_subscription_callback(&config,
+					     unsubscribe_subscription_callback, &cb);
+
+	assert(ndb_filter_init(&filter));
+	assert(ndb_filter_start_field(&filter, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(&filter, 1));
+	ndb_filter_end_field(&filter);
+	assert(ndb_filter_start_field(&filter, NDB_FILTER_SINCE));
+	assert(ndb_filter_add_int_element(&filter, 2001000000));
+	ndb_filter_end_field(&filter);
+	assert(ndb_filter_end(&filter));
+
+	assert(ndb_init(&cb.ndb, test_dir, &config));
+	assert((subid = ndb_subscribe(cb.ndb, &filter, 1)));
+
+	ingest_test_event(cb.ndb, 0x355, 1, 2001000000, 1, "", "");
+
+	pthread_mutex_lock(&cb.lock);
+	while (cb.calls == 0)
+		pthread_cond_wait(&cb.cond, &cb.lock);
+	assert(cb.unsubscribed == 1);
+	pthread_mutex_unlock(&cb.lock);
+
+	assert(ndb_num_subscriptions(cb.ndb) == 0);
+	assert(!ndb_unsubscribe(cb.ndb, subid));
+
+	// the notifier is still going after the callback unsubscribed
+	assert((subid = ndb_subscribe(cb.ndb, &filter, 1)));
+	ingest_test_event(cb.ndb, 0x356, 1, 2001000001, 1, "", "");
+
+	pthread_mutex_lock(&cb.lock);
+	while (cb.calls == 1)
+		pthread_cond_wait(&cb.cond, &cb.lock);
+	assert(cb.unsubscribed == 2);
+	pthread_mutex_unlock(&cb.lock);
+
+	ndb_destroy(cb.ndb);
+	ndb_filter_destroy(&filter);
+	pthread_mutex_destroy(&cb.lock);
+	pthread_cond_destroy(&cb.cond);
+}
+
+// Multi-char tag filters like #emoji, parsed from json and matched
+static void test_long_tag_filter()
+{
+	struct ndb_filter filter, *f = &filter;
+	struct ndb_note *note;
+	unsigned char buffer[4096], fbuf[1024];
+	char json[256];
+
+	const char *test_note = "{\"id\": \"160e76ca67405d7ce9ef7d2dd72f3f36401c8661a73d45498af842d40b01b736\",\"pubkey\": \"67c67870aebc327eb2a2e765e6dbb42f0f120d2c4e4e28dc16b824cf72a5acc1\",\"created_at\": 1700688516,\"kind\": 1,\"tags\": [[\"emoji\",\"soapbox\",\"https://gleasonator.com/emoji/Gleasonator/soapbox.png\"],[\"e\",\"soapbox\"]],\"content\": \"\",\"sig\": \"20c2d070261ed269559ada40ca5ac395c389681ee3b5f7d50de19dd9b328dd70cf27d9d13875e87c968d9b49fa05f66e90f18037be4529b9e582c7e2afac3f06\"}";
+	const char *filter_json = "{\"#emoji\":[\"soapbox\"]}";
+
+	assert(ndb_note_from_json(test_note, strlen(test_note), &note, buffer, sizeof(buffer)));
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_from_json(filter_json, strlen(filter_json), f, fbuf, sizeof(fbuf)));
+	assert(ndb_filter_matches(f, note));
+	assert(ndb_filter_json(f, json, sizeof(json)));
+	assert(!strcmp(json, filter_json));
+	ndb_filter_destroy(f);
+
+	// a prefix of the tag name is a different tag
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_tag_field_str(f, "emo"));
+	assert(ndb_filter_add_str_element(f, "soapbox"));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+	assert(!ndb_filter_matches(f, note));
+	ndb_filter_destroy(f);
+}
+
+static void long_tag_query(struct ndb_txn *txn, const char *val,
+			   struct ndb_query_result *results, int *count,
+			   struct ndb_query_profile *profile)
+{
+	struct ndb_filter filter, *f = &filter;
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_tag_field_str(f, "alt"));
+	assert(ndb_filter_add_str_element(f, val));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+
+	assert(ndb_query_with_profile(txn, f, 1, results, 4, count, profile));
+	assert(!strcmp(profile->filters[0].plan, "tags"));
+	ndb_filter_destroy(f);
+}
+
+// Multi-char tags go through the extended tag index. Values too long to
+// store whole are keyed by their prefix and hash, and checked exactly
+// against the note.
+static void test_long_tag_index()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_config config;
+	struct ndb_query_result results[4];
+	struct ndb_query_profile profile;
+	char a[302], b[302], c[247], tags[400];
+	int count;
+
+	const int t = 2001100000;
+
+	// a and b share far more than the stored prefix, c is as long as a
+	// value can be and still be stored whole
+	memset(a, 'a', 300);
+	memcpy(b, a, 300);
+	a[300] = '1';
+	b[300] = '2';
+	a[301] = b[301] = 0;
+	memset(c, 'c', 246);
+	c[246] = 0;
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	snprintf(tags, sizeof(tags), "[\"alt\",\"%s\"]", a);
+	ingest_test_event(ndb, 0x357, 1, t, 1, tags, "");
+	snprintf(tags, sizeof(tags), "[\"alt\",\"%s\"]", b);
+	ingest_test_event(ndb, 0x358, 1, t + 1, 1, tags, "");
+	snprintf(tags, sizeof(tags), "[\"alt\",\"%s\"]", c);
+	ingest_test_event(ndb, 0x359, 1, t + 2, 1, tags, "");
+	ndb_destroy(ndb);
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	assert(ndb_begin_query(ndb, &txn));
+
+	long_tag_query(&txn, a, results, &count, &profile);
+	assert(count == 1);
+	assert(ndb_note_id(results[0].note)[31] == 0x57);
+	assert(profile.filters[0].rows_rejected == 0);
+
+	long_tag_query(&txn, b, results, &count, &profile);
+	assert(count == 1);
+	assert(ndb_note_id(results[0].note)[31] == 0x58);
+
+	long_tag_query(&txn, c, results, &count, &profile);
+	assert(count == 1);
+	assert(ndb_note_id(results[0].note)[31] == 0x59);
+
+	// same prefix, different hash
+	a[300] = '3';
+	long_tag_query(&txn, a, results, &count, &profile);
+	assert(count == 0);
+	assert(profile.filters[0].notes_fetched == 0);
+
 	ndb_end_query(&txn);
-	assert(memcmp(profile_note_id, ndb_note_id(n), 32) == 0);
+	ndb_destroy(ndb);
+}
 
-	//fwrite(profile, len, 1, stdout);
+// Test compiled matchers with enough elements to spill past the kind
+// bitmap and fill the id sets
+static void test_filter_matcher()
+{
+	struct ndb_filter filter, *f = &filter;
+	struct ndb_note *note;
+	unsigned char buffer[4096], id[32];
+	int i;
+
+	const char *test_note = "{\"id\": \"160e76ca67405d7ce9ef7d2dd72f3f36401c8661a73d45498af842d40b01b736\",\"pubkey\": \"67c67870aebc327eb2a2e765e6dbb42f0f120d2c4e4e28dc16b824cf72a5acc1\",\"created_at\": 1700688516,\"kind\": 30023,\"tags\": [[\"t\",\"hashtag\"],[\"t\",\"grownostr\"],[\"p\",\"4d2e7a6a8e08007ace5a03391d21735f45caf1bf3d67b492adc28967ab46525e\"]],\"content\": \"\",\"sig\": \"20c2d070261ed269559ada40ca5ac395c389681ee3b5f7d50de19dd9b328dd70cf27d9d13875e87c968d9b49fa05f66e90f18037be4529b9e582c7e2afac3f06\"}";
+
+	assert(ndb_note_from_json(test_note, strlen(test_note), &note, buffer, sizeof(buffer)));
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 1));
+	assert(ndb_filter_add_int_element(f, 30023));
+	ndb_filter_end_field(f);
+
+	assert(ndb_filter_start_field(f, NDB_FILTER_AUTHORS));
+	memset(id, 0, sizeof(id));
+	for (i = 0; i < 100; i++) {
+		id[0] = i;
+		assert(ndb_filter_add_id_element(f, id));
+	}
+	assert(ndb_filter_add_id_element(f, ndb_note_pubkey(note)));
+	ndb_filter_end_field(f);
+
+	assert(ndb_filter_start_tag_field(f, 't'));
+	assert(ndb_filter_add_str_element(f, "nostr"));
+	assert(ndb_filter_add_str_element(f, "grownostr"));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+
+	assert(f->matcher);
+	assert(ndb_filter_matches(f, note));
+
+	_ndb_note_set_kind(note, 1);
+	assert(ndb_filter_matches(f, note));
 
+	_ndb_note_set_kind(note, 30024);
+	assert(!ndb_filter_matches(f, note));
+
+	ndb_filter_destroy(f);
+}
+
+static void test_count()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_filter filters[2], *f;
+	struct ndb_config config;
+	unsigned char pubkey[32];
+	int i, counted;
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+
+	// 5 kind 1 notes, 3 reactions and 2 reposts
+	assert(ndb_init(&ndb, test_dir, &config));
+	for (i = 0; i < 10; i++) {
+		ingest_test_event(ndb, 0x700 + i, 0xc0c0, 1000 + i,
+				  i < 5 ? 1 : i < 8 ? 7 : 6, "", "");
+	}
 	ndb_destroy(ndb);
 
-	free(json);
-	free(buf);
+	memset(pubkey, 0, 32);
+	pubkey[30] = 0xc0;
+	pubkey[31] = 0xc0;
+
+	// this one is counted straight off the index. NIP-45 counts
+	// ignore the limit.
+	f = &filters[0];
+	ndb_filter_init(f);
+	ndb_filter_start_field(f, NDB_FILTER_AUTHORS);
+	ndb_filter_add_id_element(f, pubkey);
+	ndb_filter_end_field(f);
+	ndb_filter_start_field(f, NDB_FILTER_KINDS);
+	ndb_filter_add_int_element(f, 1);
+	ndb_filter_end_field(f);
+	ndb_filter_start_field(f, NDB_FILTER_LIMIT);
+	ndb_filter_add_int_element(f, 2);
+	ndb_filter_end_field(f);
+	ndb_filter_end(f);
+
+	f = &filters[1];
+	ndb_filter_init(f);
+	ndb_filter_start_field(f, NDB_FILTER_AUTHORS);
+	ndb_filter_add_id_element(f, pubkey);
+	ndb_filter_end_field(f);
+	ndb_filter_start_field(f, NDB_FILTER_KINDS);
+	ndb_filter_add_int_element(f, 1);
+	ndb_filter_add_int_element(f, 7);
+	ndb_filter_end_field(f);
+	ndb_filter_start_field(f, NDB_FILTER_LIMIT);
+	ndb_filter_add_int_element(f, 1);
+	ndb_filter_end_field(f);
+	ndb_filter_end(f);
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	assert(ndb_begin_query(ndb, &txn));
+
+	assert(ndb_count(&txn, filters, 1, &counted));
+	assert(counted == 5);
+
+	assert(ndb_count(&txn, &filters[1], 1, &counted));
+	assert(counted == 8);
+
+	// overlapping filters are only counted once
+	assert(ndb_count(&txn, filters, 2, &counted));
+	assert(counted == 8);
+
+	ndb_end_query(&txn);
+
+	ndb_filter_destroy(&filters[0]);
+	ndb_filter_destroy(&filters[1]);
+	ndb_destroy(ndb);
+}
+
+static int cached_query(struct ndb_txn *txn, struct ndb_filter *filter,
+			struct ndb_query_result *results, int capacity)
+{
+	int count;
+	assert(ndb_query(txn, filter, 1, results, capacity, &count));
+	return count;
+}
+
+struct snapshot_query {
+	struct ndb *ndb;
+	struct ndb_filter *filter;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int state;
+	int count;
+};
+
+static void set_snapshot_state(struct snapshot_query *q, int state)
+{
+	pthread_mutex_lock(&q->lock);
+	q->state = state;
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void wait_snapshot_state(struct snapshot_query *q, int state)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->state != state)
+		pthread_cond_wait(&q->cond, &q->lock);
+	pthread_mutex_unlock(&q->lock);
+}
+
+// queries on a snapshot taken before it's told to go ahead
+static void *query_old_snapshot(void *data)
+{
+	struct snapshot_query *q = data;
+	struct ndb_query_result results[8];
+	struct ndb_txn txn;
+
+	assert(ndb_begin_query(q->ndb, &txn));
+	set_snapshot_state(q, 1);
+	wait_snapshot_state(q, 2);
+
+	q->count = cached_query(&txn, q->filter, results, 8);
+	ndb_end_query(&txn);
+	return NULL;
+}
+
+static void test_query_cache()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_filter filter, relay_filter;
+	struct snapshot_query snapshot;
+	pthread_t thread;
+	struct ndb_query_result results[8];
+	struct ndb_config config;
+	struct ndb_stat stat;
+	unsigned char pubkey[32], id[32];
+	uint64_t subid, note_keys[4], note_key;
+	size_t hits, misses;
+	int i, got;
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+	ndb_config_set_ingest_threads(&config, 1);
+
+	memset(pubkey, 0, 32);
+	pubkey[30] = 0xca;
+	pubkey[31] = 0xce;
+
+	ndb_filter_init(&filter);
+	ndb_filter_start_field(&filter, NDB_FILTER_AUTHORS);
+	ndb_filter_add_id_element(&filter, pubkey);
+	ndb_filter_end_field(&filter);
+	ndb_filter_end(&filter);
+
+	ndb_filter_init(&relay_filter);
+	ndb_filter_start_field(&relay_filter, NDB_FILTER_AUTHORS);
+	ndb_filter_add_id_element(&relay_filter, pubkey);
+	ndb_filter_end_field(&relay_filter);
+	ndb_filter_start_field(&relay_filter, NDB_FILTER_RELAYS);
+	ndb_filter_add_str_element(&relay_filter, "wss://b.example.com");
+	ndb_filter_end_field(&relay_filter);
+	ndb_filter_end(&relay_filter);
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	assert((subid = ndb_subscribe(ndb, &filter, 1)));
+
+	for (i = 0; i < 3; i++) {
+		ingest_test_event_from(ndb, "wss://a.example.com", 0x800 + i,
+				       0xcace, 2000 + i, 1, "", "");
+	}
+	for (got = 0; got < 3; )
+		got += ndb_wait_for_notes(ndb, subid, note_keys, 4);
+
+	// the same query on the same snapshot is a hit
+	assert(ndb_stat(ndb, &stat));
+	hits = stat.query_cache_hits;
+	misses = stat.query_cache_misses;
+
+	assert(ndb_begin_query(ndb, &txn));
+	assert(cached_query(&txn, &filter, results, 8) == 3);
+	assert(cached_query(&txn, &filter, results, 8) == 3);
+	assert(ndb_note_created_at(results[0].note) == 2002);
+	assert(cached_query(&txn, &relay_filter, results, 8) == 0);
+	ndb_end_query(&txn);
+
+	assert(ndb_stat(ndb, &stat));
+	assert(stat.query_cache_hits == hits + 1);
+	assert(stat.query_cache_misses == misses + 2);
+
+	// a matching write drops the entry
+	ingest_test_event(ndb, 0x803, 0xcace, 2003, 1, "", "");
+	assert(ndb_wait_for_notes(ndb, subid, note_keys, 4) == 1);
+
+	assert(ndb_begin_query(ndb, &txn));
+	assert(cached_query(&txn, &filter, results, 8) == 4);
+	assert(ndb_note_created_at(results[0].note) == 2003);
+	ndb_end_query(&txn);
+
+	// so does seeing a note we already have on a new relay
+	memset(id, 0, 32);
+	id[30] = 0x08;
+	id[31] = 0x00;
+	assert(ndb_begin_query(ndb, &txn));
+	assert((note_key = ndb_get_notekey_by_id(&txn, id)));
+	ndb_end_query(&txn);
+
+
+	// there's only one ingester, so once the note after it is written
+	// the relay is too. A second thread holds the snapshot before it.
+	snapshot.ndb = ndb;
+	snapshot.filter = &relay_filter;
+	snapshot.state = 0;
+	pthread_mutex_init(&snapshot.lock, NULL);
+	pthread_cond_init(&snapshot.cond, NULL);
+	assert(!pthread_create(&thread, NULL, query_old_snapshot, &snapshot));
+	wait_snapshot_state(&snapshot, 1);
+
+	ingest_test_event_from(ndb, "wss://b.example.com", 0x800, 0xcace,
+			       2000, 1, "", "");
+	ingest_test_event(ndb, 0x804, 0xcace, 2004, 1, "", "");
+	assert(ndb_wait_for_notes(ndb, subid, note_keys, 4) == 1);
+
+	assert(ndb_begin_query(ndb, &txn));
+	assert(ndb_note_seen_on_relay(&txn, note_key, "wss://b.example.com"));
+	assert(cached_query(&txn, &relay_filter, results, 8) == 1);
+	assert(results[0].note_id == note_key);
+	ndb_end_query(&txn);
+
+	// the entry is from a newer snapshot than the thread's, which
+	// hasn't seen the relay yet
+	set_snapshot_state(&snapshot, 2);
+	assert(!pthread_join(thread, NULL));
+	assert(snapshot.count == 0);
+	pthread_mutex_destroy(&snapshot.lock);
+	pthread_cond_destroy(&snapshot.cond);
+
+	ndb_unsubscribe(ndb, subid);
+	ndb_filter_destroy(&filter);
+	ndb_filter_destroy(&relay_filter);
+	ndb_destroy(ndb);
+}
+
+// A note that only has its hashtag in the content still reaches #t
+// subscriptions and clears cached #t queries
+static void test_content_hashtag_delivery()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_config config;
+	struct ndb_filter filter, *f = &filter;
+	struct ndb_query_result results[4];
+	uint64_t subid, note_ids[4];
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_tag_field(f, 't'));
+	assert(ndb_filter_add_str_element(f, "zorbix"));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+
+	assert(ndb_init(&ndb, test_dir, &config));
+
+	assert(ndb_begin_query(ndb, &txn));
+	assert(cached_query(&txn, f, results, 4) == 0);
+	ndb_end_query(&txn);
+
+	assert((subid = ndb_subscribe(ndb, f, 1)));
+	ingest_test_event(ndb, 0x361, 1, 2000800000, 1, "", "gm #Zorbix");
+
+	assert(ndb_wait_for_notes(ndb, subid, note_ids, 4) == 1);
+
+	assert(ndb_begin_query(ndb, &txn));
+	assert(cached_query(&txn, f, results, 4) == 1);
+	assert(results[0].note_id == note_ids[0]);
+	ndb_end_query(&txn);
+
+	assert(ndb_unsubscribe(ndb, subid));
+	ndb_destroy(ndb);
+	ndb_filter_destroy(f);
 }
 
 static void test_parse_contact_event()
@@ -907,6 +2777,46 @@ static void test_queue_boundary_conditions() {
     assert(old_count == q.count);
 }
 
+static void *drain_queue(void *arg)
+{
+	struct prot_queue *q = arg;
+	int data[TEST_BUF_SIZE];
+
+	usleep(10000);
+	assert(prot_queue_pop_all(q, data, TEST_BUF_SIZE) == TEST_BUF_SIZE);
+	return NULL;
+}
+
+// a full queue makes blocking pushes wait for the consumer
+static void test_queue_push_all_wait()
+{
+	struct prot_queue q;
+	int buffer[TEST_BUF_SIZE], big[TEST_BUF_SIZE + 1];
+	int data[3] = { 7, 8, 9 };
+	pthread_t thread;
+	int i, out;
+
+	assert(prot_queue_init(&q, buffer, sizeof(buffer), sizeof(int)) == 1);
+	for (i = 0; i < TEST_BUF_SIZE; i++)
+		assert(prot_queue_push(&q, &i) == 1);
+	assert(prot_queue_push_all(&q, data, 3) == 0);
+
+	assert(!pthread_create(&thread, NULL, drain_queue, &q));
+	assert(prot_queue_push_all_wait(&q, data, 3) == 3);
+	assert(!pthread_join(thread, NULL));
+
+	for (i = 0; i < 3; i++) {
+		assert(prot_queue_try_pop_all(&q, &out, 1) == 1);
+		assert(out == data[i]);
+	}
+
+	// there will never be room for more than the capacity
+	memset(big, 0, sizeof(big));
+	assert(prot_queue_push_all_wait(&q, big, TEST_BUF_SIZE + 1) == 0);
+
+	prot_queue_destroy(&q);
+}
+
 static void test_fast_strchr()
 {
 	// Test 1: Basic test
@@ -966,8 +2876,223 @@ static void test_fulltext()
 	free(json);
 }
 
+// Multi-word, prefix, phrase and OR searches on the posting index
+static void test_fulltext_queries()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_config config;
+	struct ndb_text_search_results results;
+	struct ndb_text_search_config ranked;
+
+	// timestamps of our own, away from the other tests
+	const int t = 2000300000;
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	ingest_test_event(ndb, 0xf1, 1, t, 1, "", "Zorbly quick brown wombat jumps over lazy dogs");
+	ingest_test_event(ndb, 0xf2, 1, t + 1, 1, "", "lazy wombat sleeps, zorbly");
+	ingest_test_event(ndb, 0xf3, 1, t + 2, 1, "", "brown zorblies nap");
+	ingest_test_event(ndb, 0xf4, 1, t + 3, 1, "", "Zörblÿ café 東京タワーに行った");
+	ingest_test_event(ndb, 0x366, 1, t + 4, 1, "", "ж жужжит");
+	ndb_destroy(ndb);
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	assert(ndb_begin_query(ndb, &txn));
+
+	assert(ndb_text_search(&txn, "zorbly wombat", &results, NULL));
+	assert(results.num_results == 2);
+	assert(results.results[0].key.timestamp == t + 1);
+	assert(results.results[1].key.timestamp == t);
+
+	// words also match the words they are a prefix of, and case and
+	// accents don't matter
+	assert(ndb_text_search(&txn, "ZORBL", &results, NULL));
+	assert(results.num_results == 4);
+
+	assert(ndb_text_search(&txn, "CAFÉ", &results, NULL));
+	assert(results.num_results == 1);
+
+	// single letters aren't indexed or searched for in any script
+	assert(!ndb_text_search(&txn, "z", &results, NULL));
+	assert(!ndb_text_search(&txn, "ж", &results, NULL));
+	assert(ndb_text_search(&txn, "ЖУЖ", &results, NULL));
+	assert(results.num_results == 1);
+
+	// cjk is searched by pairs of characters
+	assert(ndb_text_search(&txn, "タワー", &results, NULL));
+	assert(results.num_results == 1);
+	assert(ndb_text_search(&txn, "京都", &results, NULL));
+	assert(results.num_results == 0);
+
+	assert(ndb_text_search(&txn, "\"brown wombat\"", &results, NULL));
+	assert(results.num_results == 1);
+	assert(results.results[0].key.timestamp == t);
+
+	assert(ndb_text_search(&txn, "\"wombat brown\"", &results, NULL));
+	assert(results.num_results == 0);
+
+	assert(ndb_text_search(&txn, "zorblies OR sleeps", &results, NULL));
+	assert(results.num_results == 2);
+
+	// the oldest note has both words, so it ranks first
+	ndb_default_ranked_search_config(&ranked);
+	assert(ndb_text_search(&txn, "lazy OR brown", &results, &ranked));
+	assert(results.num_results == 3);
+	assert(results.results[0].key.timestamp == t);
+	assert(results.results[0].score > results.results[1].score);
+
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+}
+
+// wait for the background indexer to get through the note with this id
+static void wait_for_fulltext(struct ndb *ndb, int id)
+{
+	unsigned char note_id[32] = {0};
+	struct ndb_txn txn;
+	uint64_t note_key, indexed;
+	int i;
+
+	note_id[31] = id;
+	for (i = 0; i < 1000; i++) {
+		assert(ndb_begin_query(ndb, &txn));
+		note_key = ndb_get_notekey_by_id(&txn, note_id);
+		indexed = ndb_fulltext_indexed_key(&txn);
+		ndb_end_query(&txn);
+
+		if (note_key && indexed >= note_key)
+			return;
+		usleep(10000);
+	}
+
+	assert(!"fulltext indexer didn't catch up");
+}
+
+static void test_fulltext_kinds()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_config config;
+	struct ndb_text_search_results results;
+	struct ndb_query_result query_results[4];
+	struct ndb_filter filter;
+	struct ndb_query_profile profile;
+	uint64_t kinds[] = { 0, 1, 1063 };
+	char big_profile[640], *p;
+	int i, count;
+
+	// notes indexed with the default kinds, before the kinds change
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+	assert(ndb_init(&ndb, test_dir, &config));
+	ingest_test_event(ndb, 0xf8, 0xf8, 2000400000, 1, "", "glimbrix one");
+	ingest_test_event(ndb, 0xf9, 0xf9, 2000400001, 1, "", "two glimbrixes");
+	ndb_destroy(ndb);
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY |
+				      NDB_FLAG_ASYNC_FULLTEXT);
+	assert(ndb_config_set_fulltext_kinds(&config, kinds, 3));
+
+	assert(ndb_init(&ndb, test_dir, &config));
+	// profiles are searchable by their about field
+	ingest_test_event(ndb, 0xf5, 0xf5, 2000400000, 0, "", "{\\\"name\\\":\\\"kim\\\",\\\"about\\\":\\\"quokkas\\\\nand \\\\u00e9clairs\\\"}");
+	// a profile with more json tokens than fit on the stack
+	p = big_profile + sprintf(big_profile, "{\\\"x\\\":[1");
+	for (i = 0; i < 280; i++)
+		p += sprintf(p, ",1");
+	sprintf(p, "],\\\"about\\\":\\\"pangolins\\\"}");
+	ingest_test_event(ndb, 0x362, 0x362, 2000400000, 0, "", big_profile);
+	ingest_test_event(ndb, 0xf6, 0xf6, 2000400000, 1063, "", "satellite snapshot");
+	ingest_test_event(ndb, 0xf7, 0xf7, 2000400000, 7, "", "satellite");
+
+	// search results cached before the indexer got to the note don't
+	// stick around after it does
+	ndb_filter_init(&filter);
+	ndb_filter_start_field(&filter, NDB_FILTER_SEARCH);
+	ndb_filter_add_str_element(&filter, "snapshot");
+	ndb_filter_end_field(&filter);
+	ndb_filter_end(&filter);
+	for (i = 0, count = 0; i < 1000 && count == 0; i++) {
+		assert(ndb_begin_query(ndb, &txn));
+		assert(ndb_query(&txn, &filter, 1, query_results, 4, &count));
+		ndb_end_query(&txn);
+		usleep(1000);
+	}
+	assert(count == 1);
+	ndb_filter_destroy(&filter);
+
+	wait_for_fulltext(ndb, 0xf7);
+
+	assert(ndb_begin_query(ndb, &txn));
+	assert(ndb_text_search(&txn, "quokkas eclairs", &results, NULL));
+	assert(results.num_results == 1);
+	assert(ndb_text_search(&txn, "kim", &results, NULL));
+	assert(results.num_results == 0);
+	assert(ndb_text_search(&txn, "pangolins", &results, NULL));
+	assert(results.num_results == 1);
+	assert(ndb_text_search(&txn, "satellite", &results, NULL));
+	assert(results.num_results == 1);
+
+	// with profiles in the fulltext index, kind 0 searches go through it
+	ndb_filter_init(&filter);
+	ndb_filter_start_field(&filter, NDB_FILTER_KINDS);
+	ndb_filter_add_int_element(&filter, 0);
+	ndb_filter_end_field(&filter);
+	ndb_filter_start_field(&filter, NDB_FILTER_SEARCH);
+	ndb_filter_add_str_element(&filter, "quokkas");
+	ndb_filter_end_field(&filter);
+	ndb_filter_end(&filter);
+	assert(ndb_query_with_profile(&txn, &filter, 1, query_results, 4,
+				      &count, &profile));
+	assert(!strcmp(profile.filters[0].plan, "search"));
+	assert(count == 1);
+	assert(ndb_note_id(query_results[0].note)[31] == 0xf5);
+	ndb_filter_destroy(&filter);
+
+	// the notes from before were reindexed for the new kinds
+	assert(ndb_text_search(&txn, "glimbrix", &results, NULL));
+	assert(results.num_results == 2);
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+
+	// going back to the default kinds reindexes everything again
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+	assert(ndb_init(&ndb, test_dir, &config));
+	wait_for_fulltext(ndb, 0xf7);
+
+	assert(ndb_begin_query(ndb, &txn));
+	assert(ndb_text_search(&txn, "satellite", &results, NULL));
+	assert(results.num_results == 0);
+	assert(ndb_text_search(&txn, "glimbrix", &results, NULL));
+	assert(results.num_results == 2);
+
+	// and back to searching profile names
+	ndb_filter_init(&filter);
+	ndb_filter_start_field(&filter, NDB_FILTER_KINDS);
+	ndb_filter_add_int_element(&filter, 0);
+	ndb_filter_end_field(&filter);
+	ndb_filter_start_field(&filter, NDB_FILTER_SEARCH);
+	ndb_filter_add_str_element(&filter, "kim");
+	ndb_filter_end_field(&filter);
+	ndb_filter_end(&filter);
+	assert(ndb_query_explain(&txn, &filter, 1, &profile));
+	assert(!strcmp(profile.filters[0].plan, "profile_search"));
+	ndb_filter_destroy(&filter);
+
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+}
+
 int main(int argc, const char *argv[]) {
 	test_filters();
+	test_filter_matcher();
+	test_long_tag_filter();
+	test_long_tag_index();
 	test_migrate();
 	test_fetched_at();
 	test_profile_updates();
@@ -988,13 +3113,43 @@ int main(int argc, const char *argv[]) {
 	// note fetching
 	test_fetch_last_noteid();
 
+	// queries
+	test_query_iter_pagination();
+	test_query_materialized_paging();
+	test_count();
+	test_query_cache();
+	test_thread_query();
+	test_naddr_lookup();
+	test_mention_query();
+	test_query_profile();
+	test_intersect_query();
+	test_multi_filter_query();
+	test_query_keys();
+	test_hashtag_index();
+	test_unicode_profile_search();
+	test_content_hashtag_delivery();
+	test_migrate_rebuild();
+
+	// subscriptions
+	test_subscription_fd();
+	test_subscribe_with_query();
+	test_subscription_notifier();
+	test_many_subscriptions();
+	test_subscription_overflow();
+	test_delivery_policy();
+	test_delivery_policy_snapshot();
+	test_unsubscribe_in_callback();
+
 	// fulltext
 	test_fulltext();
+	test_fulltext_queries();
+	test_fulltext_kinds();
 
 	// protected queue tests
 	test_queue_init_pop_push();
 	test_queue_thread_safety();
 	test_queue_boundary_conditions();
+	test_queue_push_all_wait();
 
 	// memchr stuff
 	test_fast_strchr();